@@ -60,6 +60,9 @@ class Availability
 	    /** returns the size of the availability tree */
 	    int size() { return size_; }
 
+	    /** returns the heap memory held by the availability tree in bytes */
+	    size_t mem_size() const { return size_ + waiting_peers_.capacity()*sizeof(WaitingPeers::value_type); }
+
 	    /** sets the size of the availability tree once we know the size of the file */
 	    void setSize(uint64_t size);
 
@@ -6,18 +6,38 @@
  *  Copyright 2009 Delft University of Technology. All rights reserved.
  *
  */
-#include "avgspeed.h"
+#include "swift.h"
 
 using namespace swift;
 
 MovingAverageSpeed::MovingAverageSpeed(tint speed_interval, tint fudge)
 {
     speed_interval_ = speed_interval;
+    bucket_len_ = std::max((tint)1,speed_interval_/SPEED_BUCKETS);
     fudge_ = fudge;
-	t_start_ = usec_time() - fudge_;
-	t_end_ = t_start_;
-	speed_ = 0.0;
-	resetstate_ = false;
+    Reset();
+    // Only a later Reset() ignores points for a while
+    reset_until_ = 0;
+}
+
+
+void MovingAverageSpeed::Advance()
+{
+    int64_t now_no = NOW/bucket_len_;
+    if (now_no <= bucket_no_)
+        return;
+    if (now_no-bucket_no_ >= SPEED_BUCKETS) {
+        memset(buckets_,0,sizeof(buckets_));
+        sum_ = 0;
+    }
+    else {
+        // Expire the buckets that fell out of the window
+        for (int64_t b=bucket_no_+1; b<=now_no; b++) {
+            sum_ -= buckets_[b%SPEED_BUCKETS];
+            buckets_[b%SPEED_BUCKETS] = 0;
+        }
+    }
+    bucket_no_ = now_no;
 }
 
 
@@ -27,38 +47,33 @@ void MovingAverageSpeed::AddPoint(uint64_t amount)
 	// points for a few seconds after the reset, to accomodate the case
 	// of going from high speed to low speed and content still coming in.
 	//
-	if (resetstate_) {
-		if ((t_start_ + speed_interval_/2) > usec_time()) {
-			return;
-		}
-		resetstate_ = false;
-	}
+	if (NOW < reset_until_)
+		return;
 
-    tint t = usec_time();
-    speed_ = (speed_ * ((double)(t_end_ - t_start_)/((double)TINT_SEC)) + (double)amount) / ((t - t_start_)/((double)TINT_SEC) + 0.0001);
-    t_end_ = t;
-    if (t_start_ < t - speed_interval_)
-        t_start_ = t - speed_interval_;
+    Advance();
+    buckets_[bucket_no_%SPEED_BUCKETS] += amount;
+    sum_ += amount;
 }
 
 
 double MovingAverageSpeed::GetSpeed()
 {
-    AddPoint(0);
-    return speed_;
-}
-
-
-double MovingAverageSpeed::GetSpeedNeutral()
-{
-    return speed_;
+    Advance();
+    // The buckets cover the full ones before the current bucket and what
+    // passed of that. Young estimators have not seen all of it yet.
+    tint covered = NOW-(bucket_no_-SPEED_BUCKETS+1)*bucket_len_;
+    tint span = std::min(covered,NOW-t_start_);
+    if (span <= 0)
+        return 0.0;
+    return (double)sum_*TINT_SEC/span;
 }
 
 
 void MovingAverageSpeed::Reset()
 {
-	resetstate_ = true;
-	t_start_ = usec_time() - fudge_;
-	t_end_ = t_start_;
-	speed_ = 0.0;
+	t_start_ = NOW - fudge_;
+	reset_until_ = t_start_ + speed_interval_/2;
+	bucket_no_ = NOW/bucket_len_;
+	sum_ = 0;
+	memset(buckets_,0,sizeof(buckets_));
 }
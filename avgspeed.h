@@ -13,22 +13,36 @@
 
 namespace swift {
 
+// Buckets in the sliding window, each speed_interval/SPEED_BUCKETS long
+#define SPEED_BUCKETS	20
 
+/** Bytes per second over a sliding window of speed_interval, kept as
+ *  integer byte counts in fixed buckets of the cached clock (NOW). Adding
+ *  a point is a bucket increment, reading only divides once, so both are
+ *  cheap enough for every datagram. */
 class MovingAverageSpeed
 {
     public: 
 		MovingAverageSpeed( tint speed_interval = 5 * TINT_SEC, tint fudge = TINT_SEC );
 		void AddPoint( uint64_t amount );
         double GetSpeed();
-        double GetSpeedNeutral();
+        /** Same as GetSpeed(), from when adding points moved the window. */
+        double GetSpeedNeutral() { return GetSpeed(); }
+        /** Bytes in the current window */
+        uint64_t GetBytes() { Advance(); return sum_; }
         void Reset();
     protected:
         tint   speed_interval_;
+        tint   bucket_len_;
         tint   t_start_;
-        tint   t_end_;
-        double speed_;
         tint   fudge_;
-        bool   resetstate_;
+        /** Ignore points until then after a Reset() */
+        tint   reset_until_;
+        int64_t  bucket_no_;
+        uint64_t sum_;
+        uint64_t buckets_[SPEED_BUCKETS];
+
+        void Advance();
 };
 
 }
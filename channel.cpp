@@ -29,7 +29,9 @@ uint64_t Channel::global_dgrams_up=0, Channel::global_dgrams_down=0,
          Channel::global_raw_bytes_up=0, Channel::global_raw_bytes_down=0,
          Channel::global_bytes_up=0, Channel::global_bytes_down=0,
 		 Channel::global_buffers_up=0, Channel::global_syscalls_up=0,
-		 Channel::global_buffers_down=0, Channel::global_syscalls_down=0;
+		 Channel::global_buffers_down=0, Channel::global_syscalls_down=0,
+		 Channel::global_clock_reads=0, Channel::global_data_reads=0;
+MovingAverageSpeed Channel::global_speed[2];
 sckrwecb_t Channel::sock_open[] = {};
 int Channel::sock_count = 0;
 swift::tint Channel::last_tick = 0;
@@ -40,9 +42,14 @@ channels_t Channel::channels(1);
 Address Channel::tracker;
 //tbheap Channel::send_queue;
 FILE* Channel::debug_file = NULL;
+Transport* Channel::transport = NULL;
 #include "ext/simple_selector.cpp"
 //PeerSelector* Channel::peer_selector = new SimpleSelector();
 tint Channel::MIN_PEX_REQUEST_INTERVAL = TINT_SEC;
+uint8_t Channel::WIRE_VERSION = SWIFT_WIRE_MUX;
+int Channel::MAX_CHANNELS = 0;
+int Channel::open_count_ = 0;
+int Channel::closing_count_ = 0;
 
 
 /*
@@ -51,10 +58,14 @@ tint Channel::MIN_PEX_REQUEST_INTERVAL = TINT_SEC;
 
 Channel::Channel    (FileTransfer* transfer, int socket, Address peer_addr) :
 	// Arno, 2011-10-03: Reordered to avoid g++ Wall warning
-	peer_(peer_addr), socket_(socket==INVALID_SOCKET?default_socket():socket), // FIXME
+	peer_(peer_addr), socket_(socket==INVALID_SOCKET?transfer->GetSocket():socket), // FIXME
     transfer_(transfer), peer_channel_id_(0), own_id_mentioned_(false),
     data_in_(TINT_NEVER,bin_t::NONE), data_in_dbl_(bin_t::NONE),
-    data_out_cap_(bin_t::ALL),hint_out_size_(0),
+    data_out_cap_(bin_t::ALL),
+    have_snap_pos_(0), have_log_pos_(transfer->have_log_end()),
+    have_all_out_(false), have_all_in_(false),
+    wire_version_(SWIFT_WIRE_LEGACY), wire_version_sent_(0), wire_bin_out_(0), wire_bin_in_(0),
+    wire_compact_in_(false), wire_peer_time_(TINT_NEVER), hint_out_size_(0),
     // Gertjan fix 996e21e8abfc7d88db3f3f8158f2a2c4fc8a8d3f
     // "Changed PEX rate limiting to per channel limiting"
     last_pex_request_time_(0), next_pex_request_time_(0),
@@ -71,13 +82,13 @@ Channel::Channel    (FileTransfer* transfer, int socket, Address peer_addr) :
     owd_cur_bin_(0), dgrams_sent_(0), dgrams_rcvd_(0),
     raw_bytes_up_(0), raw_bytes_down_(0), bytes_up_(0), bytes_down_(0),
     scheduled4close_(false),
-	direct_sending_(false)
+	direct_sending_(false), established_pos_(-1), peer_complete_(false)
 {
     if (peer_==Address())
         peer_ = tracker;
     this->id_ = channels.size();
     channels.push_back(this);
-    transfer_->hs_in_.push_back(bin_t(id_));
+    open_count_++;
     for(int i=0; i<4; i++) {
         owd_min_bins_[i] = TINT_NEVER;
         owd_current_[i] = TINT_NEVER;
@@ -87,7 +98,7 @@ Channel::Channel    (FileTransfer* transfer, int socket, Address peer_addr) :
     evtimer_add(evsend_ptr_,tint2tv(next_send_time_));
 
     // RATELIMIT
-	transfer->mychannels_.push_back(this);
+	transfer->AddChannel(this);
 
 	dprintf("%s #%u init channel %s transfer %d\n",tintstr(),id_,peer_.str(), transfer_->fd() );
 	//fprintf(stderr,"new Channel %d %s\n", id_, peer_.str() );
@@ -97,19 +108,14 @@ Channel::Channel    (FileTransfer* transfer, int socket, Address peer_addr) :
 Channel::~Channel () {
 	dprintf("%s #%u dealloc channel\n",tintstr(),id_);
     channels[id_] = NULL;
+    open_count_--;
+    if (scheduled4close_)
+        closing_count_--;
     ClearEvents();
 
     // RATELIMIT
     if (transfer_ != NULL)
-    {
-		channels_t::iterator iter;
-		for (iter=transfer().mychannels_.begin(); iter!=transfer().mychannels_.end(); iter++)
-		{
-			if (*iter == this)
-				break;
-		}
-    	transfer_->mychannels_.erase(iter);
-    }
+    	transfer_->RemoveChannel(this);
 }
 
 
@@ -153,6 +159,61 @@ uint16_t Channel::GetMyPort() {
 		return ntohs(mysin.sin_port);
 }
 
+void Channel::GetMemoryUsage(memusage_t &mu) {
+    mu.nchannels++;
+    mu.channels += sizeof(Channel) + sizeof(struct event);
+    mu.chanbinmaps += ack_in_.total_size();
+    mu.chanqueues += data_out_.mem_size() + data_out_tmo_.mem_size()
+        + hint_in_.mem_size() + hint_out_.mem_size()
+        + reverse_pex_out_.mem_size();
+}
+
+bool Channel::MakeRoom() {
+    if (MAX_CHANNELS <= 0 || open_channels() < MAX_CHANNELS)
+        return true;
+
+    // Evict a batch, such that a burst of handshakes does not rescan for
+    // every one. Key is (class,last data time), lowest goes first.
+    typedef std::pair<std::pair<int,tint>,Channel *> victim_t;
+    std::vector<victim_t> victims;
+    for (int i=0; i<channels.size(); i++) {
+        Channel *c = channels[i];
+        if (c == NULL || c->IsScheduled4Close() || c->transfer_ == NULL)
+            continue;
+        if (NOW-c->open_time_ < SWIFT_EVICT_MIN_AGE)
+            continue;
+        // The tracker is how we find new peers, keep it
+        if (c->peer() == tracker || c->peer() == c->transfer().tracker_)
+            continue;
+        int cls = 2;
+        if (c->hashtree()->is_complete() && c->IsComplete())
+            cls = 0; // both seeders, nothing to exchange
+        else if (c->send_control_ == KEEP_ALIVE_CONTROL)
+            cls = 1;
+        tint last = std::max(c->last_data_in_time_,c->last_data_out_time_);
+        victims.push_back(victim_t(std::make_pair(cls,last),c));
+    }
+    if (victims.empty())
+        return false;
+
+    size_t batch = std::min(victims.size(),(size_t)MAX_CHANNELS/128+1);
+    std::nth_element(victims.begin(),victims.begin()+(batch-1),victims.end());
+    for (size_t i=0; i<batch; i++) {
+        Channel *c = victims[i].second;
+        dprintf("%s #%u evict channel class %d\n",tintstr(),c->id(),victims[i].first.first);
+        c->Schedule4Close();
+    }
+    return true;
+}
+
+void Channel::Compact() {
+    data_out_.release();
+    data_out_tmo_.release();
+    hint_in_.release();
+    hint_out_.release();
+    reverse_pex_out_.release();
+}
+
 bool Channel::IsDiffSenderOrDuplicate(Address addr, uint32_t chid)
 {
     if (peer() != addr)
@@ -174,7 +235,7 @@ bool Channel::IsDiffSenderOrDuplicate(Address addr, uint32_t chid)
 			// (HANDSHAKE). If so, close the channel if his port number is
 			// larger than yours (such that one channel remains).
 			//
-			recv_peer_ = addr;
+			transfer().IndexRecvPeer(this,addr);
 
 			Channel *c = transfer().FindChannel(addr,this);
 			if (c != NULL) {
@@ -220,6 +281,7 @@ tint Channel::Time () {
     //HiResTimeOfDay* tod = HiResTimeOfDay::Instance();
     //tint ret = tod->getTimeUSec();
     //DLOG(INFO)<<"now is "<<ret;
+    global_clock_reads++;
     return now_t::now = usec_time();
 }
 
@@ -282,7 +344,7 @@ int Channel::SendTo (evutil_socket_t sock, const Address& addr, struct evbuffer
 	msg.msg_iovlen = count;
 	msg.msg_name = addr.addr;
 	msg.msg_namelen = addr_len;
-	int r = sendmsg(sock, &msg, 0);
+	int r = transport ? transport->SendMsg(sock, &msg) : sendmsg(sock, &msg, 0);
     if (r<0) {
         print_error("can't send");
 		for (int i=0; i<count; ++i)
@@ -296,7 +358,6 @@ int Channel::SendTo (evutil_socket_t sock, const Address& addr, struct evbuffer
 	global_syscalls_up++;
 	for (int i=0; i<count; ++i)
 		global_raw_bytes_up+=lengths[i];
-    Time();
     return r;
 }
 
@@ -322,7 +383,7 @@ int Channel::RecvFrom (evutil_socket_t sock, Address& addr, struct evbuffer **ev
 	msg.msg_iovlen = count;
 	msg.msg_name = addr.addr;
 	msg.msg_namelen = addrlen;
-	int length = recvmsg(sock, &msg, 0);
+	int length = transport ? transport->RecvMsg(sock, &msg) : recvmsg(sock, &msg, 0);
     if (length<0) {
         length = 0;
 
@@ -354,6 +415,7 @@ int Channel::RecvFrom (evutil_socket_t sock, Address& addr, struct evbuffer **ev
 	global_buffers_down+=addr.addr->count;
 	global_syscalls_down++;
     global_raw_bytes_down+=length;
+    // Arrival time of the batch, for RTT and delay samples
     Time();
     return length;
 }
@@ -677,6 +739,18 @@ int swift::evbuffer_add_hash(struct evbuffer *evb, const Sha1Hash& hash)  {
     return evbuffer_add(evb, hash.bits, Sha1Hash::SIZE);
 }
 
+int swift::evbuffer_add_varint(struct evbuffer *evb, uint64_t v) {
+    // 7 bits per byte, least significant first, high bit set if more follow
+    uint8_t buf[10];
+    int len = 0;
+    while (v >= 0x80) {
+        buf[len++] = (uint8_t)(v|0x80);
+        v >>= 7;
+    }
+    buf[len++] = (uint8_t)v;
+    return evbuffer_add(evb, buf, len);
+}
+
 uint8_t swift::evbuffer_remove_8(struct evbuffer *evb) {
     uint8_t b;
     if (evbuffer_remove(evb, &b, 1) < 1)
@@ -708,6 +782,19 @@ uint64_t swift::evbuffer_remove_64be(struct evbuffer *evb) {
     return l;
 }
 
+uint64_t swift::evbuffer_remove_varint(struct evbuffer *evb) {
+    uint64_t v = 0;
+    for (int shift=0; shift<64; shift+=7) {
+        uint8_t b;
+        if (evbuffer_remove(evb, &b, 1) < 1)
+            return 0;
+        v |= (uint64_t)(b&0x7f) << shift;
+        if (!(b&0x80))
+            break;
+    }
+    return v;
+}
+
 Sha1Hash swift::evbuffer_remove_hash(struct evbuffer* evb)  {
     char bits[Sha1Hash::SIZE];
     if (evbuffer_remove(evb, bits, Sha1Hash::SIZE) < Sha1Hash::SIZE)
@@ -34,6 +34,11 @@ using namespace swift;
 
 #define MAX_CMD_MESSAGE 1024
 
+// BATCH: maximum number of commands in one batch
+#define CMDGW_MAX_BATCH		(4*CMDGW_MAX_CLIENT)
+// FRAMING BINARY: maximum payload of a length-prefixed frame
+#define CMDGW_MAX_FRAME		(64*1024)
+
 #define ERROR_NO_ERROR		0
 #define ERROR_UNKNOWN_CMD	-1
 #define ERROR_MISS_ARG		-2
@@ -42,6 +47,13 @@ using namespace swift;
 
 #define CMDGW_MAX_CLIENT 1024   // Arno: == maximum number of swarms per proc
 
+// Periodic INFO is only pushed for swarms whose state changed noticeably
+// since the last INFO, or that were not reported for a while.
+#define CMDGW_INFO_PROGRESS_PERMILLE	1		// complete changed by >= 0.1% of size
+#define CMDGW_INFO_SPEED_REL_DELTA		0.1		// speed changed by >= 10%...
+#define CMDGW_INFO_SPEED_ABS_DELTA		1024.0	// ...and by >= 1 KiB/s
+#define CMDGW_INFO_MAX_SILENCE			(30*TINT_SEC)
+
 struct cmd_gw_t {
     int      id;
     evutil_socket_t   cmdsock;
@@ -52,6 +64,19 @@ struct cmd_gw_t {
     uint64_t startoff;   // MULTIFILE: starting offset in content range of desired file
     uint64_t endoff;     // MULTIFILE: ending offset (careful, for an e.g. 100 byte interval this is 99)
 
+    // Peer counts, recomputed only when FileTransfer::GetPeersVersion() moved
+    bool	 counts_valid;
+    uint32_t peers_version;
+    uint32_t numleech;
+    uint32_t numseeds;
+    // State as last reported in INFO, see CmdGwINFOChanged
+    int		 info_dlstatus;
+    uint64_t info_complete;
+    double	 info_speed[2];
+    uint32_t info_numleech;
+    uint32_t info_numseeds;
+    tint	 info_time;
+
 } cmd_requests[CMDGW_MAX_CLIENT];
 
 
@@ -60,7 +85,6 @@ int cmd_gw_reqs_count = 0;
 int cmd_gw_conns_open = 0;
 
 struct evconnlistener *cmd_evlistener = NULL;
-struct evbuffer *cmd_evbuffer = NULL; // Data received on cmd socket : WARNING: one for all cmd sockets
 
 /*
  * SOCKTUNNEL
@@ -74,11 +98,58 @@ typedef enum {
 	CMDGW_TUNNEL_READTUNNEL
 } cmdgw_tunnel_t;
 
-cmdgw_tunnel_t cmd_tunnel_state=CMDGW_TUNNEL_SCAN4CRLF;
-uint32_t	 cmd_tunnel_expect=0;
-Address		 cmd_tunnel_dest_addr;
-uint32_t 	 cmd_tunnel_dest_chanid;
-evutil_socket_t   cmd_tunnel_sock=INVALID_SOCKET;
+/*
+ * FRAMING
+ * Besides CRLF-terminated lines, a client may switch its command stream to
+ * length-prefixed frames with "FRAMING BINARY\r\n": each command is then
+ * sent as a 32-bit big-endian payload length followed by the command line
+ * without CRLF. "FRAMING TEXT" (as a frame) switches back. Replies remain
+ * CRLF-terminated lines.
+ */
+typedef enum {
+	CMDGW_FRAMING_TEXT,
+	CMDGW_FRAMING_BINARY
+} cmdgw_framing_t;
+
+/*
+ * BATCH
+ * "BATCH n\r\n" followed by n START/REMOVE/MAXSPEED/CHECKPOINT commands.
+ * The commands are collected and then applied in one pass; failures are
+ * reported per command without closing the connection, followed by a
+ * single "BATCH ok failed\r\n" reply.
+ */
+
+/*
+ * Per-connection state. Commands are parsed straight from the input buffer
+ * of the connection's bufferevent and all replies are queued on its output
+ * buffer, such that tunneled data can be passed along by reference.
+ */
+struct cmd_gw_conn_t {
+    evutil_socket_t	cmdsock;
+    struct bufferevent *bev;
+    bool			closing;	// CmdGwCloseConnection called, free when unwound
+    bool			draining;	// closing, freed once its replies are written
+    // SOCKTUNNEL
+    cmdgw_tunnel_t	tunnel_state;
+    uint32_t		tunnel_expect;
+    Address			tunnel_dest_addr;
+    uint32_t		tunnel_dest_chanid;
+    // FRAMING
+    cmdgw_framing_t	framing;
+    // BATCH
+    int				batch_expect;
+    std::vector<std::string> batch_lines;
+};
+
+#define CMDGW_MAX_CONN	64
+
+cmd_gw_conn_t *cmd_conns[CMDGW_MAX_CONN];
+
+// SOCKTUNNEL: TUNNELRECV goes to the most recent cmd connection
+cmd_gw_conn_t *cmd_tunnel_conn = NULL;
+
+// SOCKTUNNEL: reused buffer in which outgoing datagrams are assembled
+struct evbuffer *cmd_tunnel_sendbuf = NULL;
 
 // HTTP gateway address for PLAY cmd
 Address cmd_gw_httpaddr;
@@ -90,9 +161,13 @@ tint cmd_gw_last_open=0;
 
 // Fwd defs
 void CmdGwDataCameInCallback(struct bufferevent *bev, void *ctx);
-bool CmdGwReadLine(evutil_socket_t cmdsock);
-void CmdGwNewRequestCallback(evutil_socket_t cmdsock, char *line);
-void CmdGwProcessData(evutil_socket_t cmdsock);
+void CmdGwDrainedCallback(struct bufferevent *bev, void *ctx);
+void CmdGwEventCameInCallback(struct bufferevent *bev, short events, void *ctx);
+bool CmdGwReadLine(cmd_gw_conn_t *conn);
+bool CmdGwReadFrame(cmd_gw_conn_t *conn);
+void CmdGwNewRequestCallback(cmd_gw_conn_t *conn, char *line);
+void CmdGwProcessData(cmd_gw_conn_t *conn);
+void CmdGwTunnelSendFrame(cmd_gw_conn_t *conn, struct evbuffer *evb);
 
 
 void CmdGwFreeRequest(cmd_gw_t* req)
@@ -105,6 +180,43 @@ void CmdGwFreeRequest(cmd_gw_t* req)
     req->mfspecname = "";
     req->startoff = -1;
     req->endoff = -1;
+    req->counts_valid = false;
+    req->peers_version = 0;
+    req->numleech = 0;
+    req->numseeds = 0;
+    req->info_dlstatus = -1;
+    req->info_complete = 0;
+    req->info_speed[DDIR_UPLOAD] = 0.0;
+    req->info_speed[DDIR_DOWNLOAD] = 0.0;
+    req->info_numleech = 0;
+    req->info_numseeds = 0;
+    req->info_time = 0;
+}
+
+
+cmd_gw_conn_t* CmdGwFindConnection(evutil_socket_t sock)
+{
+    for(int i=0; i<cmd_gw_conns_open; i++)
+        if (cmd_conns[i]->cmdsock==sock)
+            return cmd_conns[i];
+    return NULL;
+}
+
+
+void CmdGwSend(evutil_socket_t cmdsock, const char *data, size_t len)
+{
+	// Queue on the connection's output, keeps replies and tunneled data in order
+	cmd_gw_conn_t *conn = CmdGwFindConnection(cmdsock);
+	if (conn == NULL)
+		return;
+	bufferevent_write(conn->bev,data,len);
+}
+
+
+void CmdGwFreeConnection(cmd_gw_conn_t *conn)
+{
+	bufferevent_free(conn->bev); // closes socket
+	delete conn;
 }
 
 
@@ -137,14 +249,44 @@ void CmdGwCloseConnection(evutil_socket_t sock)
 	    }
 	}
 
-	// Arno, 2012-07-06: Close
-	swift::close_socket(sock);
+	// Arno, 2012-07-06: Close. The connection is freed when the callback
+	// that got us here unwinds, see CmdGwFreeConnection(), or once queued
+	// replies (e.g. ERROR) are written, see CmdGwDrainedCallback().
+	cmd_gw_conn_t *conn = CmdGwFindConnection(sock);
+	if (conn != NULL)
+	{
+		for(int i=0; i<cmd_gw_conns_open; i++)
+			if (cmd_conns[i] == conn)
+			{
+				cmd_conns[i] = cmd_conns[--cmd_gw_conns_open];
+				break;
+			}
+		if (cmd_tunnel_conn == conn)
+			cmd_tunnel_conn = NULL;
 
-	cmd_gw_conns_open--;
+		conn->closing = true;
+		if (evbuffer_get_length(bufferevent_get_output(conn->bev)) > 0)
+		{
+			bufferevent_disable(conn->bev,EV_READ);
+			bufferevent_setcb(conn->bev,NULL,CmdGwDrainedCallback,CmdGwEventCameInCallback,conn);
+			conn->draining = true;
+		}
+		else
+			bufferevent_disable(conn->bev,EV_READ|EV_WRITE);
+	}
 
 	// Arno, 2012-10-11: New policy Immediate shutdown on connection close,
 	// see CmdGwUpdateDLStatesCallback()
 	fprintf(stderr,"cmd: Shutting down on CMD connection close\n");
+	if (conn == NULL || !conn->draining)
+		event_base_loopexit(Channel::evbase, NULL);
+}
+
+
+void CmdGwDrainedCallback(struct bufferevent *bev, void *ctx)
+{
+	// Last replies of a closed connection written, shut down after all
+	CmdGwFreeConnection((cmd_gw_conn_t *)ctx);
 	event_base_loopexit(Channel::evbase, NULL);
 }
 
@@ -315,24 +457,49 @@ void CmdGwSendINFOHashChecking(evutil_socket_t cmdsock, Sha1Hash root_hash)
 	sprintf(cmd,"INFO %s %d %lli/%lli %lf %lf %u %u\r\n",root_hash.hex().c_str(),DLSTATUS_HASHCHECKING,(uint64_t)0,(uint64_t)0,0.0,3.14,0,0);
 
     //fprintf(stderr,"cmd: SendINFO: %s", cmd);
-    send(cmdsock,cmd,strlen(cmd),0);
+    CmdGwSend(cmdsock,cmd,strlen(cmd));
 }
 
 
-void CmdGwSendINFO(cmd_gw_t* req, int dlstatus)
+bool CmdGwSpeedChanged(double last, double cur)
 {
-	// Send INFO message.
-	if (cmd_gw_debug)
-		fprintf(stderr,"cmd: SendINFO: F%d initdlstatus %d\n", req->transfer, dlstatus );
+	double diff = fabs(cur-last);
+	if (cur == 0.0)
+		return last != 0.0; // always report a stall
+	return diff >= CMDGW_INFO_SPEED_ABS_DELTA && diff >= last*CMDGW_INFO_SPEED_REL_DELTA;
+}
+
 
+bool CmdGwINFOChanged(cmd_gw_t* req, int dlstatus, uint64_t complete, uint64_t size, double dlspeed, double ulspeed)
+{
+	// Whether the swarm state differs enough from the last INFO to push a new one
+	if (req->info_time == 0 || NOW - req->info_time >= CMDGW_INFO_MAX_SILENCE)
+		return true;
+	if (dlstatus != req->info_dlstatus)
+		return true;
+	if (req->numleech != req->info_numleech || req->numseeds != req->info_numseeds)
+		return true;
+	if (complete != req->info_complete && (complete == size ||
+		(complete-req->info_complete)*1000 >= size*CMDGW_INFO_PROGRESS_PERMILLE))
+		return true;
+	return CmdGwSpeedChanged(req->info_speed[DDIR_DOWNLOAD],dlspeed) ||
+		   CmdGwSpeedChanged(req->info_speed[DDIR_UPLOAD],ulspeed);
+}
+
+
+/*
+ * Format the INFO message for req into cmd. When onlyifchanged is set and
+ * the state did not change noticeably since the last INFO, returns false
+ * and leaves cmd untouched. The (expensive) peer counts are only recomputed
+ * when the channels of the transfer changed.
+ */
+bool CmdGwFormatINFO(cmd_gw_t* req, int dlstatus, char *cmd, bool onlyifchanged)
+{
 	FileTransfer *ft = FileTransfer::file(req->transfer);
 	if (ft == NULL)
 		// Download was removed or closed somehow.
-		return;
+		return false;
 
-    Sha1Hash root_hash = ft->root_hash();
-
-    char cmd[MAX_CMD_MESSAGE];
     uint64_t size = swift::Size(req->transfer);
     uint64_t complete = swift::Complete(req->transfer);
     if (size > 0 && size == complete)
@@ -340,14 +507,48 @@ void CmdGwSendINFO(cmd_gw_t* req, int dlstatus)
     if (!ft->IsOperational())
     	dlstatus = DLSTATUS_STOPPED_ON_ERROR;
 
-    uint32_t numleech = ft->GetNumLeechers();
-    uint32_t numseeds = ft->GetNumSeeders();
+    if (!req->counts_valid || req->peers_version != ft->GetPeersVersion())
+    {
+    	req->peers_version = ft->GetPeersVersion();
+    	req->numleech = ft->GetNumLeechers();
+    	req->numseeds = ft->GetNumSeeders();
+    	req->counts_valid = true;
+    }
 
     double dlspeed = ft->GetCurrentSpeed(DDIR_DOWNLOAD);
     double ulspeed = ft->GetCurrentSpeed(DDIR_UPLOAD);
-    sprintf(cmd,"INFO %s %d %lli/%lli %lf %lf %u %u\r\n",root_hash.hex().c_str(),dlstatus,complete,size,dlspeed,ulspeed,numleech,numseeds);
+    if (onlyifchanged && !CmdGwINFOChanged(req,dlstatus,complete,size,dlspeed,ulspeed))
+    	return false;
+
+    sprintf(cmd,"INFO %s %d %lli/%lli %lf %lf %u %u\r\n",ft->root_hash().hex().c_str(),dlstatus,complete,size,dlspeed,ulspeed,req->numleech,req->numseeds);
+
+    req->info_dlstatus = dlstatus;
+    req->info_complete = complete;
+    req->info_speed[DDIR_DOWNLOAD] = dlspeed;
+    req->info_speed[DDIR_UPLOAD] = ulspeed;
+    req->info_numleech = req->numleech;
+    req->info_numseeds = req->numseeds;
+    req->info_time = NOW;
+    return true;
+}
+
+
+void CmdGwSendINFO(cmd_gw_t* req, int dlstatus, bool onlyifchanged=false)
+{
+	// Send INFO message.
+	if (cmd_gw_debug)
+		fprintf(stderr,"cmd: SendINFO: F%d initdlstatus %d\n", req->transfer, dlstatus );
+
+	FileTransfer *ft = FileTransfer::file(req->transfer);
+	if (ft == NULL)
+		// Download was removed or closed somehow.
+		return;
+
+    Sha1Hash root_hash = ft->root_hash();
 
-    send(req->cmdsock,cmd,strlen(cmd),0);
+    char cmd[MAX_CMD_MESSAGE];
+    if (CmdGwFormatINFO(req,dlstatus,cmd,onlyifchanged))
+    	CmdGwSend(req->cmdsock,cmd,strlen(cmd));
 
     // MORESTATS
     if (req->moreinfo) {
@@ -391,11 +592,127 @@ void CmdGwSendINFO(cmd_gw_t* req, int dlstatus)
 
         std::stringbuf *pbuf=oss.rdbuf();
         size_t slen = strlen(pbuf->str().c_str());
-        send(req->cmdsock,pbuf->str().c_str(),slen,0);
+        CmdGwSend(req->cmdsock,pbuf->str().c_str(),slen);
     }
 }
 
 
+void CmdGwSendSTATUSALL(evutil_socket_t cmdsock)
+{
+	// Send INFO for all swarms of this connection in one go:
+	// STATUSALL count\r\n followed by count INFO lines.
+	std::string out;
+	char cmd[MAX_CMD_MESSAGE];
+	int count = 0;
+    for(int i=0; i<cmd_gw_reqs_open; i++)
+    {
+    	cmd_gw_t* req = &cmd_requests[i];
+    	if (req->cmdsock != cmdsock)
+    		continue;
+    	if (CmdGwFormatINFO(req,DLSTATUS_DOWNLOADING,cmd,false)) {
+    		out += cmd;
+    		count++;
+    	}
+    }
+    sprintf(cmd,"STATUSALL %d\r\n",count);
+    out.insert(0,cmd);
+
+	if (cmd_gw_debug)
+		fprintf(stderr,"cmd: SendSTATUSALL: %d swarms\n", count );
+
+    CmdGwSend(cmdsock,out.c_str(),out.length());
+}
+
+
+void CmdGwFormatMemUsage(std::ostringstream &oss, memusage_t &mu)
+{
+	oss << "total=" << mu.total();
+	oss << " hashtree=" << mu.hashtree;
+	oss << " mhash=" << mu.mhash;
+	oss << " picker=" << mu.picker;
+	oss << " avail=" << mu.avail;
+	oss << " channels=" << mu.channels;
+	oss << " chanbinmaps=" << mu.chanbinmaps;
+	oss << " chanqueues=" << mu.chanqueues;
+	oss << " nchannels=" << mu.nchannels;
+	oss << "\r\n";
+}
+
+
+size_t CmdGwBufferedBytes()
+{
+	// Memory held in the evbuffers of the CMD connections
+	size_t total = 0;
+	for (int i=0; i<cmd_gw_conns_open; i++)
+	{
+		struct bufferevent *bev = cmd_conns[i]->bev;
+		total += evbuffer_get_length(bufferevent_get_input(bev));
+		total += evbuffer_get_length(bufferevent_get_output(bev));
+	}
+	if (cmd_tunnel_sendbuf != NULL)
+		total += evbuffer_get_length(cmd_tunnel_sendbuf);
+	return total;
+}
+
+
+void CmdGwSendMEMINFO(evutil_socket_t cmdsock, char *paramstr)
+{
+	// MEMINFO [roothash]\r\n is answered with MEMINFO count total cmdgw\r\n
+	// followed by count lines: a MEM line per transfer (all transfers in
+	// the process, not just this connection's) and, if a roothash was
+	// given, a MEMCHAN line per channel of that transfer.
+	bool onetransfer = strlen(paramstr) > 0;
+	Sha1Hash want_hash;
+	if (onetransfer)
+		want_hash = Sha1Hash(true,paramstr);
+
+	std::ostringstream oss;
+	int count = 0;
+	size_t total = 0;
+	for (int i=0; i<FileTransfer::files.size(); i++)
+	{
+		FileTransfer *ft = FileTransfer::files[i];
+		if (ft == NULL)
+			continue;
+		if (onetransfer && ft->root_hash() != want_hash)
+			continue;
+
+		memusage_t mu;
+		ft->GetMemoryUsage(mu);
+		total += mu.total();
+		oss << "MEM " << ft->root_hash().hex() << " ";
+		CmdGwFormatMemUsage(oss,mu);
+		count++;
+		if (!onetransfer)
+			continue;
+
+		channels_t peerchans = ft->GetChannels();
+		channels_t::iterator iter;
+		for (iter=peerchans.begin(); iter!=peerchans.end(); iter++)
+		{
+			Channel *c = *iter;
+			if (c == NULL)
+				continue;
+			memusage_t cmu;
+			c->GetMemoryUsage(cmu);
+			oss << "MEMCHAN " << ft->root_hash().hex() << " " << c->peer().str() << " ";
+			CmdGwFormatMemUsage(oss,cmu);
+			count++;
+		}
+	}
+
+	char cmd[MAX_CMD_MESSAGE];
+	sprintf(cmd,"MEMINFO %d " PRISIZET " " PRISIZET "\r\n",count,(unsigned long long)total,(unsigned long long)CmdGwBufferedBytes());
+	std::string out = cmd;
+	out += oss.str();
+
+	if (cmd_gw_debug)
+		fprintf(stderr,"cmd: SendMEMINFO: %d lines\n", count );
+
+	CmdGwSend(cmdsock,out.c_str(),out.length());
+}
+
+
 void CmdGwSendPLAY(cmd_gw_t *req)
 {
 	// Send PLAY message to user
@@ -414,7 +731,7 @@ void CmdGwSendPLAY(cmd_gw_t *req)
     if (cmd_gw_debug)
         fprintf(stderr,"cmd: SendPlay: %s", cmd);
 
-    send(req->cmdsock,cmd,strlen(cmd),0);
+    CmdGwSend(req->cmdsock,cmd,strlen(cmd));
 }
 
 
@@ -430,7 +747,7 @@ void CmdGwSendERRORBySocket(evutil_socket_t cmdsock, std::string msg, const Sha1
 		fprintf(stderr,"cmd: SendERROR: %s\n", cmd.c_str() );
 
 	char *wire = strdup(cmd.c_str());
-	send(cmdsock,wire,strlen(wire),0);
+	CmdGwSend(cmdsock,wire,strlen(wire));
 	free(wire);
 }
 
@@ -511,7 +828,7 @@ void CmdGwSwiftFirstProgressCallback (int transfer, bin_t bin)
 		req->startoff = 0;
 		req->endoff = swift::Size(req->transfer)-1;
 		CmdGwSwiftPrebufferProgressCallback(req->transfer,bin_t(0,0)); // in case file on disk
-		swift::AddProgressCallback(transfer,&CmdGwSwiftPrebufferProgressCallback,CMDGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER);
+		swift::AddProgressCallback(transfer,&CmdGwSwiftPrebufferProgressCallback,CMDGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER,req->startoff,req->endoff);
 	}
 	else
 	{
@@ -538,7 +855,7 @@ void CmdGwSwiftFirstProgressCallback (int transfer, bin_t bin)
 				req->startoff = sf->GetStart();
 				req->endoff = sf->GetEnd();
 				CmdGwSwiftPrebufferProgressCallback(req->transfer,bin_t(0,0)); // in case file on disk
-				swift::AddProgressCallback(transfer,&CmdGwSwiftPrebufferProgressCallback,CMDGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER);
+				swift::AddProgressCallback(transfer,&CmdGwSwiftPrebufferProgressCallback,CMDGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER,req->startoff,req->endoff);
 				break;
 			}
 		}
@@ -559,7 +876,7 @@ void CmdGwSwiftErrorCallback (evutil_socket_t cmdsock)
 	// Error on swift socket callback
 
 	const char *response = "ERROR Swift Engine Problem\r\n";
-	send(cmdsock,response,strlen(response),0);
+	CmdGwSend(cmdsock,response,strlen(response));
 
 	//swift::close_socket(sock);
 }
@@ -581,8 +898,8 @@ void CmdGwSwiftAllocatingDiskspaceCallback (int transfer, bin_t bin)
 
 void CmdGwUpdateDLStateCallback(cmd_gw_t* req)
 {
-	// Periodic callback, tell user INFO
-	CmdGwSendINFO(req,DLSTATUS_DOWNLOADING);
+	// Periodic callback, tell user INFO if state changed
+	CmdGwSendINFO(req,DLSTATUS_DOWNLOADING,true);
 
 	// Update speed measurements such that they decrease when DL/UL stops
 	FileTransfer *ft = FileTransfer::file(req->transfer);
@@ -644,74 +961,67 @@ void CmdGwUpdateDLStatesCallback()
 void CmdGwDataCameInCallback(struct bufferevent *bev, void *ctx)
 {
 	// Turn TCP stream into lines deliniated by \r\n
+	Channel::Time();
 
-	evutil_socket_t cmdsock = bufferevent_getfd(bev);
+	cmd_gw_conn_t *conn = (cmd_gw_conn_t *)ctx;
 	if (cmd_gw_debug)
-		fprintf(stderr,"CmdGwDataCameIn: ENTER %d\n", cmdsock );
+		fprintf(stderr,"cmdgw: TCPDataCameIn: %d State %d, have %d want %d\n", conn->cmdsock, (int)conn->tunnel_state, (int)evbuffer_get_length(bufferevent_get_input(bev)), conn->tunnel_expect );
 
-	struct evbuffer *inputevbuf = bufferevent_get_input(bev);
-
-	int inlen = evbuffer_get_length(inputevbuf);
-
-    int ret = evbuffer_add_buffer(cmd_evbuffer,inputevbuf);
-	if (ret == -1) {
-		CmdGwCloseConnection(cmdsock);
-		return;
-	}
-
-	int totlen = evbuffer_get_length(cmd_evbuffer);
-
-	if (cmd_gw_debug)
-		fprintf(stderr,"cmdgw: TCPDataCameIn: State %d, got %d new bytes, have %d want %d\n", (int)cmd_tunnel_state, inlen, totlen, cmd_tunnel_expect );
-
-	CmdGwProcessData(cmdsock);
+	CmdGwProcessData(conn);
+	if (conn->closing && !conn->draining)
+		CmdGwFreeConnection(conn);
 }
 
 
-void CmdGwProcessData(evutil_socket_t cmdsock)
+void CmdGwProcessData(cmd_gw_conn_t *conn)
 {
-	// Process CMD data in the cmd_evbuffer
+	// Process CMD data in the connection's input buffer
+	struct evbuffer *evb = bufferevent_get_input(conn->bev);
 
-	if (cmd_tunnel_state == CMDGW_TUNNEL_SCAN4CRLF)
+	if (conn->tunnel_state == CMDGW_TUNNEL_SCAN4CRLF)
 	{
 		bool ok=false;
 		do
 		{
-			ok = CmdGwReadLine(cmdsock);
-			if (ok && cmd_tunnel_state == CMDGW_TUNNEL_READTUNNEL)
+			ok = CmdGwReadLine(conn);
+			if (ok && conn->tunnel_state == CMDGW_TUNNEL_READTUNNEL)
 				break;
-		} while (ok);
+		} while (ok && !conn->closing);
 	}
+	if (conn->closing)
+		return;
 	// Not else!
-	if (cmd_tunnel_state == CMDGW_TUNNEL_READTUNNEL)
+	if (conn->tunnel_state == CMDGW_TUNNEL_READTUNNEL)
 	{
 		// Got "TUNNELSEND addr size\r\n" command, now read
-		// size bytes, i.e., cmd_tunnel_expect bytes.
+		// size bytes, i.e., conn->tunnel_expect bytes.
 
 		if (cmd_gw_debug)
-			fprintf(stderr,"cmdgw: procTCPdata: tunnel state, got %d, want %d\n", evbuffer_get_length(cmd_evbuffer), cmd_tunnel_expect );
+			fprintf(stderr,"cmdgw: procTCPdata: tunnel state, got %d, want %d\n", evbuffer_get_length(evb), conn->tunnel_expect );
 
-		if (evbuffer_get_length(cmd_evbuffer) >= cmd_tunnel_expect)
+		if (evbuffer_get_length(evb) >= conn->tunnel_expect)
 		{
 			// We have all the tunneled data
-			CmdGwTunnelSendUDP(cmd_evbuffer);
+			CmdGwTunnelSendFrame(conn,evb);
 
 			// Process any remaining commands that came after the tunneled data
-			CmdGwProcessData(cmdsock);
+			CmdGwProcessData(conn);
 		}
 	}
 }
 
 
-bool CmdGwReadLine(evutil_socket_t cmdsock)
+bool CmdGwReadLine(cmd_gw_conn_t *conn)
 {
-	// Parse cmd_evbuffer for lines, and call NewRequest when found
+	// Parse input for lines, and call NewRequest when found
+	if (conn->framing == CMDGW_FRAMING_BINARY)
+		return CmdGwReadFrame(conn);
 
 	size_t rd=0;
-    char *cmd = evbuffer_readln(cmd_evbuffer,&rd, EVBUFFER_EOL_CRLF_STRICT);
+    char *cmd = evbuffer_readln(bufferevent_get_input(conn->bev),&rd, EVBUFFER_EOL_CRLF_STRICT);
     if (cmd != NULL)
     {
-    	CmdGwNewRequestCallback(cmdsock,cmd);
+    	CmdGwNewRequestCallback(conn,cmd);
     	free(cmd);
     	return true;
     }
@@ -719,29 +1029,109 @@ bool CmdGwReadLine(evutil_socket_t cmdsock)
     	return false;
 }
 
-int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline);
+bool CmdGwReadFrame(cmd_gw_conn_t *conn)
+{
+	// Parse input for a length-prefixed frame, and call NewRequest
+	// when complete
+
+	struct evbuffer *evb = bufferevent_get_input(conn->bev);
+	size_t avail = evbuffer_get_length(evb);
+	if (avail < 4)
+		return false;
+	uint32_t len;
+	evbuffer_copyout(evb,&len,4);
+	len = ntohl(len);
+	if (len > CMDGW_MAX_FRAME)
+	{
+		dprintf("cmd: frame too big %u\n", len );
+		CmdGwSendERRORBySocket(conn->cmdsock,"frame too big");
+		CmdGwCloseConnection(conn->cmdsock);
+		return false;
+	}
+	if (avail < 4+len)
+		return false;
+
+	evbuffer_drain(evb,4);
+	char *cmd = (char *)malloc(len+1);
+	evbuffer_remove(evb,cmd,len);
+	cmd[len] = '\0';
+	CmdGwNewRequestCallback(conn,cmd);
+	free(cmd);
+	return true;
+}
+
+int CmdGwHandleCommand(cmd_gw_conn_t *conn, char *copyline);
 
 
-void CmdGwNewRequestCallback(evutil_socket_t cmdsock, char *line)
+std::string CmdGwErrorMessage(int ret)
+{
+	if (ret == ERROR_UNKNOWN_CMD)
+		return "unknown command";
+	else if (ret == ERROR_MISS_ARG)
+		return "missing parameter";
+	else if (ret == ERROR_BAD_ARG)
+		return "bad parameter";
+	// BAD_SWARM already sent, and not fatal
+	return "";
+}
+
+
+void CmdGwHandleBatch(cmd_gw_conn_t *conn)
+{
+	// Apply all commands collected for a BATCH in one pass
+	evutil_socket_t cmdsock = conn->cmdsock;
+	int nok=0,nfailed=0;
+	for (int i=0; i<conn->batch_lines.size(); i++)
+	{
+		std::string &line = conn->batch_lines[i];
+		std::string method = line.substr(0,line.find(' '));
+		int ret = ERROR_UNKNOWN_CMD;
+		if (method == "START" || method == "REMOVE" || method == "MAXSPEED" || method == "CHECKPOINT")
+		{
+			char *copyline = strdup(line.c_str());
+			ret = CmdGwHandleCommand(conn,copyline);
+			free(copyline);
+		}
+		if (ret < 0) {
+			dprintf("cmd: Error processing batch command %s\n", line.c_str() );
+			std::string msg = CmdGwErrorMessage(ret);
+			if (msg != "")
+				CmdGwSendERRORBySocket(cmdsock,msg);
+			nfailed++;
+		}
+		else
+			nok++;
+	}
+	conn->batch_lines.clear();
+
+	char cmd[MAX_CMD_MESSAGE];
+	sprintf(cmd,"BATCH %d %d\r\n",nok,nfailed);
+	CmdGwSend(cmdsock,cmd,strlen(cmd));
+}
+
+
+void CmdGwNewRequestCallback(cmd_gw_conn_t *conn, char *line)
 {
 	// New command received from user
+	evutil_socket_t cmdsock = conn->cmdsock;
+
+	if (conn->batch_expect > 0)
+	{
+		// Part of BATCH, apply when all commands are in
+		conn->batch_lines.push_back(line);
+		if (--conn->batch_expect == 0)
+			CmdGwHandleBatch(conn);
+		return;
+	}
 
     // CMD request line
 	char *copyline = (char *)malloc(strlen(line)+1);
 	strcpy(copyline,line);
 
-	int ret = CmdGwHandleCommand(cmdsock,copyline);
+	int ret = CmdGwHandleCommand(conn,copyline);
 	if (ret < 0) {
 		dprintf("cmd: Error processing command %s\n", line );
-		std::string msg = "";
-		if (ret == ERROR_UNKNOWN_CMD)
-			msg = "unknown command";
-		else if (ret == ERROR_MISS_ARG)
-			msg = "missing parameter";
-		else if (ret == ERROR_BAD_ARG)
-			msg = "bad parameter";
-		// BAD_SWARM already sent, and not fatal
-
+		std::string msg = CmdGwErrorMessage(ret);
 		if (msg != "")
 		{
 			CmdGwSendERRORBySocket(cmdsock,msg);
@@ -756,8 +1146,9 @@ void CmdGwNewRequestCallback(evutil_socket_t cmdsock, char *line)
 
 
 
-int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
+int CmdGwHandleCommand(cmd_gw_conn_t *conn, char *copyline)
 {
+	evutil_socket_t cmdsock = conn->cmdsock;
 	char *method=NULL,*paramstr = NULL;
 	char * token = strchr(copyline,' '); // split into CMD PARAM
 	if (token != NULL) {
@@ -840,11 +1231,23 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
         	return ERROR_BAD_ARG;
         }
 
+        if (cmd_gw_reqs_open >= CMDGW_MAX_CLIENT)
+        {
+        	CmdGwSendERRORBySocket(cmdsock,"too many swarms",root_hash);
+        	return ERROR_BAD_SWARM;
+        }
+
         // Send INFO DLSTATUS_HASHCHECKING
 		CmdGwSendINFOHashChecking(cmdsock,root_hash);
 
 		// ARNOSMPTODO: disable/interleave hashchecking at startup
         int transfer = swift::Find(root_hash);
+        if (transfer==-1) {
+        	// SEEDDIR: content of a lazily opened seed dir
+        	FileTransfer *ft = SeedIndex::GetInstance()->Find(root_hash,false);
+        	if (ft != NULL)
+        		transfer = ft->fd();
+        }
         if (transfer==-1) {
         	std::string filename;
         	if (storagepath != "")
@@ -861,6 +1264,7 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
 
         // All is well, register req
         req = cmd_requests + cmd_gw_reqs_open++;
+        CmdGwFreeRequest(req);
         req->id = ++cmd_gw_reqs_count;
         req->cmdsock = cmdsock;
         req->transfer = transfer;
@@ -963,6 +1367,39 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
     	Sha1Hash root_hash = Sha1Hash(true,hashstr);
     	CmdGwGotSETMOREINFO(root_hash,enable);
     }
+    else if (!strcmp(method,"BATCH"))
+    {
+    	// BATCH count\r\n followed by count commands
+    	int count = 0;
+    	int n = sscanf(paramstr,"%d",&count);
+    	if (n != 1)
+    		return ERROR_MISS_ARG;
+    	if (count <= 0 || count > CMDGW_MAX_BATCH)
+    		return ERROR_BAD_ARG;
+    	conn->batch_lines.clear();
+    	conn->batch_lines.reserve(count);
+    	conn->batch_expect = count;
+    }
+    else if (!strcmp(method,"FRAMING"))
+    {
+    	// FRAMING TEXT|BINARY\r\n
+    	if (!strcmp(paramstr,"BINARY"))
+    		conn->framing = CMDGW_FRAMING_BINARY;
+    	else if (!strcmp(paramstr,"TEXT"))
+    		conn->framing = CMDGW_FRAMING_TEXT;
+    	else
+    		return ERROR_BAD_ARG;
+    }
+    else if (!strcmp(method,"STATUSALL"))
+    {
+    	// STATUSALL\r\n
+    	CmdGwSendSTATUSALL(cmdsock);
+    }
+    else if (!strcmp(method,"MEMINFO"))
+    {
+    	// MEMINFO [roothash]\r\n
+    	CmdGwSendMEMINFO(cmdsock,paramstr);
+    }
     else if (!strcmp(method,"SHUTDOWN"))
     {
     	CmdGwCloseConnection(cmdsock);
@@ -984,18 +1421,18 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
         	return ERROR_MISS_ARG;
         char *sizestr = token;
 
-    	cmd_tunnel_dest_addr = Address(addrstr);
-    	int n = sscanf(chanstr,"%08x",&cmd_tunnel_dest_chanid);
+    	conn->tunnel_dest_addr = Address(addrstr);
+    	int n = sscanf(chanstr,"%08x",&conn->tunnel_dest_chanid);
     	if (n != 1)
     		return ERROR_BAD_ARG;
-    	n = sscanf(sizestr,"%u",&cmd_tunnel_expect);
+    	n = sscanf(sizestr,"%u",&conn->tunnel_expect);
     	if (n != 1)
     		return ERROR_BAD_ARG;
 
-        cmd_tunnel_state = CMDGW_TUNNEL_READTUNNEL;
+        conn->tunnel_state = CMDGW_TUNNEL_READTUNNEL;
 
         if (cmd_gw_debug)
-        	fprintf(stderr,"cmdgw: Want tunnel %d bytes to %s\n", cmd_tunnel_expect, cmd_tunnel_dest_addr.str() );
+        	fprintf(stderr,"cmdgw: Want tunnel %d bytes to %s\n", conn->tunnel_expect, conn->tunnel_dest_addr.str() );
     }
     else if (!strcmp(method,"PEERADDR"))
     {
@@ -1030,9 +1467,13 @@ void CmdGwEventCameInCallback(struct bufferevent *bev, short events, void *ctx)
     if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
     {
     	// Called when error on cmd connection
-    	evutil_socket_t cmdsock = bufferevent_getfd(bev);
-    	CmdGwCloseConnection(cmdsock);
-		bufferevent_free(bev);
+    	cmd_gw_conn_t *conn = (cmd_gw_conn_t *)ctx;
+    	if (!conn->closing)
+    		CmdGwCloseConnection(conn->cmdsock);
+    	// Replies still queued cannot go out anymore
+    	if (conn->draining)
+    		event_base_loopexit(Channel::evbase, NULL);
+    	CmdGwFreeConnection(conn);
     }
 }
 
@@ -1045,23 +1486,34 @@ void CmdGwNewConnectionCallback(struct evconnlistener *listener,
 
     fprintf(stderr,"cmd: Got new cmd connection %i\n",fd);
 
+    if (cmd_gw_conns_open >= CMDGW_MAX_CONN)
+    {
+    	fprintf(stderr,"cmd: Too many cmd connections, refusing %i\n",fd);
+    	evutil_closesocket(fd);
+    	return;
+    }
+
     struct event_base *base = evconnlistener_get_base(listener);
     struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
 
-    bufferevent_setcb(bev, CmdGwDataCameInCallback, NULL, CmdGwEventCameInCallback, NULL);
+    cmd_gw_conn_t *conn = new cmd_gw_conn_t;
+    conn->cmdsock = fd;
+    conn->bev = bev;
+    conn->closing = false;
+    conn->draining = false;
+    conn->tunnel_state = CMDGW_TUNNEL_SCAN4CRLF;
+    conn->tunnel_expect = 0;
+    conn->tunnel_dest_chanid = 0;
+    conn->framing = CMDGW_FRAMING_TEXT;
+    conn->batch_expect = 0;
+
+    bufferevent_setcb(bev, CmdGwDataCameInCallback, NULL, CmdGwEventCameInCallback, conn);
     bufferevent_enable(bev, EV_READ|EV_WRITE);
 
-    // ARNOTODO: free bufferevent when conn closes.
-
-    // One buffer for all cmd connections, reset
-    if (cmd_evbuffer != NULL)
-	evbuffer_free(cmd_evbuffer);
-    cmd_evbuffer = evbuffer_new();
+    cmd_conns[cmd_gw_conns_open++] = conn;
 
-    // SOCKTUNNEL: assume 1 command connection
-    cmd_tunnel_sock = fd;
-
-    cmd_gw_conns_open++;
+    // SOCKTUNNEL: tunneled data received goes to the newest connection
+    cmd_tunnel_conn = conn;
 }
 
 
@@ -1105,7 +1557,7 @@ bool InstallCmdGateway (struct event_base *evbase,Address cmdaddr,Address httpad
 
     cmd_gw_httpaddr = httpaddr;
 
-    cmd_evbuffer = evbuffer_new();
+    cmd_tunnel_sendbuf = evbuffer_new();
 
     return true;
 }
@@ -1117,70 +1569,75 @@ void swift::CmdGwTunnelUDPDataCameIn(Address srcaddr, uint32_t srcchan, struct e
 {
 	// Message received on UDP socket, forward over TCP conn.
 
+	size_t len = evbuffer_get_length(evb);
 	if (cmd_gw_debug)
-		fprintf(stderr,"cmdgw: TunnelUDPData:DataCameIn %d bytes from %s/%08x\n", evbuffer_get_length(evb), srcaddr.str(), srcchan );
+		fprintf(stderr,"cmdgw: TunnelUDPData:DataCameIn %d bytes from %s/%08x\n", len, srcaddr.str(), srcchan );
+
+	cmd_gw_conn_t *conn = cmd_tunnel_conn;
+	if (conn == NULL || conn->closing)
+	{
+		evbuffer_drain(evb,len);
+		return;
+	}
 
 	/*
 	 *  Format:
 	 *  TUNNELRECV ip:port/hexchanid nbytes\r\n
 	 *  <bytes>
+	 *
+	 *  The payload is moved onto the TCP output by reference, not copied.
 	 */
+	char hdr[MAX_CMD_MESSAGE];
+	int hlen = sprintf(hdr,"TUNNELRECV %s/%x " PRISIZET "\r\n",srcaddr.str(),srcchan,(unsigned long long)len);
 
-    std::ostringstream oss;
-    oss << "TUNNELRECV " << srcaddr.str();
-    oss << "/" << std::hex << srcchan;
-    oss << " " << std::dec << evbuffer_get_length(evb) << "\r\n";
-
-	std::stringbuf *pbuf=oss.rdbuf();
-	size_t slen = strlen(pbuf->str().c_str());
-	send(cmd_tunnel_sock,pbuf->str().c_str(),slen,0);
-
-	slen = evbuffer_get_length(evb);
-	uint8_t *data = evbuffer_pullup(evb,slen);
-	send(cmd_tunnel_sock,(const char *)data,slen,0);
-
-	evbuffer_drain(evb,slen);
+	struct evbuffer *output = bufferevent_get_output(conn->bev);
+	evbuffer_add(output,hdr,hlen);
+	evbuffer_add_buffer(output,evb);
 }
 
 
-void swift::CmdGwTunnelSendUDP(struct evbuffer *evb)
+void CmdGwTunnelSendFrame(cmd_gw_conn_t *conn, struct evbuffer *evb)
 {
-	// Received data from TCP connection, send over UDP to specified dest
-	cmd_tunnel_state = CMDGW_TUNNEL_SCAN4CRLF;
+	// Received data from TCP connection, send over UDP to specified dest.
+	// The datagram is assembled in one contiguous piece of a reused buffer,
+	// which SendTo can then hand to the kernel without further copying.
+	conn->tunnel_state = CMDGW_TUNNEL_SCAN4CRLF;
 
 	if (cmd_gw_debug)
-		fprintf(stderr,"cmdgw: sendudp:");
+		fprintf(stderr,"cmdgw: sendudp: %u bytes to %s\n", conn->tunnel_expect, conn->tunnel_dest_addr.str() );
 
-	struct evbuffer *sendevbuf = evbuffer_new();
+	evbuffer_drain(cmd_tunnel_sendbuf,evbuffer_get_length(cmd_tunnel_sendbuf));
 
 	// Add channel id. Currently always CMDGW_TUNNEL_DEFAULT_CHANNEL_ID=0xffffffff
 	// but we may add a TUNNELSUBSCRIBE command later to allow the allocation
 	// of different channels for different TCP clients.
-	int ret = evbuffer_add_32be(sendevbuf, cmd_tunnel_dest_chanid);
-	if (ret < 0)
-	{
-		evbuffer_drain(evb,cmd_tunnel_expect);
-		evbuffer_free(sendevbuf);
-		fprintf(stderr,"cmdgw: sendudp :can't copy prefix to sendbuf!");
-		return;
-	}
-	ret = evbuffer_remove_buffer(evb, sendevbuf, cmd_tunnel_expect);
-	if (ret < 0)
+	struct evbuffer_iovec vec;
+	if (evbuffer_reserve_space(cmd_tunnel_sendbuf,4+conn->tunnel_expect,&vec,1) < 1)
 	{
-		evbuffer_drain(evb,cmd_tunnel_expect);
-		evbuffer_free(sendevbuf);
-		fprintf(stderr,"cmdgw: sendudp :can't copy to sendbuf!");
+		evbuffer_drain(evb,conn->tunnel_expect);
+		fprintf(stderr,"cmdgw: sendudp :can't reserve sendbuf!");
 		return;
 	}
+	uint32_t chanid = htonl(conn->tunnel_dest_chanid);
+	memcpy(vec.iov_base,&chanid,4);
+	evbuffer_remove(evb,(char *)vec.iov_base+4,conn->tunnel_expect);
+	vec.iov_len = 4+conn->tunnel_expect;
+	evbuffer_commit_space(cmd_tunnel_sendbuf,&vec,1);
+
+	CmdGwTunnelSendUDP(conn->tunnel_dest_addr,cmd_tunnel_sendbuf);
+}
+
+
+void swift::CmdGwTunnelSendUDP(const Address &dest, struct evbuffer *evb)
+{
+	// Send datagram (channel id + payload) over swift's UDP socket
 	if (Channel::sock_count != 1)
 	{
 		fprintf(stderr,"cmdgw: sendudp: no single UDP socket!");
-		evbuffer_free(sendevbuf);
+		evbuffer_drain(evb,evbuffer_get_length(evb));
 		return;
 	}
 	evutil_socket_t sock = Channel::sock_open[Channel::sock_count-1].sock;
 
-	Channel::SendTo(sock,cmd_tunnel_dest_addr,&sendevbuf);
-
-	evbuffer_free(sendevbuf);
+	Channel::SendTo(sock,dest,&evb);
 }
@@ -0,0 +1,265 @@
+/*
+ *  cmdqueue.cpp
+ *  lets other threads of an embedding application call the API: commands
+ *  go into a lock-free multi-producer single-consumer queue and an eventfd
+ *  (a socketpair where there is none) wakes up the event loop to run them.
+ *  The queue is the intrusive one of D. Vyukov, producers only do an
+ *  atomic exchange.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+using namespace swift;
+
+
+struct cmd_t {
+    CommandFunc     fn;
+    void            *arg;
+    cmd_t * volatile next;
+};
+
+static cmd_t cmdstub = { NULL, NULL, NULL };
+static cmd_t * volatile cmdhead = &cmdstub;  // last pushed, producers
+static cmd_t *cmdtail = &cmdstub;            // next to run, event loop only
+static volatile long cmdwakeup = 0;          // wakeup written, not yet read
+static evutil_socket_t cmdfds[2] = { -1, -1 }; // read, write end
+static struct event *evcmd = NULL;
+#ifdef _WIN32
+static DWORD cmdthread;
+#else
+static pthread_t cmdthread;
+#endif
+
+
+static cmd_t *AtomicSwapCmd(cmd_t * volatile *p, cmd_t *v)
+{
+#ifdef _WIN32
+    return (cmd_t *)InterlockedExchangePointer((PVOID volatile *)p,v);
+#else
+    __sync_synchronize(); // test_and_set is an acquire barrier only
+    return __sync_lock_test_and_set(p,v);
+#endif
+}
+
+
+static long AtomicSwapLong(volatile long *p, long v)
+{
+#ifdef _WIN32
+    return InterlockedExchange(p,v);
+#else
+    __sync_synchronize();
+    return __sync_lock_test_and_set(p,v);
+#endif
+}
+
+
+static bool OnLoopThread()
+{
+#ifdef _WIN32
+    return GetCurrentThreadId() == cmdthread;
+#else
+    return pthread_equal(pthread_self(),cmdthread);
+#endif
+}
+
+
+static void PushCmd(cmd_t *c)
+{
+    c->next = NULL;
+    cmd_t *prev = AtomicSwapCmd(&cmdhead,c);
+    // Until this store the consumer sees the queue end at prev
+    prev->next = c;
+}
+
+
+/** Returns NULL when empty, or when a producer is between its swap and
+ *  linking in; the wakeup it writes after comes later. */
+static cmd_t *PopCmd()
+{
+    cmd_t *tail = cmdtail, *next = tail->next;
+    if (tail == &cmdstub) {
+        if (next == NULL)
+            return NULL;
+        cmdtail = tail = next;
+        next = next->next;
+    }
+    if (next != NULL) {
+        cmdtail = next;
+        return tail;
+    }
+    if (tail != cmdhead)
+        return NULL;
+    // tail is the last one, put the stub behind it to take it out
+    PushCmd(&cmdstub);
+    next = tail->next;
+    if (next != NULL) {
+        cmdtail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+static void Wakeup()
+{
+    // Only the first producer since the last wakeup writes
+    if (AtomicSwapLong(&cmdwakeup,1) != 0)
+        return;
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(cmdfds[1],&one,sizeof(one)) < 0)
+        print_error("cmdqueue: cannot wake up event loop");
+#else
+    char one = 1;
+    if (send(cmdfds[1],&one,1,0) < 0)
+        print_error("cmdqueue: cannot wake up event loop");
+#endif
+}
+
+
+static void LibeventCmdCallback(evutil_socket_t fd, short event, void *arg)
+{
+#ifdef __linux__
+    uint64_t count;
+    if (read(fd,&count,sizeof(count)) < 0)
+        return;
+#else
+    char buf[64];
+    while (recv(fd,buf,sizeof(buf),0) > 0)
+        ;
+#endif
+    // Producers after this write again
+    AtomicSwapLong(&cmdwakeup,0);
+    Channel::Time();
+    RunCommands();
+}
+
+
+int swift::InstallCommandQueue(void)
+{
+    if (evcmd != NULL)
+        return 0;
+    if (Channel::evbase == NULL)
+        return -1;
+#ifdef __linux__
+    cmdfds[0] = cmdfds[1] = eventfd(0,EFD_NONBLOCK);
+    if (cmdfds[0] < 0) {
+        print_error("cmdqueue: cannot create eventfd");
+        return -1;
+    }
+#else
+    if (evutil_socketpair(AF_UNIX,SOCK_STREAM,0,cmdfds) < 0) {
+        print_error("cmdqueue: cannot create socketpair");
+        return -1;
+    }
+    evutil_make_socket_nonblocking(cmdfds[0]);
+    evutil_make_socket_nonblocking(cmdfds[1]);
+#endif
+#ifdef _WIN32
+    cmdthread = GetCurrentThreadId();
+#else
+    cmdthread = pthread_self();
+#endif
+    evcmd = event_new(Channel::evbase,cmdfds[0],EV_READ|EV_PERSIST,LibeventCmdCallback,NULL);
+    event_add(evcmd,NULL);
+    dprintf("%s cmdqueue: installed on fd %d\n",tintstr(),(int)cmdfds[0]);
+    return 0;
+}
+
+
+int swift::Submit(CommandFunc fn, void *arg)
+{
+    if (evcmd == NULL || fn == NULL)
+        return -1;
+    cmd_t *c = new cmd_t;
+    c->fn = fn;
+    c->arg = arg;
+    PushCmd(c);
+    Wakeup();
+    return 0;
+}
+
+
+int swift::RunCommands(void)
+{
+    int count = 0;
+    cmd_t *c;
+    while ((c = PopCmd()) != NULL) {
+        c->fn(c->arg);
+        delete c;
+        count++;
+    }
+    return count;
+}
+
+
+/** What SubmitWait() waits for */
+struct cmdwait_t {
+    CommandFunc     fn;
+    void            *arg;
+    bool            done;
+#ifdef _WIN32
+    HANDLE          event;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+#endif
+};
+
+
+static void RunAndSignal(void *arg)
+{
+    cmdwait_t *w = (cmdwait_t *)arg;
+    w->fn(w->arg);
+#ifdef _WIN32
+    w->done = true;
+    SetEvent(w->event);
+#else
+    pthread_mutex_lock(&w->mutex);
+    w->done = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+#endif
+}
+
+
+int swift::SubmitWait(CommandFunc fn, void *arg)
+{
+    if (evcmd == NULL || fn == NULL)
+        return -1;
+    if (OnLoopThread()) {
+        // Would wait for itself
+        fn(arg);
+        return 0;
+    }
+
+    cmdwait_t w;
+    w.fn = fn;
+    w.arg = arg;
+    w.done = false;
+#ifdef _WIN32
+    w.event = CreateEvent(NULL,FALSE,FALSE,NULL);
+    Submit(RunAndSignal,&w);
+    WaitForSingleObject(w.event,INFINITE);
+    CloseHandle(w.event);
+#else
+    pthread_mutex_init(&w.mutex,NULL);
+    pthread_cond_init(&w.cond,NULL);
+    Submit(RunAndSignal,&w);
+    pthread_mutex_lock(&w.mutex);
+    while (!w.done)
+        pthread_cond_wait(&w.cond,&w.mutex);
+    pthread_mutex_unlock(&w.mutex);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.mutex);
+#endif
+    return 0;
+}
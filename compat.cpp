@@ -138,6 +138,14 @@ int inet_aton(const char *cp, struct in_addr *inp)
 
 #endif
 
+// SIMULATOR: virtual clock returned by usec_time() when set
+static tint *usec_time_clock = NULL;
+
+void usec_time_virtual(tint *clock)
+{
+	usec_time_clock = clock;
+}
+
 #ifdef _WIN32
 
 LARGE_INTEGER get_freq() {
@@ -149,6 +157,8 @@ LARGE_INTEGER get_freq() {
 
 tint usec_time(void)
 {
+	if (usec_time_clock != NULL)
+		return *usec_time_clock;
 	static LARGE_INTEGER last_time;
 	LARGE_INTEGER cur_time;
 	QueryPerformanceCounter(&cur_time);
@@ -165,6 +175,26 @@ tint usec_time(void)
 
 tint usec_time(void)
 {
+    if (usec_time_clock != NULL)
+        return *usec_time_clock;
+#ifdef CLOCK_MONOTONIC
+    // Monotonic, such that RTT and LEDBAT delay samples never see the
+    // clock step back. Offset to the wall clock once, so times in logs
+    // and stats still read as such.
+    static tint wall_offset = 0;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC,&ts) == 0)
+    {
+        tint mono = (tint)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+        if (wall_offset == 0)
+        {
+            struct timeval t;
+            gettimeofday(&t,NULL);
+            wall_offset = (tint)t.tv_sec*1000000 + t.tv_usec - mono;
+        }
+        return mono + wall_offset;
+    }
+#endif
     struct timeval t;
     gettimeofday(&t,NULL);
     tint ret;
@@ -147,6 +147,23 @@ typedef int64_t tint;
 #endif
 
 
+/*
+ * Thread-local storage, memory barrier and compare-and-swap for the few
+ * lock-free structures that may be touched from outside the event loop.
+ */
+#ifdef _MSC_VER
+#define SWIFT_THREAD_LOCAL      __declspec(thread)
+#define swift_membar()          MemoryBarrier()
+#define swift_cas_ptr(p,o,n)    (InterlockedCompareExchangePointer((PVOID volatile *)(p),(n),(o)) == (o))
+#define swift_fetch_add(p,v)    InterlockedExchangeAdd((LONG volatile *)(p),(v))
+#else
+#define SWIFT_THREAD_LOCAL      __thread
+#define swift_membar()          __sync_synchronize()
+#define swift_cas_ptr(p,o,n)    __sync_bool_compare_and_swap((p),(o),(n))
+#define swift_fetch_add(p,v)    __sync_fetch_and_add((p),(v))
+#endif
+
+
 /*
  * UNICODE
  *
@@ -240,6 +257,11 @@ int     inet_aton(const char *cp, struct in_addr *inp);
 
 tint    usec_time ();
 
+/** Make usec_time() return *clock instead of the system time, such that
+    the swarm simulator can run on virtual time. NULL restores the system
+    clock. */
+void    usec_time_virtual (tint *clock);
+
 bool    make_socket_nonblocking(evutil_socket_t s);
 
 bool    close_socket (evutil_socket_t sock);
@@ -43,6 +43,11 @@ public:
         range_ = range;
     }
 
+    virtual size_t mem_size () {
+        return ack_hint_out_.total_size() + tbqueue_mem_size(hint_out_)
+            + priority_.capacity()*sizeof(bin_t);
+    }
+
     virtual bin_t Pick (binmap_t& offer, uint64_t max_width, tint expires) {
         while (hint_out_.size() && hint_out_.front().time<NOW-TINT_SEC*3/2) { // FIXME sec
             binmap_t::copy(ack_hint_out_, *(hashtree()->ack_out()), hint_out_.front().bin);
@@ -57,7 +62,9 @@ public:
     retry:      // bite me
         twist_ &= (hashtree()->peak(0).toUInt()) & ((1<<6)-1);
 
-        bin_t hint = binmap_t::find_complement(ack_hint_out_, offer, twist_);
+        bin_t hint = PickPriority(offer, ack_hint_out_, hashtree()->ack_out(), twist_);
+        if (hint.is_none())
+            hint = binmap_t::find_complement(ack_hint_out_, offer, twist_);
         if (hint.is_none()) {
             return hint; // TODO: end-game mode
         }
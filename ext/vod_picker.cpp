@@ -59,6 +59,11 @@ public:
         range_ = range;
     }
 
+    virtual size_t mem_size () {
+        return ack_hint_out_.total_size() + tbqueue_mem_size(hint_out_)
+            + priority_.capacity()*sizeof(bin_t);
+    }
+
 
     bin_t getTopBin(bin_t bin, uint64_t start, uint64_t size)
     {
@@ -186,6 +191,21 @@ public:
         	return initseq_;
         }
 
+        // Ranges waited for come first, leaving the playback position alone
+        hint = PickPriority(offer, ack_hint_out_, hashtree()->ack_out(), twist_);
+        while (!hint.is_none() && !hashtree()->ack_out()->is_empty(hint)) {
+            // unhinted/late data
+            binmap_t::copy(ack_hint_out_, *(hashtree()->ack_out()), hint);
+            hint = PickPriority(offer, ack_hint_out_, hashtree()->ack_out(), twist_);
+        }
+        if (!hint.is_none()) {
+            while (hint.base_length()>max_width && !hint.is_base())
+                hint.to_left();
+            ack_hint_out_.set(hint);
+            hint_out_.push_back(tintbin(NOW,hint));
+            return hint;
+        }
+
         do {
         	uint64_t max_size = hashtree()->size_in_chunks() - playback_pos_ - 1;
         	max_size = high_pri_window_ < max_size ? high_pri_window_ : max_size;
@@ -606,6 +606,14 @@ bool            MmapHashTree::OfferData (bin_t pos, const char* data, size_t len
     	print_error("pwrite failed");
     complete_ += length;
     completec_++;
+    for (int i=0; i<seqfronts_.size(); i++) {
+        seqfront_t &f = seqfronts_[i];
+        if (f.completec+1 == completec_ && f.frontc == pos.base_offset())
+            f.frontc = NextEmptyChunk(f.frontc);
+        if (f.completec+1 == completec_)
+            f.completec = completec_;
+        // else ack_out_ also changed elsewhere, redone on the next ask
+    }
     if (pos.base_offset()==sizec_-1) {
         size_ = ((sizec_-1)*chunk_size_) + length;
         if (storage_->GetReservedSize()!=size_)
@@ -615,32 +623,64 @@ bool            MmapHashTree::OfferData (bin_t pos, const char* data, size_t len
 }
 
 
+uint64_t      MmapHashTree::NextEmptyChunk (uint64_t c) {
+
+	bin_t b(0,c);
+	while (ack_out_.is_filled(b))
+	{
+		// Go to the subtree right next to b
+		while (b.is_right())
+			b = b.parent();
+		b = b.sibling();
+		if (b.base_offset() >= sizec_)
+			return sizec_;
+	}
+	// Leftmost empty chunk below b
+	while (!b.is_base())
+	{
+		if (!ack_out_.is_filled(b.left()))
+			b = b.left();
+		else
+			b = b.right();
+	}
+	return std::min((uint64_t)b.base_offset(),sizec_);
+}
+
+
 uint64_t      MmapHashTree::seq_complete (int64_t offset) {
 
-	uint64_t seqc = 0;
-	if (offset == 0)
+	// SEEK: Calc sequentially complete bytes from an offset, from the
+	// frontier kept for it
+	uint64_t startc = offset / chunk_size_;
+	int i;
+	for (i=0; i<seqfronts_.size(); i++)
+		if (seqfronts_[i].startc == startc)
+			break;
+	if (i == seqfronts_.size())
 	{
-	    uint64_t seqc = ack_out_.find_empty().base_offset();
-	    if (seqc==sizec_)
-	        return size_;
-	    else
-	        return seqc*chunk_size_;
+		if (seqfronts_.size() < SEQ_FRONTIERS)
+			seqfronts_.push_back(seqfront_t());
+		i = seqfronts_.size()-1;
+		seqfronts_[i].startc = startc;
+		seqfronts_[i].completec = completec_+1; // invalid
 	}
-	else
+	seqfront_t f = seqfronts_[i];
+	if (f.completec != completec_)
 	{
-		// SEEK: Calc sequentially complete bytes from an offset
-		bin_t binoff = bin_t(0,(offset - (offset % chunk_size_)) / chunk_size_);
-		bin_t nextempty = ack_out_.find_empty(binoff);
-		if (nextempty == bin_t::NONE || nextempty.base_offset() * chunk_size_ > size_)
-			return size_-offset; // All filled from offset
-
-		bin_t::uint_t diffc = nextempty.layer_offset() - binoff.layer_offset();
-		uint64_t diffb = diffc * chunk_size_;
-		if (diffb > 0)
-			diffb -= (offset % chunk_size_);
-
-		return diffb;
+		f.frontc = NextEmptyChunk(startc);
+		f.completec = completec_;
 	}
+	// Move to front, the least recently asked is replaced first
+	for (; i>0; i--)
+		seqfronts_[i] = seqfronts_[i-1];
+	seqfronts_[0] = f;
+
+	if (f.frontc >= sizec_)
+		return size_-offset; // All filled from offset
+	uint64_t diffb = (f.frontc - startc) * chunk_size_;
+	if (diffb > 0)
+		diffb -= (offset % chunk_size_);
+	return diffb;
 }
 
 
@@ -10,6 +10,7 @@
 #define SWIFT_SHA1_HASH_TREE_H
 #include <string.h>
 #include <string>
+#include <vector>
 #include "bin.h"
 #include "binmap.h"
 #include "operational.h"
@@ -18,6 +19,10 @@ namespace swift {
 
 #define HASHSZ 20
 
+// SEEK: offsets whose sequentially complete frontier is kept, e.g. one
+// per HTTP stream of the file. Least recently asked goes beyond that.
+#define SEQ_FRONTIERS	8
+
 /** SHA-1 hash, 20 bytes of data */
 struct Sha1Hash {
     uint8_t    bits[HASHSZ];
@@ -110,6 +115,11 @@ class HashTree : public Operational {
 
     virtual int TESTGetFD() = 0;
 
+    /** Heap memory held by the tree's binmaps, in bytes. */
+    virtual size_t          mem_size () const = 0;
+    /** Bytes of the .mhash file currently memory mapped. */
+    virtual size_t          mmap_size () const = 0;
+
     virtual ~HashTree() {};
 };
 
@@ -136,6 +146,15 @@ class MmapHashTree : public HashTree, Serializable {
     /**    Binmap of own chunk availability */
     binmap_t        ack_out_;
 
+    // SEEK: sequentially complete frontier per offset asked for, advanced
+    // by OfferData() such that seq_complete() need not search ack_out_
+    struct seqfront_t {
+        uint64_t    startc;     // chunk of the offset
+        uint64_t    frontc;     // first incomplete chunk from startc on
+        uint64_t    completec;  // completec_ when frontc was valid
+    };
+    std::vector<seqfront_t> seqfronts_; // most recently asked first
+
 	// CHUNKSIZE
 	/** Arno: configurable fixed chunk size in bytes */
     uint32_t			chunk_size_;
@@ -160,6 +179,8 @@ protected:
     bool 	    RecoverPeakHashes();
     Sha1Hash        DeriveRoot();
     bool            OfferPeakHash (bin_t pos, const Sha1Hash& hash);
+    /** First chunk from c on that is not in ack_out_, sizec_ if none. */
+    uint64_t        NextEmptyChunk (uint64_t c);
 
     
 public:
@@ -204,6 +225,10 @@ public:
     bool get_check_netwvshash() { return check_netwvshash_; }
 
     int TESTGetFD() { return hash_fd_; }
+
+    size_t          mem_size () const { return ack_out_.total_size() + is_hash_verified_.total_size()
+                                                + seqfronts_.capacity()*sizeof(seqfront_t); }
+    size_t          mmap_size () const { return hashes_ ? sizec_*2*sizeof(Sha1Hash) : 0; }
 };
 
 
@@ -276,6 +301,10 @@ public:
     bool get_check_netwvshash() { return true; }
 
     int TESTGetFD() { return hash_fd_; }
+
+    // Hashes are read from disk on demand, nothing is kept in memory
+    size_t          mem_size () const { return 0; }
+    size_t          mmap_size () const { return 0; }
 };
 
 
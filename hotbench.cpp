@@ -0,0 +1,651 @@
+/*
+ *  hotbench.cpp
+ *  microbenchmarks of the per-datagram protocol code: Channel::Send (with
+ *  AddHave, AddAck, AddHint, AddData), Channel::RecvDatagram dispatch
+ *  (OnAck, OnHave, OnHint, OnHash, OnData -> OfferData) and DequeueHint
+ *
+ *  A seeder and a leecher channel live in one process, connected by a
+ *  transport that hands each datagram over when the benchmark says so.
+ *  Every call is timed on its own, so the cost of e.g. the seeder's receive
+ *  of an ACK is separated from the send it triggers. Channel state is set
+ *  up directly where a scenario needs it (hints, cwnd, fragmented maps).
+ *
+ *  Scenarios:
+ *    lockstep      one chunk in flight, hints picked by the leecher
+ *    large-cwnd    the seeder sends a window of W chunks before the acks
+ *                  come back, so OnAck works on a long data_out_
+ *    fragmented    the leecher already holds every other chunk
+ *
+ *  Output is one JSON object per scenario and operation with ns per call
+ *  and, where perf_event is available, cycles, instructions, cache misses
+ *  and branch misses per call.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include <algorithm>
+#include <deque>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace swift;
+
+#define HOTBENCH_SEEDER_SOCK    200000
+#define HOTBENCH_LEECHER_SOCK   200001
+// Virtual time between two operations
+#define HOTBENCH_STEP           (10*TINT_uSEC)
+#define HOTBENCH_NCOUNTERS      4
+
+namespace swift {
+
+
+/** Hardware counters of this thread, user space only. */
+class PerfCounters {
+  public:
+    PerfCounters() : leader_(-1) {}
+    ~PerfCounters();
+
+    /** Returns false when perf_event is not available. */
+    bool        Open();
+    bool        available() { return leader_ >= 0; }
+    /** Current values of cycles, instructions, cache misses, branch misses. */
+    bool        Read(uint64_t *values);
+
+  protected:
+    int         leader_;
+    int         fds_[HOTBENCH_NCOUNTERS];
+};
+
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    if (leader_ < 0)
+        return;
+    for (int i=0; i<HOTBENCH_NCOUNTERS; i++)
+        close(fds_[i]);
+#endif
+}
+
+
+bool PerfCounters::Open()
+{
+#ifdef __linux__
+    static const uint64_t configs[HOTBENCH_NCOUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for (int i=0; i<HOTBENCH_NCOUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr,0,sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fds_[i] = syscall(__NR_perf_event_open,&attr,0,-1,i ? fds_[0] : -1,0);
+        if (fds_[i] < 0) {
+            while (i--)
+                close(fds_[i]);
+            return false;
+        }
+    }
+    leader_ = fds_[0];
+    ioctl(leader_,PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+bool PerfCounters::Read(uint64_t *values)
+{
+#ifdef __linux__
+    uint64_t buf[1+HOTBENCH_NCOUNTERS];
+    if (leader_ < 0 || read(leader_,buf,sizeof(buf)) != sizeof(buf))
+        return false;
+    for (int i=0; i<HOTBENCH_NCOUNTERS; i++)
+        values[i] = buf[1+i];
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+/** Timings of one operation in one scenario. */
+struct hotop_t {
+    std::vector<int64_t>    ns;
+    uint64_t                counters[HOTBENCH_NCOUNTERS];
+    hotop_t() { memset(counters,0,sizeof(counters)); }
+};
+
+
+/** Datagram between the two channels, waiting for delivery. */
+struct hotdgram_t {
+    evutil_socket_t to;
+    Address         from;
+    std::string     data;
+};
+
+
+class HotPathBench : public Transport {
+  public:
+    HotPathBench(std::string filename, std::string workdir, uint32_t chunk_size, int window);
+    ~HotPathBench();
+
+    bool        Lockstep(int maxchunks);
+    bool        LargeCwnd(int maxchunks);
+    bool        Fragmented(int maxchunks);
+    void        Report(FILE *fp);
+
+    // Transport
+    int         SendMsg(evutil_socket_t sock, struct msghdr *msg);
+    int         RecvMsg(evutil_socket_t sock, struct msghdr *msg);
+
+  protected:
+    std::string filename_, workdir_, scenario_;
+    uint32_t    chunk_size_;
+    int         window_;
+    tint        now_;
+    FileTransfer *seeder_, *leecher_;
+    Channel     *sc_, *lc_;
+    Address     saddr_, laddr_;
+    std::deque<hotdgram_t>  pending_;
+    hotdgram_t  *delivering_;
+    PerfCounters perf_;
+    /** Cost of an empty measurement, subtracted from every sample */
+    int64_t     overhead_ns_;
+    uint64_t    overhead_counters_[HOTBENCH_NCOUNTERS];
+    std::map<std::string,hotop_t>   ops_;
+    std::vector<std::string>        order_;
+    // Measurement in progress
+    int64_t     t0_;
+    uint64_t    c0_[HOTBENCH_NCOUNTERS];
+
+    bool        Setup(std::string scenario);
+    void        Teardown();
+    void        Step() { now_ += HOTBENCH_STEP; Channel::Time(); }
+    void        Begin();
+    void        End(std::string op);
+    void        Calibrate();
+    void        Send(Channel *c, const char *who, bool timed=true);
+    void        Deliver(bool timed=true);
+    void        InjectHint(int chunk);
+    void        SuppressLeecherHints() { lc_->hint_out_size_ = 1<<30; }
+    bool        Done() { return leecher_->hashtree()->is_complete(); }
+    static std::string Describe(const std::string &dgram);
+    static int64_t  Nanos();
+};
+
+
+int64_t HotPathBench::Nanos()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (int64_t)(count.QuadPart*1e9/freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+HotPathBench::HotPathBench(std::string filename, std::string workdir, uint32_t chunk_size, int window) :
+    filename_(filename), workdir_(workdir), chunk_size_(chunk_size), window_(window),
+    seeder_(NULL), leecher_(NULL), sc_(NULL), lc_(NULL),
+    saddr_((uint32_t)0x0A000001,7000), laddr_((uint32_t)0x0A000002,7000),
+    delivering_(NULL), overhead_ns_(0)
+{
+    memset(overhead_counters_,0,sizeof(overhead_counters_));
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    now_ = Channel::epoch;
+    usec_time_virtual(&now_);
+    Channel::Time();
+    Channel::transport = this;
+    // Both ends share Channel::channels
+    Channel::SELF_CONN_OK = true;
+    perf_.Open();
+    Calibrate();
+}
+
+
+HotPathBench::~HotPathBench()
+{
+    Teardown();
+    Channel::transport = NULL;
+    usec_time_virtual(NULL);
+    Channel::Time();
+}
+
+
+int HotPathBench::SendMsg(evutil_socket_t sock, struct msghdr *msg)
+{
+    struct sockaddr_mptp *sa = (struct sockaddr_mptp *)msg->msg_name;
+    int total = 0;
+    for (int i=0; i<msg->msg_iovlen; i++) {
+        int len = msg->msg_iov[i].iov_len;
+        sa->dests[i].bytes = len;
+        total += len;
+        hotdgram_t dgram;
+        dgram.to = sa->dests[i].addr == saddr_.addr->dests[0].addr ? HOTBENCH_SEEDER_SOCK : HOTBENCH_LEECHER_SOCK;
+        dgram.from = sock == HOTBENCH_SEEDER_SOCK ? saddr_ : laddr_;
+        dgram.data.assign((const char *)msg->msg_iov[i].iov_base,len);
+        pending_.push_back(dgram);
+    }
+    return total;
+}
+
+
+int HotPathBench::RecvMsg(evutil_socket_t sock, struct msghdr *msg)
+{
+    struct sockaddr_mptp *sa = (struct sockaddr_mptp *)msg->msg_name;
+    if (delivering_ == NULL || msg->msg_iovlen < 1) {
+        sa->count = 0;
+        return 0;
+    }
+    int len = delivering_->data.length();
+    if (len > msg->msg_iov[0].iov_len)
+        len = msg->msg_iov[0].iov_len;
+    memcpy(msg->msg_iov[0].iov_base,delivering_->data.data(),len);
+    sa->count = 1;
+    sa->dests[0].addr = delivering_->from.addr->dests[0].addr;
+    sa->dests[0].port = delivering_->from.addr->dests[0].port;
+    sa->dests[0].bytes = len;
+    delivering_ = NULL;
+    return len;
+}
+
+
+void HotPathBench::Begin()
+{
+    perf_.Read(c0_);
+    t0_ = Nanos();
+}
+
+
+void HotPathBench::End(std::string op)
+{
+    int64_t t1 = Nanos();
+    uint64_t c1[HOTBENCH_NCOUNTERS];
+    bool counted = perf_.Read(c1);
+
+    std::string key = scenario_+"\t"+op;
+    if (ops_.find(key) == ops_.end())
+        order_.push_back(key);
+    hotop_t &o = ops_[key];
+    o.ns.push_back(std::max((int64_t)0,t1-t0_-overhead_ns_));
+    if (counted)
+        for (int i=0; i<HOTBENCH_NCOUNTERS; i++)
+            o.counters[i] += c1[i]-c0_[i]-std::min(c1[i]-c0_[i],overhead_counters_[i]);
+}
+
+
+void HotPathBench::Calibrate()
+{
+    const int n = 10000;
+    std::vector<int64_t> ns;
+    uint64_t sum[HOTBENCH_NCOUNTERS] = {0};
+    for (int i=0; i<n; i++) {
+        Begin();
+        int64_t t1 = Nanos();
+        uint64_t c1[HOTBENCH_NCOUNTERS];
+        if (perf_.Read(c1))
+            for (int j=0; j<HOTBENCH_NCOUNTERS; j++)
+                sum[j] += c1[j]-c0_[j];
+        ns.push_back(t1-t0_);
+    }
+    std::sort(ns.begin(),ns.end());
+    overhead_ns_ = ns[n/2];
+    for (int j=0; j<HOTBENCH_NCOUNTERS; j++)
+        overhead_counters_[j] = sum[j]/n;
+}
+
+
+/** Message types in a datagram, e.g. "HASH+DATA". Compact messages are
+ *  named as their legacy counterparts, multiplexed datagrams "MUX". */
+std::string HotPathBench::Describe(const std::string &dgram)
+{
+    static const char *names[SWIFT_MESSAGE_COUNT] = {
+        "HANDSHAKE", "DATA", "ACK", "HAVE", "HASH", "PEX_ADD", "PEX_REQ",
+        "SIGNED_HASH", "HINT", "MSGTYPE_RCVD", "RANDOMIZE", "VERSION",
+        "DATA", "ACK", "HAVE", "HASH", "HINT", "HASH" };
+    // Bytes after the type, not counting the varint bin of compact ones
+    static const int lengths[SWIFT_MESSAGE_COUNT] = {
+        4, -1, 4+8, 4, 4+Sha1Hash::SIZE, 4+2, 0, -1, 4, -1, 4, 1,
+        -1, 4, 0, Sha1Hash::SIZE, 0, 1 };
+    uint32_t chid = 0;
+    if (dgram.length() >= 4)
+        memcpy(&chid,dgram.data(),4);
+    if (ntohl(chid) == SWIFT_MUX_CHANNEL_ID)
+        return "MUX";
+    std::string desc;
+    const char *last = NULL;
+    size_t pos = 4;
+    while (pos < dgram.length()) {
+        uint8_t type = dgram[pos++];
+        if (type >= SWIFT_MESSAGE_COUNT || lengths[type] < 0) {
+            desc += desc.empty() ? "" : "+";
+            desc += type == SWIFT_DATA || type == SWIFT_COMPACT_DATA ? "DATA" : "?";
+            break;
+        }
+        if (last == NULL || strcmp(names[type],last)) {
+            desc += desc.empty() ? "" : "+";
+            desc += names[type];
+            last = names[type];
+        }
+        if (type >= SWIFT_COMPACT_DATA)
+            while (pos < dgram.length() && (dgram[pos++] & 0x80))
+                ;
+        pos += lengths[type];
+        if (type == SWIFT_COMPACT_UNCLES && pos <= dgram.length())
+            pos += (uint8_t)dgram[pos-1]*Sha1Hash::SIZE;
+    }
+    return desc.empty() ? "KEEPALIVE" : desc;
+}
+
+
+void HotPathBench::Send(Channel *c, const char *who, bool timed)
+{
+    // Flush what is held for multiplexing, as the end of the event loop
+    // iteration would
+    if (!timed) {
+        c->Send();
+        Channel::messageQueue.Flush();
+        return;
+    }
+    Begin();
+    c->Send();
+    Channel::messageQueue.Flush();
+    End(std::string(who)+".Send");
+}
+
+
+/** Hand over the pending datagrams in the order they were sent. */
+void HotPathBench::Deliver(bool timed)
+{
+    while (!pending_.empty()) {
+        hotdgram_t dgram = pending_.front();
+        pending_.pop_front();
+        std::string op = std::string(dgram.to == HOTBENCH_SEEDER_SOCK ? "seeder" : "leecher")
+            +".RecvDatagram "+Describe(dgram.data);
+        delivering_ = &dgram;
+        if (timed)
+            Begin();
+        Channel::RecvDatagram(dgram.to);
+        if (timed)
+            End(op);
+        delivering_ = NULL;
+    }
+}
+
+
+void HotPathBench::InjectHint(int chunk)
+{
+    sc_->hint_in_.push_back(tintbin(NOW,bin_t(0,chunk)));
+}
+
+
+bool HotPathBench::Setup(std::string scenario)
+{
+    Teardown();
+    scenario_ = scenario;
+    Step();
+
+    seeder_ = new FileTransfer(filename_,Sha1Hash::ZERO,true,true,chunk_size_);
+    if (!seeder_->IsOperational() || !seeder_->hashtree()->is_complete()) {
+        print_error("hotbench: cannot seed file");
+        return false;
+    }
+    seeder_->SetSocket(HOTBENCH_SEEDER_SOCK);
+
+    std::string dir = workdir_+FILE_SEP+"leecher";
+    if (file_exists_utf8(dir) != 2)
+        mkdir_utf8(dir);
+    std::string leechname = dir+FILE_SEP+seeder_->root_hash().hex();
+    remove_utf8(leechname);
+    remove_utf8(leechname+".mhash");
+    remove_utf8(leechname+".mbinmap");
+    leecher_ = new FileTransfer(leechname,seeder_->root_hash(),true,true,chunk_size_);
+    leecher_->SetSocket(HOTBENCH_LEECHER_SOCK);
+
+    // Handshake: the seeder's channel is created on the first datagram.
+    // Sends only happen when the benchmark calls Send().
+    lc_ = new Channel(leecher_,HOTBENCH_LEECHER_SOCK,saddr_);
+    lc_->direct_sending_ = true;
+    Send(lc_,"leecher",false);
+    sc_ = NULL;
+    while (!pending_.empty()) {
+        Deliver(false);
+        if (sc_ == NULL && seeder_->GetChannels().size()) {
+            sc_ = seeder_->GetChannels().back();
+            sc_->direct_sending_ = true;
+            Step();
+            Send(sc_,"seeder",false);
+        }
+    }
+    // The seeder's channel is established once it sees its own id
+    Step();
+    Send(lc_,"leecher",false);
+    Deliver(false);
+    if (sc_ == NULL || !lc_->is_established() || !sc_->is_established()) {
+        print_error("hotbench: handshake failed");
+        return false;
+    }
+    return true;
+}
+
+
+void HotPathBench::Teardown()
+{
+    delete leecher_;
+    delete seeder_;
+    leecher_ = seeder_ = NULL;
+    sc_ = lc_ = NULL;
+    pending_.clear();
+}
+
+
+/** Regular download: the leecher hints, one chunk in flight. */
+bool HotPathBench::Lockstep(int maxchunks)
+{
+    if (!Setup("lockstep"))
+        return false;
+    for (int i=0; i<maxchunks && !Done(); i++) {
+        Step();
+        Send(lc_,"leecher");
+        Deliver();
+        Step();
+        Send(sc_,"seeder");
+        Deliver();
+    }
+    return true;
+}
+
+
+/** The seeder sends window_ chunks before any of them is acked. */
+bool HotPathBench::LargeCwnd(int maxchunks)
+{
+    if (!Setup("large-cwnd"))
+        return false;
+    int nchunks = (int)std::min((uint64_t)maxchunks,seeder_->hashtree()->size_in_chunks());
+    for (int first=0; first<nchunks; first+=window_) {
+        int last = std::min(first+window_,nchunks);
+
+        // Time DequeueHint on a window of hints, then queue them afresh
+        // so the data goes out in chunk order
+        lazytbqueue saved = sc_->hint_in_;
+        for (int c=first; c<last; c++)
+            InjectHint(c);
+        for (int c=first; c<last; c++) {
+            bool retransmit;
+            Begin();
+            sc_->DequeueHint(&retransmit);
+            End("seeder.DequeueHint");
+        }
+        sc_->hint_in_ = saved;
+        for (int c=first; c<last; c++)
+            InjectHint(c);
+
+        for (int c=first; c<last; c++) {
+            Step();
+            sc_->cwnd_ = window_;
+            sc_->send_interval_ = 0;
+            Send(sc_,"seeder");
+        }
+        // Data in, each followed by its ack; acks go back all at once
+        std::deque<hotdgram_t> data;
+        data.swap(pending_);
+        std::deque<hotdgram_t> acks;
+        while (!data.empty()) {
+            pending_.push_back(data.front());
+            data.pop_front();
+            Step();
+            Deliver();
+            SuppressLeecherHints();
+            Send(lc_,"leecher");
+            acks.insert(acks.end(),pending_.begin(),pending_.end());
+            pending_.clear();
+        }
+        pending_.swap(acks);
+        Step();
+        Deliver();
+    }
+    return true;
+}
+
+
+/** The leecher holds every other chunk, the rest is fetched. */
+bool HotPathBench::Fragmented(int maxchunks)
+{
+    if (!Setup("fragmented"))
+        return false;
+    int nchunks = (int)std::min((uint64_t)maxchunks,seeder_->hashtree()->size_in_chunks());
+    for (int parity=0; parity<2; parity++) {
+        bool timed = parity == 1;
+        for (int c=parity; c<nchunks; c+=2) {
+            InjectHint(c);
+            Step();
+            sc_->send_interval_ = 0;
+            Send(sc_,"seeder",timed);
+            Deliver(timed);
+            Step();
+            SuppressLeecherHints();
+            Send(lc_,"leecher",timed);
+            Deliver(timed);
+        }
+    }
+    return true;
+}
+
+
+static int64_t Percentile(const std::vector<int64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return -1;
+    return sorted[(size_t)(p*(sorted.size()-1)+0.5)];
+}
+
+
+void HotPathBench::Report(FILE *fp)
+{
+    static const char *names[HOTBENCH_NCOUNTERS] = {
+        "cycles", "instructions", "cache_misses", "branch_misses" };
+    for (int i=0; i<order_.size(); i++) {
+        hotop_t &o = ops_[order_[i]];
+        size_t tab = order_[i].find('\t');
+        std::sort(o.ns.begin(),o.ns.end());
+        int64_t sum = 0;
+        for (int j=0; j<o.ns.size(); j++)
+            sum += o.ns[j];
+        fprintf(fp,"{\"scenario\": \"%s\", \"op\": \"%s\", \"count\": %u, \"ns_avg\": %.1f, "
+            "\"ns_p50\": %lld, \"ns_p99\": %lld",
+            order_[i].substr(0,tab).c_str(),order_[i].substr(tab+1).c_str(),(unsigned int)o.ns.size(),
+            (double)sum/o.ns.size(),(long long)Percentile(o.ns,0.5),(long long)Percentile(o.ns,0.99));
+        for (int j=0; j<HOTBENCH_NCOUNTERS; j++) {
+            if (perf_.available())
+                fprintf(fp,", \"%s\": %.1f",names[j],(double)o.counters[j]/o.ns.size());
+            else
+                fprintf(fp,", \"%s\": -1",names[j]);
+        }
+        fprintf(fp,"}\n");
+    }
+}
+
+}
+
+
+static void usage()
+{
+    fprintf(stderr,"Usage: hotbench [options]\n");
+    fprintf(stderr,"  -f\tfile to seed (default: generate one of -s bytes)\n");
+    fprintf(stderr,"  -s\tsize of the generated file in bytes (default 8 MiB)\n");
+    fprintf(stderr,"  -c\tchunk size in bytes (default %d)\n",SWIFT_DEFAULT_CHUNK_SIZE);
+    fprintf(stderr,"  -n\tmaximum chunks per scenario (default all)\n");
+    fprintf(stderr,"  -W\twindow of the large-cwnd scenario in chunks (default 512)\n");
+    fprintf(stderr,"  -w\twork directory (default ./hotbench.d)\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    std::string filename = "", workdir = "hotbench.d";
+    uint64_t size = 8*1024*1024;
+    uint32_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
+    int maxchunks = 1<<30, window = 512;
+    int c;
+
+    LibraryInit();
+    while (-1 != (c = getopt(argc, argv, "f:s:c:n:W:w:"))) {
+        switch (c) {
+            case 'f': filename = optarg; break;
+            case 's': size = strtoull(optarg,NULL,10); break;
+            case 'c': chunk_size = atoi(optarg); break;
+            case 'n': maxchunks = atoi(optarg); break;
+            case 'W': window = atoi(optarg); break;
+            case 'w': workdir = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (chunk_size == 0 || maxchunks < 1 || window < 1) {
+        usage();
+        return 1;
+    }
+
+    if (file_exists_utf8(workdir) != 2)
+        mkdir_utf8(workdir);
+    if (filename == "") {
+        filename = workdir+FILE_SEP+"content";
+        FILE *fp = fopen_utf8(filename.c_str(),"wb");
+        if (fp == NULL) {
+            print_error("hotbench: cannot create content file");
+            return 1;
+        }
+        uint64_t x = 1;
+        for (uint64_t i=0; i<size; i++) {
+            x = x*6364136223846793005ULL + 1442695040888963407ULL;
+            fputc((int)(x>>56),fp);
+        }
+        fclose(fp);
+    }
+    remove_utf8(filename+".mhash");
+    remove_utf8(filename+".mbinmap");
+
+    HotPathBench bench(filename,workdir,chunk_size,window);
+    if (!bench.Lockstep(maxchunks) || !bench.LargeCwnd(maxchunks) || !bench.Fragmented(maxchunks))
+        return 1;
+    bench.Report(stdout);
+    return 0;
+}
@@ -265,6 +265,7 @@ void HttpGwSubscribeToWrite(http_gw_t * req) {
 void HttpGwLibeventMayWriteCallback(evutil_socket_t fd, short events, void *evreqvoid )
 {
 	//fprintf(stderr,"httpgw: MayWrite: %d events %d evreq is %p\n", fd, events, evreqvoid);
+	Channel::Time();
 
 	http_gw_t * req = HttpGwFindRequestByEV((struct evhttp_request *)evreqvoid);
 	if (req != NULL) {
@@ -652,6 +653,8 @@ bool swift::ParseURI(std::string uri,parseduri_t &map)
 
 void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 
+    Channel::Time();
+
     dprintf("%s @%i http new request\n",tintstr(),http_gw_reqs_count+1);
 
     if (evhttp_request_get_command(evreq) != EVHTTP_REQ_GET) {
@@ -704,6 +707,12 @@ void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 
     // 4. Initiate transfer
     int transfer = swift::Find(root_hash);
+    if (transfer==-1) {
+        // SEEDDIR: content of a lazily opened seed dir
+        FileTransfer *ft = SeedIndex::GetInstance()->Find(root_hash,false);
+        if (ft != NULL)
+            transfer = ft->fd();
+    }
     if (transfer==-1) {
         transfer = swift::Open(hashstr,root_hash,Address(),false,true,httpgw_chunk_size);
         dprintf("%s @%i trying to HTTP GET swarm %s that has not been STARTed\n",tintstr(),http_gw_reqs_open+1,hashstr.c_str());
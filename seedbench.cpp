@@ -0,0 +1,314 @@
+/*
+ *  seedbench.cpp
+ *  cold-start benchmark for seeding a directory (-d): time to start and
+ *  resident memory against the number of files, for the eager open of
+ *  every file (as OpenSwiftDirectory in swift.cpp) and for the lazy-open
+ *  index (-d with -L, SeedIndex). Reports one JSON line per run.
+ *
+ *  With -p it also opens that many channels to idle peers on one of the
+ *  files and reports their resident size per peer, and how many such
+ *  peers fit in 16 GiB.
+ *
+ *  Each run is done in a forked child such that the memory of one run does
+ *  not count towards the next. The directories are generated and
+ *  checkpointed once, startup itself then reads .mhash/.mbinmap only.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+using namespace swift;
+
+
+static void usage()
+{
+    fprintf(stderr,"Usage: seedbench [options]\n");
+    fprintf(stderr,"  -n\tcomma separated file counts (default 1000,10000)\n");
+    fprintf(stderr,"  -s\tsize of each file in bytes (default 4096)\n");
+    fprintf(stderr,"  -c\tchunk size in bytes (default %d)\n",SWIFT_DEFAULT_CHUNK_SIZE);
+    fprintf(stderr,"  -m\tcomma separated modes: eager,lazy (default both)\n");
+    fprintf(stderr,"  -p\tidle peers to measure per run (default 0)\n");
+    fprintf(stderr,"  -w\twork directory (default ./seedbench.d)\n");
+}
+
+
+static tint WallTime()
+{
+#ifdef _WIN32
+    return (tint)GetTickCount()*TINT_MSEC;
+#else
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (tint)tv.tv_sec*TINT_SEC + tv.tv_usec;
+#endif
+}
+
+
+/** Resident and virtual size of the process in KiB, -1 if unknown. */
+static void MemoryKB(long *rss, long *vsz)
+{
+    *rss = *vsz = -1;
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/statm","r");
+    if (fp == NULL)
+        return;
+    long size, resident;
+    if (fscanf(fp,"%ld %ld",&size,&resident) == 2) {
+        long pagekb = sysconf(_SC_PAGESIZE)/1024;
+        *vsz = size*pagekb;
+        *rss = resident*pagekb;
+    }
+    fclose(fp);
+#endif
+}
+
+
+static std::vector<std::string> Split(std::string s)
+{
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= s.length()) {
+        size_t end = s.find(',',start);
+        if (end == std::string::npos)
+            end = s.length();
+        if (end > start)
+            parts.push_back(s.substr(start,end-start));
+        start = end+1;
+    }
+    return parts;
+}
+
+
+/** Create dirname with nfiles distinct files of size bytes and checkpoint
+ *  them, unless that was done by an earlier run. */
+static int PrepareDir(std::string dirname, int nfiles, uint64_t size, uint32_t chunk_size)
+{
+    std::string done = dirname+".ok";
+    if (file_exists_utf8(done) == 1)
+        return 0;
+    if (file_exists_utf8(dirname) != 2 && mkdir_utf8(dirname) < 0) {
+        print_error("seedbench: cannot create directory");
+        return -1;
+    }
+    std::vector<char> buf(size);
+    for (int f=0; f<nfiles; f++) {
+        char name[32];
+        sprintf(name,"file%07d",f);
+        std::string path = dirname+FILE_SEP+name;
+        uint64_t x = f+1;
+        for (uint64_t i=0; i<size; i++) {
+            x = x*6364136223846793005ULL + 1442695040888963407ULL;
+            buf[i] = (char)(x>>56);
+        }
+        FILE *fp = fopen_utf8(path.c_str(),"wb");
+        if (fp == NULL) {
+            print_error("seedbench: cannot create content file");
+            return -1;
+        }
+        fwrite(&buf[0],1,size,fp);
+        fclose(fp);
+    }
+    // Checkpoints every file and closes it again
+    SeedIndex prep;
+    if (prep.Scan(dirname,chunk_size) != nfiles) {
+        fprintf(stderr,"seedbench: could not checkpoint all of %s\n",dirname.c_str());
+        return -1;
+    }
+    FILE *fp = fopen_utf8(done.c_str(),"wb");
+    if (fp != NULL)
+        fclose(fp);
+    return 0;
+}
+
+
+/** Open every file, as OpenSwiftDirectory() does. Returns the number opened. */
+static int OpenEager(std::string dirname, uint32_t chunk_size)
+{
+    DirEntry *de = opendir_utf8(dirname);
+    if (de == NULL)
+        return -1;
+    int count = 0;
+    while (de != NULL) {
+        if (!(de->isdir_ || de->filename_.rfind(".mhash") != std::string::npos || de->filename_.rfind(".mbinmap") != std::string::npos)) {
+            std::string path = dirname+FILE_SEP+de->filename_;
+            MmapHashTree *ht = new MmapHashTree(true,path+".mbinmap");
+            int fd = swift::Find(ht->root_hash());
+            delete ht;
+            if (fd == -1)
+                fd = swift::Open(path,Sha1Hash::ZERO,Address(),false,true,chunk_size);
+            if (fd >= 0)
+                count++;
+        }
+        DirEntry *newde = readdir_utf8(de);
+        delete de;
+        de = newde;
+    }
+    return count;
+}
+
+
+/** Open npeers channels on ft to distinct peers, as a seeder keeps for
+ *  peers that handshook and then went quiet. Returns the resident bytes
+ *  per channel, -1 if unknown. */
+static double IdlePeers(FileTransfer *ft, int npeers)
+{
+    long rss0, vsz0, rss1, vsz1;
+    MemoryKB(&rss0,&vsz0);
+    for (int i=0; i<npeers; i++) {
+        // 11.0.0.0 and up, nothing is sent as the event loop does not run
+        Channel *c = new Channel(ft,INVALID_SOCKET,Address((uint32_t)(0x0B000000+i),7000));
+        c->SwitchSendControl(Channel::KEEP_ALIVE_CONTROL);
+    }
+    MemoryKB(&rss1,&vsz1);
+    if (rss0 < 0 || npeers == 0)
+        return -1;
+    return (rss1-rss0)*1024.0/npeers;
+}
+
+
+/** One cold start, prints its JSON line. */
+static int RunOnce(std::string mode, std::string dirname, int nfiles, uint32_t chunk_size, int npeers)
+{
+    long rss0, vsz0, rss1, vsz1;
+    MemoryKB(&rss0,&vsz0);
+
+    tint start = WallTime();
+    int indexed;
+    size_t index_bytes = 0;
+    if (mode == "eager")
+        indexed = OpenEager(dirname,chunk_size);
+    else {
+        indexed = SeedIndex::GetInstance()->Scan(dirname,chunk_size);
+        index_bytes = SeedIndex::GetInstance()->mem_size();
+    }
+    tint startup = WallTime()-start;
+    MemoryKB(&rss1,&vsz1);
+
+    int opened = 0;
+    for (int i=0; i<FileTransfer::files.size(); i++)
+        if (FileTransfer::files[i] != NULL)
+            opened++;
+
+    // Cost of serving the first request for some file; the lazy mode
+    // opens it here, the eager one just looks it up.
+    tint first_open = -1;
+    FileTransfer *ft = NULL;
+    if (nfiles > 0) {
+        char name[32];
+        sprintf(name,"file%07d",nfiles/2);
+        Sha1Hash root_hash;
+        uint32_t cs;
+        if (SeedIndex::ReadCheckpointHeader(dirname+FILE_SEP+name+".mbinmap",&root_hash,&cs) == 0) {
+            start = WallTime();
+            ft = FileTransfer::Find(root_hash);
+            if (ft == NULL)
+                ft = SeedIndex::GetInstance()->Find(root_hash);
+            if (ft != NULL)
+                first_open = WallTime()-start;
+        }
+    }
+
+    double peer_bytes = -1;
+    memusage_t mu;
+    if (ft != NULL && npeers > 0) {
+        peer_bytes = IdlePeers(ft,npeers);
+        ft->GetMemoryUsage(mu);
+    }
+
+    printf("{\"mode\": \"%s\", \"files\": %d, \"indexed\": %d, \"transfers_open\": %d, "
+        "\"startup_us\": %lld, \"rss_kb\": %ld, \"vsz_kb\": %ld, \"index_bytes\": %llu, "
+        "\"first_request_us\": %lld",
+        mode.c_str(),nfiles,indexed,opened,(long long)startup,
+        rss1 >= 0 ? rss1-rss0 : -1L,vsz1 >= 0 ? vsz1-vsz0 : -1L,
+        (unsigned long long)index_bytes,(long long)first_open);
+    if (npeers > 0)
+        printf(", \"idle_peers\": %d, \"rss_per_peer_b\": %.0f, \"accounted_per_peer_b\": %llu, "
+            "\"peers_per_16GiB\": %.0f",
+            mu.nchannels,peer_bytes,mu.nchannels ? (unsigned long long)((mu.channels+mu.chanbinmaps+mu.chanqueues)/mu.nchannels) : 0ULL,
+            peer_bytes > 0 ? 16.0*1024*1024*1024/peer_bytes : -1.0);
+    printf("}\n");
+    fflush(stdout);
+    return indexed == nfiles ? 0 : 2;
+}
+
+
+int main(int argc, char** argv)
+{
+    std::string workdir = "seedbench.d", counts = "1000,10000", modes = "eager,lazy";
+    uint64_t size = 4096;
+    uint32_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
+    int npeers = 0;
+    int c;
+
+    LibraryInit();
+    while (-1 != (c = getopt(argc, argv, "n:s:c:m:p:w:"))) {
+        switch (c) {
+            case 'n': counts = optarg; break;
+            case 's': size = strtoull(optarg,NULL,10); break;
+            case 'c': chunk_size = atoi(optarg); break;
+            case 'm': modes = optarg; break;
+            case 'p': npeers = atoi(optarg); break;
+            case 'w': workdir = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    std::vector<std::string> countlist = Split(counts), modelist = Split(modes);
+    if (chunk_size == 0 || size == 0 || npeers < 0 || countlist.empty() || modelist.empty()) {
+        usage();
+        return 1;
+    }
+    for (int m=0; m<modelist.size(); m++)
+        if (modelist[m] != "eager" && modelist[m] != "lazy") {
+            usage();
+            return 1;
+        }
+
+#ifndef _WIN32
+    // The eager mode keeps two descriptors per file open
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE,&rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE,&rl);
+    }
+#endif
+
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    if (file_exists_utf8(workdir) != 2)
+        mkdir_utf8(workdir);
+
+    int ret = 0;
+    for (int n=0; n<countlist.size(); n++) {
+        int nfiles = atoi(countlist[n].c_str());
+        std::string dirname = workdir+FILE_SEP+"seed"+countlist[n];
+        if (PrepareDir(dirname,nfiles,size,chunk_size) < 0)
+            return 1;
+        for (int m=0; m<modelist.size(); m++) {
+#ifdef _WIN32
+            ret |= RunOnce(modelist[m],dirname,nfiles,chunk_size,npeers);
+#else
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0) {
+                print_error("seedbench: cannot fork");
+                return 1;
+            }
+            if (pid == 0)
+                _exit(RunOnce(modelist[m],dirname,nfiles,chunk_size,npeers));
+            int status;
+            if (waitpid(pid,&status,0) < 0 || !WIFEXITED(status))
+                ret |= 2;
+            else
+                ret |= WEXITSTATUS(status);
+#endif
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,328 @@
+/*
+ *  seedindex.cpp
+ *  lazy-open index for seeding a large directory of content: maps root
+ *  hashes to file names and opens a FileTransfer only when a peer or a
+ *  gateway asks for it. Requires the content to be checkpointed (.mhash
+ *  and .mbinmap next to it), files that are not get checkpointed once
+ *  at scan time.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include "compat.h"
+
+using namespace swift;
+
+
+SeedIndex * SeedIndex::__singleton = NULL;
+
+
+SeedIndex::SeedIndex() : max_open_(0)
+{
+	if (__singleton == NULL)
+		__singleton = this;
+}
+
+
+SeedIndex::~SeedIndex()
+{
+	if (__singleton == this)
+		__singleton = NULL;
+}
+
+
+SeedIndex * SeedIndex::GetInstance()
+{
+	if (__singleton == NULL)
+		new SeedIndex();
+	return __singleton;
+}
+
+
+int SeedIndex::ReadCheckpointHeader(std::string binmap_filename, Sha1Hash *root_hash, uint32_t *chunk_size)
+{
+	// Only the first lines of MmapHashTree::serialize() output, the binmap
+	// itself is not needed until the transfer is opened.
+	FILE *fp = fopen_utf8(binmap_filename.c_str(),"rb");
+	if (!fp)
+		return -1;
+
+	char hexhashstr[256];
+	unsigned long cs;
+	int version;
+	int ret = -1;
+	if (fscanf(fp,"version %i\n",&version) == 1 &&
+		fscanf(fp,"root hash %255s\n",hexhashstr) == 1 &&
+		fscanf(fp,"chunk size %lu\n",&cs) == 1)
+	{
+		*root_hash = Sha1Hash(true,hexhashstr);
+		*chunk_size = cs;
+		if (*root_hash != Sha1Hash::ZERO && cs > 0)
+			ret = 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+
+int SeedIndex::IndexFile(std::string path, uint32_t chunk_size, seedentry_t *e)
+{
+	if (ReadCheckpointHeader(path+".mbinmap",&e->root_hash,&e->chunk_size) == 0)
+		return 0;
+
+	// No checkpoint: hashcheck now, so the next start is fast
+	dprintf("%s seedindex: checkpointing %s\n",tintstr(),path.c_str());
+	int fd = swift::Open(path,Sha1Hash::ZERO,Address(),false,true,chunk_size);
+	if (fd < 0)
+		return -1;
+	int ret = swift::Checkpoint(fd);
+	e->root_hash = swift::RootMerkleHash(fd);
+	e->chunk_size = chunk_size;
+	swift::Close(fd);
+	if (ret < 0 || e->root_hash == Sha1Hash::ZERO)
+		return -1;
+	return 0;
+}
+
+
+static bool SeedIndexNameLess(const std::pair<const char *,int> &a, const std::pair<const char *,int> &b)
+{
+	return strcmp(a.first,b.first) < 0;
+}
+
+
+int SeedIndex::Scan(std::string dirname, uint32_t chunk_size)
+{
+	DirEntry *de = opendir_utf8(dirname);
+	if (de == NULL)
+		return -1;
+
+	// On a rescan, take files already indexed from the old index instead
+	// of rereading their checkpoints.
+	std::vector<std::pair<const char *,int> > byname;
+	if (dirname == dirname_)
+	{
+		for (int i=0; i<entries_.size(); i++)
+			byname.push_back(std::make_pair(names_.c_str()+entries_[i].name,i));
+		std::sort(byname.begin(),byname.end(),SeedIndexNameLess);
+	}
+
+	seedentries_t newentries;
+	std::string newnames;
+	while(1)
+	{
+		if (!(de->isdir_ || de->filename_.rfind(".mhash") != std::string::npos || de->filename_.rfind(".mbinmap") != std::string::npos))
+		{
+			// Not dir, or metafile
+			seedentry_t e;
+			std::pair<const char *,int> key(de->filename_.c_str(),-1);
+			std::vector<std::pair<const char *,int> >::iterator iter = std::lower_bound(byname.begin(),byname.end(),key,SeedIndexNameLess);
+			bool known = iter != byname.end() && !strcmp(iter->first,key.first);
+			if (known)
+				e = entries_[iter->second];
+			if (known || IndexFile(dirname+FILE_SEP+de->filename_,chunk_size,&e) == 0)
+			{
+				e.name = newnames.length();
+				newnames.append(de->filename_);
+				newnames.push_back('\0');
+				newentries.push_back(e);
+			}
+			else
+				dprintf("%s seedindex: cannot index %s\n",tintstr(),de->filename_.c_str());
+		}
+
+		DirEntry *newde = readdir_utf8(de);
+		delete de;
+		de = newde;
+		if (de == NULL)
+			break;
+	}
+	std::sort(newentries.begin(),newentries.end());
+
+	dirname_ = dirname;
+	entries_.swap(newentries);
+	names_.swap(newnames);
+
+	// Also closes transfers whose file disappeared, but that still had
+	// channels, as the next handshake can no longer open them.
+	std::set<int> delset;
+	std::map<int,Sha1Hash>::iterator iter;
+	for (iter=opened_.begin(); iter!=opened_.end(); iter++)
+	{
+		if (Lookup(iter->second) == NULL)
+			delset.insert(iter->first);
+	}
+	std::set<int>::iterator iiter;
+	for (iiter=delset.begin(); iiter!=delset.end(); iiter++)
+	{
+		if (Opened(opened_.find(*iiter)) != NULL)
+		{
+			dprintf("%s F%u seedindex: content removed, close\n",tintstr(),*iiter);
+			swift::Close(*iiter);
+		}
+		opened_.erase(*iiter);
+	}
+	CloseIdle();
+
+	dprintf("%s seedindex: %d files in %s, %d open\n",tintstr(),(int)entries_.size(),dirname.c_str(),(int)opened_.size());
+	return entries_.size();
+}
+
+
+int SeedIndex::LookupName(std::string filename)
+{
+	// Linear, only used for the odd file added or removed
+	for (int i=0; i<entries_.size(); i++)
+		if (!strcmp(names_.c_str()+entries_[i].name,filename.c_str()))
+			return i;
+	return -1;
+}
+
+
+int SeedIndex::Add(std::string filename, uint32_t chunk_size)
+{
+	if (dirname_ == "")
+		return -1;
+	if (LookupName(filename) >= 0)
+		return 0;
+
+	seedentry_t e;
+	if (IndexFile(dirname_+FILE_SEP+filename,chunk_size,&e) < 0)
+	{
+		dprintf("%s seedindex: cannot index %s\n",tintstr(),filename.c_str());
+		return -1;
+	}
+	e.name = names_.length();
+	names_.append(filename);
+	names_.push_back('\0');
+	entries_.insert(std::upper_bound(entries_.begin(),entries_.end(),e),e);
+	dprintf("%s seedindex: added %s\n",tintstr(),filename.c_str());
+	return 0;
+}
+
+
+void SeedIndex::Remove(std::string filename)
+{
+	int i = LookupName(filename);
+	if (i < 0)
+		return;
+	Sha1Hash root_hash = entries_[i].root_hash;
+	entries_.erase(entries_.begin()+i);
+	dprintf("%s seedindex: removed %s\n",tintstr(),filename.c_str());
+
+	std::map<int,Sha1Hash>::iterator iter;
+	for (iter=opened_.begin(); iter!=opened_.end(); iter++)
+	{
+		if (iter->second != root_hash)
+			continue;
+		if (Opened(iter) != NULL)
+			swift::Close(iter->first);
+		opened_.erase(iter);
+		break;
+	}
+}
+
+
+const SeedIndex::seedentry_t *SeedIndex::Lookup(const Sha1Hash &root_hash)
+{
+	seedentry_t key;
+	key.root_hash = root_hash;
+	seedentries_t::iterator iter = std::lower_bound(entries_.begin(),entries_.end(),key);
+	if (iter == entries_.end() || iter->root_hash != root_hash)
+		return NULL;
+	return &*iter;
+}
+
+
+FileTransfer *SeedIndex::Find(const Sha1Hash &root_hash, bool closeidle)
+{
+	const seedentry_t *e = Lookup(root_hash);
+	if (e == NULL)
+		return NULL;
+
+	int fd = swift::Find(root_hash);
+	if (fd < 0)
+	{
+		if (closeidle && max_open_ > 0 && (int)opened_.size() >= max_open_)
+			CloseLRU();
+		std::string path = dirname_+FILE_SEP+(names_.c_str()+e->name);
+		dprintf("%s seedindex: opening %s for %s\n",tintstr(),path.c_str(),root_hash.hex().c_str());
+		fd = swift::Open(path,root_hash,Address(),false,true,e->chunk_size);
+		if (fd < 0)
+			return NULL;
+		if (closeidle)
+			opened_[fd] = root_hash;
+	}
+	else if (!closeidle)
+		// Now owned by whoever asked, e.g. a CMD gateway START
+		opened_.erase(fd);
+	return FileTransfer::file(fd);
+}
+
+
+FileTransfer *SeedIndex::Opened(std::map<int,Sha1Hash>::iterator iter)
+{
+	FileTransfer *ft = FileTransfer::file(iter->first);
+	if (ft == NULL || ft->root_hash() != iter->second)
+		return NULL;
+	return ft;
+}
+
+
+void SeedIndex::CloseIdle()
+{
+	std::set<int> delset;
+	std::map<int,Sha1Hash>::iterator iter;
+	for (iter=opened_.begin(); iter!=opened_.end(); iter++)
+	{
+		FileTransfer *ft = Opened(iter);
+		if (ft == NULL || ft->GetChannels().size() == 0)
+			delset.insert(iter->first);
+	}
+	std::set<int>::iterator iiter;
+	for (iiter=delset.begin(); iiter!=delset.end(); iiter++)
+	{
+		if (Opened(opened_.find(*iiter)) != NULL)
+		{
+			dprintf("%s F%u seedindex: idle, close\n",tintstr(),*iiter);
+			swift::Close(*iiter);
+		}
+		opened_.erase(*iiter);
+	}
+}
+
+
+void SeedIndex::CloseLRU()
+{
+	// Idle ones first, they cost nothing to reopen
+	CloseIdle();
+	while ((int)opened_.size() >= max_open_)
+	{
+		std::map<int,Sha1Hash>::iterator iter, lru = opened_.end();
+		for (iter=opened_.begin(); iter!=opened_.end(); iter++)
+		{
+			FileTransfer *ft = Opened(iter);
+			if (lru == opened_.end() || ft == NULL ||
+				ft->GetLastDataTime() < Opened(lru)->GetLastDataTime())
+				lru = iter;
+			if (ft == NULL)
+				break;
+		}
+		if (Opened(lru) != NULL)
+		{
+			dprintf("%s F%u seedindex: least recently used, close\n",tintstr(),lru->first);
+			// Its channels may have datagrams queued
+			Channel::messageQueue.Flush();
+			swift::Close(lru->first);
+		}
+		opened_.erase(lru);
+	}
+}
+
+
+size_t SeedIndex::mem_size()
+{
+	return sizeof(*this)+entries_.capacity()*sizeof(seedentry_t)+names_.capacity()
+		+opened_.size()*(sizeof(int)+sizeof(Sha1Hash)+4*sizeof(void *));
+}
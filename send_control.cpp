@@ -74,6 +74,8 @@ tint    Channel::KeepAliveNextSendTime () {
         return SwitchSendControl(SLOW_START_CONTROL);
     if (data_in_.time!=TINT_NEVER)
         return NOW;
+    // Idle: give back what only flowing data needs
+    Compact();
 	/* Gertjan fix 5f51e5451e3785a74c058d9651b2d132c5a94557
     "Do not increase send interval in keep-alive mode when previous Reschedule
     was already in the future.
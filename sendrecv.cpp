@@ -51,11 +51,9 @@ struct event Channel::evrecv;
 void    Channel::AddPeakHashes (struct evbuffer *evb) {
     for(int i=0; i<hashtree()->peak_count(); i++) {
         bin_t peak = hashtree()->peak(i);
-        evbuffer_add_8(evb, SWIFT_HASH);
-        evbuffer_add_32be(evb, bin_toUInt32(peak));
+        AddBinMessage(evb, SWIFT_HASH, peak);
         evbuffer_add_hash(evb, hashtree()->peak_hash(i));
-        char bin_name_buf[32];
-        dprintf("%s #%u +phash %s\n",tintstr(),id_,peak.str(bin_name_buf));
+        dtrace(TRACE_EV_PEAK_HASH_OUT,id_,peak,0);
     }
 }
 
@@ -66,19 +64,137 @@ void    Channel::AddUncleHashes (struct evbuffer *evb, bin_t pos) {
     dprintf("%s #%u +uncle hash for %s\n",tintstr(),id_,pos.str(bin_name_buf2));
 
     bin_t peak = hashtree()->peak_for(pos);
+    if (wire_version_ >= SWIFT_WIRE_COMPACT) {
+        // One run: the bin, then the hashes of its uncles going up
+        bin_t start = pos;
+        std::vector<bin_t> uncles;
+        while (pos!=peak && ((NOW&3)==3 || !pos.parent().contains(data_out_cap_)) &&
+                ack_in_.is_empty(pos.parent()) && uncles.size()<255 ) {
+            uncles.push_back(pos.sibling());
+            pos = pos.parent();
+        }
+        if (uncles.empty())
+            return;
+        AddBinMessage(evb, SWIFT_COMPACT_UNCLES, start);
+        evbuffer_add_8(evb, uncles.size());
+        for(int i=0; i<uncles.size(); i++) {
+            evbuffer_add_hash(evb,  hashtree()->hash(uncles[i]) );
+            dtrace(TRACE_EV_HASH_OUT,id_,uncles[i],0);
+        }
+        return;
+    }
     while (pos!=peak && ((NOW&3)==3 || !pos.parent().contains(data_out_cap_)) &&
             ack_in_.is_empty(pos.parent()) ) {
         bin_t uncle = pos.sibling();
         evbuffer_add_8(evb, SWIFT_HASH);
         evbuffer_add_32be(evb, bin_toUInt32(uncle));
         evbuffer_add_hash(evb,  hashtree()->hash(uncle) );
-        char bin_name_buf[32];
-        dprintf("%s #%u +hash %s\n",tintstr(),id_,uncle.str(bin_name_buf));
+        dtrace(TRACE_EV_HASH_OUT,id_,uncle,0);
         pos = pos.parent();
     }
 }
 
 
+void    Channel::AddBinMessage (struct evbuffer *evb, uint8_t type, bin_t bin) {
+    AddBinMessage(evb, wire_version_, &wire_bin_out_, type, bin);
+}
+
+
+void    Channel::AddBinMessage (struct evbuffer *evb, uint8_t version, uint32_t *wire_bin, uint8_t type, bin_t bin) {
+    uint32_t v = bin_toUInt32(bin);
+    if (version < SWIFT_WIRE_COMPACT) {
+        evbuffer_add_8(evb, type);
+        evbuffer_add_32be(evb, v);
+        return;
+    }
+    switch (type) {
+        case SWIFT_DATA: type = SWIFT_COMPACT_DATA; break;
+        case SWIFT_ACK: type = SWIFT_COMPACT_ACK; break;
+        case SWIFT_HAVE: type = SWIFT_COMPACT_HAVE; break;
+        case SWIFT_HASH: type = SWIFT_COMPACT_HASH; break;
+        case SWIFT_HINT: type = SWIFT_COMPACT_HINT; break;
+    }
+    // Zigzag coded difference with the previous bin in this datagram,
+    // consecutive bins mostly take a single byte
+    int32_t delta = (int32_t)(v-*wire_bin);
+    evbuffer_add_8(evb, type);
+    evbuffer_add_varint(evb, ((uint32_t)delta<<1) ^ (uint32_t)(delta>>31));
+    *wire_bin = v;
+}
+
+
+uint8_t Channel::MessageType (uint8_t type, bool *compact) {
+    *compact = type >= SWIFT_COMPACT_DATA;
+    switch (type) {
+        case SWIFT_COMPACT_DATA: return SWIFT_DATA;
+        case SWIFT_COMPACT_ACK: return SWIFT_ACK;
+        case SWIFT_COMPACT_HAVE: return SWIFT_HAVE;
+        case SWIFT_COMPACT_HASH: return SWIFT_HASH;
+        case SWIFT_COMPACT_HINT: return SWIFT_HINT;
+    }
+    return type;
+}
+
+
+bin_t   Channel::RemoveBin (struct evbuffer *evb) {
+    return RemoveBin(evb, wire_compact_in_, &wire_bin_in_);
+}
+
+
+bin_t   Channel::RemoveBin (struct evbuffer *evb, bool compact, uint32_t *wire_bin) {
+    if (!compact)
+        return bin_fromUInt32(evbuffer_remove_32be(evb));
+    uint32_t z = (uint32_t)evbuffer_remove_varint(evb);
+    *wire_bin += (z>>1) ^ (0-(z&1));
+    return bin_fromUInt32(*wire_bin);
+}
+
+
+void    Channel::AddVersion (struct evbuffer *evb) {
+    evbuffer_add_8(evb, SWIFT_VERSION);
+    evbuffer_add_8(evb, WIRE_VERSION);
+    dprintf("%s #%u +version %d\n",tintstr(),id_,(int)WIRE_VERSION);
+}
+
+
+void    Channel::SendVersion () {
+    // Alone in its datagram: legacy peers stop parsing at unknown messages
+    // and skip the end of Recv(), which must not cost them the liveness
+    // and rescheduling of a datagram that carries anything else. Sent
+    // without the channel, so it does not count as a send and is never
+    // multiplexed.
+    struct evbuffer *evb = evbuffer_new();
+    evbuffer_add_32be(evb, peer_channel_id_);
+    AddVersion(evb);
+    raw_bytes_up_ += evbuffer_get_length(evb);
+    wire_version_sent_++;
+    messageQueue.AddBuffer(socket_, evb, peer(), NULL);
+}
+
+
+void    Channel::OnVersion (struct evbuffer *evb) {
+    uint8_t version = evbuffer_remove_8(evb);
+    wire_version_ = version < WIRE_VERSION ? version : WIRE_VERSION;
+    dprintf("%s #%u -version %d, using %d\n",tintstr(),id_,(int)version,(int)wire_version_);
+}
+
+
+void    Channel::OnUncleHashes (struct evbuffer *evb) {
+    bin_t pos = RemoveBin(evb);
+    int count = evbuffer_remove_8(evb);
+    for(int i=0; i<count && evbuffer_get_length(evb)>=Sha1Hash::SIZE; i++) {
+        Sha1Hash hash = evbuffer_remove_hash(evb);
+        if (!pos.is_none() && !pos.is_all()) {
+            bin_t uncle = pos.sibling();
+            if (!transfer().IsZeroState())
+                hashtree()->OfferHash(uncle,hash);
+            dtrace(TRACE_EV_HASH_IN,id_,uncle,0);
+            pos = pos.parent();
+        }
+    }
+}
+
+
 bin_t           Channel::ImposeHint () {
     uint64_t twist = peer_channel_id_;  // got no hints, send something randomly
 
@@ -146,8 +262,7 @@ bin_t        Channel::DequeueHint (bool *retransmitptr) {
     // Arno, 2012-03-09: Is mucho expensive on busy server.
     //for(int i=0; i<hint_in_.size(); i++)
     //    mass += hint_in_[i].bin.base_length();
-    char bin_name_buf[32];
-    dprintf("%s #%u dequeued %s [%lli]\n",tintstr(),id_,send.str(bin_name_buf),mass);
+    dtrace(TRACE_EV_DEQUEUED,id_,send,mass);
     return send;
 }
 
@@ -169,7 +284,10 @@ void    Channel::AddHandshake (struct evbuffer *evb) {
     	encoded = EncodeID(id_);
     evbuffer_add_32be(evb, encoded);
     dprintf("%s #%u +hs %x\n",tintstr(),id_,encoded);
-    have_out_.clear();
+    // Peer may have lost what we told it, start over
+    have_snap_pos_ = 0;
+    have_log_pos_ = transfer().have_log_end();
+    have_all_out_ = false;
 }
 
 
@@ -179,6 +297,7 @@ void    Channel::Send () {
 
     struct evbuffer *evb = evbuffer_new();
     evbuffer_add_32be(evb, peer_channel_id_);
+    wire_bin_out_ = 0;
     bin_t data = bin_t::NONE;
     int evbnonadplen = 0;
     if ( is_established() ) {
@@ -207,16 +326,22 @@ void    Channel::Send () {
         AddAck(evb);
     }
 
+    bool isdata = !data.is_none();
     lastsendwaskeepalive_ = (evbuffer_get_length(evb) == 4);
 
     if (evbuffer_get_length(evb)==4) {// only the channel id; bare keep-alive
         data = bin_t::ALL;
     }
-    dprintf("%s #%u sent %ib %s:%x\n",
-            tintstr(),id_,(int)evbuffer_get_length(evb),peer().str(),
-            peer_channel_id_);
+    dtrace(TRACE_EV_SEND,id_,bin_t(((uint64_t)peer().ipv4()<<16)|peer().port()),
+        ((uint64_t)peer_channel_id_<<32)|evbuffer_get_length(evb));
+
+	messageQueue.AddBuffer(socket_, evb, peer(), this, true, isdata);
 
-	messageQueue.AddBuffer(socket_, evb, peer(), this); 
+    // Once, and again while the peer's has not arrived. A lost one only
+    // leaves that side sending legacy fields, compact ones parse anyway.
+    if (is_established() && send_control_!=CLOSE_CONTROL && WIRE_VERSION > SWIFT_WIRE_LEGACY &&
+            wire_version_sent_ < SWIFT_VERSION_TRIES && (wire_version_sent_ == 0 || wire_version_ == SWIFT_WIRE_LEGACY))
+        SendVersion();
 }
 
 void Channel::Sent(int bytes, evbuffer *evb, bool tofree)
@@ -226,11 +351,229 @@ void Channel::Sent(int bytes, evbuffer *evb, bool tofree)
 		last_send_time_ = NOW;
 		sent_since_recv_++;
 		dgrams_sent_++;
-		evbuffer_free(evb);
+		if (evb != NULL) // NULL: held by the MessageQueue, freed there
+			evbuffer_free(evb);
 		Reschedule();
 	}
 }
 
+
+/*
+ * MessageQueue
+ */
+
+void MessageQueue::AddBuffer(int sock, evbuffer *evb, const Address &addr, Channel *channel, bool tofree, bool isdata)
+{
+	EntryList &list = lists[sock];
+	list.push_back(Entry(evb, addr, channel, tofree));
+	bool mux = Muxable(list.back());
+	if ((!mux && !(isdata && tofree)) || Channel::evbase == NULL) {
+		if (list.size() >= MAX_QUEUE_LENGTH)
+			Flush(sock);
+		return;
+	}
+
+	// Wait for what else this event loop iteration sends, to the peer for
+	// multiplexing, to others for one sendmsg() with DATA to all of them.
+	// The channel carries on as if sent, as it would with a flush right away.
+	list.back().mux = mux;
+	list.back().channel = NULL;
+	ScheduleFlush();
+	// Flush() frees evb
+	int len = evbuffer_get_length(evb);
+	if (list.size() >= MAX_MUX_QUEUE_LENGTH)
+		Flush(sock);
+	if (channel != NULL)
+		channel->Sent(len, NULL, tofree);
+}
+
+
+ssize_t MessageQueue::AddPayload(evbuffer *evb, const Sha1Hash &root, Storage *storage, int64_t offset, size_t len)
+{
+	payload_t *p = NULL;
+	for (int i=0; i<payloads.size() && p == NULL; i++)
+		if (payloads[i]->offset == offset && payloads[i]->size == len && payloads[i]->root == root)
+			p = payloads[i];
+
+	if (p == NULL && (Channel::evbase == NULL || payloads.size() >= MAX_SHARED_PAYLOADS)) {
+		// Nobody to drop it at the end of the iteration, read into evb
+		struct evbuffer_iovec vec;
+		if (evbuffer_reserve_space(evb, len, &vec, 1) < 0) {
+			print_error("error on evbuffer_reserve_space");
+			return -1;
+		}
+		ssize_t r = storage->Read((char *)vec.iov_base, len, offset);
+		Channel::global_data_reads++;
+		if (r < 0) {
+			print_error("error on reading");
+			return -1;
+		}
+		vec.iov_len = r;
+		if (evbuffer_commit_space(evb, &vec, 1) < 0) {
+			print_error("error on evbuffer_commit_space");
+			return -1;
+		}
+		return r;
+	}
+
+	if (p == NULL) {
+		p = new payload_t;
+		p->data = (char *)malloc(len);
+		ssize_t r = storage->Read(p->data, len, offset);
+		Channel::global_data_reads++;
+		if (r < 0) {
+			print_error("error on reading");
+			free(p->data);
+			delete p;
+			return -1;
+		}
+		p->root = root;
+		p->offset = offset;
+		p->size = len;
+		p->len = r;
+		p->refs = 1;
+		payloads.push_back(p);
+		ScheduleFlush();
+	}
+
+	if (p->len == 0)
+		return 0;
+	p->refs++;
+	if (evbuffer_add_reference(evb, p->data, p->len, PayloadCleanupCallback, p) < 0) {
+		print_error("error on evbuffer_add_reference");
+		p->refs--;
+		return -1;
+	}
+	return p->len;
+}
+
+
+void MessageQueue::ScheduleFlush()
+{
+	if (evflush_ == NULL)
+		evflush_ = evtimer_new(Channel::evbase, LibeventFlushCallback, this);
+	if (!evtimer_pending(evflush_, NULL))
+		evtimer_add(evflush_, tint2tv(0));
+}
+
+
+void MessageQueue::DropPayloads()
+{
+	for (int i=0; i<payloads.size(); i++)
+		UnrefPayload(payloads[i]);
+	payloads.clear();
+}
+
+
+void MessageQueue::UnrefPayload(payload_t *p)
+{
+	if (--p->refs > 0)
+		return;
+	free(p->data);
+	delete p;
+}
+
+
+void MessageQueue::PayloadCleanupCallback(const void *data, size_t len, void *arg)
+{
+	UnrefPayload((payload_t *)arg);
+}
+
+
+void MessageQueue::LibeventFlushCallback(int fd, short event, void *arg)
+{
+	Channel::Time();
+	((MessageQueue *)arg)->Flush();
+}
+
+
+bool MessageQueue::Muxable(const Entry &e)
+{
+	if (!e.tofree || e.channel == NULL || e.channel->wire_version() < SWIFT_WIRE_MUX)
+		return false;
+	size_t len = evbuffer_get_length(e.evb);
+	if (len < 4 || len > SWIFT_MAX_NONDATA_DGRAM_SIZE)
+		return false;
+	// Not handshakes, the receiver looks those up by hash
+	uint32_t chid = 0;
+	evbuffer_copyout(e.evb, &chid, 4);
+	return chid != 0;
+}
+
+
+void MessageQueue::Multiplex(EntryList &list, EntryList &out)
+{
+	// Datagram still open for more parts, by peer
+	std::map<uint64_t,int> open;
+	std::vector<EntryList> parts;
+	std::vector<size_t> sizes;
+	for (EntryList::iterator it = list.begin(); it != list.end(); ++it) {
+		uint64_t key = ((uint64_t)(*it).addr.addr->dests[0].addr << 16) | (*it).addr.addr->dests[0].port;
+		size_t len = evbuffer_get_length((*it).evb)+2;
+		std::map<uint64_t,int>::iterator o = open.find(key);
+		if (!(*it).mux)
+			// Later parts must not overtake this one
+			open.erase(key);
+		else if (o != open.end() && sizes[o->second]+len <= SWIFT_MAX_UDP_OVER_ETH_PAYLOAD) {
+			parts[o->second].push_back(*it);
+			sizes[o->second] += len;
+			continue;
+		}
+		else
+			open[key] = out.size();
+		out.push_back(*it);
+		parts.push_back(EntryList(1, *it));
+		sizes.push_back(4+len);
+	}
+
+	for (int i=0; i<out.size(); i++) {
+		if (parts[i].size() < 2)
+			continue;
+		evbuffer *evb = evbuffer_new();
+		evbuffer_add_32be(evb, SWIFT_MUX_CHANNEL_ID);
+		for (EntryList::iterator it = parts[i].begin(); it != parts[i].end(); ++it) {
+			size_t len = evbuffer_get_length((*it).evb);
+			evbuffer_add_32be(evb, evbuffer_remove_32be((*it).evb));
+			evbuffer_add_16be(evb, len-4);
+			evbuffer_remove_buffer((*it).evb, evb, len-4);
+			evbuffer_free((*it).evb);
+		}
+		out[i].evb = evb;
+	}
+}
+
+
+void MessageQueue::Flush(int sock)
+{
+	// Sent() may reschedule and send directly, adding to lists[sock]
+	// while we iterate, so take the entries out first.
+	EntryList list, out;
+	list.swap(lists[sock]);
+	if (list.empty())
+		return;
+	Multiplex(list, out);
+
+	Address addr;
+	free(addr.addr);
+	addr.addr = (struct sockaddr_mptp *) calloc(1, sizeof(struct sockaddr_mptp) + out.size() * sizeof(struct mptp_dest));
+	addr.addr->count = out.size();
+	evbuffer *evbs[out.size()];
+	int i = 0;
+	for (EntryList::iterator it = out.begin(); it != out.end(); ++it, ++i) {
+		addr.addr->dests[i].addr = (*it).addr.addr->dests[0].addr;
+		addr.addr->dests[i].port = (*it).addr.addr->dests[0].port;
+		evbs[i] = (*it).evb;
+	}
+
+	int r = Channel::SendTo(sock, addr, evbs);
+	for (EntryList::iterator it = out.begin(); it != out.end(); ++it) {
+		if ((*it).channel == NULL)
+			evbuffer_free((*it).evb);
+		else if (r > 0)
+			(*it).channel->Sent(evbuffer_get_length((*it).evb), (*it).evb, (*it).tofree);
+	}
+}
+
 void    Channel::AddHint (struct evbuffer *evb) {
 
 	// RATELIMIT
@@ -251,7 +594,8 @@ void    Channel::AddHint (struct evbuffer *evb) {
         hint_out_.pop_front();
     }
 
-    int first_plan_pck = max ( (tint)1, plan_for / dip_avg_ );
+    // dip_avg_ decays to 0 when datagrams arrive within the same usec
+    int first_plan_pck = max ( (tint)1, plan_for / max((tint)1,dip_avg_) );
 
     // Riccardo, 2012-04-04: Actually allowed is max minus what we already asked for
     int queue_allowed_hints = max(0,first_plan_pck-(int)hint_out_size_);
@@ -294,11 +638,8 @@ void    Channel::AddHint (struct evbuffer *evb) {
         		char binstr[32];
         		fprintf(stderr,"hint c%d: ask %s\n", id(), hint.str(binstr) );
         	}
-            evbuffer_add_8(evb, SWIFT_HINT);
-            evbuffer_add_32be(evb, bin_toUInt32(hint));
-            char bin_name_buf[32];
-            dprintf("%s #%u +hint %s [%lli]\n",tintstr(),id_,hint.str(bin_name_buf),hint_out_size_);
-            dprintf("%s #%u +hint base %s width %d\n",tintstr(),id_,hint.base_left().str(bin_name_buf), hint.base_length() );
+            AddBinMessage(evb, SWIFT_HINT, hint);
+            dtrace(TRACE_EV_HINT_OUT,id_,hint,hint_out_size_);
             hint_out_.push_back(hint);
             hint_out_size_ += hint.base_length();
             //fprintf(stderr,"send c%d: HINTLEN %i\n", id(), hint.base_length());
@@ -313,10 +654,8 @@ void    Channel::AddHint (struct evbuffer *evb) {
 
 bin_t        Channel::AddData (struct evbuffer **evb) {
 	// RATELIMIT
-	if (transfer().GetCurrentSpeed(DDIR_UPLOAD) > transfer().GetMaxSpeed(DDIR_UPLOAD)) {
-		transfer().OnSendNoData();
+	if (transfer().GetCurrentSpeed(DDIR_UPLOAD) > transfer().GetMaxSpeed(DDIR_UPLOAD))
 		return bin_t::NONE;
-	}
 
     if (!hashtree()->size()) // know nothing
         return bin_t::NONE;
@@ -361,6 +700,7 @@ bin_t        Channel::AddData (struct evbuffer **evb) {
 		messageQueue.AddBuffer(socket_, *evb, peer(), this, false);
 		*evb = evbuffer_new();
         evbuffer_add_32be(*evb, peer_channel_id_);
+        wire_bin_out_ = 0;
     }
 
     if (hashtree()->chunk_size() != SWIFT_DEFAULT_CHUNK_SIZE && isretransmit) {
@@ -381,37 +721,21 @@ bin_t        Channel::AddData (struct evbuffer **evb) {
          evbuffer_add_32be(*evb, (int)rand() );
     }
 
-    evbuffer_add_8(*evb, SWIFT_DATA);
-    evbuffer_add_32be(*evb, bin_toUInt32(tosend));
+    AddBinMessage(*evb, SWIFT_DATA, tosend);
 
-    struct evbuffer_iovec vec;
-    if (evbuffer_reserve_space(*evb, hashtree()->chunk_size(), &vec, 1) < 0) {
-	print_error("error on evbuffer_reserve_space");
-	return bin_t::NONE;
-    }
-    size_t r = transfer().GetStorage()->Read((char *)vec.iov_base,
-		     hashtree()->chunk_size(),tosend.base_offset()*hashtree()->chunk_size());
-    // TODO: corrupted data, retries, caching
-    if (r<0) {
-        print_error("error on reading");
-        vec.iov_len = 0;
-        evbuffer_commit_space(*evb, &vec, 1);
-        return bin_t::NONE;
-    }
-    // assert(dgram.space()>=r+4+1);
-    vec.iov_len = r;
-    if (evbuffer_commit_space(*evb, &vec, 1) < 0) {
-        print_error("error on evbuffer_commit_space");
+    // Shared with the DATA of this chunk to other peers
+    ssize_t r = messageQueue.AddPayload(*evb, transfer().root_hash(), transfer().GetStorage(),
+		     tosend.base_offset()*hashtree()->chunk_size(), hashtree()->chunk_size());
+    // TODO: corrupted data, retries
+    if (r<0)
         return bin_t::NONE;
-    }
 
     last_data_out_time_ = NOW;
     data_out_.push_back(tosend);
     bytes_up_ += r;
     global_bytes_up += r;
 
-    char bin_name_buf[32];
-    dprintf("%s #%u +data %s\n",tintstr(),id_,tosend.str(bin_name_buf));
+    dtrace(TRACE_EV_DATA_OUT,id_,tosend,0);
 
     // RATELIMIT
     // ARNOSMPTODO: count overhead bytes too? Move to Send() then.
@@ -426,19 +750,19 @@ void    Channel::AddAck (struct evbuffer *evb) {
 	//if (data_in_.bin==bin64_t::NONE)
         return;
     // sometimes, we send a HAVE (e.g. in case the peer did repetitive send)
-    evbuffer_add_8(evb, data_in_.time==TINT_NEVER?SWIFT_HAVE:SWIFT_ACK);
-    evbuffer_add_32be(evb, bin_toUInt32(data_in_.bin));
-    if (data_in_.time!=TINT_NEVER)
-        evbuffer_add_64be(evb, data_in_.time);
+    AddBinMessage(evb, data_in_.time==TINT_NEVER?SWIFT_HAVE:SWIFT_ACK, data_in_.bin);
+    if (data_in_.time!=TINT_NEVER) {
+        if (wire_version_ >= SWIFT_WIRE_COMPACT)
+            evbuffer_add_32be(evb, (uint32_t)data_in_.time);
+        else
+            evbuffer_add_64be(evb, data_in_.time);
+    }
 
 
 	if (DEBUGTRAFFIC)
 		fprintf(stderr,"send c%d: ACK %i\n", id(), bin_toUInt32(data_in_.bin));
 
-    have_out_.set(data_in_.bin);
-    char bin_name_buf[32];
-    dprintf("%s #%u +ack %s %s\n",
-        tintstr(),id_,data_in_.bin.str(bin_name_buf),tintstr(data_in_.time));
+    dtrace(TRACE_EV_ACK_OUT,id_,data_in_.bin,data_in_.time);
     if (data_in_.bin.layer()>2)
         data_in_dbl_ = data_in_.bin;
 
@@ -448,55 +772,101 @@ void    Channel::AddAck (struct evbuffer *evb) {
 }
 
 
+/** Leftmost filled bin in range that starts at or after chunk from. */
+static bin_t FindFilledFrom (binmap_t *map, bin_t range, uint64_t from) {
+    if (range.base_offset()+range.base_length() <= from || map->is_empty(range))
+        return bin_t::NONE;
+    if (range.base_offset() >= from && map->is_filled(range))
+        return range;
+    if (range.is_base())
+        return bin_t::NONE;
+    bin_t ack = FindFilledFrom(map,range.left(),from);
+    if (!ack.is_none())
+        return ack;
+    return FindFilledFrom(map,range.right(),from);
+}
+
+
 void    Channel::AddHave (struct evbuffer *evb) {
     if (!data_in_dbl_.is_none()) { // TODO: do redundancy better
-        evbuffer_add_8(evb, SWIFT_HAVE);
-        evbuffer_add_32be(evb, bin_toUInt32(data_in_dbl_));
+        AddBinMessage(evb, SWIFT_HAVE, data_in_dbl_);
         data_in_dbl_=bin_t::NONE;
     }
+    if (have_all_out_)
+        return;
     if (DEBUGTRAFFIC)
 		fprintf(stderr,"send c%d: HAVE ",id() );
 
-	// ZEROSTATE
-	if (transfer().IsZeroState())
-	{
-		if (is_established())
-			return;
+    // Seeders (and ZEROSTATE) say so once. Legacy peers take HAVE ALL
+    // for a bin of the file's size, tell them the peaks instead.
+    if (hashtree()->is_complete()) {
+        if (wire_version_ >= SWIFT_WIRE_COMPACT)
+            AddHaveBin(evb,bin_t::ALL);
+        else
+            for (int i=0; i<hashtree()->peak_count(); i++)
+                AddHaveBin(evb,hashtree()->peak(i));
+        have_all_out_ = true;
+        if (DEBUGTRAFFIC)
+            fprintf(stderr,"\n");
+        return;
+    }
 
-		// Say we have peaks
-        for(int i=0; i<hashtree()->peak_count(); i++) {
-            bin_t peak = hashtree()->peak(i);
-			evbuffer_add_8(evb, SWIFT_HAVE);
-            evbuffer_add_32be(evb, bin_toUInt32(peak));
-			char bin_name_buf[32];
-		    dprintf("%s #%u +have %s\n",tintstr(),id_,peak.str(bin_name_buf));
+    // Rolling HAVE queue: first what we had at the handshake, left to
+    // right, then what came in since from the transfer's HAVE log.
+    binmap_t *ack_out = hashtree()->ack_out();
+    int count = 0;
+    bin_t last = bin_t::NONE;
+    for(int i=0; i<hashtree()->peak_count() && count<4; ) {
+        bin_t peak = hashtree()->peak(i);
+        if (have_snap_pos_ >= peak.base_offset()+peak.base_length()) {
+            i++;
+            continue;
         }
-		return;
-	}
+        bin_t ack = FindFilledFrom(ack_out,peak,have_snap_pos_);
+        if (ack.is_none()) {
+            have_snap_pos_ = peak.base_offset()+peak.base_length();
+            continue;
+        }
+        ack = ack_out->cover(ack);
+        have_snap_pos_ = ack.base_offset()+ack.base_length();
+        AddHaveBin(evb,ack);
+        last = ack;
+        count++;
+    }
+    if (have_log_pos_ < transfer().have_log_begin()) {
+        // Fell off the log, rescan
+        have_snap_pos_ = 0;
+        have_log_pos_ = transfer().have_log_end();
+    }
+    for(; have_log_pos_<transfer().have_log_end() && count<4; have_log_pos_++) {
+        // The peer that sent it got an ACK
+        if (transfer().have_log_channel(have_log_pos_) == id_)
+            continue;
+        bin_t ack = ack_out->cover(transfer().have_log(have_log_pos_));
+        if (ack.is_none() || (!last.is_none() && last.contains(ack)))
+            continue;
+        AddHaveBin(evb,ack);
+        last = ack;
+        count++;
+    }
+	if (DEBUGTRAFFIC)
+		fprintf(stderr,"\n");
 
-    for(int count=0; count<4; count++) {
-        bin_t ack = binmap_t::find_complement(have_out_, *(hashtree()->ack_out()), 0); // FIXME: do rotating queue
-        if (ack.is_none())
-            break;
-        ack = hashtree()->ack_out()->cover(ack);
-        have_out_.set(ack);
-        evbuffer_add_8(evb, SWIFT_HAVE);
-        evbuffer_add_32be(evb, bin_toUInt32(ack));
+}
 
-    	if (DEBUGTRAFFIC)
-    		fprintf(stderr," %i", bin_toUInt32(ack));
 
-        char bin_name_buf[32];
-        dprintf("%s #%u +have %s\n",tintstr(),id_,ack.str(bin_name_buf));
-    }
+void    Channel::AddHaveBin (struct evbuffer *evb, bin_t ack) {
+    AddBinMessage(evb, SWIFT_HAVE, ack);
+
 	if (DEBUGTRAFFIC)
-		fprintf(stderr,"\n");
+		fprintf(stderr," %i", bin_toUInt32(ack));
 
+    dtrace(TRACE_EV_HAVE_OUT,id_,ack,0);
 }
 
 
 void    Channel::Recv (struct evbuffer *evb) {
-    dprintf("%s #%u recvd %ib\n",tintstr(),id_,(int)evbuffer_get_length(evb)+4);
+    dtrace(TRACE_EV_RECV,id_,bin_t::NONE,evbuffer_get_length(evb)+4);
     dgrams_rcvd_++;
 
     if (!transfer().IsOperational()) {
@@ -522,12 +892,16 @@ void    Channel::Recv (struct evbuffer *evb) {
 	if (DEBUGTRAFFIC)
 		fprintf(stderr,"recv c%d: size %d ", id(), evbuffer_get_length(evb));
 
+    wire_bin_in_ = 0;
 	while (evbuffer_get_length(evb)) {
         uint8_t type = evbuffer_remove_8(evb);
 
         if (DEBUGTRAFFIC)
         	fprintf(stderr," %d\n", type);
 
+        // Same handlers, RemoveBin() decodes the compact fields
+        type = MessageType(type, &wire_compact_in_);
+
         switch (type) {
             case SWIFT_HANDSHAKE:
             	OnHandshake(evb);
@@ -571,6 +945,12 @@ void    Channel::Recv (struct evbuffer *evb) {
             case SWIFT_RANDOMIZE:
             	OnRandomize(evb);
             	break; //FRAGRAND
+            case SWIFT_VERSION:
+            	OnVersion(evb);
+            	break;
+            case SWIFT_COMPACT_UNCLES:
+            	OnUncleHashes(evb);
+            	break;
             default:
                 dprintf("%s #%u ?msg id unknown %i\n",tintstr(),id_,(int)type);
                 return;
@@ -581,6 +961,8 @@ void    Channel::Recv (struct evbuffer *evb) {
     	fprintf(stderr,"\n");
     }
 
+    OnHaveAll();
+
     last_recv_time_ = NOW;
     sent_since_recv_ = 0;
 
@@ -612,11 +994,10 @@ void   Channel::CloseOnError()
  * hashes check out should they be stored in the hashtree, otherwise revert.
  */
 void    Channel::OnHash (struct evbuffer *evb) {
-	bin_t pos = bin_fromUInt32(evbuffer_remove_32be(evb));
+	bin_t pos = RemoveBin(evb);
     Sha1Hash hash = evbuffer_remove_hash(evb);
     hashtree()->OfferHash(pos,hash);
-    char bin_name_buf[32];
-    dprintf("%s #%u -hash %s\n",tintstr(),id_,pos.str(bin_name_buf));
+    dtrace(TRACE_EV_HASH_IN,id_,pos,0);
 
     //fprintf(stderr,"HASH %lli hex %s\n",pos.toUInt(), hash.hex().c_str() );
 }
@@ -654,7 +1035,7 @@ void    Channel::CleanHintOut (bin_t pos) {
 bin_t Channel::OnData (struct evbuffer *evb) {  // TODO: HAVE NONE for corrupted data
 
 	char bin_name_buf[32];
-	bin_t pos = bin_fromUInt32(evbuffer_remove_32be(evb));
+	bin_t pos = RemoveBin(evb);
 
     // Arno: Assuming DATA last message in datagram
     if (evbuffer_get_length(evb) > hashtree()->chunk_size()) {
@@ -665,7 +1046,7 @@ bin_t Channel::OnData (struct evbuffer *evb) {  // TODO: HAVE NONE for corrupted
     int length = (evbuffer_get_length(evb) < hashtree()->chunk_size()) ? evbuffer_get_length(evb) : hashtree()->chunk_size();
     if (!hashtree()->ack_out()->is_empty(pos)) {
         // Arno, 2012-01-24: print message for duplicate
-        dprintf("%s #%u Ddata %s\n",tintstr(),id_,pos.str(bin_name_buf));
+        dtrace(TRACE_EV_DATA_DUP,id_,pos,0);
         evbuffer_drain(evb, length);
         data_in_ = tintbin(TINT_NEVER,transfer().ack_out()->cover(pos));
 
@@ -678,20 +1059,18 @@ bin_t Channel::OnData (struct evbuffer *evb) {  // TODO: HAVE NONE for corrupted
     data_in_ = tintbin(NOW,bin_t::NONE);
     if (!hashtree()->OfferData(pos, (char*)data, length)) {
     	evbuffer_drain(evb, length);
-        char bin_name_buf[32];
-        dprintf("%s #%u !data %s\n",tintstr(),id_,pos.str(bin_name_buf));
+        dtrace(TRACE_EV_DATA_BAD,id_,pos,0);
         return bin_t::NONE;
     }
     evbuffer_drain(evb, length);
-    dprintf("%s #%u -data %s\n",tintstr(),id_,pos.str(bin_name_buf));
+    dtrace(TRACE_EV_DATA_IN,id_,pos,0);
+    transfer().AddHaveLog(pos,id_);
 
     if (DEBUGTRAFFIC)
     	fprintf(stderr,"$ ");
 
     bin_t cover = transfer().ack_out()->cover(pos);
-    for(int i=0; i<transfer().cb_installed; i++)
-        if (cover.layer()>=transfer().cb_agg[i])
-            transfer().callbacks[i](transfer().fd(),cover);  // FIXME
+    transfer().NotifyProgress(cover);
     if (cover.layer() >= 5) // Arno: tested with 32K, presently = 2 ** 5 * chunk_size CHUNKSIZE
     	transfer().OnRecvData( pow((double)2,(double)5)*((double)hashtree()->chunk_size()) );
     data_in_.bin = pos;
@@ -717,9 +1096,22 @@ void Channel::UpdateDIP(bin_t pos)
 
 
 void    Channel::OnAck (struct evbuffer *evb) {
-    bin_t ackd_pos = bin_fromUInt32(evbuffer_remove_32be(evb));
-    tint peer_time = evbuffer_remove_64be(evb); // FIXME 32
-    // FIXME FIXME: wrap around here
+    bin_t ackd_pos = RemoveBin(evb);
+    tint peer_time;
+    if (wire_compact_in_) {
+        // Low 32 bits of the peer's clock. Only differences between
+        // samples matter for LEDBAT, so the first is taken as the value
+        // closest to our clock and later ones closest to the previous. Our
+        // clock would pick the wrong epoch every other sample when the
+        // offset between the clocks is near 2^31 us. Gaps between ACKs
+        // must stay below 2^31 us (35 min), as they do on a live channel.
+        uint32_t low = evbuffer_remove_32be(evb);
+        tint ref = wire_peer_time_ == TINT_NEVER ? NOW : wire_peer_time_;
+        peer_time = ref + (int32_t)(low-(uint32_t)ref);
+        wire_peer_time_ = peer_time;
+    }
+    else
+        peer_time = evbuffer_remove_64be(evb);
     if (ackd_pos.is_none())
         return; // likely, broken chunk/ insufficient hashes
     if (hashtree()->size() && ackd_pos.base_offset()>=hashtree()->size_in_chunks()) {
@@ -728,6 +1120,7 @@ void    Channel::OnAck (struct evbuffer *evb) {
         return;
     }
     ack_in_.set(ackd_pos);
+    transfer().UpdateChannel(this);
 
     //fprintf(stderr,"OnAck: got bin %s is_complete %d\n", ackd_pos.str(), (int)ack_in_.is_complete_arno( hashtree()->ack_out()->get_height() ));
 
@@ -740,9 +1133,7 @@ void    Channel::OnAck (struct evbuffer *evb) {
     // rule out retransmits
     while (  ri<data_out_tmo_.size() && !ackd_pos.contains(data_out_tmo_[ri].bin) )
         ri++;
-    char bin_name_buf[32];
-    dprintf("%s #%u %cack %s %lli\n",tintstr(),id_,
-            di==data_out_.size()?'?':'-',ackd_pos.str(bin_name_buf),peer_time);
+    dtrace(di==data_out_.size()?TRACE_EV_ACK_UNKNOWN:TRACE_EV_ACK_IN,id_,ackd_pos,peer_time);
     if (di!=data_out_.size() && ri==data_out_tmo_.size()) { // not a retransmit
             // round trip time calculations
         tint rtt = NOW-data_out_[di].time;
@@ -760,6 +1151,7 @@ void    Channel::OnAck (struct evbuffer *evb) {
         }
         if (owd_min_bins_[owd_min_bin_]>owd)
             owd_min_bins_[owd_min_bin_] = owd;
+        char bin_name_buf[32];
         dprintf("%s #%u sendctrl rtt %lli dev %lli based on %s\n",
                 tintstr(),id_,rtt_avg_,dev_avg_,data_out_[di].bin.str(bin_name_buf));
         ack_rcvd_recent_++;
@@ -769,7 +1161,7 @@ void    Channel::OnAck (struct evbuffer *evb) {
                 continue;
             ack_not_rcvd_recent_++;
             data_out_tmo_.push_back(data_out_[re].bin);
-            dprintf("%s #%u Rdata %s\n",tintstr(),id_,data_out_.front().bin.str(bin_name_buf));
+            dtrace(TRACE_EV_DATA_REORDER,id_,data_out_.front().bin,0);
             data_out_cap_ = bin_t::ALL;
             data_out_[re] = tintbin();
         }
@@ -793,8 +1185,7 @@ void Channel::TimeoutDataOut ( ) {
             ack_not_rcvd_recent_++;
             data_out_cap_ = bin_t::ALL;
             data_out_tmo_.push_back(data_out_.front().bin);
-            char bin_name_buf[32];
-            dprintf("%s #%u Tdata %s\n",tintstr(),id_,data_out_.front().bin.str(bin_name_buf));
+            dtrace(TRACE_EV_DATA_TIMEOUT,id_,data_out_.front().bin,0);
         }
         data_out_.pop_front();
     }
@@ -805,9 +1196,29 @@ void Channel::TimeoutDataOut ( ) {
 
 
 void Channel::OnHave (struct evbuffer *evb) {
-    bin_t ackd_pos = bin_fromUInt32(evbuffer_remove_32be(evb));
+    bin_t ackd_pos = RemoveBin(evb);
     if (ackd_pos.is_none())
         return; // wow, peer has hashes
+    if (ackd_pos.is_all()) {
+        // HAVE ALL, mapped onto the peaks once we know the size, i.e.
+        // with the first chunk as we hint (0,0) until then
+        have_all_in_ = true;
+        return;
+    }
+    OnHaveBin(ackd_pos);
+}
+
+
+void Channel::OnHaveAll () {
+    if (!have_all_in_ || hashtree()->size() == 0)
+        return;
+    have_all_in_ = false;
+    for(int i=0; i<hashtree()->peak_count(); i++)
+        OnHaveBin(hashtree()->peak(i));
+}
+
+
+void Channel::OnHaveBin (bin_t ackd_pos) {
 
     // PPPLUG
     if (ENABLE_VOD_PIECEPICKER) {
@@ -821,8 +1232,8 @@ void Channel::OnHave (struct evbuffer *evb) {
     }
 
     ack_in_.set(ackd_pos);
-    char bin_name_buf[32];
-    dprintf("%s #%u -have %s\n",tintstr(),id_,ackd_pos.str(bin_name_buf));
+    transfer().UpdateChannel(this);
+    dtrace(TRACE_EV_HAVE_IN,id_,ackd_pos,0);
 
     //fprintf(stderr,"OnHave: got bin %s is_complete %d\n", ackd_pos.str(), IsComplete() );
 
@@ -830,11 +1241,10 @@ void Channel::OnHave (struct evbuffer *evb) {
 
 
 void    Channel::OnHint (struct evbuffer *evb) {
-    bin_t hint = bin_fromUInt32(evbuffer_remove_32be(evb));
+    bin_t hint = RemoveBin(evb);
     // FIXME: wake up here
     hint_in_.push_back(hint);
-    char bin_name_buf[32];
-    dprintf("%s #%u -hint %s\n",tintstr(),id_,hint.str(bin_name_buf));
+    dtrace(TRACE_EV_HINT_IN,id_,hint,0);
 }
 
 
@@ -847,6 +1257,8 @@ void Channel::OnHandshake (struct evbuffer *evb) {
     	// Arno: received explicit close
     	peer_channel_id_ = 0; // == established -> false
     	Close();
+    	// TRACKER: may have been established by this same datagram
+    	Schedule4Close();
     	return;
     }
 
@@ -874,7 +1286,9 @@ void Channel::OnPexAdd (struct evbuffer *evb) {
     uint16_t port = evbuffer_remove_16be(evb);
     Address addr(ipv4,port);
     dprintf("%s #%u -pex %s\n",tintstr(),id_,addr.str());
-    if (transfer().OnPexAddIn(addr))
+    bool added = transfer().OnPexAddIn(addr);
+    dtrace(TRACE_EV_PEX_IN,id_,bin_t(((uint64_t)ipv4<<16)|port),added?0:1);
+    if (added)
         useless_pex_count_ = 0;
     else
     {
@@ -910,6 +1324,7 @@ void    Channel::AddPex (struct evbuffer *evb) {
             	evbuffer_add_32be(evb, a.ipv4());
             	evbuffer_add_16be(evb, a.port());
             	dprintf("%s #%u +pex (reverse) %s\n",tintstr(),id_,a.str());
+            	dtrace(TRACE_EV_PEX_OUT,id_,bin_t(((uint64_t)a.ipv4()<<16)|a.port()),1);
             }
         } while (!reverse_pex_out_.empty() && (SWIFT_MAX_NONDATA_DGRAM_SIZE-evbuffer_get_length(evb)) >= 7);
 
@@ -943,11 +1358,12 @@ void    Channel::AddPex (struct evbuffer *evb) {
     evbuffer_add_32be(evb, a.ipv4());
     evbuffer_add_16be(evb, a.port());
     dprintf("%s #%u +pex %s\n",tintstr(),id_,a.str());
+    dtrace(TRACE_EV_PEX_OUT,id_,bin_t(((uint64_t)a.ipv4()<<16)|a.port()),0);
 
     pex_requested_ = false;
     /* Ensure that we don't add the same id to the reverse_pex_out_ queue
        more than once. */
-    for (tbqueue::iterator i = channels[chid]->reverse_pex_out_.begin();
+    for (lazytbqueue::iterator i = channels[chid]->reverse_pex_out_.begin();
             i != channels[chid]->reverse_pex_out_.end(); i++)
         if ((int) (i->bin.toUInt()) == id_)
             return;
@@ -979,7 +1395,7 @@ void Channel::AddPexReq(struct evbuffer *evb) {
     pex_request_outstanding_ = false;
 
     // Initiate at most SWIFT_MAX_CONNECTIONS connections
-    if (transfer().hs_in_.size() >= SWIFT_MAX_CONNECTIONS ||
+    if (transfer().channel_count() >= SWIFT_MAX_CONNECTIONS ||
             // Check whether this channel has been providing useful peer information
             useless_pex_count_ > 2)
     {
@@ -1006,8 +1422,8 @@ void Channel::AddPexReq(struct evbuffer *evb) {
  */
 
 void Channel::LibeventReceiveCallback(evutil_socket_t fd, short event, void *arg) {
-	// Called by libevent when a datagram is received on the socket
-    Time();
+	// Called by libevent when a datagram is received on the socket,
+	// RecvFrom() reads the clock
     RecvDatagram(fd);
     event_add(&evrecv, NULL);
 }
@@ -1028,110 +1444,158 @@ void    Channel::RecvDatagram (evutil_socket_t socket) {
     RecvFrom(socket, addr, pevb);
 	int i = 0;
 	for (; i<addr.addr->count; ++i) {
-		struct evbuffer *evb = pevb[i];
 		Address fromi;
 		fromi.addr->dests[0].addr = addr.addr->dests[i].addr;
 		fromi.addr->dests[0].port = addr.addr->dests[i].port;
-		size_t evboriglen = evbuffer_get_length(evb);
+		RecvDatagram(socket, fromi, pevb[i]);
+	}
+
+	for (; i<NUM_DATAGRAMS; ++i)
+		evbuffer_free(pevb[i]);
+}
+
+
+void    Channel::RecvDatagram (evutil_socket_t socket, const Address &fromi, struct evbuffer *evb) {
+	size_t evboriglen = evbuffer_get_length(evb);
 
 //#define return_log(...) { fprintf(stderr,__VA_ARGS__); evbuffer_free(evb); return; }
 #define return_log(...) { dprintf(__VA_ARGS__); evbuffer_free(evb); return; }
 
-		if (evbuffer_get_length(evb)<4)
-			return_log("socket layer weird: datagram < 4 bytes from %s (prob ICMP unreach)\n",fromi.str());
-		uint32_t mych = evbuffer_remove_32be(evb);
-		Sha1Hash hash;
-		Channel* channel = NULL;
-		if (mych==0) { // peer initiates handshake
-			if (evbuffer_get_length(evb)<1+4+1+4+Sha1Hash::SIZE)
-				return_log ("%s #0 incorrect size %i initial handshake packet %s\n",
-						tintstr(),(int)evbuffer_get_length(evb),fromi.str());
-			uint8_t hashid = evbuffer_remove_8(evb);
-			if (hashid!=SWIFT_HASH)
-				return_log ("%s #0 no hash in the initial handshake %s\n",
-						tintstr(),fromi.str());
-			bin_t pos = bin_fromUInt32(evbuffer_remove_32be(evb));
-			if (!pos.is_all())
-				return_log ("%s #0 that is not the root hash %s\n",tintstr(),fromi.str());
-			hash = evbuffer_remove_hash(evb);
-			FileTransfer* ft = FileTransfer::Find(hash);
-			if (!ft)
-			{
-				ZeroState *zs = ZeroState::GetInstance();
-            	ft = zs->Find(hash);
-            	if (!ft)
-					return_log ("%s #0 hash %s unknown, requested by %s\n",tintstr(),hash.hex().c_str(),fromi.str());
-			}
-			else if (ft->IsZeroState() && !ft->hashtree()->is_complete())
-			{
-				return_log ("%s #0 zero hash %s broken, requested by %s\n",tintstr(),hash.hex().c_str(),addr.str());
-			}
-			if (!ft->IsOperational())
-			{
-				return_log ("%s #0 hash %s broken, requested by %s\n",tintstr(),hash.hex().c_str(),addr.str());
-			}
+	if (evbuffer_get_length(evb)<4)
+		return_log("socket layer weird: datagram < 4 bytes from %s (prob ICMP unreach)\n",fromi.str());
+	uint32_t mych = evbuffer_remove_32be(evb);
+	Sha1Hash hash;
+	Channel* channel = NULL;
+	if (mych==0) { // peer initiates handshake
+		if (evbuffer_get_length(evb)<1+4+1+4+Sha1Hash::SIZE)
+			return_log ("%s #0 incorrect size %i initial handshake packet %s\n",
+					tintstr(),(int)evbuffer_get_length(evb),fromi.str());
+		uint8_t hashid = evbuffer_remove_8(evb);
+		if (hashid!=SWIFT_HASH)
+			return_log ("%s #0 no hash in the initial handshake %s\n",
+					tintstr(),fromi.str());
+		bin_t pos = bin_fromUInt32(evbuffer_remove_32be(evb));
+		if (!pos.is_all())
+			return_log ("%s #0 that is not the root hash %s\n",tintstr(),fromi.str());
+		hash = evbuffer_remove_hash(evb);
+		if (Tracker *tracker = Tracker::Find(socket)) {
+			// TRACKER: answered without channel
+			tracker->OnHandshake(fromi,hash,evb);
+			evbuffer_free(evb);
+			return;
+		}
+		FileTransfer* ft = FileTransfer::Find(hash,socket);
+		if (!ft)
+			// SEEDDIR: not opened yet
+			ft = SeedIndex::GetInstance()->Find(hash);
+		if (!ft)
+		{
+			ZeroState *zs = ZeroState::GetInstance();
+        	ft = zs->Find(hash);
+        	if (!ft)
+				return_log ("%s #0 hash %s unknown, requested by %s\n",tintstr(),hash.hex().c_str(),fromi.str());
+		}
+		else if (ft->IsZeroState() && !ft->hashtree()->is_complete())
+		{
+			return_log ("%s #0 zero hash %s broken, requested by %s\n",tintstr(),hash.hex().c_str(),fromi.str());
+		}
+		if (!ft->IsOperational())
+		{
+			return_log ("%s #0 hash %s broken, requested by %s\n",tintstr(),hash.hex().c_str(),fromi.str());
+		}
+		// COOKIE: answered without a channel
+		if (ft->IsZeroState() && ZeroState::GetInstance()->IsStateless() && ft->FindChannel(fromi,NULL) == NULL &&
+				ZeroState::GetInstance()->Answer(socket,fromi,ft,evb))
+		{
+			evbuffer_free(evb);
+			return;
+		}
 
-			dprintf("%s #0 -hash ALL %s\n",tintstr(),hash.hex().c_str());
-
-			// Arno, 2012-02-27: Check for duplicate channel
-			Channel* existchannel = ft->FindChannel(fromi,NULL);
-			if (existchannel)
-			{
-				// Arno: 2011-10-13: Ignore if established, otherwise consider
-				// it a concurrent connection attempt.
-				if (existchannel->is_established()) {
-					// ARNOTODO: Read complete handshake here so we know whether
-					// attempt is to new channel or to existing. Currently read
-					// in OnHandshake()
-                    //
-                    return_log("%s #0 have a channel already to %s\n",tintstr(),fromi.str());
-                } else {
-                    channel = existchannel;
-                    //fprintf(stderr,"Channel::RecvDatagram: HANDSHAKE: reuse channel %s\n", channel->peer_.str() );
-                }
-            }
-            if (channel == NULL) {
-                //fprintf(stderr,"Channel::RecvDatagram: HANDSHAKE: create new channel %s\n", addr.str() );
-                channel = new Channel(ft, socket, fromi);
+		dprintf("%s #0 -hash ALL %s\n",tintstr(),hash.hex().c_str());
+
+		// Arno, 2012-02-27: Check for duplicate channel
+		Channel* existchannel = ft->FindChannel(fromi,NULL);
+		if (existchannel)
+		{
+			// Arno: 2011-10-13: Ignore if established, otherwise consider
+			// it a concurrent connection attempt.
+			if (existchannel->is_established()) {
+				// ARNOTODO: Read complete handshake here so we know whether
+				// attempt is to new channel or to existing. Currently read
+				// in OnHandshake()
+                //
+                return_log("%s #0 have a channel already to %s\n",tintstr(),fromi.str());
+            } else {
+                channel = existchannel;
+                //fprintf(stderr,"Channel::RecvDatagram: HANDSHAKE: reuse channel %s\n", channel->peer_.str() );
             }
-            //fprintf(stderr,"CHANNEL INCOMING DEF hass %s is id %d\n",hash.hex().c_str(),channel->id());
-
-        } else if (mych==CMDGW_TUNNEL_DEFAULT_CHANNEL_ID) {
-            // SOCKTUNNEL
-    	    CmdGwTunnelUDPDataCameIn(addr,CMDGW_TUNNEL_DEFAULT_CHANNEL_ID,evb);
-    	    evbuffer_free(evb);
-    	    return;
-        } else { // peer responds to my handshake (and other messages)
-            mych = DecodeID(mych);
-            if (mych>=channels.size())
-                return_log("%s invalid channel #%u, %s\n",tintstr(),mych,fromi.str());
-            channel = channels[mych];
-            if (!channel)
-                return_log ("%s #%u is already closed\n",tintstr(),mych);
-            if (channel->IsDiffSenderOrDuplicate(fromi,mych)) {
-                channel->Schedule4Close();
-                return_log ("%s #%u is duplicate\n",tintstr(),mych);
+        }
+        if (channel == NULL) {
+            if (!MakeRoom())
+                return_log("%s #0 at %d channels, refusing %s\n",tintstr(),MAX_CHANNELS,fromi.str());
+            //fprintf(stderr,"Channel::RecvDatagram: HANDSHAKE: create new channel %s\n", addr.str() );
+            channel = new Channel(ft, socket, fromi);
+        }
+        //fprintf(stderr,"CHANNEL INCOMING DEF hass %s is id %d\n",hash.hex().c_str(),channel->id());
+
+    } else if (mych==CMDGW_TUNNEL_DEFAULT_CHANNEL_ID) {
+        // SOCKTUNNEL
+	    CmdGwTunnelUDPDataCameIn(fromi,CMDGW_TUNNEL_DEFAULT_CHANNEL_ID,evb);
+	    evbuffer_free(evb);
+	    return;
+    } else if (mych==SWIFT_MUX_CHANNEL_ID) {
+        // Parts for several channels, each handled as a datagram of its own
+        while (evbuffer_get_length(evb) >= 4+2) {
+            uint32_t partch = evbuffer_remove_32be(evb);
+            uint16_t len = evbuffer_remove_16be(evb);
+            if (len > evbuffer_get_length(evb))
+                return_log("%s multiplexed part of %u bytes truncated, %s\n",tintstr(),(unsigned)len,fromi.str());
+            if (partch==0 || partch==SWIFT_MUX_CHANNEL_ID || partch==CMDGW_TUNNEL_DEFAULT_CHANNEL_ID) {
+                evbuffer_drain(evb, len);
+                continue;
             }
-            channel->own_id_mentioned_ = true;
+            struct evbuffer *part = evbuffer_new();
+            evbuffer_add_32be(part, partch);
+            evbuffer_remove_buffer(evb, part, len);
+            RecvDatagram(socket, fromi, part);
         }
-        channel->raw_bytes_down_ += evboriglen;
-        //dprintf("recvd %i bytes for %i\n",data.size(),channel->id);
-        bool wasestablished = channel->is_established();
-
-        //dprintf("%s #%u peer %s recv_peer %s addr %s\n", tintstr(),mych, channel->peer().str(), channel->recv_peer().str(), fromi.str() );
-
-        channel->Recv(evb);
-
         evbuffer_free(evb);
-        //SAFECLOSE
-        if (wasestablished && !channel->is_established()) {
-            // Arno, 2012-01-26: Received an explict close, clean up channel, safely.
+        return;
+    } else { // peer responds to my handshake (and other messages)
+        if (Tracker::Find(socket))
+            return_log("%s tracker: no channels, dropping #%u from %s\n",tintstr(),mych,fromi.str());
+        mych = DecodeID(mych);
+        if (mych & SWIFT_COOKIE_FLAG) {
+            ZeroState::GetInstance()->OnCookieDatagram(socket,fromi,mych,evb);
+            evbuffer_free(evb);
+            return;
+        }
+        if (mych>=channels.size())
+            return_log("%s invalid channel #%u, %s\n",tintstr(),mych,fromi.str());
+        channel = channels[mych];
+        if (!channel)
+            return_log ("%s #%u is already closed\n",tintstr(),mych);
+        if (channel->IsDiffSenderOrDuplicate(fromi,mych)) {
             channel->Schedule4Close();
+            return_log ("%s #%u is duplicate\n",tintstr(),mych);
         }
+        channel->own_id_mentioned_ = true;
     }
+    channel->raw_bytes_down_ += evboriglen;
+    //dprintf("recvd %i bytes for %i\n",data.size(),channel->id);
+    bool wasestablished = channel->is_established();
 
-	for (; i<NUM_DATAGRAMS; ++i)
-		evbuffer_free(pevb[i]);
+    //dprintf("%s #%u peer %s recv_peer %s addr %s\n", tintstr(),mych, channel->peer().str(), channel->recv_peer().str(), fromi.str() );
+
+    channel->Recv(evb);
+    channel->transfer().UpdateChannel(channel);
+
+    evbuffer_free(evb);
+    //SAFECLOSE
+    if (wasestablished && !channel->is_established()) {
+        // Arno, 2012-01-26: Received an explict close, clean up channel, safely.
+        channel->Schedule4Close();
+    }
 }
 
 
@@ -1152,6 +1616,7 @@ void Channel::CloseChannelByAddress(const Address &addr)
 			// ARNOSMPTODO: will do another send attempt before not being
 			// Rescheduled.
 			c->peer_channel_id_ = 0; // established->false, do no more sending
+			c->transfer().UpdateChannel(c);
 			c->Schedule4Close();
 			break;
 		}
@@ -1181,7 +1646,7 @@ void Channel::Reschedule () {
 
 	// Arno: CAREFUL: direct send depends on diff between next_send_time_ and
 	// NOW to be 0, so any calls to Time in between may put things off. Sigh.
-	Time();
+	// Hence NOW as cached by the callback we are in.
     next_send_time_ = NextSendTime();
     if (next_send_time_!=TINT_NEVER) {
 
@@ -1201,7 +1666,7 @@ void Channel::Reschedule () {
         	if (evsend_ptr_ != NULL) {
         		struct timeval duetv = *tint2tv(duein);
         		evtimer_add(evsend_ptr_,&duetv);
-        		dprintf("%s #%u requeue for %s in %lli\n",tintstr(),id_,tintstr(next_send_time_), duein);
+        		dtrace(TRACE_EV_REQUEUE,id_,bin_t::NONE,duein);
         	}
         	else
         		dprintf("%s #%u cannot requeue for %s, closed\n",tintstr(),id_,tintstr(next_send_time_));
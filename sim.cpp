@@ -0,0 +1,461 @@
+/*
+ *  sim.cpp
+ *  deterministic in-process swarm simulator, see sim.h
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "sim.h"
+
+using namespace swift;
+
+
+Simulator::Simulator(uint64_t seed, std::string workdir) :
+    seed_(seed), seq_(0), workdir_(workdir), delivering_(NULL), tracker_(-1)
+{
+    rng_ = seed*2654435761ULL + 0x9E3779B97F4A7C15ULL;
+    // The library itself uses rand(), e.g. for picker twists
+    srand((unsigned int)seed);
+
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+
+    // Start at the log epoch such that tintstr() in debug logs starts at 0
+    start_ = now_ = Channel::epoch;
+    next_clean_ = start_ + SIM_CLEAN_INTERVAL;
+    usec_time_virtual(&now_);
+    Channel::Time();
+    Channel::transport = this;
+    // All peers share Channel::channels, so the self-connection check
+    // would find the remote end of every channel
+    self_conn_ok_ = Channel::SELF_CONN_OK;
+    Channel::SELF_CONN_OK = true;
+
+    if (file_exists_utf8(workdir_) != 2)
+        mkdir_utf8(workdir_);
+}
+
+
+Simulator::~Simulator()
+{
+    for (int i=0; i<peers_.size(); i++)
+        delete peers_[i].transfer;
+    delete tracker();
+    Channel::messageQueue.Flush();
+    Channel::transport = NULL;
+    Channel::SELF_CONN_OK = self_conn_ok_;
+    usec_time_virtual(NULL);
+    Channel::Time();
+}
+
+
+uint64_t Simulator::Random()
+{
+    // xorshift64*
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    return rng_ * 2685821657736338717ULL;
+}
+
+
+double Simulator::Uniform()
+{
+    return (Random() >> 11) * (1.0/9007199254740992.0);
+}
+
+
+int Simulator::AddPeer(const simlink_t &link, int host)
+{
+    int i = peers_.size();
+    simpeer_t p;
+    if (host >= 0 && host < i) {
+        p.host = peers_[host].host;
+        p.addr = peers_[p.host].addr;
+        p.sock = peers_[p.host].sock;
+        p.link = peers_[p.host].link;
+    } else {
+        p.host = i;
+        p.addr = Address((uint32_t)(0x0A000001+i),7000); // 10.0.0.1 and up
+        p.sock = SIM_SOCKET_BASE+i;
+        p.link = link;
+    }
+    p.listening = false;
+    p.seeder = false;
+    p.tracker = false;
+    p.zerostate = false;
+    p.chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
+    p.transfer = NULL;
+    p.join_time = start_;
+    p.done_time = TINT_NEVER;
+    p.uplink_free = start_;
+    p.dgrams_sent = p.dgrams_lost = p.dgrams_recv = 0;
+    p.bytes_sent = p.bytes_recv = 0;
+    peers_.push_back(p);
+    if (p.host != i)
+        return i;
+
+    uint64_t key = ((uint64_t)p.addr.addr->dests[0].addr << 16) | p.addr.addr->dests[0].port;
+    addrs_[key] = i;
+    return i;
+}
+
+
+int Simulator::FindPeer(uint32_t addr, uint16_t port)
+{
+    std::map<uint64_t,int>::iterator iter = addrs_.find(((uint64_t)addr << 16) | port);
+    return iter == addrs_.end() ? -1 : iter->second;
+}
+
+
+int Simulator::AddSeeder(std::string filename, const simlink_t &link, uint32_t chunk_size, int host)
+{
+    int i = AddPeer(link,host);
+    simpeer_t &p = peers_[i];
+    p.seeder = true;
+    p.filename = filename;
+    p.chunk_size = chunk_size;
+    p.transfer = new FileTransfer(filename,Sha1Hash::ZERO,true,true,chunk_size);
+    if (!p.transfer->IsOperational() || !p.transfer->hashtree()->is_complete()) {
+        print_error("sim: cannot seed file");
+        delete p.transfer;
+        p.transfer = NULL;
+        return -1;
+    }
+    p.transfer->SetSocket(p.sock);
+    p.root = p.transfer->root_hash();
+    p.done_time = now_;
+    peers_[p.host].listening = true;
+    // Announces itself when cleaning up finds it without peers
+    if (tracker_ >= 0)
+        p.transfer->SetTracker(peers_[tracker_].addr);
+    return i;
+}
+
+
+int Simulator::AddLeecher(Sha1Hash root, const simlink_t &link, tint join_time, uint32_t chunk_size, int host)
+{
+    int i = AddPeer(link,host);
+    simpeer_t &p = peers_[i];
+    p.root = root;
+    p.chunk_size = chunk_size;
+    p.join_time = start_+join_time;
+
+    char dirname[32];
+    sprintf(dirname,"peer%d",i);
+    std::string dir = workdir_+FILE_SEP+dirname;
+    if (file_exists_utf8(dir) != 2)
+        mkdir_utf8(dir);
+    p.filename = dir+FILE_SEP+root.hex();
+
+    // Each run starts from scratch, remove state of a previous run
+    remove_utf8(p.filename);
+    remove_utf8(p.filename+".mhash");
+    remove_utf8(p.filename+".mbinmap");
+    return i;
+}
+
+
+int Simulator::AddZeroSeeder(Sha1Hash root, const simlink_t &link)
+{
+    int i = AddPeer(link,-1);
+    simpeer_t &p = peers_[i];
+    p.seeder = true;
+    p.zerostate = true;
+    p.root = root;
+    p.done_time = now_;
+    p.listening = true;
+    return i;
+}
+
+
+int Simulator::AddTracker(const simlink_t &link, uint32_t max_members)
+{
+    if (tracker_ >= 0)
+        return -1;
+    int i = AddPeer(link,-1);
+    simpeer_t &p = peers_[i];
+    p.tracker = true;
+    p.done_time = now_;
+    p.listening = true;
+    new Tracker(p.sock,max_members);
+    tracker_ = i;
+    for (int j=0; j<peers_.size(); j++)
+        if (peers_[j].seeder && peers_[j].transfer != NULL)
+            peers_[j].transfer->SetTracker(p.addr);
+    return i;
+}
+
+
+void Simulator::StartPeers()
+{
+    int seeder = -1;
+    for (int i=0; i<peers_.size(); i++) {
+        if (peers_[i].seeder && (peers_[i].transfer != NULL || peers_[i].zerostate)) {
+            seeder = i;
+            break;
+        }
+    }
+    for (int i=0; i<peers_.size(); i++) {
+        simpeer_t &p = peers_[i];
+        if (p.seeder || p.tracker || p.transfer != NULL || p.join_time > now_)
+            continue;
+        p.transfer = new FileTransfer(p.filename,p.root,true,true,p.chunk_size);
+        p.transfer->SetSocket(p.sock);
+        peers_[p.host].listening = true;
+        int tracker = tracker_ >= 0 ? tracker_ : seeder;
+        for (int j=0; j<peers_.size(); j++)
+            if (tracker_ < 0 && peers_[j].seeder && (peers_[j].transfer != NULL || peers_[j].zerostate) && peers_[j].root == p.root) {
+                tracker = j;
+                break;
+            }
+        if (tracker >= 0) {
+            // Unless there is a tracker the seeder doubles as one, other
+            // peers are found via PEX
+            p.transfer->SetTracker(peers_[tracker].addr);
+            p.transfer->ConnectToTracker();
+        }
+    }
+}
+
+
+int Simulator::SendMsg(evutil_socket_t sock, struct msghdr *msg)
+{
+    int from = sock-SIM_SOCKET_BASE;
+    if (from < 0 || from >= peers_.size()) {
+        errno = EBADF;
+        return -1;
+    }
+    simpeer_t &src = peers_[from];
+    struct sockaddr_mptp *sa = (struct sockaddr_mptp *)msg->msg_name;
+    int total = 0;
+    for (int i=0; i<msg->msg_iovlen; i++) {
+        int len = msg->msg_iov[i].iov_len;
+        sa->dests[i].bytes = len;
+        total += len;
+        src.dgrams_sent++;
+        src.bytes_sent += len;
+
+        int to = FindPeer(sa->dests[i].addr,sa->dests[i].port);
+        if (to < 0) {
+            src.dgrams_lost++;
+            continue;
+        }
+
+        // Serialization on the uplink, drop-tail when its queue is full
+        tint depart = now_;
+        if (src.link.upload > 0) {
+            if (src.uplink_free < now_)
+                src.uplink_free = now_;
+            double backlog = (double)(src.uplink_free-now_)*src.link.upload/TINT_SEC;
+            if (backlog+len > src.link.queue) {
+                src.dgrams_lost++;
+                continue;
+            }
+            src.uplink_free += (tint)(len*(double)TINT_SEC/src.link.upload);
+            depart = src.uplink_free;
+        }
+        if (src.link.loss > 0 && Uniform() < src.link.loss) {
+            src.dgrams_lost++;
+            continue;
+        }
+        tint arrive = depart+src.link.delay;
+        if (src.link.jitter > 0)
+            arrive += (tint)(Uniform()*src.link.jitter);
+        if (src.link.reorder > 0 && Uniform() < src.link.reorder)
+            arrive += src.link.delay;
+
+        simdgram_t &dgram = inflight_[std::make_pair(arrive,seq_++)];
+        dgram.from = from;
+        dgram.to = to;
+        dgram.data.assign((const char *)msg->msg_iov[i].iov_base,len);
+    }
+    return total;
+}
+
+
+int Simulator::RecvMsg(evutil_socket_t sock, struct msghdr *msg)
+{
+    struct sockaddr_mptp *sa = (struct sockaddr_mptp *)msg->msg_name;
+    if (delivering_ == NULL || msg->msg_iovlen < 1) {
+        sa->count = 0;
+        return 0;
+    }
+    int len = delivering_->data.length();
+    if (len > msg->msg_iov[0].iov_len)
+        len = msg->msg_iov[0].iov_len;
+    memcpy(msg->msg_iov[0].iov_base,delivering_->data.data(),len);
+
+    simpeer_t &src = peers_[delivering_->from];
+    sa->count = 1;
+    sa->dests[0].addr = src.addr.addr->dests[0].addr;
+    sa->dests[0].port = src.addr.addr->dests[0].port;
+    sa->dests[0].bytes = len;
+    delivering_ = NULL;
+    return len;
+}
+
+
+void Simulator::Deliver(simdgram_t &dgram)
+{
+    simpeer_t &dst = peers_[dgram.to];
+    if (!dst.listening)
+        return; // not started yet, as if nobody listens
+    dst.dgrams_recv++;
+    dst.bytes_recv += dgram.data.length();
+    delivering_ = &dgram;
+    Channel::RecvDatagram(dst.sock);
+    delivering_ = NULL;
+}
+
+
+void Simulator::FireTimers()
+{
+    // Channels may be created while iterating, they are appended
+    for (int i=0; i<Channel::channels.size(); i++) {
+        Channel *c = Channel::channels[i];
+        if (c == NULL || c->evsend_ptr_ == NULL || !evtimer_pending(c->evsend_ptr_,NULL))
+            continue;
+        if (c->next_send_time_ > now_)
+            continue;
+        evtimer_del(c->evsend_ptr_);
+        Channel::LibeventSendCallback(-1,EV_TIMEOUT,c);
+    }
+}
+
+
+tint Simulator::NextEventTime()
+{
+    tint next = next_clean_;
+    if (!inflight_.empty() && inflight_.begin()->first.first < next)
+        next = inflight_.begin()->first.first;
+    for (int i=0; i<peers_.size(); i++)
+        if (peers_[i].transfer == NULL && !peers_[i].seeder && !peers_[i].tracker && peers_[i].join_time < next)
+            next = peers_[i].join_time;
+    for (int i=0; i<Channel::channels.size(); i++) {
+        Channel *c = Channel::channels[i];
+        if (c == NULL || c->evsend_ptr_ == NULL || !evtimer_pending(c->evsend_ptr_,NULL))
+            continue;
+        if (c->next_send_time_ < next)
+            next = c->next_send_time_;
+    }
+    // Timers that are already due fire in the next step, guarantee progress
+    if (next <= now_)
+        next = now_+TINT_uSEC;
+    return next;
+}
+
+
+bool Simulator::CheckComplete()
+{
+    bool alldone = true;
+    for (int i=0; i<peers_.size(); i++) {
+        simpeer_t &p = peers_[i];
+        if (p.seeder || p.tracker || p.done_time != TINT_NEVER)
+            continue;
+        if (p.transfer != NULL && p.transfer->hashtree()->is_complete())
+            p.done_time = now_;
+        else
+            alldone = false;
+    }
+    return alldone;
+}
+
+
+bool Simulator::Run(tint duration)
+{
+    tint end = now_+duration;
+    for (uint64_t step=1; ; step++) {
+        Channel::Time();
+        StartPeers();
+
+        while (!inflight_.empty() && inflight_.begin()->first.first <= now_) {
+            simdgram_t dgram;
+            dgram.from = inflight_.begin()->second.from;
+            dgram.to = inflight_.begin()->second.to;
+            dgram.data.swap(inflight_.begin()->second.data);
+            inflight_.erase(inflight_.begin());
+            Deliver(dgram);
+        }
+
+        FireTimers();
+
+        if (now_ >= next_clean_) {
+            for (int i=0; i<peers_.size(); i++)
+                if (peers_[i].transfer != NULL)
+                    FileTransfer::LibeventCleanCallback(-1,EV_TIMEOUT,peers_[i].transfer);
+            next_clean_ += SIM_CLEAN_INTERVAL;
+        }
+        FileTransfer::DeliverProgress();
+        Channel::messageQueue.Flush();
+        // Drain the trace rings, as TimerCallback does in swift
+        if ((step & 255) == 0)
+            TraceFlush();
+
+        if (CheckComplete())
+            return true;
+        tint next = NextEventTime();
+        if (next > end) {
+            now_ = end;
+            return false;
+        }
+        now_ = next;
+    }
+}
+
+
+void Simulator::Report(FILE *fp)
+{
+    uint64_t size = 0;
+    for (int i=0; i<peers_.size(); i++) {
+        FileTransfer *ft = peers_[i].transfer;
+        if (peers_[i].zerostate)
+            ft = FileTransfer::Find(peers_[i].root,peers_[i].sock);
+        if (peers_[i].seeder && ft != NULL) {
+            size = ft->hashtree()->size();
+            break;
+        }
+    }
+
+    uint64_t wirebytes = 0, lost = 0, dgrams = 0;
+    int leechers = 0, completed = 0;
+    double goodputsum = 0.0;
+    fprintf(fp,"{\"seed\": %llu, \"elapsed_us\": %lld, \"size\": %llu, \"peers\": [",
+        (unsigned long long)seed_,(long long)Elapsed(),(unsigned long long)size);
+    for (int i=0; i<peers_.size(); i++) {
+        simpeer_t &p = peers_[i];
+        wirebytes += p.bytes_sent;
+        lost += p.dgrams_lost;
+        dgrams += p.dgrams_sent;
+        long long took = -1;
+        double goodput = 0.0;
+        if (!p.seeder && !p.tracker) {
+            leechers++;
+            if (p.done_time != TINT_NEVER) {
+                completed++;
+                took = p.done_time-p.join_time;
+                goodput = took > 0 ? (double)size*TINT_SEC/took : 0.0;
+                goodputsum += goodput;
+            }
+        }
+        fprintf(fp,"%s\n  {\"peer\": %d, \"host\": %d, \"addr\": \"%s\", \"seeder\": %s, \"join_us\": %lld, "
+            "\"complete_us\": %lld, \"goodput_Bps\": %.0f, \"dgrams_sent\": %llu, \"dgrams_lost\": %llu, "
+            "\"dgrams_recv\": %llu, \"bytes_sent\": %llu, \"bytes_recv\": %llu}",
+            i ? "," : "",i,p.host,p.addr.str(),p.seeder ? "true" : "false",(long long)(p.join_time-start_),
+            took,goodput,(unsigned long long)p.dgrams_sent,(unsigned long long)p.dgrams_lost,
+            (unsigned long long)p.dgrams_recv,(unsigned long long)p.bytes_sent,(unsigned long long)p.bytes_recv);
+    }
+    // Overhead: bytes on the wire per content byte delivered to a leecher,
+    // and the bytes beyond the content (headers, control messages and
+    // duplicate data) per MiB delivered
+    double delivered = (double)size*completed;
+    double overhead = delivered > 0 ? (double)wirebytes/delivered : 0.0;
+    double permb = delivered > 0 ? ((double)wirebytes-delivered)*1048576.0/delivered : 0.0;
+    fprintf(fp,"\n], \"leechers\": %d, \"completed\": %d, \"goodput_avg_Bps\": %.0f, "
+        "\"wire_bytes\": %llu, \"dgrams_sent\": %llu, \"dgrams_per_s\": %.0f, \"dgrams_lost\": %llu, "
+        "\"overhead\": %.4f, \"wire_version\": %d, \"header_bytes_per_MB\": %.0f}\n",
+        leechers,completed,completed ? goodputsum/completed : 0.0,
+        (unsigned long long)wirebytes,(unsigned long long)dgrams,
+        Elapsed() > 0 ? (double)dgrams*TINT_SEC/Elapsed() : 0.0,(unsigned long long)lost,
+        overhead,(int)Channel::WIRE_VERSION,permb);
+}
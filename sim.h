@@ -0,0 +1,143 @@
+/*
+ *  sim.h
+ *  deterministic in-process swarm simulator: runs many swift peers in one
+ *  process on virtual time, routing their datagrams through a link model
+ *
+ *  The real FileTransfer/Channel code is used unmodified: the simulator
+ *  installs itself as Channel::transport and as the usec_time() clock, and
+ *  fires the channel send timers and transfer clean-up timers itself
+ *  instead of libevent. Runs are reproducible from the seed.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_SIM_H
+#define SWIFT_SIM_H
+
+#include "swift.h"
+
+namespace swift {
+
+// Fake socket numbers handed to the simulated peers
+#define SIM_SOCKET_BASE		100000
+// As FileTransfer::LibeventCleanCallback
+#define SIM_CLEAN_INTERVAL	(5*TINT_SEC)
+
+
+/** Access link of a simulated peer, applied to every datagram it sends. */
+struct simlink_t {
+    double      upload;     // bytes/s, 0 is unlimited
+    uint32_t    queue;      // bytes the uplink may queue (drop-tail)
+    tint        delay;      // one-way propagation delay
+    tint        jitter;     // uniform extra delay in [0,jitter)
+    double      loss;       // drop probability
+    double      reorder;    // probability of being held back one extra delay
+    simlink_t() : upload(0), queue(64*1024), delay(10*TINT_MSEC), jitter(0),
+        loss(0), reorder(0) {}
+};
+
+
+/** A simulated swift peer and its statistics. Peers on one host share its
+ *  address, socket and link, the datagram counts are the host's. */
+struct simpeer_t {
+    Address         addr;
+    evutil_socket_t sock;
+    int             host;           // peer index of the host, own if first
+    bool            listening;      // host: some peer on it was started
+    simlink_t       link;
+    bool            seeder;
+    bool            tracker;        // tracker-only, see AddTracker
+    bool            zerostate;      // seeder without transfer, see AddZeroSeeder
+    std::string     filename;
+    Sha1Hash        root;
+    uint32_t        chunk_size;
+    FileTransfer    *transfer;
+    tint            join_time;
+    tint            done_time;      // TINT_NEVER while incomplete
+    tint            uplink_free;    // when the uplink queue drains
+    uint64_t        dgrams_sent, dgrams_lost, dgrams_recv;
+    uint64_t        bytes_sent, bytes_recv;
+};
+
+
+/** Datagram in flight. */
+struct simdgram_t {
+    int             from;
+    int             to;
+    std::string     data;
+};
+
+
+class Simulator : public Transport {
+  public:
+    /** Use workdir for the peers' content and state files. */
+    Simulator(uint64_t seed, std::string workdir);
+    ~Simulator();
+
+    /** Add a peer seeding filename. Returns the peer index or -1. With
+     *  host the index of an earlier peer, it runs on that peer's host
+     *  (address, socket and link), link is then ignored. */
+    int         AddSeeder(std::string filename, const simlink_t &link, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE, int host=-1);
+    /** Add a peer downloading root from the first seeder of root (or
+     *  else the first seeder), starting at join_time (relative to the start
+     *  of the run). Returns the peer index. root is taken by value, it may
+     *  well be peer(i).root. host as for AddSeeder. */
+    int         AddLeecher(Sha1Hash root, const simlink_t &link, tint join_time=0, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE, int host=-1);
+    /** COOKIE: add a peer seeding root from the ZeroState content dir,
+     *  which the caller sets up, in whatever mode ZeroState is in. The
+     *  transfer is opened on the first handshake and is not peer(i).transfer.
+     *  Returns the peer index. */
+    int         AddZeroSeeder(Sha1Hash root, const simlink_t &link);
+    /** TRACKER: add a tracker-only peer remembering max_members, all
+     *  peers then find each other through it instead of via the seeder.
+     *  Returns the peer index, tracker() then gives the Tracker. */
+    int         AddTracker(const simlink_t &link, uint32_t max_members=1024*1024);
+    Tracker     *tracker() { return tracker_ < 0 ? NULL : Tracker::Find(peers_[tracker_].sock); }
+
+    /** Run until all leechers completed or duration virtual time passed.
+     *  Returns true if all leechers completed. */
+    bool        Run(tint duration);
+
+    /** Write completion times, goodput and overhead as JSON. */
+    void        Report(FILE *fp);
+
+    /** Virtual time since the start of the run */
+    tint        Elapsed() { return now_-start_; }
+    int         peer_count() { return peers_.size(); }
+    simpeer_t&  peer(int i) { return peers_[i]; }
+
+    // Transport
+    int         SendMsg(evutil_socket_t sock, struct msghdr *msg);
+    int         RecvMsg(evutil_socket_t sock, struct msghdr *msg);
+
+  protected:
+    uint64_t    seed_;
+    tint        now_;
+    tint        start_;
+    tint        next_clean_;
+    uint64_t    rng_;
+    uint64_t    seq_;
+    std::string workdir_;
+    std::vector<simpeer_t>  peers_;
+    std::map<uint64_t,int>  addrs_;
+    /** Datagrams in flight, by arrival time and then send order */
+    std::map<std::pair<tint,uint64_t>,simdgram_t>   inflight_;
+    /** Datagram being delivered by RecvMsg */
+    simdgram_t  *delivering_;
+    bool        self_conn_ok_;
+    int         tracker_;       // peer index of the tracker, -1 if none
+
+    uint64_t    Random();
+    double      Uniform();
+    int         FindPeer(uint32_t addr, uint16_t port);
+    int         AddPeer(const simlink_t &link, int host);
+    void        StartPeers();
+    bool        CheckComplete();
+    tint        NextEventTime();
+    void        Deliver(simdgram_t &dgram);
+    void        FireTimers();
+};
+
+}
+
+#endif
@@ -8,6 +8,7 @@
  *
  */
 
+#include <sstream>
 #include "swift.h"
 #include <event2/http.h>
 
@@ -188,15 +189,14 @@ void StatsGetSpeedCallback(struct evhttp_request *evreq)
     statsgw_last_time = nu;
 
     // Arno: PDD+ wants content speeds too
-    double contentdownspeed = 0.0, contentupspeed = 0.0;
+    double contentdownspeed = Channel::global_speed[DDIR_DOWNLOAD].GetSpeed();
+    double contentupspeed = Channel::global_speed[DDIR_UPLOAD].GetSpeed();
     uint32_t nleech=0,nseed=0;
     for (int i=0; i<swift::FileTransfer::files.size(); i++)
     {
     	FileTransfer *ft = swift::FileTransfer::files[i];
     	if (ft != NULL)
     	{
-    		contentdownspeed += ft->GetCurrentSpeed(DDIR_DOWNLOAD);
-    		contentupspeed += ft->GetCurrentSpeed(DDIR_UPLOAD);
     		nleech += ft->GetNumLeechers();
     		nseed += ft->GetNumSeeders();
     	}
@@ -228,6 +228,58 @@ void StatsGetSpeedCallback(struct evhttp_request *evreq)
 }
 
 
+void StatsGetMemoryCallback(struct evhttp_request *evreq)
+{
+	// Memory footprint per transfer, broken down by component, in bytes
+	std::ostringstream oss;
+	size_t total = 0;
+	bool first = true;
+	oss << "{\"success\": \"true\", \"swarms\": [";
+	for (int i=0; i<swift::FileTransfer::files.size(); i++)
+	{
+		FileTransfer *ft = swift::FileTransfer::files[i];
+		if (ft == NULL)
+			continue;
+		memusage_t mu;
+		ft->GetMemoryUsage(mu);
+		total += mu.total();
+		if (!first)
+			oss << ", ";
+		first = false;
+		oss << "{\"roothash\": \"" << ft->root_hash().hex() << "\", ";
+		oss << "\"total\": " << mu.total() << ", ";
+		oss << "\"hashtree\": " << mu.hashtree << ", ";
+		oss << "\"mhash\": " << mu.mhash << ", ";
+		oss << "\"picker\": " << mu.picker << ", ";
+		oss << "\"avail\": " << mu.avail << ", ";
+		oss << "\"channels\": " << mu.channels << ", ";
+		oss << "\"chanbinmaps\": " << mu.chanbinmaps << ", ";
+		oss << "\"chanqueues\": " << mu.chanqueues << ", ";
+		oss << "\"nchannels\": " << mu.nchannels << "}";
+	}
+	oss << "], \"total\": " << total << "}";
+	std::string memstr = oss.str();
+
+	char contlenstr[1024];
+	sprintf(contlenstr,"%lu",(unsigned long)memstr.length());
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(evreq);
+	evhttp_add_header(headers, "Connection", "close" );
+	evhttp_add_header(headers, "Content-Type", "application/json" );
+	evhttp_add_header(headers, "Content-Length", contlenstr );
+	evhttp_add_header(headers, "Accept-Ranges", "none" );
+
+	struct evbuffer *evb = evbuffer_new();
+	int ret = evbuffer_add(evb,memstr.c_str(),memstr.length());
+	if (ret < 0) {
+		print_error("statsgw: GetMemoryCallback: error evbuffer_add");
+		return;
+	}
+
+	evhttp_send_reply(evreq, 200, "OK", evb);
+	evbuffer_free(evb);
+}
+
+
 void StatsGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 
     dprintf("%s @%i http new request\n",tintstr(),statsgw_reqs_count);
@@ -248,6 +300,10 @@ void StatsGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
     {
     	StatsGetSpeedCallback(evreq);
     }
+    else if (strstr(uri,"get_memory_info") != NULL)
+    {
+    	StatsGetMemoryCallback(evreq);
+    }
     else if (!strncmp(uri,"/webUI/exit",strlen("/webUI/exit")) || statsgw_quit_process)
     {
     	statsgw_quit_process = true;
@@ -12,6 +12,9 @@
 #include "swift.h"
 #include <cfloat>
 #include <sstream>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 using namespace swift;
 
@@ -29,6 +32,11 @@ int OpenSwiftDirectory(std::string dirname, Address tracker, bool force_check_di
 void ReportCallback(int fd, short event, void *arg);
 void EndCallback(int fd, short event, void *arg);
 void RescanDirCallback(int fd, short event, void *arg);
+void RescanSwiftDirectory();
+bool InstallSeedDirWatcher(std::string dirname);
+void SeedDirWatchCallback(int fd, short event, void *arg);
+void SeedDirPendingCallback(int fd, short event, void *arg);
+void SeedDirIdleCallback(int fd, short event, void *arg);
 int CreateMultifileSpec(std::string specfilename, int argc, char *argv[], int argidx);
 void TimerCallback(int fd, short event, void *arg);
 
@@ -43,6 +51,10 @@ void CmdGwUpdateDLStatesCallback();
 
 // Global variables
 struct event evreport, evrescan, evend, evtimer;
+// SEEDDIR: directory watcher and the files it found, opened one per loop
+struct event evwatch, evwatchpending, evwatchidle;
+evutil_socket_t watch_fd = -1;
+std::deque<std::string> watch_pending;
 int single_fd = -1;
 bool file_enable_checkpoint = false;
 bool file_checkpointed = false;
@@ -55,6 +67,7 @@ bool do_nat_test = false;
 bool generate_multifile=false;
 
 std::string scan_dirname="";
+bool scan_lazy=false;
 uint32_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
 Address tracker;
 
@@ -94,6 +107,13 @@ int utf8main (int argc, char** argv)
         {"urlfilehex",required_argument, 0, '2'},   // SWIFTPROCUNICODE
         {"zerosdirhex",required_argument, 0, '3'},  // SWIFTPROCUNICODE
         {"zerostimeout",required_argument, 0, 'T'},  // ZEROSTATE
+        {"trace",   required_argument, 0, 'x'}, // TRACE
+        {"tracecats",required_argument, 0, 'X'}, // TRACE
+        {"lazy",    no_argument, 0, 'L'}, // SEEDDIR
+        {"maxchannels",required_argument, 0, 'K'},
+        {"maxopen", required_argument, 0, 'O'}, // SEEDDIR
+        {"tracker-only",required_argument, 0, 'R'}, // TRACKER
+        {"zerostateless",no_argument, 0, 'Z'}, // COOKIE
         {0, 0, 0, 0}
     };
 
@@ -107,12 +127,16 @@ int utf8main (int argc, char** argv)
     tint wait_time = 0;
     double maxspeed[2] = {DBL_MAX,DBL_MAX};
     tint zerostimeout = TINT_NEVER;
+    std::string tracefilename = "";
+    uint32_t tracecats = TRACE_CAT_ALL;
+    uint32_t tracker_members = 0;
+    bool zerostateless = false;
 
     LibraryInit();
     Channel::evbase = event_base_new();
 
     int c,n;
-    while ( -1 != (c = getopt_long (argc, argv, ":h:f:d:l:t:D:pg:s:c:o:u:y:z:wBNHmM:e:r:jC:1:2:3:T:", long_options, 0)) ) {
+    while ( -1 != (c = getopt_long (argc, argv, ":h:f:d:l:t:D:pg:s:c:o:u:y:z:wBNHmM:e:r:jC:1:2:3:T:x:X:LK:O:R:Z", long_options, 0)) ) {
         switch (c) {
             case 'h':
                 if (strlen(optarg)!=40)
@@ -246,6 +270,31 @@ int utf8main (int argc, char** argv)
             case '3': // ZEROSTATE // SWIFTPROCUNICODE
                 zerostatedir = hex2bin(strdup(optarg));
                 break;
+            case 'x': // TRACE
+                tracefilename = optarg;
+                break;
+            case 'L': // SEEDDIR
+                scan_lazy = true;
+                break;
+            case 'K':
+                Channel::MAX_CHANNELS = atoi(optarg);
+                break;
+            case 'O': // SEEDDIR
+                SeedIndex::GetInstance()->SetMaxOpen(atoi(optarg));
+                break;
+            case 'Z': // COOKIE
+                zerostateless = true;
+                break;
+            case 'R': // TRACKER
+                tracker_members = atoi(optarg);
+                if (tracker_members == 0)
+                    quit("tracker-only needs the number of members to remember\n");
+                break;
+            case 'X': // TRACE
+                tracecats = TraceParseCategories(optarg);
+                if (tracecats == TRACE_CAT_NONE)
+                    quit("tracecats must be a list of send,recv,data,ack,have,hint,hash,pex,loss,all\n");
+                break;
             case 'T': // ZEROSTATE
             	double t=0.0;
             	n = sscanf(optarg,"%lf",&t);
@@ -271,9 +320,17 @@ int utf8main (int argc, char** argv)
 	if (httpgw_enabled)
 		fprintf(stderr,"CWD %s\n",getcwd_utf8().c_str() );
 
+    if (tracefilename != "" && !TraceOpen(tracefilename,tracecats,Channel::epoch))
+        quit("cannot open trace file %s\n",tracefilename.c_str());
+
     if (bindaddr!=Address()) { // seeding
-        if (Listen(bindaddr)<=0)
+        evutil_socket_t sock = Listen(bindaddr);
+        if (sock<=0)
             quit("cant listen to %s\n",bindaddr.str())
+        if (tracker_members > 0) // TRACKER
+            new Tracker(sock,tracker_members);
+    } else if (tracker_members > 0) {
+        quit("tracker-only needs a --listen address\n");
     } else if (tracker!=Address() || httpgw_enabled || cmdgw_enabled) { // leeching
     	evutil_socket_t sock = INVALID_SOCKET;
         for (int i=0; i<=10; i++) {
@@ -304,6 +361,7 @@ int utf8main (int argc, char** argv)
     ZeroState *zs = ZeroState::GetInstance();
     zs->SetContentDir(zerostatedir);
     zs->SetConnectTimeout(zerostimeout);
+    zs->SetStateless(zerostateless);
 
 
     if (!cmdgw_enabled)
@@ -316,6 +374,8 @@ int utf8main (int argc, char** argv)
 				// Single file
 				ret = HandleSwiftFile(filename,root_hash,trackerargstr,printurl,urlfilename,maxspeed);
 			}
+			else if (scan_dirname != "" && scan_lazy)
+				ret = SeedIndex::GetInstance()->Scan(scan_dirname,chunk_size) < 0 ? -1 : 1;
 			else if (scan_dirname != "")
 				ret = OpenSwiftDirectory(scan_dirname,Address(),false,chunk_size);
 			else
@@ -354,10 +414,17 @@ int utf8main (int argc, char** argv)
 			fprintf(stderr,"  -u, --uprate\tupload rate limit in KiB/s (default: unlimited)\n");
 			fprintf(stderr,"  -y, --downrate\tdownload rate limit in KiB/s (default: unlimited)\n");
 			fprintf(stderr,"  -w, --wait\tlimit running time, e.g. 1[DHMs] (default: infinite with -l, -g)\n");
+			fprintf(stderr,"  -L, --lazy\twith -d, open files only when a peer asks for them\n");
+			fprintf(stderr,"  -O, --maxopen\twith -L, files kept open at most, least recently used closed first (default: unlimited)\n");
+			fprintf(stderr,"  -Z, --zerostateless\tserve zero state content without a channel per peer\n");
+			fprintf(stderr,"  -R, --tracker-only\tonly answer handshakes on the listen port with peers of the same swarm, remembering at most this many\n");
+			fprintf(stderr,"  -K, --maxchannels\tchannels over all files at most, least useful closed first (default: unlimited)\n");
 			fprintf(stderr,"  -H, --checkpoint\tcreate checkpoint of file when complete for fast restart\n");
 			fprintf(stderr,"  -z, --chunksize\tchunk size in bytes (default: %d)\n", SWIFT_DEFAULT_CHUNK_SIZE);
 			fprintf(stderr,"  -m, --printurl\tcompose URL from tracker, file and chunksize\n");
 			fprintf(stderr,"  -M, --multifile\tcreate multi-file spec with given files\n");
+			fprintf(stderr,"  -x, --trace\tfile name for binary event trace, decode with tracedump (default: none)\n");
+			fprintf(stderr,"  -X, --tracecats\tcomma separated trace categories: send,recv,data,ack,have,hint,hash,pex,loss,all (default: all)\n");
 			return 1;
 		}
     }
@@ -385,7 +452,7 @@ int utf8main (int argc, char** argv)
 
 
 		// Arno:
-		if (scan_dirname != "") {
+		if (scan_dirname != "" && !InstallSeedDirWatcher(scan_dirname)) {
 			evtimer_assign(&evrescan, Channel::evbase, RescanDirCallback, NULL);
 			evtimer_add(&evrescan, tint2tv(RESCAN_DIR_INTERVAL*TINT_SEC));
 		}
@@ -406,6 +473,7 @@ int utf8main (int argc, char** argv)
 
     if (Channel::debug_file)
         fclose(Channel::debug_file);
+    TraceClose();
 
     swift::Shutdown();
 
@@ -577,13 +645,14 @@ void ReportCallback(int fd, short event, void *arg) {
 		if (report_progress) {
 			fprintf(stderr,
 				"%s %lli of %lli (seq %lli) %lli dgram %lli bytes up, "	\
-				"%lli dgram %lli bytes down mptp[send:%lli,%lli;recv:%lli,%lli]\n",
+				"%lli dgram %lli bytes down mptp[send:%lli,%lli;recv:%lli,%lli] clock %llu\n",
 				IsComplete(single_fd ) ? "DONE" : "done",
 				Complete(single_fd), Size(single_fd), SeqComplete(single_fd),
 				Channel::global_dgrams_up, Channel::global_raw_bytes_up,
 				Channel::global_dgrams_down, Channel::global_raw_bytes_down,
 				Channel::global_buffers_up, Channel::global_syscalls_up,
-				Channel::global_buffers_down, Channel::global_syscalls_down);
+				Channel::global_buffers_down, Channel::global_syscalls_down,
+				(unsigned long long)Channel::global_clock_reads);
 		}
 
         FileTransfer *ft = FileTransfer::file(single_fd);
@@ -647,7 +716,10 @@ void ReportCallback(int fd, short event, void *arg) {
 }
 
 void TimerCallback(int fd, short event, void *arg) {
+	Channel::Time();
 	Channel::messageQueue.Flush();
+	// TRACE: drain per-thread rings to disk before they fill up
+	TraceFlush();
 	evtimer_add(&evtimer, tint2tv(TIMER_USEC));
 }
 
@@ -664,14 +736,168 @@ void RescanDirCallback(int fd, short event, void *arg) {
 	// by running swift separately and then copy content + *.m* to scanned dir,
 	// such that a fast restore from checkpoint is done.
 	//
-	OpenSwiftDirectory(scan_dirname,tracker,false,chunk_size);
-
-	CleanSwiftDirectory(scan_dirname);
+	Channel::Time();
+	RescanSwiftDirectory();
 
 	evtimer_add(&evrescan, tint2tv(RESCAN_DIR_INTERVAL*TINT_SEC));
 }
 
 
+void RescanSwiftDirectory()
+{
+	if (scan_lazy)
+		// Also closes lazily opened transfers that became idle
+		SeedIndex::GetInstance()->Scan(scan_dirname,chunk_size);
+	else
+	{
+		OpenSwiftDirectory(scan_dirname,tracker,false,chunk_size);
+
+		CleanSwiftDirectory(scan_dirname);
+	}
+}
+
+
+/*
+ * SEEDDIR: On Linux the scanned dir is watched with inotify instead of being
+ * rescanned every RESCAN_DIR_INTERVAL. A file is opened (or indexed, with
+ * --lazy) once it is closed after writing or moved in, and its transfer is
+ * closed when it is deleted or moved out. New files are queued and taken
+ * one per event loop iteration, so a burst of them does not stall the
+ * loop, although hashchecking a single big file still does: better still
+ * copy content + *.m* into the dir. Returns false if the dir cannot be
+ * watched, the caller then falls back to rescanning.
+ */
+bool InstallSeedDirWatcher(std::string dirname)
+{
+#ifdef __linux__
+	watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (watch_fd < 0) {
+		print_error("cannot init inotify, rescanning instead");
+		return false;
+	}
+	if (inotify_add_watch(watch_fd,dirname.c_str(),IN_CLOSE_WRITE|IN_MOVED_TO|IN_DELETE|IN_MOVED_FROM) < 0) {
+		print_error("cannot watch dir, rescanning instead");
+		close(watch_fd);
+		watch_fd = -1;
+		return false;
+	}
+	event_assign(&evwatch,Channel::evbase,watch_fd,EV_READ|EV_PERSIST,SeedDirWatchCallback,NULL);
+	event_add(&evwatch,NULL);
+	evtimer_assign(&evwatchpending,Channel::evbase,SeedDirPendingCallback,NULL);
+	// No more rescans to close idle lazily opened transfers, do that alone
+	evtimer_assign(&evwatchidle,Channel::evbase,SeedDirIdleCallback,NULL);
+	if (scan_lazy)
+		evtimer_add(&evwatchidle,tint2tv(RESCAN_DIR_INTERVAL*TINT_SEC));
+	if (!quiet)
+		fprintf(stderr,"swift: watching %s\n", dirname.c_str() );
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+void SeedDirWatchCallback(int fd, short event, void *arg)
+{
+#ifdef __linux__
+	Channel::Time();
+
+	char buf[64*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(fd,buf,sizeof(buf))) > 0)
+	{
+		for (char *p=buf; p<buf+len; )
+		{
+			struct inotify_event *ie = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event)+ie->len;
+
+			if (ie->mask & IN_Q_OVERFLOW) {
+				// Lost track of events
+				fprintf(stderr,"swift: watch: overflow, rescanning\n");
+				watch_pending.clear();
+				RescanSwiftDirectory();
+				continue;
+			}
+			if (ie->mask & IN_IGNORED) {
+				// Dir itself went away or was unmounted, back to rescanning
+				fprintf(stderr,"swift: watch: lost %s, rescanning\n", scan_dirname.c_str() );
+				event_del(&evwatch);
+				evtimer_del(&evwatchpending);
+				evtimer_del(&evwatchidle);
+				close(watch_fd);
+				watch_fd = -1;
+				watch_pending.clear();
+				evtimer_assign(&evrescan, Channel::evbase, RescanDirCallback, NULL);
+				evtimer_add(&evrescan, tint2tv(RESCAN_DIR_INTERVAL*TINT_SEC));
+				return;
+			}
+			if (ie->len == 0 || (ie->mask & IN_ISDIR))
+				continue;
+			std::string filename = ie->name;
+			if (filename.rfind(".mhash") != std::string::npos || filename.rfind(".mbinmap") != std::string::npos)
+				continue;
+
+			std::deque<std::string>::iterator iter = std::find(watch_pending.begin(),watch_pending.end(),filename);
+			if (ie->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+				if (iter == watch_pending.end())
+					watch_pending.push_back(filename);
+			}
+			else if (ie->mask & (IN_DELETE|IN_MOVED_FROM)) {
+				if (iter != watch_pending.end())
+					watch_pending.erase(iter);
+				std::string path = scan_dirname+FILE_SEP+filename;
+				if (scan_lazy)
+					SeedIndex::GetInstance()->Remove(filename);
+				else
+					for (int i=0; i<FileTransfer::files.size(); i++) {
+						FileTransfer *ft = FileTransfer::files[i];
+						if (ft != NULL && ft->GetStorage()->GetOSPathName() == path) {
+							fprintf(stderr,"swift: watch: Deleting transfer %d\n", ft->fd() );
+							swift::Close(ft->fd());
+							break;
+						}
+					}
+			}
+		}
+	}
+	if (!watch_pending.empty() && !evtimer_pending(&evwatchpending,NULL))
+		evtimer_add(&evwatchpending,tint2tv(0));
+#endif
+}
+
+
+void SeedDirPendingCallback(int fd, short event, void *arg)
+{
+	Channel::Time();
+	if (watch_pending.empty())
+		return;
+
+	std::string filename = watch_pending.front();
+	watch_pending.pop_front();
+	std::string path = scan_dirname+FILE_SEP+filename;
+	if (file_exists_utf8(path) == 1)
+	{
+		if (scan_lazy)
+			SeedIndex::GetInstance()->Add(filename,chunk_size);
+		else {
+			int fd = OpenSwiftFile(path,Sha1Hash::ZERO,tracker,false,chunk_size);
+			if (fd >= 0)
+				Checkpoint(fd);
+		}
+	}
+	if (!watch_pending.empty())
+		evtimer_add(&evwatchpending,tint2tv(0));
+}
+
+
+void SeedDirIdleCallback(int fd, short event, void *arg)
+{
+	Channel::Time();
+	SeedIndex::GetInstance()->CloseIdle();
+	evtimer_add(&evwatchidle,tint2tv(RESCAN_DIR_INTERVAL*TINT_SEC));
+}
+
+
 #include <iostream>
 
 // MULTIFILE
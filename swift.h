@@ -67,6 +67,7 @@
 #include "avgspeed.h"
 // Arno, 2012-05-21: MacOS X has an Availability.h :-(
 #include "avail.h"
+#include "trace.h"
 #include "../kernel/mptp.h"
 
 namespace swift {
@@ -87,6 +88,28 @@ namespace swift {
 
 #define SWIFT_URI_SCHEME			"tswift"
 
+// Rolling HAVE queue: trim once the log has this many entries, keeping what
+// the slowest channel still has to announce, but never more than MAX.
+#define SWIFT_HAVE_LOG_TRIM			1024
+#define SWIFT_HAVE_LOG_MAX			(64*1024)
+
+// Wire encodings, announced in a VERSION message that goes in a datagram of
+// its own once the channel is established, at most SWIFT_VERSION_TRIES times
+// until the peer's arrives. COMPACT: varint bins delta coded per datagram, 32-bit ACK
+// timestamps and runs of uncle hashes. A peer that does not announce one
+// (legacy) gets the original fixed size fields. MUX: as COMPACT, and the
+// small control-only datagrams for several channels to the same peer that
+// are queued together go out as one datagram.
+#define SWIFT_WIRE_LEGACY			0
+#define SWIFT_WIRE_COMPACT			1
+#define SWIFT_WIRE_MUX				2
+#define SWIFT_VERSION_TRIES			3
+
+// Channel id of a multiplexed datagram. It is followed by parts of a
+// 32-bit peer channel id, a 16-bit length and that many bytes of messages,
+// each handled as if received in a datagram of its own.
+#define SWIFT_MUX_CHANNEL_ID		0xfffffffe
+
 
 /** IPv4 address, just a nice wrapping around struct sockaddr_in. */
     struct Address {
@@ -226,6 +249,78 @@ namespace swift {
     typedef std::deque<bin_t> binqueue;
     typedef Address   Address;
 
+    /** Estimate of the heap memory held by a tbqueue: std::deque allocates
+        its elements in fixed size nodes plus a map of node pointers. */
+    inline size_t tbqueue_mem_size (const tbqueue& q) {
+        const size_t node = 512;
+        size_t nodes = q.size()*sizeof(tintbin)/node + 1;
+        return nodes*(node+sizeof(void *));
+    }
+
+    /** tbqueue that holds no memory while empty. An empty std::deque still
+        has a node and a map, and the five of them were most of an idle
+        channel. The deque is allocated on the first push and given back by
+        release(), which channels call once idle (KEEP_ALIVE_CONTROL). */
+    class lazytbqueue {
+        tbqueue     *q_;
+        tbqueue&    get() { if (q_ == NULL) q_ = new tbqueue(); return *q_; }
+    public:
+        typedef tbqueue::iterator iterator;
+        lazytbqueue() : q_(NULL) {}
+        lazytbqueue(const lazytbqueue& b) : q_(b.q_ ? new tbqueue(*b.q_) : NULL) {}
+        ~lazytbqueue() { delete q_; }
+        lazytbqueue& operator = (const lazytbqueue& b) {
+            if (this != &b) {
+                delete q_;
+                q_ = b.q_ ? new tbqueue(*b.q_) : NULL;
+            }
+            return *this;
+        }
+        bool        empty () const { return q_ == NULL || q_->empty(); }
+        size_t      size () const { return q_ ? q_->size() : 0; }
+        tintbin&    front () { return q_->front(); }
+        tintbin&    back () { return q_->back(); }
+        tintbin&    operator [] (size_t i) { return (*q_)[i]; }
+        iterator    begin () { return q_ ? q_->begin() : iterator(); }
+        iterator    end () { return q_ ? q_->end() : iterator(); }
+        void        push_back (const tintbin& tb) { get().push_back(tb); }
+        void        push_front (const tintbin& tb) { get().push_front(tb); }
+        void        pop_front () { q_->pop_front(); }
+        void        release () {
+            if (q_ != NULL && q_->empty()) {
+                delete q_;
+                q_ = NULL;
+            }
+        }
+        size_t      mem_size () const { return q_ ? sizeof(tbqueue)+tbqueue_mem_size(*q_) : 0; }
+    };
+
+    /** Memory footprint in bytes, broken down by component. Filled in per
+        channel by Channel::GetMemoryUsage() and per transfer (including its
+        channels) by FileTransfer::GetMemoryUsage(). */
+    struct memusage_t {
+        size_t  hashtree;       // own ack_out_, hash verification binmaps, HAVE log
+        size_t  mhash;          // memory mapped .mhash file
+        size_t  picker;         // piece picker binmaps and hint queue
+        size_t  avail;          // Availability::avail_ array
+        size_t  channels;       // Channel objects themselves
+        size_t  chanbinmaps;    // per channel ack_in_
+        size_t  chanqueues;     // per channel data/hint/pex tbqueues
+        int     nchannels;
+        memusage_t() : hashtree(0), mhash(0), picker(0), avail(0),
+            channels(0), chanbinmaps(0), chanqueues(0), nchannels(0) {}
+        size_t  total () const {
+            return hashtree+mhash+picker+avail+channels+chanbinmaps+chanqueues;
+        }
+        memusage_t& operator += (const memusage_t& b) {
+            hashtree += b.hashtree; mhash += b.mhash; picker += b.picker;
+            avail += b.avail; channels += b.channels;
+            chanbinmaps += b.chanbinmaps; chanqueues += b.chanqueues;
+            nchannels += b.nchannels;
+            return *this;
+        }
+    };
+
     /** A heap (priority queue) for timestamped bin numbers (tintbins). */
     class tbheap {
         tbqueue data_;
@@ -265,7 +360,14 @@ namespace swift {
         SWIFT_MSGTYPE_RCVD = 9,
         SWIFT_RANDOMIZE = 10, //FRAGRAND
         SWIFT_VERSION = 11, // Arno, 2011-10-19: TODO to match RFC-rev-03
-        SWIFT_MESSAGE_COUNT = 12
+        // SWIFT_WIRE_COMPACT only, sent after the peer announced it
+        SWIFT_COMPACT_DATA = 12,
+        SWIFT_COMPACT_ACK = 13,
+        SWIFT_COMPACT_HAVE = 14,
+        SWIFT_COMPACT_HASH = 15,
+        SWIFT_COMPACT_HINT = 16,
+        SWIFT_COMPACT_UNCLES = 17,
+        SWIFT_MESSAGE_COUNT = 18
     } messageid_t;
 
     typedef enum {
@@ -279,6 +381,7 @@ namespace swift {
     class Channel;
     typedef std::vector<Channel *>	channels_t;
     typedef void (*ProgressCallback) (int transfer, bin_t bin);
+    typedef void (*RangeCallback) (int transfer, uint64_t offset, uint64_t length, void *arg);
     class Storage;
 
     /** A class representing single file transfer. */
@@ -309,11 +412,14 @@ namespace swift {
         // Jori
         int             RevealChannel (int& i);
         // Gertjan
+        /** Id of a random established channel other than own_id, -1 if none. */
         int             RandomChannel (int own_id);
 
 
         /** Find transfer by the root hash. */
         static FileTransfer* Find (const Sha1Hash& hash);
+        /** Find transfer by the root hash, preferring the one bound to sock. */
+        static FileTransfer* Find (const Sha1Hash& hash, evutil_socket_t sock);
         /** Find transfer by the file descriptor. */
         static FileTransfer* file (int fd) {
             return fd<files.size() ? files[fd] : NULL;
@@ -324,7 +430,7 @@ namespace swift {
         /** Piece picking strategy used by this transfer. */
         PiecePicker&    picker () { return *picker_; }
         /** The number of channels working for this transfer. */
-        int             channel_count () const { return hs_in_.size(); }
+        int             channel_count () const { return mychannels_.size(); }
         /** Hash tree checked file; all the hashes and data are kept here. */
         HashTree *       hashtree() { return hashtree_; }
         /** File descriptor for the data file. */
@@ -339,8 +445,6 @@ namespace swift {
         void			OnRecvData(int n);
         /** Arno: Call when n bytes are sent. */
         void			OnSendData(int n);
-        /** Arno: Call when no bytes are sent due to rate limiting. */
-        void 			OnSendNoData();
         /** Arno: Return current speed for the given direction in bytes/s */
 		double 			GetCurrentSpeed(data_direction_t ddir);
 		/** Arno: Return maximum speed for the given direction in bytes/s */
@@ -351,8 +455,40 @@ namespace swift {
 		uint32_t		GetNumLeechers();
 		/** Arno: Return the number of seeders current channeled with. */
 		uint32_t		GetNumSeeders();
+
+		// CHANREG: indexes over mychannels_, kept up to date by Channel
+		/** Register a new channel. */
+		void			AddChannel(Channel *c);
+		/** Unregister a channel that is going away. */
+		void			RemoveChannel(Channel *c);
+		/** Recheck whether c is established and its peer complete. Call
+		 * when its handshake state or ack_in_ changed. */
+		void			UpdateChannel(Channel *c);
+		/** Set the recv_peer() of c to addr and index c under it as well.
+		 * Indexes each channel once per address, however often called. */
+		void			IndexRecvPeer(Channel *c, const Address &addr);
 		/** Arno: Return the set of Channels for this transfer. MORESTATS */
 		channels_t GetChannels() { return mychannels_; }
+		/** Return a counter that changes whenever a channel is added or
+		 * removed or a peer becomes a seeder, such that status reporters
+		 * can skip GetNumLeechers()/GetNumSeeders() when nothing changed. */
+		uint32_t		GetPeersVersion();
+		void			OnPeersChanged() { peers_version_++; }
+		/** Last time data was sent or received, for unloading cold
+		 * transfers first. */
+		tint			GetLastDataTime() { return last_data_time_; }
+		/** Add the memory held by this transfer and its channels to mu. */
+		void			GetMemoryUsage(memusage_t &mu);
+
+		/** Rolling HAVE queue: bins completed since the transfer started,
+		 * in order. Channels announce them from their own position in the
+		 * log, positions count from the start of the transfer. Each entry
+		 * keeps the id of the channel the chunk came in on, that one ACKs it. */
+		void			AddHaveLog(bin_t pos, uint32_t channel);
+		uint64_t		have_log_begin() { return have_log_base_; }
+		uint64_t		have_log_end() { return have_log_base_+have_log_.size(); }
+		bin_t			have_log(uint64_t i) { return have_log_[i-have_log_base_].bin; }
+		uint32_t		have_log_channel(uint64_t i) { return have_log_[i-have_log_base_].channel; }
 
 		/** Arno: set the tracker for this transfer. Reseting it won't kill
 		 * any existing connections.
@@ -373,9 +509,26 @@ namespace swift {
 		// MULTIFILE
 		Storage * GetStorage() { return storage_; }
 
+		/** Socket for the channels this transfer opens, by default
+		 * Channel::default_socket(). Set per transfer when several peers
+		 * run in one process, as in the simulator. */
+		void SetSocket(evutil_socket_t sock) { sock_ = sock; }
+		evutil_socket_t GetSocket();
+
 		// SAFECLOSE
 		static void LibeventCleanCallback(int fd, short event, void *arg);
 
+		// PROGRESS
+		/** Note new data, cover being its cover bin in ack_out(). The
+		 * progress callbacks it concerns get it after the datagrams of
+		 * this event loop iteration are done, once per callback with the
+		 * largest cover bin seen. Awaited ranges it touches are checked
+		 * for completion then as well. */
+		void NotifyProgress(bin_t cover);
+		/** Call the progress callbacks for what was noted since last time. */
+		static void DeliverProgress();
+		static void LibeventProgressCallback(int fd, short event, void *arg);
+
 		//ZEROSTATE
 		/** Returns whether this FileTransfer is running in zero-state mode,
 		 * meaning that the hash tree is not mmapped into memory but read
@@ -396,9 +549,6 @@ namespace swift {
         /** Piece picker strategy. */
         PiecePicker*    picker_;
 
-        /** Channels working for this transfer. */
-        binqueue        hs_in_;			// Arno, 2011-10-03: Should really be queue of channel ID (=uint32_t)
-
         /** Messages we are accepting.    */
         uint64_t        cap_out_;
 
@@ -408,16 +558,54 @@ namespace swift {
         /** Availability in the swarm */
         Availability* 	availability_;
 
-#define SWFT_MAX_TRANSFER_CB 8
-        ProgressCallback callbacks[SWFT_MAX_TRANSFER_CB];
-        uint8_t         cb_agg[SWFT_MAX_TRANSFER_CB];
-        int             cb_installed;
+        // PROGRESS: subscribers, see NotifyProgress()
+        struct progress_sub_t {
+            ProgressCallback cb;
+            uint8_t         agg;        // minimal layer of the cover bin
+            uint64_t        startoff;   // bytes of interest, inclusive
+            uint64_t        endoff;
+            bin_t           pending;    // to deliver, NONE if nothing
+        };
+        std::vector<progress_sub_t> progress_subs_;
+        // Byte ranges waited for, see swift::AwaitRange()
+        struct range_wait_t {
+            uint64_t        offset;
+            uint64_t        length;
+            RangeCallback   cb;
+            void            *arg;
+            bool            touched;    // new data in range since last check
+            bool            prioritized;
+        };
+        std::vector<range_wait_t> range_waits_;
+        /** (Un)prioritize the chunks of w in the picker. */
+        void            PrioritizeRange(range_wait_t &w, bool on);
+        bool            progress_pending_;
+        static std::vector<int> progress_pending_fds_;
+        static struct event *evprogress_;
 
 		// RATELIMIT
-        channels_t			mychannels_; // Arno, 2012-01-31: May be duplicate of hs_in_
+        channels_t			mychannels_;
+        // CHANREG
+        /** mychannels_ by AddressKey() of peer() and recv_peer() */
+        std::multimap<uint64_t,Channel *> chanbyaddr_;
+        /** Drop the entries of c under the key of addr. */
+        void            UnindexChannel(Channel *c, const Address &addr);
+        /** Established channels, for sampling by RandomChannel() */
+        channels_t			established_;
+        /** Channels whose peer has everything, as of nseeders_peaks_ peaks */
+        uint32_t			nseeders_;
+        int					nseeders_peaks_;
         MovingAverageSpeed	cur_speed_[2];
         double				max_speed_[2];
-        int					speedzerocount_;
+        uint32_t			peers_version_;
+        tint				last_data_time_;
+
+        struct havelog_t {
+            bin_t		bin;
+            uint32_t	channel;
+        };
+        std::deque<havelog_t>	have_log_;
+        uint64_t			have_log_base_;
 
         // SAFECLOSE
         struct event 		evclean_;
@@ -425,11 +613,14 @@ namespace swift {
         Address 			tracker_; // Tracker for this transfer
         tint				tracker_retry_interval_;
         tint				tracker_retry_time_;
+        tint				tracker_announce_time_; // TRACKER
 
         // MULTIFILE
         Storage				*storage_;
         int					fd_;
 
+        evutil_socket_t		sock_;
+
         //ZEROSTATE
         bool				zerostate_;
 
@@ -450,8 +641,10 @@ namespace swift {
         friend uint64_t  SeqComplete (int fdes, int64_t offset);
         friend int     Open (const char* filename, const Sha1Hash& hash, Address tracker, bool force_check_diskvshash, bool check_netwvshash, uint32_t chunk_size);
         friend void    Close (int fd) ;
-        friend void AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg);
+        friend void AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg,uint64_t startoff,uint64_t endoff);
         friend void RemoveProgressCallback (int transfer,ProgressCallback cb);
+        friend int  AwaitRange (int transfer,uint64_t offset,uint64_t length,RangeCallback cb,void *arg);
+        friend void CancelRange (int transfer,RangeCallback cb,void *arg);
         friend void ExternallyRetrieved (int transfer,bin_t piece);
     };
 
@@ -475,6 +668,19 @@ namespace swift {
          *  @param  offbin		bin number of new playback pos
          *  @param  whence      only SEEK_CUR supported */
         virtual int Seek(bin_t offbin, int whence) = 0;
+        /** Pick from range before anything else, until it is complete or
+         *  Unprioritize()d. Used for swift::AwaitRange(). */
+        virtual void Prioritize(bin_t range) { priority_.push_back(range); }
+        virtual void Unprioritize(bin_t range);
+        /** Returns the heap memory held by the picker in bytes. */
+        virtual size_t mem_size () = 0;
+    protected:
+        /** Ranges from Prioritize(), in order */
+        std::vector<bin_t> priority_;
+        /** First bin in offer but not in hinted from the prioritized ranges,
+         *  dropping the ranges that are filled in complete. Pickers call it
+         *  before their own strategy. */
+        bin_t PickPriority (binmap_t& offer, binmap_t& hinted, binmap_t* complete, uint64_t twist);
     };
 
 
@@ -485,10 +691,25 @@ namespace swift {
     };
 
 
+    /** Replacement for the sendmsg()/recvmsg() calls on swift's sockets,
+        with the same multi-destination (sockaddr_mptp) semantics: SendMsg
+        sets dests[i].bytes, RecvMsg sets count and dests[i]. Installed in
+        Channel::transport by the in-process swarm simulator (sim.h). */
+    class Transport {
+    public:
+        virtual int SendMsg (evutil_socket_t sock, struct msghdr *msg) = 0;
+        virtual int RecvMsg (evutil_socket_t sock, struct msghdr *msg) = 0;
+        virtual ~Transport() {}
+    };
+    class Simulator;
+    class HotPathBench;
+
+
     /**    swift channel's "control block"; channels loosely correspond to TCP
 	   connections or FTP sessions; one channel is created for one file
 	   being transferred between two peers. As we don't need buffers and
 	   lots of other TCP stuff, sizeof(Channel+members) must be below 1K.
+	   The queues only take memory while data flows, see Compact().
 	   Normally, API users do not deal with this class. */
 	class MessageQueue;
     class Channel {
@@ -513,10 +734,15 @@ namespace swift {
         static const char* SEND_CONTROL_MODES[];
 
 		static MessageQueue messageQueue;
+		/** Datagram transport to use instead of the sockets, NULL normally. */
+		static Transport *transport;
 
 	    static tint epoch, start;
 	    static uint64_t global_dgrams_up, global_dgrams_down, global_raw_bytes_up, global_raw_bytes_down, global_bytes_up, global_bytes_down,
-						global_buffers_up, global_syscalls_up, global_buffers_down, global_syscalls_down;
+						global_buffers_up, global_syscalls_up, global_buffers_down, global_syscalls_down,
+						global_clock_reads, global_data_reads;
+	    /** Content speed over all transfers, indexed by data_direction_t */
+	    static MovingAverageSpeed global_speed[2];
         static void CloseChannelByAddress(const Address &addr);
 
         // SOCKMGMT
@@ -525,6 +751,7 @@ namespace swift {
         static void LibeventSendCallback(int fd, short event, void *arg);
         static void LibeventReceiveCallback(int fd, short event, void *arg);
         static void RecvDatagram (evutil_socket_t socket); // Called by LibeventReceiveCallback
+        static void RecvDatagram (evutil_socket_t socket, const Address &from, struct evbuffer *evb); // frees evb
 	    static int RecvFrom(evutil_socket_t sock, Address& addr, struct evbuffer **evb); // Called by RecvDatagram
 	    static int SendTo(evutil_socket_t sock, const Address& addr, struct evbuffer **evb); // Called by Channel::Send()
 	    static evutil_socket_t Bind(Address address, sckrwecb_t callbacks=sckrwecb_t());
@@ -535,7 +762,9 @@ namespace swift {
 	    /** close the port */
 	    static void CloseSocket(evutil_socket_t sock);
 	    static void Shutdown ();
-	    /** the current time */
+	    /** Read the clock into NOW. NOW is cached otherwise: read once when
+	        a libevent callback starts and once per receive syscall, so call
+	        this only where finer precision matters. */
 	    static tint Time();
 
 	    // Arno: Per instance methods
@@ -545,16 +774,26 @@ namespace swift {
 
         void        OnAck (struct evbuffer *evb);
         void        OnHave (struct evbuffer *evb);
+        void        OnHaveBin (bin_t ackd_pos);
+        void        OnHaveAll ();
         bin_t       OnData (struct evbuffer *evb);
         void        OnHint (struct evbuffer *evb);
         void        OnHash (struct evbuffer *evb);
         void        OnPexAdd (struct evbuffer *evb);
         void        OnHandshake (struct evbuffer *evb);
         void        OnRandomize (struct evbuffer *evb); //FRAGRAND
+        void        OnVersion (struct evbuffer *evb);
+        void        OnUncleHashes (struct evbuffer *evb);
         void        AddHandshake (struct evbuffer *evb);
         bin_t       AddData (struct evbuffer **evb);
         void        AddAck (struct evbuffer *evb);
         void        AddHave (struct evbuffer *evb);
+        void        AddHaveBin (struct evbuffer *evb, bin_t ack);
+        void        AddVersion (struct evbuffer *evb);
+        void        SendVersion ();
+        /** Message type plus bin, in the encoding agreed with the peer. */
+        void        AddBinMessage (struct evbuffer *evb, uint8_t type, bin_t bin);
+        bin_t       RemoveBin (struct evbuffer *evb);
         void        AddHint (struct evbuffer *evb);
         void        AddUncleHashes (struct evbuffer *evb, bin_t pos);
         void        AddPeakHashes (struct evbuffer *evb);
@@ -569,6 +808,8 @@ namespace swift {
         tint        CwndRateNextSendTime ();
         tint        SlowStartNextSendTime ();
         tint        AimdNextSendTime ();
+        /** Give back the memory only needed while data flows. */
+        void        Compact ();
         tint        LedbatNextSendTime ();
         /** Arno: return true if this peer has complete file. May be fuzzy if Peak Hashes not in */
         bool		IsComplete();
@@ -586,6 +827,10 @@ namespace swift {
         static bool SELF_CONN_OK;
         static tint MAX_POSSIBLE_RTT;
         static tint MIN_PEX_REQUEST_INTERVAL;
+        /** Highest wire encoding we announce, SWIFT_WIRE_LEGACY disables. */
+        static uint8_t WIRE_VERSION;
+        /** Budget of open channels over all transfers, 0 is unlimited. */
+        static int  MAX_CHANNELS;
         static FILE* debug_file;
 
         const std::string id_string () const;
@@ -601,6 +846,7 @@ namespace swift {
         	return tmo < 30*TINT_SEC ? tmo : 30*TINT_SEC;
         }
         uint32_t    id () const { return id_; }
+        uint8_t     wire_version () const { return wire_version_; }
 
         // MORESTATS
         uint64_t raw_bytes_up() { return raw_bytes_up_; }
@@ -610,6 +856,12 @@ namespace swift {
 
         static int  DecodeID(int scrambled);
         static int  EncodeID(int unscrambled);
+        /** Bin message codec shared with stateless serving. wire_bin holds
+         *  the previous bin of the datagram for the compact encoding. */
+        static void AddBinMessage (struct evbuffer *evb, uint8_t version, uint32_t *wire_bin, uint8_t type, bin_t bin);
+        /** Legacy type of a message type, compact is set for compact ones. */
+        static uint8_t MessageType (uint8_t type, bool *compact);
+        static bin_t RemoveBin (struct evbuffer *evb, bool compact, uint32_t *wire_bin);
         static Channel* channel(int i) {
             return i<channels.size()?channels[i]:NULL;
         }
@@ -617,7 +869,11 @@ namespace swift {
 
         // SAFECLOSE
         void		ClearEvents();
-        void 		Schedule4Close() { scheduled4close_ = true; }
+        void 		Schedule4Close() {
+        	if (!scheduled4close_)
+        		closing_count_++;
+        	scheduled4close_ = true;
+        }
         bool		IsScheduled4Close() { return scheduled4close_; }
 
 		void Sent(int bytes, evbuffer *evb, bool tofree);
@@ -630,9 +886,22 @@ namespace swift {
         void OnPexReqZeroState(struct evbuffer *evb);
 
         tint GetOpenTime() { return open_time_; }
+        /** Position in the transfer's HAVE log up to which we announced. */
+        uint64_t have_log_pos() { return have_log_pos_; }
+
+        /** Add the memory held by this channel to mu. */
+        void GetMemoryUsage(memusage_t &mu);
 
         void CloseOnError();
 
+        /** Channels open and not scheduled for close. */
+        static int  open_channels() { return open_count_-closing_count_; }
+        /** Make room for one more channel under MAX_CHANNELS by scheduling
+            the least useful ones for close: first those where both sides
+            have everything, then idle ones, then the ones whose data flowed
+            longest ago. Returns false if none can go. */
+        static bool MakeRoom();
+
     protected:
 #define DGRAM_MAX_SOCK_OPEN 128
    	    static int sock_count;
@@ -656,16 +925,32 @@ namespace swift {
         tintbin     data_in_;
         bin_t       data_in_dbl_;
         /** The history of data sent and still unacknowledged. */
-        tbqueue     data_out_;
+        lazytbqueue data_out_;
         /** Timeouted data (potentially to be retransmitted). */
-        tbqueue     data_out_tmo_;
+        lazytbqueue data_out_tmo_;
         bin_t       data_out_cap_;
-        /** Index in the history array. */
-        binmap_t    have_out_;
+        /** HAVEs sent: a left to right scan of what we had at the time of
+            the handshake, then the transfer's HAVE log from have_log_pos_. */
+        uint64_t    have_snap_pos_;
+        uint64_t    have_log_pos_;
+        bool        have_all_out_;
+        /** Peer sent HAVE ALL before we knew the size. */
+        bool        have_all_in_;
+        /** Encoding we send in, the lowest of the peer's and ours. The bins
+            of compact messages are relative to the previous one in the same
+            datagram. wire_compact_in_ is set while parsing a compact one.
+            wire_peer_time_ is the last peer time from a compact ACK.
+            wire_version_sent_ counts our VERSION datagrams. */
+        uint8_t     wire_version_;
+        uint8_t     wire_version_sent_;
+        uint32_t    wire_bin_out_;
+        uint32_t    wire_bin_in_;
+        bool        wire_compact_in_;
+        tint        wire_peer_time_;
         /**    Transmit schedule: in most cases filled with the peer's hints */
-        tbqueue     hint_in_;
+        lazytbqueue hint_in_;
         /** Hints sent (to detect and reschedule ignored hints). */
-        tbqueue     hint_out_;
+        lazytbqueue hint_out_;
         uint64_t    hint_out_size_;
         /** Types of messages the peer accepts. */
         uint64_t    cap_in_;
@@ -674,7 +959,7 @@ namespace swift {
         tint        last_pex_request_time_;
         tint        next_pex_request_time_;
         bool        pex_request_outstanding_;
-        tbqueue     reverse_pex_out_;		// Arno, 2011-10-03: should really be a queue of (tint,channel id(= uint32_t)) pairs.
+        lazytbqueue reverse_pex_out_;		// Arno, 2011-10-03: should really be a queue of (tint,channel id(= uint32_t)) pairs.
         int         useless_pex_count_;
         /** Smoothed averages for RTT, RTT deviation and data interarrival periods. */
         tint        rtt_avg_, dev_avg_, dip_avg_;
@@ -724,6 +1009,11 @@ namespace swift {
 
 		bool		direct_sending_;
 
+        // CHANREG: state as last seen by FileTransfer::UpdateChannel()
+        /** Index into transfer().established_, -1 if not established */
+        int			established_pos_;
+        bool		peer_complete_;
+
         int         PeerBPS() const {
             return TINT_SEC / dip_avg_ * 1024;
         }
@@ -743,6 +1033,7 @@ namespace swift {
         //static tbheap   send_queue;
 
         static channels_t channels;
+        static int      open_count_, closing_count_;
 
         friend int      Listen (Address addr);
         friend void     Shutdown (int sock_des);
@@ -750,7 +1041,13 @@ namespace swift {
         friend void     SetTracker(const Address& tracker);
         friend int      Open (const char*, const Sha1Hash&, Address tracker, bool force_check_diskvshash, bool check_netwvshash, uint32_t chunk_size) ; // FIXME
         // SOCKTUNNEL
-        friend void 	CmdGwTunnelSendUDP(struct evbuffer *evb);
+        friend void 	CmdGwTunnelSendUDP(const Address &dest, struct evbuffer *evb);
+        // SIMULATOR: drives send timers and datagram delivery itself
+        friend class	Simulator;
+        // HOTBENCH: sets up channel state for the microbenchmarks
+        friend class	HotPathBench;
+        // CHANREG
+        friend class	FileTransfer;
     };
 
 
@@ -893,6 +1190,20 @@ namespace swift {
 
 	};
 
+// COOKIE: a channel id with this bit set after DecodeID() is a cookie
+#define SWIFT_COOKIE_FLAG		0x80000000
+// Below it: the fd of the transfer, a MAC
+#define SWIFT_COOKIE_FD_BITS	12
+#define SWIFT_COOKIE_MAC_BITS	19
+// Hinted ranges queued per peer, later ones are dropped
+#define SWIFT_COOKIE_HINTS		4
+// Chunks in flight per peer at most
+#define SWIFT_COOKIE_CWND_MAX	64
+// Nothing acked for this long while in flight: assume lost
+#define SWIFT_COOKIE_RTO		TINT_SEC
+// Peers silent for this long are forgotten, as a channel would close
+#define SWIFT_COOKIE_IDLE		(3*60*TINT_SEC)
+
 	class ZeroState
 	{
 	  public:
@@ -903,6 +1214,21 @@ namespace swift {
     	void SetConnectTimeout(tint timeout);
     	FileTransfer * Find(Sha1Hash &root_hash);
 
+    	/** COOKIE: serve zero state transfers without a Channel per peer.
+    	 * The handshake is answered with a keyed MAC as channel id, from
+    	 * which the transfer is taken again on every datagram. HINTs are answered with DATA and uncle hashes, paced
+    	 * by the peer's ACKs. Per peer there is only a cookiepeer_t. */
+    	void SetStateless(bool stateless) { stateless_ = stateless; }
+    	bool IsStateless() { return stateless_; }
+    	/** COOKIE: answer the initial handshake from peer for ft, evb is at
+    	 * the message following the root hash. Returns false, with evb
+    	 * untouched, if a Channel has to do it after all. */
+    	bool Answer(evutil_socket_t sock, const Address &peer, FileTransfer *ft, struct evbuffer *evb);
+    	/** COOKIE: handle a datagram to cookie, as decoded by DecodeID() */
+    	void OnCookieDatagram(evutil_socket_t sock, const Address &peer, uint32_t cookie, struct evbuffer *evb);
+    	size_t cookie_peer_count() { return cookiepeers_.size(); }
+    	/** COOKIE: forget the peers of transfer fd, as it closes */
+    	void ForgetCookiePeers(int fd);
 
     	static void LibeventCleanCallback(int fd, short event, void *arg);
 
@@ -912,6 +1238,28 @@ namespace swift {
     	struct event 		evclean_;
         std::string 		contentdir_;
 
+        // COOKIE
+        struct cookiepeer_t {
+            uint32_t	peer_channel_id;
+            uint8_t		nhints;
+            uint16_t	cwnd;		// chunks
+            uint16_t	inflight;	// chunks sent, not acked
+            tint		last_recv_time;
+            tint		last_ack_time;
+            bin_t		last_data;	// NONE: peak hashes first
+            uint8_t		version;	// lowest of ours and the announced one
+            uint32_t	hint_next[SWIFT_COOKIE_HINTS];	// chunk ranges asked for
+            uint32_t	hint_end[SWIFT_COOKIE_HINTS];
+        };
+        bool				stateless_;
+        Sha1Hash			cookie_secret_;
+        /** By address and transfer, see CookieKey() */
+        std::map<uint64_t,cookiepeer_t>	cookiepeers_;
+
+        uint32_t MakeCookie(const Address &peer, uint32_t peer_channel_id, FileTransfer *ft);
+        void Pump(evutil_socket_t sock, const Address &peer, FileTransfer *ft, int version, cookiepeer_t &cp);
+        void SendData(evutil_socket_t sock, const Address &peer, FileTransfer *ft, int version, cookiepeer_t &cp, bin_t pos);
+
         /* Arno, 2012-07-20: A very slow peer can keep a transfer alive
           for a long time (3 minute channel close timeout not reached).
           This causes problems on Mac where there are just 256 file
@@ -922,6 +1270,163 @@ namespace swift {
 	};
 
 
+	/** SEEDDIR: lazily opened seed directory. Only the root hash, chunk size
+	 * and file name of each file are kept in memory, read from the header of
+	 * its .mbinmap checkpoint. The FileTransfer is opened on the first
+	 * handshake or request for it, and closed again by Scan() once it has
+	 * no channels left.
+	 */
+	class SeedIndex
+	{
+	  public:
+		SeedIndex();
+		~SeedIndex();
+		static SeedIndex *GetInstance();
+
+		/** (Re)scan dirname. Files without a checkpoint are hashchecked
+		 * and checkpointed once. Returns the number of files indexed or -1. */
+		int Scan(std::string dirname, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
+		/** Index one new file of the scanned dir, e.g. reported by a
+		 * directory watcher. Returns 0 if indexed or already known. */
+		int Add(std::string filename, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
+		/** Forget a file of the scanned dir and close its transfer if
+		 * opened by Find(). Its name stays in names_ until the next Scan(). */
+		void Remove(std::string filename);
+		/** Return the transfer for root_hash, opening it if indexed. If
+		 * closeidle, Scan() may close it when it has no channels. */
+		FileTransfer *Find(const Sha1Hash &root_hash, bool closeidle=true);
+		/** Close transfers opened by Find() that have no channels. */
+		void CloseIdle();
+		/** Keep at most max_open transfers opened by Find(), 0 is
+		 * unlimited. Beyond it the one with the oldest data is closed, it
+		 * is reopened from its checkpoint when a peer asks again. */
+		void SetMaxOpen(int max_open) { max_open_ = max_open; }
+
+		int size() { return entries_.size(); }
+		/** Heap memory held by the index */
+		size_t mem_size();
+
+		/** Read root hash and chunk size from the header of a .mbinmap
+		 * checkpoint. Returns -1 if absent or unreadable. */
+		static int ReadCheckpointHeader(std::string binmap_filename, Sha1Hash *root_hash, uint32_t *chunk_size);
+
+	  protected:
+		static SeedIndex *__singleton;
+
+		struct seedentry_t {
+			Sha1Hash	root_hash;
+			uint32_t	chunk_size;
+			uint32_t	name;		// offset into names_
+			bool operator < (const seedentry_t &b) const {
+				return memcmp(root_hash.bits,b.root_hash.bits,Sha1Hash::SIZE) < 0;
+			}
+		};
+		typedef std::vector<seedentry_t>	seedentries_t;
+
+		std::string		dirname_;
+		/** Sorted by root hash */
+		seedentries_t	entries_;
+		/** File names, '\0' separated */
+		std::string		names_;
+		/** Transfers opened by Find() that may be closed when idle. The
+		 * root hash guards against the fd being reused after someone else
+		 * closed the transfer. */
+		std::map<int,Sha1Hash>	opened_;
+		int				max_open_;
+
+		FileTransfer *Opened(std::map<int,Sha1Hash>::iterator iter);
+		void CloseLRU();
+
+		const seedentry_t *Lookup(const Sha1Hash &root_hash);
+		int LookupName(std::string filename);
+		int IndexFile(std::string path, uint32_t chunk_size, seedentry_t *e);
+	};
+
+
+// TRACKER: most recent members remembered per swarm
+#define SWIFT_TRACKER_SWARM_PEERS	32
+// PEX_ADDs in an answer
+#define SWIFT_TRACKER_PEX			16
+// Seconds a member is remembered without announcing again
+#define SWIFT_TRACKER_PEER_TTL		(30*60)
+// Peers with other peers still announce this often, see ReConnectToTrackerIfAllowed()
+#define SWIFT_TRACKER_REANNOUNCE	(10*60*TINT_SEC)
+// Channel number the tracker answers with, never that of a real channel
+#define SWIFT_TRACKER_CHANNEL_NO	0x7ffffffd
+
+	/** TRACKER: tracker-only mode. Answers the initial handshake for any
+	 * root hash arriving on its socket with PEX_ADDs of peers that recently
+	 * did the same, and remembers the sender as member of that swarm. There
+	 * is no content and no channel: the answer ends with an explicit close
+	 * and later datagrams are dropped. Peers announce again after
+	 * SWIFT_TRACKER_REANNOUNCE, members silent for SWIFT_TRACKER_PEER_TTL
+	 * are forgotten.
+	 *
+	 * Swarms live in one open addressing table keyed by root hash, each
+	 * with an array of at most SWIFT_TRACKER_SWARM_PEERS members of 8
+	 * bytes. The number of members is bounded, beyond it only known swarms
+	 * take new members, in place of their oldest.
+	 */
+	class Tracker
+	{
+	  public:
+		Tracker(evutil_socket_t sock, uint32_t max_members);
+		~Tracker();
+		/** The tracker answering on sock, NULL if none */
+		static Tracker *Find(evutil_socket_t sock) {
+			return (__instance != NULL && __instance->sock_ == sock) ? __instance : NULL;
+		}
+
+		/** Answer an initial handshake from peer for root, evb is at the
+		 * message following the root hash. */
+		void OnHandshake(const Address &peer, const Sha1Hash &root, struct evbuffer *evb);
+		/** Write up to max other members of root into out, then remember
+		 * peer as member. Returns the number written. */
+		int Announce(const Address &peer, const Sha1Hash &root, Address *out, int max);
+		/** Forget members not heard of for ttl seconds. */
+		void Expire(uint32_t ttl);
+
+		uint32_t swarms() { return nswarms_; }
+		uint32_t members() { return nmembers_; }
+		uint64_t handshakes() { return handshakes_; }
+		/** Heap memory held by the tables */
+		size_t mem_size();
+
+	  protected:
+		static Tracker *__instance;
+
+		struct trackpeer_t {
+			uint32_t	ipv4;
+			uint16_t	port;
+			uint16_t	seen;		// seconds, see Now()
+		};
+		struct trackswarm_t {
+			Sha1Hash	root;
+			uint32_t	npeers;
+			trackpeer_t	*peers;		// capacity npeers rounded up to a power of 2, NULL if slot free
+		};
+
+		evutil_socket_t	sock_;
+		uint32_t		max_members_;
+		uint32_t		nmembers_;
+		uint32_t		nswarms_;
+		uint64_t		handshakes_;
+		tint			last_expire_;
+		/** Size is a power of 2, at most 3/4 used */
+		std::vector<trackswarm_t> table_;
+
+		static uint16_t Now() { return (uint16_t)(NOW/TINT_SEC); }
+		size_t Home(const Sha1Hash &root) {
+			uint64_t h;
+			memcpy(&h,root.bits,sizeof(h));
+			return h & (table_.size()-1);
+		}
+		trackswarm_t *Lookup(const Sha1Hash &root, bool create);
+		void RemoveSwarm(size_t slot);
+		void Grow();
+	};
+
+
     /*************** The top-level API ****************/
     /** Start listening a port. Returns socket descriptor. */
     int     Listen (Address addr);
@@ -982,10 +1487,39 @@ namespace swift {
     /** Get the address bound to the socket descriptor returned by Listen() */
     Address BoundAddress(evutil_socket_t sock);
 
-    void AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg);
+    /** Have cb called when data arrives whose cover bin is at least layer
+        agg and overlaps bytes startoff..endoff. Calls are coalesced per
+        event loop iteration. */
+    void AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg,uint64_t startoff=0,uint64_t endoff=UINT64_MAX);
     void RemoveProgressCallback (int transfer,ProgressCallback cb);
+    /** Have cb called once bytes offset..offset+length-1 are all verified
+        and stored, right away if they already are (returns 1). Meanwhile
+        their chunks are picked before others. Returns 0 when waiting, -1
+        for a bad transfer or range. A range waited for before the size
+        was known that turns out to end beyond it gets cb with length 0.
+        Not called if the transfer is closed first. */
+    int  AwaitRange (int transfer,uint64_t offset,uint64_t length,RangeCallback cb,void *arg=NULL);
+    /** Stop waiting for the ranges of cb with arg. */
+    void CancelRange (int transfer,RangeCallback cb,void *arg=NULL);
     void ExternallyRetrieved (int transfer,bin_t piece);
 
+    // CMDQUEUE: this API must be used from the event loop thread. Other
+    // threads of an embedding application hand it calls via Submit().
+    typedef void (*CommandFunc) (void *arg);
+    /** Set up the command queue on Channel::evbase. Call once from the
+        event loop thread before entering the loop. Returns -1 on error. */
+    int  InstallCommandQueue (void);
+    /** Have fn(arg) called on the event loop thread. Lock-free and safe
+        from any thread, it does not wait: fn passes any results back via
+        arg. Returns -1 if no queue is installed. */
+    int  Submit (CommandFunc fn,void *arg);
+    /** As Submit(), but return only after fn(arg) has run. Called on the
+        event loop thread it runs fn(arg) directly. */
+    int  SubmitWait (CommandFunc fn,void *arg);
+    /** Run the commands queued so far, returns their number. The event
+        loop does this when woken up. */
+    int  RunCommands (void);
+
 
     /** Must be called by any client using the library */
     void LibraryInit(void);
@@ -996,16 +1530,20 @@ namespace swift {
     int evbuffer_add_32be(struct evbuffer *evb, uint32_t i);
     int evbuffer_add_64be(struct evbuffer *evb, uint64_t l);
     int evbuffer_add_hash(struct evbuffer *evb, const Sha1Hash& hash);
+    int evbuffer_add_varint(struct evbuffer *evb, uint64_t v);
 
     uint8_t evbuffer_remove_8(struct evbuffer *evb);
     uint16_t evbuffer_remove_16be(struct evbuffer *evb);
     uint32_t evbuffer_remove_32be(struct evbuffer *evb);
     uint64_t evbuffer_remove_64be(struct evbuffer *evb);
     Sha1Hash evbuffer_remove_hash(struct evbuffer* evb);
+    uint64_t evbuffer_remove_varint(struct evbuffer *evb);
 
     const char* tintstr(tint t=0);
     std::string sock2str (struct sockaddr_in addr);
  #define SWIFT_MAX_CONNECTIONS 20
+// Channels younger than this are not evicted to stay under MAX_CHANNELS
+#define SWIFT_EVICT_MIN_AGE	(10*TINT_SEC)
 
     void nat_test_update(void);
 
@@ -1014,9 +1552,13 @@ namespace swift {
 
     // SOCKTUNNEL
     void CmdGwTunnelUDPDataCameIn(Address srcaddr, uint32_t srcchan, struct evbuffer* evb);
-    void CmdGwTunnelSendUDP(struct evbuffer *evb); // for friendship with Channel
+    void CmdGwTunnelSendUDP(const Address &dest, struct evbuffer *evb); // for friendship with Channel
 
 #define MAX_QUEUE_LENGTH 1
+// Multiplexable and DATA datagrams held per socket before flushing anyway
+#define MAX_MUX_QUEUE_LENGTH 64
+// Chunks read for DATA kept until the end of the event loop iteration
+#define MAX_SHARED_PAYLOADS 64
 #define TIMER_USEC 10000
 
 	class MessageQueue
@@ -1030,62 +1572,67 @@ namespace swift {
 					evb(ievb),
 					addr(iaddr),
 					channel(ichannel),
-					tofree(itofree)
+					tofree(itofree),
+					mux(false)
 			{
 			}
 
 			evbuffer *evb;
 			Address addr;
-			Channel *channel;
+			Channel *channel;	// NULL: nobody to call back, free evb
 			bool tofree;
+			bool mux;
 		};
 
 		typedef std::deque<Entry> EntryList;
 		typedef std::map<int, EntryList> EntryLists;
 	
-		void AddBuffer(int sock, evbuffer *evb, const Address &addr, Channel *channel, bool tofree = true)
+		MessageQueue() : evflush_(NULL) {}
+
+		/** Queue evb for sending. Control-only datagrams of channels that
+		 *  agreed on SWIFT_WIRE_MUX and datagrams carrying DATA (isdata) are
+		 *  held until the end of the current event loop iteration, such that
+		 *  one flush sends them to all peers. Others flush the queue of sock. */
+		void AddBuffer(int sock, evbuffer *evb, const Address &addr, Channel *channel, bool tofree = true, bool isdata = false);
+		/** Append the len bytes at offset of the content with the given root
+		 *  hash to evb, read from storage. A chunk is read once per event
+		 *  loop iteration, the DATA datagrams to all peers refer to that one
+		 *  copy. Returns the bytes added, -1 on error. */
+		ssize_t AddPayload(evbuffer *evb, const Sha1Hash &root, Storage *storage, int64_t offset, size_t len);
+		void Flush(int sock);
+		void Flush()
 		{
-			EntryList &list = lists[sock];
-			list.push_back(Entry(evb, addr, channel, tofree));
-			if (list.size() == MAX_QUEUE_LENGTH)
-				Flush(sock);
-		}
-
-		void Flush(int sock)
-		{
-			EntryList &list = lists[sock];
-			if (list.empty())
-				return;
-
-			Address addr;
-			free(addr.addr);
-			addr.addr = (struct sockaddr_mptp *) calloc(1, sizeof(struct sockaddr_mptp) + list.size() * sizeof(struct mptp_dest));
-			addr.addr->count = list.size();
-			evbuffer *evbs[list.size()];
-			int i = 0;
-			for (EntryList::iterator it = list.begin(); it != list.end(); ++it, ++i) {
-				addr.addr->dests[i].addr = (*it).addr.addr->dests[0].addr;
-				addr.addr->dests[i].port = (*it).addr.addr->dests[0].port;
-				evbs[i] = (*it).evb;
-			}
-
-			int r = Channel::SendTo(sock, addr, evbs);
-			if (r > 0) {
-				i = 0;
-				for (EntryList::iterator it = list.begin(); it != list.end(); ++it, ++i)
-					(*it).channel->Sent(evbuffer_get_length((*it).evb), (*it).evb, (*it).tofree);
-			}
-			list.clear();
-		}
-
-		void Flush() 
-		{ 
 			for (EntryLists::iterator it = lists.begin(); it != lists.end(); ++it)
 				Flush(it->first);
+			DropPayloads();
 		}
 
+		static void LibeventFlushCallback(int fd, short event, void *arg);
+
 	private:
 		EntryLists lists;
+		struct event *evflush_;
+
+		/** Chunk read for the DATA datagrams of this event loop iteration,
+		 *  freed when neither the queue nor an evbuffer refers to it. */
+		struct payload_t {
+			Sha1Hash root;
+			int64_t offset;
+			size_t size;	// asked for
+			size_t len;		// read
+			int refs;
+			char *data;
+		};
+		std::vector<payload_t *> payloads;
+
+		void ScheduleFlush();
+		void DropPayloads();
+		static void UnrefPayload(payload_t *p);
+		static void PayloadCleanupCallback(const void *data, size_t len, void *arg);
+		static bool Muxable(const Entry &e);
+		/** Combine the held entries of list to the same peer into
+		 *  multiplexed datagrams, keeping the order per peer. */
+		static void Multiplex(EntryList &list, EntryList &out);
 	};
 
 } // namespace end
@@ -1095,9 +1642,13 @@ namespace swift {
 #ifndef SWIFT_MUTE
 #define dprintf(...) do { if (Channel::debug_file) fprintf(Channel::debug_file,__VA_ARGS__); } while (0)
 #define dflush() fflush(Channel::debug_file)
+// Hot path: typed binary trace event, rendered as text too when debugging
+#define dtrace(ev,ch,bin,arg) do { if ((swift::trace_mask & swift::trace_events[ev].cat) || Channel::debug_file) \
+    swift::TraceEmit(Channel::debug_file,Channel::epoch,NOW,ev,ch,bin,(uint64_t)(arg)); } while (0)
 #else
 #define dprintf(...) do {} while(0)
 #define dflush() do {} while(0)
+#define dtrace(ev,ch,bin,arg) do {} while(0)
 #endif
 #define eprintf(...) fprintf(stderr,__VA_ARGS__)
 
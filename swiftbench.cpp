@@ -0,0 +1,394 @@
+/*
+ *  swiftbench.cpp
+ *  end-to-end throughput benchmark: one seeder and N leechers in one
+ *  process, over loopback sockets or the in-process transport (sim.h).
+ *  Reports throughput, CPU per GB, syscalls and clock reads per datagram
+ *  and DATA->ACK latency percentiles as JSON.
+ *
+ *  Latencies are taken from a DATA/ACK event trace (trace.h) written to
+ *  the work directory during the run. With the in-process transport they
+ *  are in virtual time.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "sim.h"
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace swift;
+
+#define BENCH_POLL_INTERVAL     (10*TINT_MSEC)
+
+
+struct benchpeer_t {
+    evutil_socket_t sock;
+    struct event    evrecv;
+    FileTransfer    *transfer;
+    tint            done_time;
+};
+
+static std::vector<benchpeer_t *> bench_peers;
+static tint bench_start, bench_end;
+static struct event bench_evpoll;
+
+
+static void usage()
+{
+    fprintf(stderr,"Usage: swiftbench [options]\n");
+    fprintf(stderr,"  -m\ttransport: \"inproc\" (default) or \"loopback\"\n");
+    fprintf(stderr,"  -f\tfile to seed (default: generate one of -s bytes)\n");
+    fprintf(stderr,"  -s\tsize of the generated file in bytes (default 64 MiB)\n");
+    fprintf(stderr,"  -n\tnumber of leechers (default 1)\n");
+    fprintf(stderr,"  -c\tchunk size in bytes (default %d)\n",SWIFT_DEFAULT_CHUNK_SIZE);
+    fprintf(stderr,"  -p\tfirst loopback port (default 17000)\n");
+    fprintf(stderr,"  -d\tin-process one-way delay in ms (default 0)\n");
+    fprintf(stderr,"  -t\tmaximum run time in s (default 300)\n");
+    fprintf(stderr,"  -w\twork directory (default ./swiftbench.d)\n");
+    fprintf(stderr,"  -L\tdo not trace, no latency percentiles\n");
+}
+
+
+static double CpuSeconds()
+{
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF,&ru) == 0)
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 +
+               ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+#endif
+    return 0.0;
+}
+
+
+static tint WallTime()
+{
+    // Not usec_time(), that runs on virtual time inside the simulator
+#ifdef _WIN32
+    return (tint)GetTickCount()*TINT_MSEC;
+#else
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (tint)tv.tv_sec*TINT_SEC + tv.tv_usec;
+#endif
+}
+
+
+/** Results of a run; the clock starts once the seeder has hashed its content. */
+struct benchresult_t {
+    uint64_t    size;
+    int         completed;
+    tint        wall;
+    double      cpu;
+    benchresult_t() : size(0), completed(0), wall(0), cpu(0.0) {}
+};
+
+
+static void StartClock(benchresult_t &res)
+{
+    res.wall = WallTime();
+    res.cpu = CpuSeconds();
+}
+
+
+static void StopClock(benchresult_t &res)
+{
+    res.wall = WallTime()-res.wall;
+    res.cpu = CpuSeconds()-res.cpu;
+}
+
+
+static std::string LeecherFilename(std::string workdir, int i, const Sha1Hash &root)
+{
+    char dirname[32];
+    sprintf(dirname,"peer%d",i);
+    std::string dir = workdir+FILE_SEP+dirname;
+    if (file_exists_utf8(dir) != 2)
+        mkdir_utf8(dir);
+    std::string filename = dir+FILE_SEP+root.hex();
+    remove_utf8(filename);
+    remove_utf8(filename+".mhash");
+    remove_utf8(filename+".mbinmap");
+    return filename;
+}
+
+
+/*
+ * Loopback: every peer gets its own UDP socket on 127.0.0.1, all driven
+ * by the one libevent loop.
+ */
+
+static void BenchReceiveCallback(evutil_socket_t fd, short event, void *arg)
+{
+    Channel::Time();
+    Channel::RecvDatagram(fd);
+}
+
+
+static void BenchPollCallback(evutil_socket_t fd, short event, void *arg)
+{
+    Channel::Time();
+    bool done = true;
+    for (int i=0; i<bench_peers.size(); i++) {
+        benchpeer_t *p = bench_peers[i];
+        if (p->done_time == TINT_NEVER && p->transfer->hashtree()->is_complete())
+            p->done_time = NOW;
+        done = done && p->done_time != TINT_NEVER;
+    }
+    TraceFlush();
+    if (done || NOW >= bench_end)
+        event_base_loopbreak(Channel::evbase);
+    else
+        evtimer_add(&bench_evpoll,tint2tv(BENCH_POLL_INTERVAL));
+}
+
+
+static benchpeer_t *BenchAddPeer(uint16_t port)
+{
+    evutil_socket_t sock = Channel::Bind(Address("127.0.0.1",port));
+    if (sock == INVALID_SOCKET)
+        return NULL;
+    benchpeer_t *p = new benchpeer_t;
+    p->sock = sock;
+    p->transfer = NULL;
+    p->done_time = TINT_NEVER;
+    event_assign(&p->evrecv,Channel::evbase,sock,EV_READ|EV_PERSIST,BenchReceiveCallback,NULL);
+    event_add(&p->evrecv,NULL);
+    return p;
+}
+
+
+static int RunLoopback(std::string filename, std::string workdir, int nleechers,
+                       uint32_t chunk_size, uint16_t port, tint duration, benchresult_t &res)
+{
+    // All peers share Channel::channels, see Simulator
+    Channel::SELF_CONN_OK = true;
+
+    benchpeer_t *seeder = BenchAddPeer(port);
+    if (seeder == NULL)
+        return -1;
+    seeder->transfer = new FileTransfer(filename,Sha1Hash::ZERO,true,true,chunk_size);
+    if (!seeder->transfer->IsOperational() || !seeder->transfer->hashtree()->is_complete()) {
+        print_error("swiftbench: cannot seed file");
+        return -1;
+    }
+    seeder->transfer->SetSocket(seeder->sock);
+    Sha1Hash root = seeder->transfer->root_hash();
+    res.size = seeder->transfer->hashtree()->size();
+
+    StartClock(res);
+    Channel::Time();
+    bench_start = NOW;
+    bench_end = bench_start+duration;
+    for (int i=0; i<nleechers; i++) {
+        benchpeer_t *p = BenchAddPeer(port+1+i);
+        if (p == NULL)
+            return -1;
+        p->transfer = new FileTransfer(LeecherFilename(workdir,i+1,root),root,true,true,chunk_size);
+        p->transfer->SetSocket(p->sock);
+        p->transfer->SetTracker(Address("127.0.0.1",port));
+        p->transfer->ConnectToTracker();
+        bench_peers.push_back(p);
+    }
+
+    evtimer_assign(&bench_evpoll,Channel::evbase,BenchPollCallback,NULL);
+    evtimer_add(&bench_evpoll,tint2tv(BENCH_POLL_INTERVAL));
+    event_base_dispatch(Channel::evbase);
+    StopClock(res);
+
+    for (int i=0; i<bench_peers.size(); i++)
+        if (bench_peers[i]->done_time != TINT_NEVER)
+            res.completed++;
+    return 0;
+}
+
+
+/*
+ * In-process: the simulator with unlimited links (zero delay by default),
+ * such that only the protocol code itself is measured.
+ */
+
+static int RunInproc(std::string filename, std::string workdir, int nleechers,
+                     uint32_t chunk_size, tint delay, tint duration, benchresult_t &res)
+{
+    Simulator sim(1,workdir);
+    simlink_t link;
+    link.delay = delay;
+    link.queue = 0xffffffff;
+    int seeder = sim.AddSeeder(filename,link,chunk_size);
+    if (seeder < 0)
+        return -1;
+    res.size = sim.peer(seeder).transfer->hashtree()->size();
+
+    StartClock(res);
+    for (int i=0; i<nleechers; i++)
+        sim.AddLeecher(sim.peer(seeder).root,link,0,chunk_size);
+    sim.Run(duration);
+    StopClock(res);
+
+    for (int i=0; i<sim.peer_count(); i++)
+        if (!sim.peer(i).seeder && sim.peer(i).done_time != TINT_NEVER)
+            res.completed++;
+    return 0;
+}
+
+
+/*
+ * Pairs each DATA_OUT with the ACK_IN that covers it on the same channel.
+ * A retransmission restarts the measurement for that chunk.
+ */
+static std::vector<tint> ReadLatencies(std::string tracefilename)
+{
+    std::vector<tint> samples;
+    FILE *fp = fopen_utf8(tracefilename.c_str(),"rb");
+    if (fp == NULL)
+        return samples;
+    char magic[8];
+    uint32_t recsize = 0;
+    tint epoch = 0;
+    if (fread(magic,1,8,fp) != 8 || memcmp(magic,TRACE_FILE_MAGIC,8)
+        || fread(&recsize,sizeof(recsize),1,fp) != 1 || recsize != sizeof(trace_record_t)
+        || fread(&epoch,sizeof(epoch),1,fp) != 1) {
+        fclose(fp);
+        return samples;
+    }
+
+    std::map<std::pair<uint32_t,uint64_t>,tint> out;
+    trace_record_t rec;
+    while (fread(&rec,sizeof(rec),1,fp) == 1) {
+        if (rec.event == TRACE_EV_DATA_OUT)
+            out[std::make_pair(rec.channel,rec.bin)] = rec.time;
+        else if (rec.event == TRACE_EV_ACK_IN) {
+            bin_t acked(rec.bin);
+            uint64_t first = acked.base_offset(), last = first+acked.base_length();
+            for (uint64_t c=first; c<last; c++) {
+                std::map<std::pair<uint32_t,uint64_t>,tint>::iterator iter =
+                    out.find(std::make_pair(rec.channel,bin_t(0,c).toUInt()));
+                if (iter == out.end())
+                    continue;
+                samples.push_back(rec.time-iter->second);
+                out.erase(iter);
+            }
+        }
+    }
+    fclose(fp);
+    std::sort(samples.begin(),samples.end());
+    return samples;
+}
+
+
+static long long Percentile(const std::vector<tint> &sorted, double p)
+{
+    if (sorted.empty())
+        return -1;
+    size_t i = (size_t)(p*(sorted.size()-1)+0.5);
+    return (long long)sorted[i];
+}
+
+
+int main(int argc, char** argv)
+{
+    std::string filename = "", workdir = "swiftbench.d", mode = "inproc";
+    uint64_t size = 64*1024*1024;
+    int nleechers = 1;
+    uint32_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
+    uint16_t port = 17000;
+    double duration = 300, delay = 0;
+    bool latency = true;
+    int c;
+
+    LibraryInit();
+    while (-1 != (c = getopt(argc, argv, "m:f:s:n:c:p:d:t:w:L"))) {
+        switch (c) {
+            case 'm': mode = optarg; break;
+            case 'f': filename = optarg; break;
+            case 's': size = strtoull(optarg,NULL,10); break;
+            case 'n': nleechers = atoi(optarg); break;
+            case 'c': chunk_size = atoi(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 'd': delay = atof(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'w': workdir = optarg; break;
+            case 'L': latency = false; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (chunk_size == 0 || nleechers < 1 || (mode != "inproc" && mode != "loopback")) {
+        usage();
+        return 1;
+    }
+
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    if (file_exists_utf8(workdir) != 2)
+        mkdir_utf8(workdir);
+
+    if (filename == "") {
+        filename = workdir+FILE_SEP+"content";
+        FILE *fp = fopen_utf8(filename.c_str(),"wb");
+        if (fp == NULL) {
+            print_error("swiftbench: cannot create content file");
+            return 1;
+        }
+        char buf[65536];
+        uint64_t x = 1;
+        for (uint64_t done=0; done<size; ) {
+            size_t n = std::min((uint64_t)sizeof(buf),size-done);
+            for (size_t i=0; i<n; i++) {
+                x = x*6364136223846793005ULL + 1442695040888963407ULL;
+                buf[i] = (char)(x>>56);
+            }
+            fwrite(buf,1,n,fp);
+            done += n;
+        }
+        fclose(fp);
+    }
+    remove_utf8(filename+".mhash");
+    remove_utf8(filename+".mbinmap");
+
+    std::string tracefilename = workdir+FILE_SEP+"bench.trace";
+    if (latency && !TraceOpen(tracefilename,TRACE_CAT_DATA|TRACE_CAT_ACK,Channel::epoch))
+        return 1;
+
+    benchresult_t res;
+    int ret;
+    if (mode == "loopback")
+        ret = RunLoopback(filename,workdir,nleechers,chunk_size,port,(tint)(duration*TINT_SEC),res);
+    else
+        ret = RunInproc(filename,workdir,nleechers,chunk_size,(tint)(delay*TINT_MSEC),
+                        (tint)(duration*TINT_SEC),res);
+    if (ret < 0)
+        return 1;
+
+    std::vector<tint> lat;
+    if (latency) {
+        TraceClose();
+        lat = ReadLatencies(tracefilename);
+        remove_utf8(tracefilename);
+    }
+
+    double secs = res.wall > 0 ? (double)res.wall/TINT_SEC : 1e-6;
+    double delivered = (double)res.size*res.completed;
+    printf("{\"mode\": \"%s\", \"size\": %llu, \"chunk_size\": %u, \"leechers\": %d, \"completed\": %d, "
+        "\"wall_us\": %lld, \"cpu_s\": %.3f, \"throughput_Gbps\": %.4f, \"dgrams_per_s\": %.0f, "
+        "\"cpu_s_per_GB\": %.3f, \"dgrams_up\": %llu, \"raw_bytes_up\": %llu, \"syscalls_up\": %llu, "
+        "\"syscalls_per_dgram\": %.4f, \"data_reads\": %llu, \"clock_reads_per_dgram\": %.4f, \"latency_samples\": %u, \"latency_p50_us\": %lld, "
+        "\"latency_p90_us\": %lld, \"latency_p99_us\": %lld, \"latency_max_us\": %lld}\n",
+        mode.c_str(),(unsigned long long)res.size,chunk_size,nleechers,res.completed,
+        (long long)res.wall,res.cpu,delivered*8/secs/1e9,Channel::global_dgrams_up/secs,
+        delivered > 0 ? res.cpu/(delivered/1e9) : 0.0,
+        (unsigned long long)Channel::global_dgrams_up,(unsigned long long)Channel::global_raw_bytes_up,
+        (unsigned long long)Channel::global_syscalls_up,
+        Channel::global_buffers_up ? (double)Channel::global_syscalls_up/Channel::global_buffers_up : 0.0,
+        (unsigned long long)Channel::global_data_reads,
+        Channel::global_dgrams_up+Channel::global_dgrams_down ?
+            (double)Channel::global_clock_reads/(Channel::global_dgrams_up+Channel::global_dgrams_down) : 0.0,
+        (unsigned int)lat.size(),Percentile(lat,0.5),Percentile(lat,0.9),Percentile(lat,0.99),
+        lat.empty() ? -1LL : (long long)lat.back());
+
+    return res.completed == nleechers ? 0 : 2;
+}
@@ -0,0 +1,139 @@
+/*
+ *  swiftsim.cpp
+ *  command line front-end for the in-process swarm simulator (sim.h):
+ *  one seeder and N leechers on virtual time, results as JSON. With -m
+ *  several swarms, all seeded by the one seeder host and downloaded by
+ *  every leecher host.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "sim.h"
+
+using namespace swift;
+
+
+static void usage()
+{
+    fprintf(stderr,"Usage: swiftsim [options]\n");
+    fprintf(stderr,"  -f\tfile to seed (default: generate one of -s bytes)\n");
+    fprintf(stderr,"  -s\tsize of the generated file in bytes (default 1048576)\n");
+    fprintf(stderr,"  -n\tnumber of leechers (default 4)\n");
+    fprintf(stderr,"  -m\tnumber of swarms, generated content only (default 1)\n");
+    fprintf(stderr,"  -c\tchunk size in bytes (default %d)\n",SWIFT_DEFAULT_CHUNK_SIZE);
+    fprintf(stderr,"  -u\tleecher upload bandwidth in KiB/s (default unlimited)\n");
+    fprintf(stderr,"  -U\tseeder upload bandwidth in KiB/s (default -u)\n");
+    fprintf(stderr,"  -q\tuplink queue in bytes (default 65536)\n");
+    fprintf(stderr,"  -d\tone-way delay in ms (default 10)\n");
+    fprintf(stderr,"  -j\tjitter in ms (default 0)\n");
+    fprintf(stderr,"  -l\tloss in percent (default 0)\n");
+    fprintf(stderr,"  -r\treordering in percent (default 0)\n");
+    fprintf(stderr,"  -i\tinterval between leecher joins in ms (default 0)\n");
+    fprintf(stderr,"  -t\tmaximum virtual run time in s (default 600)\n");
+    fprintf(stderr,"  -S\trandom seed (default 1)\n");
+    fprintf(stderr,"  -V\twire encoding, 0 legacy, 1 compact or 2 multiplexed (default %d)\n",(int)Channel::WIRE_VERSION);
+    fprintf(stderr,"  -w\twork directory (default ./swiftsim.d)\n");
+    fprintf(stderr,"  -B\tdebug log file\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    std::string filename = "", workdir = "swiftsim.d";
+    uint64_t size = 1024*1024, seed = 1;
+    int nleechers = 4, nswarms = 1;
+    uint32_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
+    double upload = 0, seedupload = -1, jointerval = 0, duration = 600;
+    simlink_t link;
+    int c;
+
+    LibraryInit();
+    while (-1 != (c = getopt(argc, argv, "f:s:n:m:c:u:U:q:d:j:l:r:i:t:S:V:w:B:"))) {
+        switch (c) {
+            case 'f': filename = optarg; break;
+            case 's': size = strtoull(optarg,NULL,10); break;
+            case 'n': nleechers = atoi(optarg); break;
+            case 'm': nswarms = atoi(optarg); break;
+            case 'c': chunk_size = atoi(optarg); break;
+            case 'u': upload = atof(optarg)*1024.0; break;
+            case 'U': seedupload = atof(optarg)*1024.0; break;
+            case 'q': link.queue = atoi(optarg); break;
+            case 'd': link.delay = (tint)(atof(optarg)*TINT_MSEC); break;
+            case 'j': link.jitter = (tint)(atof(optarg)*TINT_MSEC); break;
+            case 'l': link.loss = atof(optarg)/100.0; break;
+            case 'r': link.reorder = atof(optarg)/100.0; break;
+            case 'i': jointerval = atof(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'S': seed = strtoull(optarg,NULL,10); break;
+            case 'V': Channel::WIRE_VERSION = atoi(optarg); break;
+            case 'w': workdir = optarg; break;
+            case 'B': Channel::debug_file = fopen_utf8(optarg,"w"); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (chunk_size == 0 || nleechers < 0 || nswarms < 1 || (nswarms > 1 && filename != "")) {
+        usage();
+        return 1;
+    }
+
+    Simulator sim(seed,workdir);
+
+    std::vector<std::string> filenames;
+    if (filename != "")
+        filenames.push_back(filename);
+    for (int k=0; filename == "" && k<nswarms; k++) {
+        // Content derived from the seed, such that runs are reproducible
+        std::string path = workdir+FILE_SEP+"content";
+        if (k > 0) {
+            char num[16];
+            sprintf(num,"%d",k);
+            path += num;
+        }
+        FILE *fp = fopen_utf8(path.c_str(),"wb");
+        if (fp == NULL) {
+            print_error("swiftsim: cannot create content file");
+            return 1;
+        }
+        uint64_t x = seed+1+k;
+        for (uint64_t i=0; i<size; i++) {
+            x = x*6364136223846793005ULL + 1442695040888963407ULL;
+            fputc((int)(x>>56),fp);
+        }
+        fclose(fp);
+        remove_utf8(path+".mhash");
+        remove_utf8(path+".mbinmap");
+        filenames.push_back(path);
+    }
+
+    simlink_t seedlink = link;
+    seedlink.upload = seedupload >= 0 ? seedupload : upload;
+    std::vector<Sha1Hash> roots;
+    int seeder = -1;
+    for (int k=0; k<filenames.size(); k++) {
+        int s = sim.AddSeeder(filenames[k],seedlink,chunk_size,seeder);
+        if (s < 0)
+            return 1;
+        if (seeder < 0)
+            seeder = s;
+        roots.push_back(sim.peer(s).root);
+    }
+
+    link.upload = upload;
+    for (int i=0; i<nleechers; i++) {
+        int host = -1;
+        for (int k=0; k<roots.size(); k++) {
+            int l = sim.AddLeecher(roots[k],link,(tint)(i*jointerval*TINT_MSEC),chunk_size,host);
+            if (host < 0)
+                host = l;
+        }
+    }
+
+    bool done = sim.Run((tint)(duration*TINT_SEC));
+    sim.Report(stdout);
+
+    if (Channel::debug_file)
+        fclose(Channel::debug_file);
+    return done ? 0 : 2;
+}
@@ -0,0 +1,99 @@
+# see LICENSE.txt for license information
+#
+# Measures CMD gateway command throughput in commands/sec for single text
+# commands, BATCH and FRAMING BINARY. Run against a swift started with
+# e.g. "swift -c 127.0.0.1:62481 -l 0.0.0.0:6778". The commands used are
+# MAXSPEED and CHECKPOINT for unknown swarms, such that the measurement is
+# of the gateway itself and not of the transfers.
+#
+# Usage: cmdgwbench.py [host:port] [ncommands]
+
+from __future__ import print_function
+
+import sys
+import socket
+import struct
+import random
+import time
+
+BATCHSIZE = 1000
+
+
+def randhash():
+    return "".join(random.choice("0123456789abcdef") for i in range(40))
+
+
+def makecmds(n):
+    cmds = []
+    for i in range(n):
+        if i % 2:
+            cmds.append("MAXSPEED %s DOWNLOAD %d" % (randhash(), random.randint(1, 1000)))
+        else:
+            cmds.append("CHECKPOINT %s" % (randhash()))
+    return cmds
+
+
+def frame(cmd):
+    data = cmd.encode("ascii")
+    return struct.pack(">I", len(data)) + data
+
+
+def sync(s, binary):
+    # STATUSALL is answered after all preceding commands have been applied
+    if binary:
+        s.sendall(frame("STATUSALL"))
+    else:
+        s.sendall(b"STATUSALL\r\n")
+    buf = b""
+    while b"STATUSALL" not in buf:
+        data = s.recv(65536)
+        if not data:
+            raise IOError("connection closed")
+        buf += data
+
+
+def run(s, name, cmds, binary, batch):
+    if binary:
+        s.sendall(b"FRAMING BINARY\r\n")
+        enc = frame
+    else:
+        enc = lambda c: (c + "\r\n").encode("ascii")
+
+    start = time.time()
+    for i in range(0, len(cmds), BATCHSIZE):
+        chunk = cmds[i:i + BATCHSIZE]
+        if batch:
+            msg = enc("BATCH %d" % len(chunk)) + b"".join(enc(c) for c in chunk)
+            s.sendall(msg)
+        else:
+            for c in chunk:
+                s.sendall(enc(c))
+    sync(s, binary)
+    elapsed = time.time() - start
+    print("%-14s %8d cmds %8.3f s %10.0f cmds/s" % (name, len(cmds), elapsed, len(cmds) / elapsed))
+    if binary:
+        s.sendall(frame("FRAMING TEXT"))
+
+
+def main():
+    host, port = "127.0.0.1", 62481
+    n = 100000
+    if len(sys.argv) > 1:
+        host, port = sys.argv[1].split(":")
+        port = int(port)
+    if len(sys.argv) > 2:
+        n = int(sys.argv[2])
+    addr = (host, port)
+    cmds = makecmds(n)
+
+    # Note: swift shuts down when the CMD connection is closed
+    s = socket.create_connection(addr)
+    run(s, "text", cmds, False, False)
+    run(s, "text batch", cmds, False, True)
+    run(s, "binary", cmds, True, False)
+    run(s, "binary batch", cmds, True, True)
+    s.close()
+
+
+if __name__ == "__main__":
+    main()
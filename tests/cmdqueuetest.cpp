@@ -0,0 +1,157 @@
+/*
+ *  cmdqueuetest.cpp
+ *  API calls from other threads through the command queue
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include <pthread.h>
+#include <gtest/gtest.h>
+
+using namespace swift;
+
+#define CMDTEST_THREADS     4
+#define CMDTEST_COMMANDS    10000
+
+
+static int run_count;       // event loop thread only
+static int run_order_bad;
+
+struct producer_t {
+    int         id;
+    int         last;       // last sequence number run
+};
+
+struct seqcmd_t {
+    producer_t  *producer;
+    int         seq;
+};
+
+
+static void Count(void *arg)
+{
+    seqcmd_t *c = (seqcmd_t *)arg;
+    // FIFO per producer
+    if (c->seq != c->producer->last+1)
+        run_order_bad++;
+    c->producer->last = c->seq;
+    run_count++;
+    delete c;
+}
+
+
+static void *Produce(void *arg)
+{
+    producer_t *p = (producer_t *)arg;
+    for (int i=0; i<CMDTEST_COMMANDS; i++) {
+        seqcmd_t *c = new seqcmd_t;
+        c->producer = p;
+        c->seq = i;
+        Submit(Count,c);
+    }
+    return NULL;
+}
+
+
+static void RunLoopUntil(int *count, int target)
+{
+    tint deadline = usec_time()+10*TINT_SEC;
+    while (*count < target && usec_time() < deadline)
+        event_base_loop(Channel::evbase,EVLOOP_ONCE|EVLOOP_NONBLOCK);
+}
+
+
+TEST(CmdQueueTest,NotInstalled) {
+
+    EXPECT_EQ(-1,Submit(Count,NULL));
+
+}
+
+TEST(CmdQueueTest,ManyProducers) {
+
+    ASSERT_EQ(0,InstallCommandQueue());
+    EXPECT_EQ(0,InstallCommandQueue());
+    run_count = run_order_bad = 0;
+
+    producer_t producers[CMDTEST_THREADS];
+    pthread_t threads[CMDTEST_THREADS];
+    for (int i=0; i<CMDTEST_THREADS; i++) {
+        producers[i].id = i;
+        producers[i].last = -1;
+        ASSERT_EQ(0,pthread_create(&threads[i],NULL,Produce,&producers[i]));
+    }
+    RunLoopUntil(&run_count,CMDTEST_THREADS*CMDTEST_COMMANDS);
+    for (int i=0; i<CMDTEST_THREADS; i++)
+        pthread_join(threads[i],NULL);
+
+    EXPECT_EQ(CMDTEST_THREADS*CMDTEST_COMMANDS,run_count);
+    EXPECT_EQ(0,run_order_bad);
+    EXPECT_EQ(0,RunCommands());
+
+}
+
+
+struct opencmd_t {
+    std::string filename;
+    int         fd;
+    uint64_t    size;
+};
+
+static void OpenCmd(void *arg)
+{
+    opencmd_t *o = (opencmd_t *)arg;
+    o->fd = swift::Open(o->filename);
+    o->size = o->fd >= 0 ? swift::Size(o->fd) : 0;
+}
+
+static int waited;
+
+static void *OpenWaiting(void *arg)
+{
+    SubmitWait(OpenCmd,arg);
+    waited = 1;
+    return NULL;
+}
+
+TEST(CmdQueueTest,Wait) {
+
+    ASSERT_EQ(0,InstallCommandQueue());
+    FILE *fp = fopen_utf8("cmdqueuetest.dat","wb");
+    ASSERT_TRUE(fp != NULL);
+    for (int i=0; i<10000; i++)
+        fputc(i>>3,fp);
+    fclose(fp);
+    remove_utf8("cmdqueuetest.dat.mhash");
+    remove_utf8("cmdqueuetest.dat.mbinmap");
+
+    opencmd_t o;
+    o.filename = "cmdqueuetest.dat";
+    o.fd = -1;
+    waited = 0;
+    pthread_t thread;
+    ASSERT_EQ(0,pthread_create(&thread,NULL,OpenWaiting,&o));
+    RunLoopUntil(&waited,1);
+    pthread_join(thread,NULL);
+    EXPECT_EQ(1,waited);
+    EXPECT_GE(o.fd,0);
+    EXPECT_EQ(10000,o.size);
+
+    swift::Close(o.fd);
+
+    // On the loop thread itself it just runs
+    o.fd = -1;
+    EXPECT_EQ(0,SubmitWait(OpenCmd,&o));
+    EXPECT_GE(o.fd,0);
+    swift::Close(o.fd);
+
+}
+
+int main (int argc, char** argv) {
+
+    swift::LibraryInit();
+    Channel::evbase = event_base_new();
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+
+}
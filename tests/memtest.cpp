@@ -0,0 +1,82 @@
+/*
+ *  memtest.cpp
+ *  memory accounting of the per transfer and per channel structures
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include <gtest/gtest.h>
+
+using namespace swift;
+
+
+TEST(MemTest,BinmapGrows) {
+
+    binmap_t b;
+    size_t empty = b.total_size();
+    EXPECT_GT(empty,sizeof(binmap_t)-1);
+    for (int i=0; i<100000; i+=100)
+        b.set(bin_t(0,i));
+    EXPECT_GT(b.total_size(),empty);
+
+}
+
+TEST(MemTest,TbqueueGrows) {
+
+    tbqueue q;
+    size_t empty = tbqueue_mem_size(q);
+    EXPECT_GT(empty,0);
+    for (int i=0; i<10000; i++)
+        q.push_back(tintbin(i,bin_t(0,i)));
+    EXPECT_GT(tbqueue_mem_size(q),10000*sizeof(tintbin));
+
+}
+
+TEST(MemTest,LazyTbqueue) {
+
+    lazytbqueue q;
+    EXPECT_EQ(0,q.mem_size());
+    EXPECT_TRUE(q.begin() == q.end());
+    for (int i=0; i<100; i++)
+        q.push_back(tintbin(i,bin_t(0,i)));
+    EXPECT_GT(q.mem_size(),100*sizeof(tintbin));
+    q.release();
+    EXPECT_EQ(100,q.size());
+    lazytbqueue copy = q;
+    while (!q.empty())
+        q.pop_front();
+    q.release();
+    EXPECT_EQ(0,q.mem_size());
+    EXPECT_EQ(100,copy.size());
+    EXPECT_EQ(bin_t(0,99),copy.back().bin);
+
+}
+
+TEST(MemTest,Availability) {
+
+    Availability avail;
+    EXPECT_EQ(0,avail.mem_size());
+    avail.setSize(1000);
+    // 1024 leaves plus the layers above them
+    EXPECT_EQ(2047,avail.mem_size());
+
+}
+
+TEST(MemTest,Sum) {
+
+    memusage_t a, b;
+    a.hashtree = 10; a.mhash = 100; a.nchannels = 1;
+    b.chanbinmaps = 5; b.chanqueues = 7; b.nchannels = 2;
+    a += b;
+    EXPECT_EQ(122,a.total());
+    EXPECT_EQ(3,a.nchannels);
+
+}
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
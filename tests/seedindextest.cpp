@@ -0,0 +1,225 @@
+/*
+ *  seedindextest.cpp
+ *  lazy-open seed dir: indexing, opening on request, closing when idle
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include <gtest/gtest.h>
+
+using namespace swift;
+
+#define SEEDTEST_DIR     "seedindextest.d"
+#define SEEDTEST_NFILES  3
+#define SEEDTEST_SIZE    (10*1024+7)
+
+
+static std::string FileName(int f)
+{
+    char name[32];
+    sprintf(name,"file%d",f);
+    return std::string(SEEDTEST_DIR)+FILE_SEP+name;
+}
+
+
+static void CreateContent()
+{
+    mkdir_utf8(SEEDTEST_DIR);
+    for (int f=0; f<SEEDTEST_NFILES; f++) {
+        FILE *fp = fopen_utf8(FileName(f).c_str(),"wb");
+        ASSERT_TRUE(fp != NULL);
+        for (int i=0; i<SEEDTEST_SIZE; i++)
+            fputc((i*7919+f)>>3,fp);
+        fclose(fp);
+        remove_utf8(FileName(f)+".mhash");
+        remove_utf8(FileName(f)+".mbinmap");
+    }
+}
+
+
+static int OpenTransfers()
+{
+    int count = 0;
+    for (int i=0; i<FileTransfer::files.size(); i++)
+        if (FileTransfer::files[i] != NULL)
+            count++;
+    return count;
+}
+
+
+TEST(SeedIndexTest,LazyOpen) {
+
+    SeedIndex index;
+    // First scan checkpoints, but leaves nothing open
+    EXPECT_EQ(SEEDTEST_NFILES,index.Scan(SEEDTEST_DIR));
+    EXPECT_EQ(0,OpenTransfers());
+
+    Sha1Hash root_hash;
+    uint32_t chunk_size = 0;
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(FileName(1)+".mbinmap",&root_hash,&chunk_size));
+    EXPECT_EQ(SWIFT_DEFAULT_CHUNK_SIZE,chunk_size);
+
+    FileTransfer *ft = index.Find(root_hash);
+    ASSERT_TRUE(ft != NULL);
+    EXPECT_EQ(root_hash,ft->root_hash());
+    EXPECT_TRUE(ft->hashtree()->is_complete());
+    EXPECT_EQ(SEEDTEST_SIZE,ft->hashtree()->size());
+    EXPECT_EQ(1,OpenTransfers());
+    // Found again, not opened twice
+    EXPECT_EQ(ft,index.Find(root_hash));
+    EXPECT_EQ(1,OpenTransfers());
+
+    EXPECT_TRUE(index.Find(Sha1Hash("not there",9)) == NULL);
+
+    // No channels, so a rescan closes it
+    EXPECT_EQ(SEEDTEST_NFILES,index.Scan(SEEDTEST_DIR));
+    EXPECT_EQ(0,OpenTransfers());
+
+}
+
+TEST(SeedIndexTest,KeptOpen) {
+
+    SeedIndex index;
+    EXPECT_EQ(SEEDTEST_NFILES,index.Scan(SEEDTEST_DIR));
+
+    Sha1Hash root_hash;
+    uint32_t chunk_size = 0;
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(FileName(2)+".mbinmap",&root_hash,&chunk_size));
+
+    // As opened for a gateway request: not closed when idle
+    FileTransfer *ft = index.Find(root_hash,false);
+    ASSERT_TRUE(ft != NULL);
+    int fd = ft->fd();
+    index.Scan(SEEDTEST_DIR);
+    EXPECT_EQ(ft,FileTransfer::file(fd));
+    swift::Close(fd);
+
+}
+
+TEST(SeedIndexTest,Removed) {
+
+    SeedIndex index;
+    EXPECT_EQ(SEEDTEST_NFILES,index.Scan(SEEDTEST_DIR));
+
+    Sha1Hash root_hash;
+    uint32_t chunk_size = 0;
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(FileName(0)+".mbinmap",&root_hash,&chunk_size));
+    remove_utf8(FileName(0));
+    remove_utf8(FileName(0)+".mhash");
+    remove_utf8(FileName(0)+".mbinmap");
+
+    EXPECT_EQ(SEEDTEST_NFILES-1,index.Scan(SEEDTEST_DIR));
+    EXPECT_TRUE(index.Find(root_hash) == NULL);
+
+}
+
+TEST(SeedIndexTest,AddRemove) {
+
+    SeedIndex index;
+    int before = index.Scan(SEEDTEST_DIR);
+
+    std::string filename = std::string(SEEDTEST_DIR)+FILE_SEP+"added";
+    FILE *fp = fopen_utf8(filename.c_str(),"wb");
+    ASSERT_TRUE(fp != NULL);
+    for (int i=0; i<SEEDTEST_SIZE; i++)
+        fputc(i>>2,fp);
+    fclose(fp);
+    remove_utf8(filename+".mhash");
+    remove_utf8(filename+".mbinmap");
+
+    // As reported by the directory watcher
+    EXPECT_EQ(0,index.Add("added"));
+    EXPECT_EQ(before+1,index.size());
+    EXPECT_EQ(0,index.Add("added"));
+    EXPECT_EQ(before+1,index.size());
+
+    Sha1Hash root_hash;
+    uint32_t chunk_size = 0;
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(filename+".mbinmap",&root_hash,&chunk_size));
+    FileTransfer *ft = index.Find(root_hash);
+    ASSERT_TRUE(ft != NULL);
+    int fd = ft->fd();
+
+    index.Remove("added");
+    EXPECT_EQ(before,index.size());
+    EXPECT_TRUE(FileTransfer::file(fd) == NULL);
+    EXPECT_TRUE(index.Find(root_hash) == NULL);
+
+}
+
+TEST(SeedIndexTest,MaxOpen) {
+
+    SeedIndex index;
+    EXPECT_EQ(SEEDTEST_NFILES,index.Scan(SEEDTEST_DIR));
+    index.SetMaxOpen(1);
+
+    Sha1Hash root_hash1, root_hash2;
+    uint32_t chunk_size = 0;
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(FileName(1)+".mbinmap",&root_hash1,&chunk_size));
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(FileName(2)+".mbinmap",&root_hash2,&chunk_size));
+
+    // A channel keeps it from being closed as idle
+    FileTransfer *ft1 = index.Find(root_hash1);
+    ASSERT_TRUE(ft1 != NULL);
+    new Channel(ft1,INVALID_SOCKET,Address("127.0.0.1:7001"));
+    EXPECT_EQ(1,OpenTransfers());
+
+    // Over budget, so the least recently used goes
+    FileTransfer *ft2 = index.Find(root_hash2);
+    ASSERT_TRUE(ft2 != NULL);
+    EXPECT_EQ(1,OpenTransfers());
+    EXPECT_EQ(-1,swift::Find(root_hash1));
+
+    // And comes back on demand
+    ft1 = index.Find(root_hash1);
+    ASSERT_TRUE(ft1 != NULL);
+    EXPECT_EQ(1,OpenTransfers());
+    swift::Close(ft1->fd());
+
+}
+
+TEST(SeedIndexTest,MaxChannels) {
+
+    SeedIndex index;
+    EXPECT_EQ(SEEDTEST_NFILES,index.Scan(SEEDTEST_DIR));
+    Sha1Hash root_hash;
+    uint32_t chunk_size = 0;
+    ASSERT_EQ(0,SeedIndex::ReadCheckpointHeader(FileName(1)+".mbinmap",&root_hash,&chunk_size));
+    FileTransfer *ft = index.Find(root_hash,false);
+    ASSERT_TRUE(ft != NULL);
+
+    int before = Channel::open_channels();
+    Channel::MAX_CHANNELS = before+4;
+    Channel *c[4];
+    for (int i=0; i<4; i++)
+        c[i] = new Channel(ft,INVALID_SOCKET,Address((uint32_t)(0x0B000000+i),7000));
+    c[1]->SwitchSendControl(Channel::KEEP_ALIVE_CONTROL);
+
+    // All too young to evict
+    EXPECT_FALSE(Channel::MakeRoom());
+
+    NOW += SWIFT_EVICT_MIN_AGE+TINT_SEC;
+    EXPECT_TRUE(Channel::MakeRoom());
+    EXPECT_EQ(before+3,Channel::open_channels());
+    EXPECT_TRUE(c[1]->IsScheduled4Close());
+
+    // Below budget again, nothing more goes
+    EXPECT_TRUE(Channel::MakeRoom());
+    EXPECT_EQ(before+3,Channel::open_channels());
+
+    Channel::MAX_CHANNELS = 0;
+    swift::Close(ft->fd());
+    EXPECT_EQ(before,Channel::open_channels());
+
+}
+
+int main (int argc, char** argv) {
+
+    swift::LibraryInit();
+    Channel::evbase = event_base_new();
+    CreateContent();
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+
+}
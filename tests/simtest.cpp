@@ -0,0 +1,467 @@
+/*
+ *  simtest.cpp
+ *  small swarms on the virtual-time simulator: completion, reproducibility,
+ *  wire encodings, swarms sharing hosts, flash crowds
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "sim.h"
+#include <gtest/gtest.h>
+
+using namespace swift;
+
+#define SIMTEST_DIR     "simtest.d"
+#define SIMTEST_FILE    SIMTEST_DIR FILE_SEP "content"
+#define SIMTEST_FILE2   SIMTEST_DIR FILE_SEP "content2"
+#define SIMTEST_SIZE    (256*1024+123)
+
+
+static void CreateContent(const char *filename, int salt)
+{
+    mkdir_utf8(SIMTEST_DIR);
+    FILE *fp = fopen_utf8(filename,"wb");
+    ASSERT_TRUE(fp != NULL);
+    for (int i=0; i<SIMTEST_SIZE; i++)
+        fputc(((i*7919)>>3)+salt,fp);
+    fclose(fp);
+    remove_utf8(std::string(filename)+".mhash");
+    remove_utf8(std::string(filename)+".mbinmap");
+}
+
+
+static std::vector<tint> RunSwarm(uint64_t seed, int nleechers, const simlink_t &link)
+{
+    std::vector<tint> done;
+    Simulator sim(seed,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    EXPECT_EQ(0,seeder);
+    if (seeder < 0)
+        return done;
+    for (int i=0; i<nleechers; i++)
+        sim.AddLeecher(sim.peer(seeder).root,link,i*100*TINT_MSEC);
+    EXPECT_TRUE(sim.Run(120*TINT_SEC));
+    for (int i=0; i<sim.peer_count(); i++) {
+        if (sim.peer(i).seeder)
+            continue;
+        EXPECT_NE(TINT_NEVER,sim.peer(i).done_time);
+        EXPECT_EQ(SIMTEST_SIZE,sim.peer(i).transfer->hashtree()->complete());
+        done.push_back(sim.peer(i).done_time);
+    }
+    return done;
+}
+
+
+TEST(SimTest,Complete) {
+
+    simlink_t link;
+    link.upload = 512*1024;
+    std::vector<tint> done = RunSwarm(1,3,link);
+    EXPECT_EQ(3,done.size());
+
+}
+
+TEST(SimTest,Reproducible) {
+
+    simlink_t link;
+    link.upload = 256*1024;
+    link.jitter = 5*TINT_MSEC;
+    std::vector<tint> a = RunSwarm(7,3,link);
+    std::vector<tint> b = RunSwarm(7,3,link);
+    EXPECT_EQ(a,b);
+
+}
+
+TEST(SimTest,Loss) {
+
+    simlink_t link;
+    link.upload = 512*1024;
+    link.loss = 0.05;
+    link.reorder = 0.05;
+    std::vector<tint> done = RunSwarm(3,3,link);
+    EXPECT_EQ(3,done.size());
+
+}
+
+TEST(SimTest,LegacyWire) {
+
+    simlink_t link;
+    link.upload = 512*1024;
+    link.loss = 0.05;
+    uint8_t version = Channel::WIRE_VERSION;
+    Channel::WIRE_VERSION = SWIFT_WIRE_LEGACY;
+    std::vector<tint> done = RunSwarm(5,3,link);
+    Channel::WIRE_VERSION = version;
+    EXPECT_EQ(3,done.size());
+
+}
+
+/** Two swarms seeded by one host and both downloaded by two other hosts,
+ *  returns the datagrams sent. */
+static uint64_t RunSharedHosts(uint8_t version)
+{
+    uint8_t oldversion = Channel::WIRE_VERSION;
+    Channel::WIRE_VERSION = version;
+    simlink_t link;
+    Simulator sim(11,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    int seeder2 = sim.AddSeeder(SIMTEST_FILE2,link,SWIFT_DEFAULT_CHUNK_SIZE,seeder);
+    EXPECT_TRUE(seeder >= 0 && seeder2 >= 0);
+    EXPECT_EQ(sim.peer(seeder).sock,sim.peer(seeder2).sock);
+    for (int h=0; h<2; h++) {
+        int l = sim.AddLeecher(sim.peer(seeder).root,link);
+        sim.AddLeecher(sim.peer(seeder2).root,link,0,SWIFT_DEFAULT_CHUNK_SIZE,l);
+    }
+    EXPECT_TRUE(sim.Run(120*TINT_SEC));
+    uint64_t dgrams = 0;
+    for (int i=0; i<sim.peer_count(); i++) {
+        if (!sim.peer(i).seeder)
+            EXPECT_EQ(SIMTEST_SIZE,sim.peer(i).transfer->hashtree()->complete());
+        dgrams += sim.peer(i).dgrams_sent;
+    }
+    Channel::WIRE_VERSION = oldversion;
+    return dgrams;
+}
+
+TEST(SimTest,Multiplex) {
+
+    // Acknowledgements for both swarms go out together
+    uint64_t compact = RunSharedHosts(SWIFT_WIRE_COMPACT);
+    uint64_t mux = RunSharedHosts(SWIFT_WIRE_MUX);
+    EXPECT_LT(mux,compact*3/4);
+
+}
+
+/** Sequentially complete bytes from offset, the slow way. */
+static uint64_t SeqCompleteScan(FileTransfer *ft, uint64_t offset)
+{
+    uint32_t cs = ft->hashtree()->chunk_size();
+    uint64_t c = offset/cs;
+    while (c < ft->hashtree()->size_in_chunks() && ft->ack_out()->is_filled(bin_t(0,c)))
+        c++;
+    if (c >= ft->hashtree()->size_in_chunks())
+        return ft->hashtree()->size()-offset;
+    return c*cs > offset ? c*cs-offset : 0;
+}
+
+TEST(SimTest,SeqComplete) {
+
+    // Loss and reordering leave holes behind the frontiers
+    simlink_t link;
+    link.upload = 512*1024;
+    link.loss = 0.05;
+    link.reorder = 0.1;
+    Simulator sim(7,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    ASSERT_EQ(0,seeder);
+    int leecher = sim.AddLeecher(sim.peer(seeder).root,link);
+    uint64_t offsets[] = { 0, 1, 100*1024+17, 200*1024, SIMTEST_SIZE-1 };
+    int checks = 0;
+    bool done = false;
+    while (!done && sim.Elapsed() < 120*TINT_SEC) {
+        done = sim.Run(20*TINT_MSEC);
+        FileTransfer *ft = sim.peer(leecher).transfer;
+        if (ft == NULL || ft->hashtree()->size() == 0)
+            continue;
+        for (int i=0; i<sizeof(offsets)/sizeof(offsets[0]); i++)
+            EXPECT_EQ(SeqCompleteScan(ft,offsets[i]),SeqComplete(ft->fd(),offsets[i]));
+        checks++;
+    }
+    EXPECT_TRUE(done);
+    EXPECT_GT(checks,10);
+
+}
+
+static int progress_calls, range_calls, range_outside;
+
+static void CountProgress(int transfer, bin_t bin)
+{
+    progress_calls++;
+}
+
+static void CountRangeProgress(int transfer, bin_t bin)
+{
+    range_calls++;
+    uint64_t cs = swift::ChunkSize(transfer);
+    if ((bin.base_offset()+bin.base_length())*cs <= SIMTEST_SIZE/2)
+        range_outside++;
+}
+
+TEST(SimTest,Progress) {
+
+    simlink_t link;
+    Simulator sim(9,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    ASSERT_EQ(0,seeder);
+    int leecher = sim.AddLeecher(sim.peer(seeder).root,link);
+    progress_calls = range_calls = range_outside = 0;
+    bool subscribed = false, done = false;
+    while (!done && sim.Elapsed() < 120*TINT_SEC) {
+        done = sim.Run(20*TINT_MSEC);
+        FileTransfer *ft = sim.peer(leecher).transfer;
+        if (ft != NULL && !subscribed) {
+            AddProgressCallback(ft->fd(),&CountProgress,0);
+            AddProgressCallback(ft->fd(),&CountRangeProgress,0,SIMTEST_SIZE/2,SIMTEST_SIZE-1);
+            subscribed = true;
+        }
+    }
+    EXPECT_TRUE(done);
+    EXPECT_GT(progress_calls,0);
+    EXPECT_GT(range_calls,0);
+    EXPECT_EQ(0,range_outside);
+
+    // Coalesced until delivered, and only for the range of interest
+    FileTransfer *ft = sim.peer(leecher).transfer;
+    progress_calls = range_calls = 0;
+    ft->NotifyProgress(bin_t(0,0));
+    ft->NotifyProgress(bin_t(1,0));
+    ft->NotifyProgress(bin_t(0,1));
+    EXPECT_EQ(0,progress_calls);
+    FileTransfer::DeliverProgress();
+    EXPECT_EQ(1,progress_calls);
+    EXPECT_EQ(0,range_calls);
+    FileTransfer::DeliverProgress();
+    EXPECT_EQ(1,progress_calls);
+
+}
+
+/** Check the channel indexes of ft against its channel list. */
+static void CheckRegistry(FileTransfer *ft)
+{
+    channels_t chans = ft->GetChannels();
+    uint32_t seeders = 0;
+    int established = 0;
+    for (int i=0; i<chans.size(); i++) {
+        if (chans[i]->IsComplete())
+            seeders++;
+        if (chans[i]->is_established())
+            established++;
+        EXPECT_TRUE(ft->FindChannel(chans[i]->peer(),NULL) != NULL);
+    }
+    EXPECT_EQ(seeders,ft->GetNumSeeders());
+    EXPECT_EQ(chans.size()-seeders,ft->GetNumLeechers());
+    for (int i=0; i<chans.size(); i++) {
+        int id = ft->RandomChannel(chans[i]->id());
+        if (established == 0 || (established == 1 && chans[i]->is_established())) {
+            EXPECT_EQ(-1,id);
+            continue;
+        }
+        ASSERT_NE(-1,id);
+        EXPECT_NE(chans[i]->id(),id);
+        EXPECT_TRUE(Channel::channel(id)->is_established());
+        EXPECT_EQ(ft,&Channel::channel(id)->transfer());
+    }
+}
+
+TEST(SimTest,Registry) {
+
+    simlink_t link;
+    link.upload = 512*1024;
+    Simulator sim(13,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    ASSERT_EQ(0,seeder);
+    for (int i=0; i<4; i++)
+        sim.AddLeecher(sim.peer(seeder).root,link,i*200*TINT_MSEC);
+    bool done = false;
+    int checks = 0, moves = 0;
+    std::vector<uint32_t> versions(sim.peer_count(),0), seeds(sim.peer_count(),0);
+    while (!done && sim.Elapsed() < 120*TINT_SEC) {
+        done = sim.Run(50*TINT_MSEC);
+        for (int p=0; p<sim.peer_count(); p++)
+            if (sim.peer(p).transfer != NULL) {
+                FileTransfer *ft = sim.peer(p).transfer;
+                CheckRegistry(ft);
+                checks++;
+                // The counts may only change along with the version
+                uint32_t version = ft->GetPeersVersion();
+                if (version == versions[p])
+                    EXPECT_EQ(seeds[p],ft->GetNumSeeders());
+                else
+                    moves++;
+                versions[p] = version;
+                seeds[p] = ft->GetNumSeeders();
+            }
+    }
+    EXPECT_TRUE(done);
+    EXPECT_GT(checks,10);
+    // Not bumped by every HAVE and ACK
+    EXPECT_LT(moves,checks/2);
+    EXPECT_GT(sim.peer(seeder).transfer->GetNumSeeders(),0);
+
+}
+
+static int awaited_calls;
+static bool awaited_complete;
+
+static void RangeAwaited(int transfer, uint64_t offset, uint64_t length, void *arg)
+{
+    awaited_calls++;
+    awaited_complete = swift::SeqComplete(transfer,offset) >= length;
+    *(tint *)arg = NOW;
+}
+
+static void RangeBeyondEnd(int transfer, uint64_t offset, uint64_t length, void *arg)
+{
+    *(uint64_t *)arg = length;
+}
+
+TEST(SimTest,AwaitRange) {
+
+    simlink_t link;
+    link.upload = 512*1024;
+    Simulator sim(11,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    ASSERT_EQ(0,seeder);
+    int leecher = sim.AddLeecher(sim.peer(seeder).root,link);
+    awaited_calls = 0;
+    awaited_complete = false;
+    tint awaited_time = TINT_NEVER;
+    // The tail, which the sequential picker would get last
+    uint64_t offset = SIMTEST_SIZE-20*1024, length = 20*1024;
+    uint64_t beyond_length = 1;
+    bool waiting = false, done = false;
+    while (!done && sim.Elapsed() < 120*TINT_SEC) {
+        done = sim.Run(20*TINT_MSEC);
+        FileTransfer *ft = sim.peer(leecher).transfer;
+        if (ft != NULL && !waiting) {
+            EXPECT_EQ(0,ft->hashtree()->size());
+            EXPECT_EQ(0,AwaitRange(ft->fd(),offset,length,&RangeAwaited,&awaited_time));
+            EXPECT_EQ(0,AwaitRange(ft->fd(),offset,length+1,&RangeBeyondEnd,&beyond_length));
+            waiting = true;
+        }
+    }
+    EXPECT_TRUE(done);
+    EXPECT_EQ(1,awaited_calls);
+    EXPECT_TRUE(awaited_complete);
+    EXPECT_LT(awaited_time,sim.peer(leecher).done_time);
+    // Failed once the size came
+    EXPECT_EQ(0,beyond_length);
+
+    // Already there, or never will be
+    int fd = sim.peer(leecher).transfer->fd();
+    EXPECT_EQ(1,AwaitRange(fd,0,length,&RangeAwaited,&awaited_time));
+    EXPECT_EQ(2,awaited_calls);
+    EXPECT_EQ(-1,AwaitRange(fd,offset,length+1,&RangeAwaited,&awaited_time));
+    EXPECT_EQ(-1,AwaitRange(fd,0,0,&RangeAwaited,&awaited_time));
+
+}
+
+TEST(SimTest,Tracker) {
+
+    simlink_t link;
+    link.upload = 512*1024;
+    Simulator sim(17,SIMTEST_DIR);
+    int tracker = sim.AddTracker(link);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    for (int i=0; i<3; i++)
+        sim.AddLeecher(sim.peer(seeder).root,link,i*TINT_SEC);
+    // Peers only learn of each other from the tracker
+    EXPECT_TRUE(sim.Run(120*TINT_SEC));
+    ASSERT_TRUE(sim.tracker() != NULL);
+    EXPECT_EQ(1,sim.tracker()->swarms());
+    EXPECT_EQ(4,sim.tracker()->members());
+    EXPECT_GE(sim.tracker()->handshakes(),4);
+
+    // Which closed every channel to it, they go on the next clean up
+    for (int p=0; p<sim.peer_count(); p++) {
+        if (sim.peer(p).transfer == NULL)
+            continue;
+        Channel *c = sim.peer(p).transfer->FindChannel(sim.peer(tracker).addr,NULL);
+        EXPECT_TRUE(c == NULL || (!c->is_established() && c->IsScheduled4Close()));
+    }
+
+}
+
+/** Three leechers served statelessly by a zero-state seeder, everyone
+ *  at wire version. */
+static void RunZeroStateless(uint8_t version)
+{
+    uint8_t oldversion = Channel::WIRE_VERSION;
+    Channel::WIRE_VERSION = version;
+    simlink_t link;
+    link.upload = 512*1024;
+    Simulator sim(19,SIMTEST_DIR);
+
+    // Content, hashes and checkpoint named by root hash, as ZeroState wants
+    std::string zerodir = std::string(SIMTEST_DIR)+FILE_SEP+"zero";
+    std::string path = zerodir+FILE_SEP+"content";
+    mkdir_utf8(zerodir);
+    CreateContent(path.c_str(),2);
+    int fd = swift::Open(path);
+    ASSERT_GE(fd,0);
+    Sha1Hash root = FileTransfer::file(fd)->root_hash();
+    ASSERT_EQ(0,swift::Checkpoint(fd));
+    swift::Close(fd);
+    std::string zeropath = zerodir+FILE_SEP+root.hex();
+    ASSERT_EQ(0,rename(path.c_str(),zeropath.c_str()));
+    ASSERT_EQ(0,rename((path+".mhash").c_str(),(zeropath+".mhash").c_str()));
+    ASSERT_EQ(0,rename((path+".mbinmap").c_str(),(zeropath+".mbinmap").c_str()));
+
+    ZeroState *zs = ZeroState::GetInstance();
+    zs->SetContentDir(zerodir);
+    zs->SetStateless(true);
+    int seeder = sim.AddZeroSeeder(root,link);
+    for (int i=0; i<3; i++)
+        sim.AddLeecher(root,link,i*TINT_SEC);
+    EXPECT_TRUE(sim.Run(120*TINT_SEC));
+    for (int i=0; i<sim.peer_count(); i++)
+        if (!sim.peer(i).seeder)
+            EXPECT_EQ(SIMTEST_SIZE,sim.peer(i).transfer->hashtree()->complete());
+
+    // Served without a single channel
+    FileTransfer *ft = FileTransfer::Find(root,sim.peer(seeder).sock);
+    ASSERT_TRUE(ft != NULL);
+    EXPECT_TRUE(ft->IsZeroState());
+    EXPECT_EQ(0,ft->GetChannels().size());
+    EXPECT_EQ(3,zs->cookie_peer_count());
+
+    zs->SetStateless(false);
+    swift::Close(ft->fd());
+    Channel::WIRE_VERSION = oldversion;
+}
+
+TEST(SimTest,ZeroStateless) {
+
+    RunZeroStateless(Channel::WIRE_VERSION);
+
+}
+
+TEST(SimTest,ZeroStatelessLegacy) {
+
+    // No VERSION from the leechers, the seeder must not send HAVE ALL
+    RunZeroStateless(SWIFT_WIRE_LEGACY);
+
+}
+
+TEST(SimTest,SharedPayload) {
+
+    // A flash crowd asks the seeder for the same chunks at the same time
+    simlink_t link;
+    Simulator sim(23,SIMTEST_DIR);
+    int seeder = sim.AddSeeder(SIMTEST_FILE,link);
+    for (int i=0; i<8; i++)
+        sim.AddLeecher(sim.peer(seeder).root,link);
+    uint64_t reads = Channel::global_data_reads, bytes = Channel::global_bytes_up;
+    uint64_t dgrams = Channel::global_dgrams_up, syscalls = Channel::global_syscalls_up;
+    EXPECT_TRUE(sim.Run(120*TINT_SEC));
+    for (int i=0; i<sim.peer_count(); i++)
+        if (!sim.peer(i).seeder)
+            EXPECT_EQ(SIMTEST_SIZE,sim.peer(i).transfer->hashtree()->complete());
+
+    // Each chunk read once for the DATA to several peers, sent to them
+    // in one go
+    uint64_t chunks = (Channel::global_bytes_up-bytes+SWIFT_DEFAULT_CHUNK_SIZE-1)/SWIFT_DEFAULT_CHUNK_SIZE;
+    EXPECT_LT(Channel::global_data_reads-reads,chunks/4);
+    EXPECT_LT(Channel::global_syscalls_up-syscalls,(Channel::global_dgrams_up-dgrams)*3/4);
+
+}
+
+int main (int argc, char** argv) {
+
+    swift::LibraryInit();
+    CreateContent(SIMTEST_FILE,0);
+    CreateContent(SIMTEST_FILE2,1);
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+
+}
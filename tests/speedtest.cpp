@@ -0,0 +1,79 @@
+/*
+ *  speedtest.cpp
+ *  bucketed moving average speed on the cached clock
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include <gtest/gtest.h>
+
+using namespace swift;
+
+
+TEST(SpeedTest,Steady) {
+
+    MovingAverageSpeed s;
+    // 1000 bytes every 10 ms is 100 KB/s
+    for (int i=0; i<1000; i++) {
+        NOW += 10*TINT_MSEC;
+        s.AddPoint(1000);
+    }
+    EXPECT_NEAR(100000.0,s.GetSpeed(),100000.0*0.01);
+    EXPECT_EQ(s.GetSpeed(),s.GetSpeedNeutral());
+    // Wherever NOW is in the current bucket
+    for (int i=0; i<25; i++) {
+        NOW += 10*TINT_MSEC;
+        s.AddPoint(1000);
+        EXPECT_NEAR(100000.0,s.GetSpeed(),100000.0*0.01);
+    }
+
+}
+
+TEST(SpeedTest,Young) {
+
+    MovingAverageSpeed s(5*TINT_SEC,TINT_SEC);
+    s.AddPoint(1000);
+    // Over the fudge, not over the full window
+    EXPECT_NEAR(1000.0,s.GetSpeed(),1.0);
+
+}
+
+TEST(SpeedTest,Decays) {
+
+    MovingAverageSpeed s;
+    for (int i=0; i<100; i++) {
+        NOW += 10*TINT_MSEC;
+        s.AddPoint(1000);
+    }
+    EXPECT_GT(s.GetSpeed(),0.0);
+    // Nothing added, still falls out of the window
+    NOW += 5*TINT_SEC;
+    EXPECT_EQ(0.0,s.GetSpeed());
+    EXPECT_EQ(0,s.GetBytes());
+
+}
+
+TEST(SpeedTest,Reset) {
+
+    MovingAverageSpeed s;
+    NOW += 10*TINT_SEC;
+    s.AddPoint(1000);
+    s.Reset();
+    EXPECT_EQ(0.0,s.GetSpeed());
+    // Points right after a reset are ignored
+    s.AddPoint(1000);
+    EXPECT_EQ(0,s.GetBytes());
+    NOW += 2*TINT_SEC;
+    s.AddPoint(1000);
+    EXPECT_EQ(1000,s.GetBytes());
+
+}
+
+int main (int argc, char** argv) {
+
+	Channel::Time();
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
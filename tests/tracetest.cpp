@@ -0,0 +1,99 @@
+/*
+ *  tracetest.cpp
+ *  binary event trace: categories, rendering, ring drain to file
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <string.h>
+#include "trace.h"
+#include <gtest/gtest.h>
+
+using namespace swift;
+
+
+TEST(TraceTest,ParseCategories) {
+
+    EXPECT_EQ(TRACE_CAT_DATA|TRACE_CAT_ACK,TraceParseCategories("data,ack"));
+    EXPECT_EQ(TRACE_CAT_ALL,TraceParseCategories("all"));
+    EXPECT_EQ(TRACE_CAT_NONE,TraceParseCategories("bogus"));
+    EXPECT_EQ(TRACE_CAT_HINT,TraceParseCategories("bogus,hint"));
+
+}
+
+TEST(TraceTest,Format) {
+
+    trace_record_t rec;
+    rec.time = 5*TINT_SEC + 3*TINT_MSEC + 7;
+    rec.channel = 3;
+    rec.event = TRACE_EV_DATA_IN;
+    rec.thread = 0;
+    rec.bin = bin_t(0,5).toUInt();
+    rec.arg = 0;
+    char line[256];
+    EXPECT_STREQ("0_00_05_003_007 #3 -data (0,5)",TraceFormat(rec,0,line,sizeof(line)));
+
+    rec.event = TRACE_EV_HINT_OUT;
+    rec.bin = bin_t(2,1).toUInt();
+    rec.arg = 12;
+    EXPECT_STREQ("0_00_05_003_007 #3 +hint (2,1) [12]\n0_00_05_003_007 #3 +hint base (0,4) width 4",
+        TraceFormat(rec,0,line,sizeof(line)));
+
+    // As mfold/logparse wants them
+    rec.event = TRACE_EV_SEND;
+    rec.bin = ((uint64_t)0x7f000001<<16)|7001;
+    rec.arg = ((uint64_t)0xabc<<32)|1109;
+    EXPECT_STREQ("0_00_05_003_007 #3 sent 1109b 127.0.0.1:7001:abc",TraceFormat(rec,0,line,sizeof(line)));
+
+    rec.event = TRACE_EV_PEX_IN;
+    rec.bin = ((uint64_t)0x0a000102<<16)|7002;
+    rec.arg = 1;
+    EXPECT_STREQ("0_00_05_003_007 #3 -pex 10.0.1.2:7002",TraceFormat(rec,0,line,sizeof(line)));
+
+    rec.event = TRACE_EV_ACK_OUT;
+    rec.bin = bin_t(0,5).toUInt();
+    rec.arg = 4*TINT_SEC;
+    EXPECT_STREQ("0_00_05_003_007 #3 +ack (0,5) 0_00_04_000_000",TraceFormat(rec,0,line,sizeof(line)));
+
+}
+
+TEST(TraceTest,RoundTrip) {
+
+    std::string filename = gettmpdir_utf8() + FILE_SEP + "tracetest.trace";
+    ASSERT_TRUE(TraceOpen(filename,TRACE_CAT_DATA,1000));
+    TraceEmit(NULL,1000,2000,TRACE_EV_DATA_OUT,1,bin_t(0,1),0);
+    TraceEmit(NULL,1000,2001,TRACE_EV_ACK_IN,1,bin_t(0,1),42); // filtered
+    TraceEmit(NULL,1000,2002,TRACE_EV_DATA_IN,2,bin_t(1,0),0);
+    TraceClose();
+
+    FILE *fp = fopen_utf8(filename.c_str(),"rb");
+    ASSERT_TRUE(fp != NULL);
+    char magic[8];
+    uint32_t recsize;
+    tint epoch;
+    ASSERT_EQ(8,fread(magic,1,8,fp));
+    EXPECT_EQ(0,memcmp(magic,TRACE_FILE_MAGIC,8));
+    ASSERT_EQ(1,fread(&recsize,sizeof(recsize),1,fp));
+    EXPECT_EQ(sizeof(trace_record_t),recsize);
+    ASSERT_EQ(1,fread(&epoch,sizeof(epoch),1,fp));
+    EXPECT_EQ(1000,epoch);
+
+    trace_record_t recs[3];
+    ASSERT_EQ(2,fread(recs,sizeof(trace_record_t),3,fp));
+    EXPECT_EQ(TRACE_EV_DATA_OUT,recs[0].event);
+    EXPECT_EQ(2000,recs[0].time);
+    EXPECT_EQ(TRACE_EV_DATA_IN,recs[1].event);
+    EXPECT_EQ(2,recs[1].channel);
+    EXPECT_EQ(bin_t(1,0),bin_t(recs[1].bin));
+    EXPECT_EQ(0,TraceDropped());
+    fclose(fp);
+    remove_utf8(filename);
+
+}
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,125 @@
+# see LICENSE.txt for license information
+#
+# Measures SOCKTUNNEL throughput in both directions:
+#  - TCP->UDP: TUNNELSEND commands on the CMD connection, datagrams counted
+#    at a local UDP socket;
+#  - UDP->TCP: datagrams on channel 0xffffffff sent to swift's UDP port,
+#    TUNNELRECV messages counted on the CMD connection.
+# Run against a swift started with e.g.
+#   swift -c 127.0.0.1:62481 -l 127.0.0.1:6778
+#
+# Usage: tunnelbench.py [cmdhost:port] [udphost:port] [ndgrams] [size]
+
+from __future__ import print_function
+
+import sys
+import socket
+import threading
+import time
+
+TUNNEL_CHANNEL = b"\xff\xff\xff\xff"
+
+
+def addr(s):
+    host, port = s.split(":")
+    return (host, int(port))
+
+
+def tcp2udp(cmd, n, size):
+    us = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    us.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 * 1024 * 1024)
+    us.bind(("127.0.0.1", 0))
+    us.settimeout(2.0)
+    dest = "%s:%d" % us.getsockname()
+
+    got = [0, 0]
+
+    def receiver():
+        while got[0] < n:
+            try:
+                msg = us.recv(65536)
+            except socket.timeout:
+                break
+            got[0] += 1
+            got[1] += len(msg) - 4
+
+    t = threading.Thread(target=receiver)
+    t.daemon = True
+    t.start()
+
+    payload = b"x" * size
+    msg = ("TUNNELSEND %s/ffffffff %d\r\n" % (dest, size)).encode("ascii") + payload
+    start = time.time()
+    for i in range(n):
+        cmd.sendall(msg)
+    t.join()
+    elapsed = time.time() - start
+    report("tcp->udp", got[0], n, got[1], elapsed)
+    us.close()
+
+
+def udp2tcp(cmd, udpaddr, n, size):
+    us = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    payload = TUNNEL_CHANNEL + b"y" * size
+
+    got = [0, 0]
+
+    def receiver():
+        buf = b""
+        cmd.settimeout(2.0)
+        while got[0] < n:
+            try:
+                data = cmd.recv(1024 * 1024)
+            except socket.timeout:
+                break
+            if not data:
+                break
+            buf += data
+            while True:
+                eol = buf.find(b"\r\n")
+                if eol < 0:
+                    break
+                hdr = buf[:eol].split()
+                if hdr[0] != b"TUNNELRECV":
+                    buf = buf[eol + 2:]
+                    continue
+                nbytes = int(hdr[2])
+                if len(buf) < eol + 2 + nbytes:
+                    break
+                buf = buf[eol + 2 + nbytes:]
+                got[0] += 1
+                got[1] += nbytes
+
+    t = threading.Thread(target=receiver)
+    t.daemon = True
+    t.start()
+
+    start = time.time()
+    for i in range(n):
+        us.sendto(payload, udpaddr)
+    t.join()
+    elapsed = time.time() - start
+    report("udp->tcp", got[0], n, got[1], elapsed)
+    us.close()
+
+
+def report(name, got, sent, nbytes, elapsed):
+    print("%-9s %7d/%7d dgrams %8.3f s %10.0f dgrams/s %8.2f MB/s" %
+          (name, got, sent, elapsed, got / elapsed, nbytes / elapsed / 1e6))
+
+
+def main():
+    cmdaddr = addr(sys.argv[1]) if len(sys.argv) > 1 else ("127.0.0.1", 62481)
+    udpaddr = addr(sys.argv[2]) if len(sys.argv) > 2 else ("127.0.0.1", 6778)
+    n = int(sys.argv[3]) if len(sys.argv) > 3 else 100000
+    size = int(sys.argv[4]) if len(sys.argv) > 4 else 1024
+
+    # Note: swift shuts down when the CMD connection is closed
+    cmd = socket.create_connection(cmdaddr)
+    tcp2udp(cmd, n, size)
+    udp2tcp(cmd, udpaddr, n, size)
+    cmd.close()
+
+
+if __name__ == "__main__":
+    main()
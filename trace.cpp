@@ -0,0 +1,271 @@
+/*
+ *  trace.cpp
+ *  low-overhead binary event tracing for the protocol hot path
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <string.h>
+#include "trace.h"
+
+using namespace swift;
+
+
+/*
+ * Event table. Formats reproduce the dprintf lines these events replaced,
+ * such that mfold/logparse works on decoded traces too. Unless TraceFormat()
+ * says otherwise, a format gets (time string, channel, bin string, arg).
+ */
+const trace_event_info_t swift::trace_events[TRACE_EV_COUNT] = {
+    { TRACE_CAT_NONE, "none",       "%s #%u none %s %lli" },
+    { TRACE_CAT_SEND, "send",       "%s #%u sent %lib %u.%u.%u.%u:%u:%x" },
+    { TRACE_CAT_RECV, "recv",       "%s #%u recvd %lib" },
+    { TRACE_CAT_SEND, "requeue",    "%s #%u requeue for %s in %lli" },
+    { TRACE_CAT_DATA, "data_out",   "%s #%u +data %s" },
+    { TRACE_CAT_DATA, "data_in",    "%s #%u -data %s" },
+    { TRACE_CAT_DATA, "data_dup",   "%s #%u Ddata %s" },
+    { TRACE_CAT_DATA, "data_bad",   "%s #%u !data %s" },
+    { TRACE_CAT_ACK,  "ack_out",    "%s #%u +ack %s %s" },
+    { TRACE_CAT_ACK,  "ack_in",     "%s #%u -ack %s %lli" },
+    { TRACE_CAT_HAVE, "have_out",   "%s #%u +have %s" },
+    { TRACE_CAT_HAVE, "have_in",    "%s #%u -have %s" },
+    { TRACE_CAT_HINT, "hint_out",   "%s #%u +hint %s [%lli]" },
+    { TRACE_CAT_HINT, "hint_in",    "%s #%u -hint %s" },
+    { TRACE_CAT_HINT, "dequeued",   "%s #%u dequeued %s [%lli]" },
+    { TRACE_CAT_HASH, "hash_out",   "%s #%u +hash %s" },
+    { TRACE_CAT_HASH, "hash_in",    "%s #%u -hash %s" },
+    { TRACE_CAT_HASH, "phash_out",  "%s #%u +phash %s" },
+    { TRACE_CAT_LOSS, "data_tmo",   "%s #%u Tdata %s" },
+    { TRACE_CAT_LOSS, "data_reord", "%s #%u Rdata %s" },
+    { TRACE_CAT_ACK,  "ack_unknown","%s #%u ?ack %s %lli" },
+    { TRACE_CAT_PEX,  "pex_out",    "%s #%u +pex %u.%u.%u.%u:%u" },
+    { TRACE_CAT_PEX,  "pex_in",     "%s #%u -pex %u.%u.%u.%u:%u" },
+};
+
+
+uint32_t swift::trace_mask = TRACE_CAT_NONE;
+
+
+/*
+ * Per-thread rings. Each ring has a single producer (its thread) and a
+ * single consumer (TraceFlush on the event loop thread), so head and tail
+ * only need ordering, no locks. When a ring is full, records are dropped
+ * and counted rather than overwriting unread ones.
+ */
+struct trace_ring_t {
+    trace_record_t          recs[TRACE_RING_RECORDS];
+    volatile uint64_t       head;   // written by producer
+    volatile uint64_t       tail;   // written by consumer
+    volatile uint64_t       dropped;
+    uint16_t                thread;
+    trace_ring_t            *next;
+};
+
+static trace_ring_t * volatile trace_rings = NULL;
+static SWIFT_THREAD_LOCAL trace_ring_t *trace_myring = NULL;
+static volatile int trace_nthreads = 0;
+static FILE *trace_fp = NULL;
+
+
+static trace_ring_t *TraceRegisterRing()
+{
+    trace_ring_t *r = new trace_ring_t;
+    r->head = r->tail = r->dropped = 0;
+    r->thread = (uint16_t)swift_fetch_add(&trace_nthreads,1);
+    do {
+        r->next = trace_rings;
+    } while (!swift_cas_ptr(&trace_rings,r->next,r));
+    return r;
+}
+
+
+void swift::TraceEmit(FILE* textfp, tint epoch, tint time, trace_event_t ev, uint32_t channel, bin_t bin, uint64_t arg)
+{
+    trace_record_t rec;
+    rec.time = time;
+    rec.channel = channel;
+    rec.event = ev;
+    rec.bin = bin.toUInt();
+    rec.arg = arg;
+
+    if (trace_fp != NULL && (trace_mask & trace_events[ev].cat))
+    {
+        trace_ring_t *r = trace_myring;
+        if (r == NULL)
+            r = trace_myring = TraceRegisterRing();
+        rec.thread = r->thread;
+        if (r->head - r->tail >= TRACE_RING_RECORDS)
+            r->dropped++;
+        else {
+            r->recs[r->head & (TRACE_RING_RECORDS-1)] = rec;
+            swift_membar(); // record visible before head moves
+            r->head++;
+        }
+    }
+    if (textfp != NULL)
+    {
+        char line[256];
+        rec.thread = 0;
+        fprintf(textfp,"%s\n",TraceFormat(rec,epoch,line,sizeof(line)));
+    }
+}
+
+
+/** As tintstr(), relative to epoch. */
+static const char* TraceTimeStr(tint time, tint epoch, char* buf)
+{
+    if (time == TINT_NEVER)
+        return "NEVER";
+    time -= epoch;
+    if (time < 0)
+        time = 0;
+    int hours = time/TINT_HOUR;
+    time %= TINT_HOUR;
+    int mins = time/TINT_MIN;
+    time %= TINT_MIN;
+    int secs = time/TINT_SEC;
+    time %= TINT_SEC;
+    int msecs = time/TINT_MSEC;
+    time %= TINT_MSEC;
+    int usecs = time/TINT_uSEC;
+    sprintf(buf,"%i_%02i_%02i_%03i_%03i",hours,mins,secs,msecs,usecs);
+    return buf;
+}
+
+
+const char* swift::TraceFormat(const trace_record_t& rec, tint epoch, char* buf, size_t buflen)
+{
+    char timestr[32], binstr[32], argstr[32];
+    TraceTimeStr(rec.time,epoch,timestr);
+    bin_t bin(rec.bin);
+    bin.str(binstr);
+    const char *fmt = rec.event < TRACE_EV_COUNT ? trace_events[rec.event].fmt : trace_events[0].fmt;
+    switch (rec.event)
+    {
+        case TRACE_EV_SEND:
+            snprintf(buf,buflen,fmt,timestr,rec.channel,(long)(rec.arg & 0xffffffff),
+                (unsigned)(rec.bin>>40)&0xff,(unsigned)(rec.bin>>32)&0xff,(unsigned)(rec.bin>>24)&0xff,
+                (unsigned)(rec.bin>>16)&0xff,(unsigned)rec.bin&0xffff,(unsigned)(rec.arg>>32));
+            break;
+        case TRACE_EV_RECV:
+            snprintf(buf,buflen,fmt,timestr,rec.channel,(long)rec.arg);
+            break;
+        case TRACE_EV_PEX_OUT:
+        case TRACE_EV_PEX_IN:
+            snprintf(buf,buflen,fmt,timestr,rec.channel,
+                (unsigned)(rec.bin>>40)&0xff,(unsigned)(rec.bin>>32)&0xff,(unsigned)(rec.bin>>24)&0xff,
+                (unsigned)(rec.bin>>16)&0xff,(unsigned)rec.bin&0xffff);
+            break;
+        case TRACE_EV_REQUEUE:
+            snprintf(buf,buflen,fmt,timestr,rec.channel,
+                TraceTimeStr(rec.time+(tint)rec.arg,epoch,argstr),(long long)rec.arg);
+            break;
+        case TRACE_EV_ACK_OUT:
+            snprintf(buf,buflen,fmt,timestr,rec.channel,binstr,TraceTimeStr((tint)rec.arg,epoch,argstr));
+            break;
+        case TRACE_EV_HINT_OUT:
+        {
+            // Two lines, as before
+            int n = snprintf(buf,buflen,fmt,timestr,rec.channel,binstr,(long long)rec.arg);
+            if (n >= 0 && n < buflen)
+                snprintf(buf+n,buflen-n,"\n%s #%u +hint base %s width %d",timestr,rec.channel,
+                    bin.base_left().str(binstr),(int)bin.base_length());
+            break;
+        }
+        default:
+            snprintf(buf,buflen,fmt,timestr,rec.channel,binstr,(long long)rec.arg);
+    }
+    return buf;
+}
+
+
+bool swift::TraceOpen(std::string filename, uint32_t catmask, tint epoch)
+{
+    TraceClose();
+    trace_fp = fopen_utf8(filename.c_str(),"wb");
+    if (trace_fp == NULL) {
+        print_error("cannot open trace file");
+        return false;
+    }
+    // Header: magic, record size, epoch used for rendering times
+    uint32_t recsize = sizeof(trace_record_t);
+    fwrite(TRACE_FILE_MAGIC,1,8,trace_fp);
+    fwrite(&recsize,sizeof(recsize),1,trace_fp);
+    fwrite(&epoch,sizeof(epoch),1,trace_fp);
+    trace_mask = catmask;
+    return true;
+}
+
+
+void swift::TraceFlush()
+{
+    if (trace_fp == NULL)
+        return;
+    bool written = false;
+    for (trace_ring_t *r = trace_rings; r != NULL; r = r->next)
+    {
+        uint64_t head = r->head;
+        swift_membar(); // read records only after seeing head
+        while (r->tail < head)
+        {
+            // Write contiguous stretches in one go
+            uint64_t idx = r->tail & (TRACE_RING_RECORDS-1);
+            uint64_t n = head - r->tail;
+            if (idx + n > TRACE_RING_RECORDS)
+                n = TRACE_RING_RECORDS - idx;
+            fwrite(&r->recs[idx],sizeof(trace_record_t),n,trace_fp);
+            swift_membar(); // done reading before slots are released
+            r->tail += n;
+            written = true;
+        }
+    }
+    if (written)
+        fflush(trace_fp);
+}
+
+
+void swift::TraceClose()
+{
+    if (trace_fp == NULL)
+        return;
+    TraceFlush();
+    fclose(trace_fp);
+    trace_fp = NULL;
+    trace_mask = TRACE_CAT_NONE;
+}
+
+
+uint64_t swift::TraceDropped()
+{
+    uint64_t dropped = 0;
+    for (trace_ring_t *r = trace_rings; r != NULL; r = r->next)
+        dropped += r->dropped;
+    return dropped;
+}
+
+
+uint32_t swift::TraceParseCategories(const char* str)
+{
+    static const struct { const char *name; uint32_t cat; } names[] = {
+        { "send", TRACE_CAT_SEND }, { "recv", TRACE_CAT_RECV },
+        { "data", TRACE_CAT_DATA }, { "ack", TRACE_CAT_ACK },
+        { "have", TRACE_CAT_HAVE }, { "hint", TRACE_CAT_HINT },
+        { "hash", TRACE_CAT_HASH }, { "pex", TRACE_CAT_PEX },
+        { "loss", TRACE_CAT_LOSS }, { "all", TRACE_CAT_ALL },
+    };
+    uint32_t mask = TRACE_CAT_NONE;
+    std::string s = str;
+    size_t start = 0;
+    while (start <= s.size())
+    {
+        size_t end = s.find(',',start);
+        if (end == std::string::npos)
+            end = s.size();
+        std::string tok = s.substr(start,end-start);
+        for (int i=0; i<sizeof(names)/sizeof(names[0]); i++)
+            if (tok == names[i].name)
+                mask |= names[i].cat;
+        start = end+1;
+    }
+    return mask;
+}
@@ -0,0 +1,115 @@
+/*
+ *  trace.h
+ *  low-overhead binary event tracing for the protocol hot path
+ *
+ *  Events are compile-time typed (see trace_event_t) and recorded as
+ *  fixed-size binary records into per-thread lock-free ring buffers. The
+ *  rings are drained to a trace file from the event loop (TraceFlush) and
+ *  decoded offline with the tracedump tool. Which events are recorded is
+ *  selected at runtime by category.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_TRACE_H
+#define SWIFT_TRACE_H
+
+#include <stdio.h>
+#include "compat.h"
+#include "bin.h"
+
+namespace swift {
+
+/** Event categories, selectable at runtime. */
+typedef enum {
+    TRACE_CAT_NONE  = 0,
+    TRACE_CAT_SEND  = 1<<0,   // datagram assembly and scheduling
+    TRACE_CAT_RECV  = 1<<1,   // datagram reception
+    TRACE_CAT_DATA  = 1<<2,
+    TRACE_CAT_ACK   = 1<<3,
+    TRACE_CAT_HAVE  = 1<<4,
+    TRACE_CAT_HINT  = 1<<5,
+    TRACE_CAT_HASH  = 1<<6,
+    TRACE_CAT_PEX   = 1<<7,
+    TRACE_CAT_LOSS  = 1<<8,
+    TRACE_CAT_ALL   = 0xffff
+} trace_cat_t;
+
+/** Event types. The order of this enum is part of the trace file format,
+    only append. */
+typedef enum {
+    TRACE_EV_NONE = 0,
+    TRACE_EV_SEND,          // bin = peer ipv4<<16|port, arg = peer channel<<32|length
+    TRACE_EV_RECV,          // arg = datagram length
+    TRACE_EV_REQUEUE,       // arg = microseconds till next send
+    TRACE_EV_DATA_OUT,
+    TRACE_EV_DATA_IN,
+    TRACE_EV_DATA_DUP,
+    TRACE_EV_DATA_BAD,
+    TRACE_EV_ACK_OUT,       // arg = time of the data being acked
+    TRACE_EV_ACK_IN,        // arg = peer time
+    TRACE_EV_HAVE_OUT,
+    TRACE_EV_HAVE_IN,
+    TRACE_EV_HINT_OUT,      // arg = outstanding hinted chunks
+    TRACE_EV_HINT_IN,
+    TRACE_EV_DEQUEUED,      // arg = outstanding hinted chunks
+    TRACE_EV_HASH_OUT,
+    TRACE_EV_HASH_IN,
+    TRACE_EV_PEAK_HASH_OUT,
+    TRACE_EV_DATA_TIMEOUT,
+    TRACE_EV_DATA_REORDER,
+    TRACE_EV_ACK_UNKNOWN,   // ack for data not outstanding, arg = peer time
+    TRACE_EV_PEX_OUT,       // bin = peer ipv4<<16|port, arg = 1 if reverse PEX
+    TRACE_EV_PEX_IN,        // bin = peer ipv4<<16|port, arg = 1 if already known
+    TRACE_EV_COUNT
+} trace_event_t;
+
+/** One trace record. Fixed size, written as-is (host byte order) to the
+    trace file. */
+struct trace_record_t {
+    tint        time;
+    uint32_t    channel;
+    uint16_t    event;
+    uint16_t    thread;
+    uint64_t    bin;
+    uint64_t    arg;
+};
+
+/** Static description of an event type. */
+struct trace_event_info_t {
+    uint16_t    cat;
+    const char* name;
+    /** printf format for the text rendering, see TraceFormat() for the
+        arguments */
+    const char* fmt;
+};
+
+#define TRACE_FILE_MAGIC        "SWTRACE1"
+#define TRACE_RING_RECORDS      (1<<16) // per thread, must be power of 2
+
+extern const trace_event_info_t trace_events[TRACE_EV_COUNT];
+
+/** Runtime category mask; an event is recorded when its category is set. */
+extern uint32_t trace_mask;
+
+/** Start writing binary trace records for the given categories to filename.
+    Returns false when the file cannot be opened. */
+bool        TraceOpen(std::string filename, uint32_t catmask, tint epoch);
+/** Drain the per-thread rings to the trace file. Call from the event loop. */
+void        TraceFlush();
+/** Flush and close the trace file. */
+void        TraceClose();
+/** Parse a comma separated list of category names ("data,ack", "all"). */
+uint32_t    TraceParseCategories(const char* str);
+/** Number of records dropped because a ring was full. */
+uint64_t    TraceDropped();
+
+/** Record an event; when textfp is set the event is also rendered as a
+    debug log line, with times relative to epoch. Use the dtrace() macro. */
+void        TraceEmit(FILE* textfp, tint epoch, tint time, trace_event_t ev, uint32_t channel, bin_t bin, uint64_t arg);
+/** Render a record in the classic debug log format. */
+const char* TraceFormat(const trace_record_t& rec, tint epoch, char* buf, size_t buflen);
+
+}
+
+#endif
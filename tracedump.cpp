@@ -0,0 +1,83 @@
+/*
+ *  tracedump.cpp
+ *  offline decoder for binary event traces written by swift --trace
+ *
+ *  Renders records in the classic debug log format (which mfold/logparse
+ *  understands), or as a CSV timeline for plotting.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <string.h>
+#include "trace.h"
+
+using namespace swift;
+
+
+static void usage()
+{
+    fprintf(stderr,"Usage: tracedump [-c] [-X cats] tracefile\n");
+    fprintf(stderr,"  -c\tCSV timeline: time_us,thread,channel,event,bin,arg\n");
+    fprintf(stderr,"  -X\tonly print the given comma separated categories\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    bool csv = false;
+    uint32_t catmask = TRACE_CAT_ALL;
+    int c;
+    while (-1 != (c = getopt(argc, argv, "cX:"))) {
+        switch (c) {
+            case 'c':
+                csv = true;
+                break;
+            case 'X':
+                catmask = TraceParseCategories(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    FILE *fp = fopen_utf8(argv[optind],"rb");
+    if (fp == NULL) {
+        print_error("cannot open trace file");
+        return 1;
+    }
+    char magic[8];
+    uint32_t recsize = 0;
+    tint epoch = 0;
+    if (fread(magic,1,8,fp) != 8 || memcmp(magic,TRACE_FILE_MAGIC,8)
+        || fread(&recsize,sizeof(recsize),1,fp) != 1
+        || fread(&epoch,sizeof(epoch),1,fp) != 1) {
+        fprintf(stderr,"tracedump: %s is not a swift trace\n",argv[optind]);
+        return 1;
+    }
+    if (recsize != sizeof(trace_record_t)) {
+        fprintf(stderr,"tracedump: record size %u, expected " PRISIZET "\n",recsize,sizeof(trace_record_t));
+        return 1;
+    }
+
+    if (csv)
+        printf("time_us,thread,channel,event,bin,arg\n");
+    trace_record_t rec;
+    char line[256];
+    while (fread(&rec,sizeof(rec),1,fp) == 1) {
+        if (rec.event >= TRACE_EV_COUNT || !(trace_events[rec.event].cat & catmask))
+            continue;
+        if (csv)
+            printf("%lli,%u,%u,%s,%llu,%llu\n",(long long)(rec.time-epoch),rec.thread,
+                rec.channel,trace_events[rec.event].name,
+                (unsigned long long)rec.bin,(unsigned long long)rec.arg);
+        else
+            printf("%s\n",TraceFormat(rec,epoch,line,sizeof(line)));
+    }
+    fclose(fp);
+    return 0;
+}
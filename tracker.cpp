@@ -0,0 +1,258 @@
+/*
+ *  tracker.cpp
+ *  tracker-only mode: answers handshakes for any swarm with the addresses
+ *  of its recent members, keeping no content and no channels. See the
+ *  Tracker class in swift.h.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+
+using namespace swift;
+
+
+#define TRACKER_INITIAL_SLOTS	1024
+
+
+Tracker * Tracker::__instance = NULL;
+
+
+Tracker::Tracker(evutil_socket_t sock, uint32_t max_members) :
+	sock_(sock), max_members_(max_members), nmembers_(0), nswarms_(0),
+	handshakes_(0), last_expire_(NOW)
+{
+	trackswarm_t empty;
+	empty.npeers = 0;
+	empty.peers = NULL;
+	table_.resize(TRACKER_INITIAL_SLOTS,empty);
+	if (__instance == NULL)
+		__instance = this;
+}
+
+
+Tracker::~Tracker()
+{
+	for (int i=0; i<table_.size(); i++)
+		free(table_[i].peers);
+	if (__instance == this)
+		__instance = NULL;
+}
+
+
+Tracker::trackswarm_t *Tracker::Lookup(const Sha1Hash &root, bool create)
+{
+	size_t mask = table_.size()-1;
+	for (size_t i=Home(root); ; i=(i+1)&mask)
+	{
+		trackswarm_t &s = table_[i];
+		if (s.peers == NULL)
+		{
+			if (!create)
+				return NULL;
+			if ((nswarms_+1)*4 > table_.size()*3)
+			{
+				Grow();
+				return Lookup(root,true);
+			}
+			s.root = root;
+			s.npeers = 0;
+			s.peers = (trackpeer_t *)malloc(sizeof(trackpeer_t));
+			nswarms_++;
+			return &s;
+		}
+		if (s.root == root)
+			return &s;
+	}
+}
+
+
+void Tracker::Grow()
+{
+	std::vector<trackswarm_t> old;
+	old.swap(table_);
+	trackswarm_t empty;
+	empty.npeers = 0;
+	empty.peers = NULL;
+	table_.resize(old.size()*2,empty);
+	size_t mask = table_.size()-1;
+	for (int j=0; j<old.size(); j++)
+	{
+		if (old[j].peers == NULL)
+			continue;
+		size_t i = Home(old[j].root);
+		while (table_[i].peers != NULL)
+			i = (i+1)&mask;
+		table_[i] = old[j];
+	}
+	dprintf("%s tracker: %u swarms, grown to %d slots\n",tintstr(),nswarms_,(int)table_.size());
+}
+
+
+void Tracker::RemoveSwarm(size_t slot)
+{
+	nmembers_ -= table_[slot].npeers;
+	nswarms_--;
+	free(table_[slot].peers);
+	table_[slot].peers = NULL;
+
+	// Shift back later entries that may no longer be found across the hole
+	size_t mask = table_.size()-1, hole = slot;
+	for (size_t j=(slot+1)&mask; table_[j].peers != NULL; j=(j+1)&mask)
+	{
+		size_t home = Home(table_[j].root);
+		bool stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+		if (stays)
+			continue;
+		table_[hole] = table_[j];
+		table_[j].peers = NULL;
+		hole = j;
+	}
+}
+
+
+void Tracker::Expire(uint32_t ttl)
+{
+	uint16_t now = Now();
+	uint32_t before = nmembers_;
+	for (size_t i=0; i<table_.size(); i++)
+	{
+		trackswarm_t &s = table_[i];
+		if (s.peers == NULL)
+			continue;
+		uint32_t n = 0;
+		for (uint32_t p=0; p<s.npeers; p++)
+			if ((uint16_t)(now-s.peers[p].seen) <= ttl)
+				s.peers[n++] = s.peers[p];
+		nmembers_ -= s.npeers-n;
+		s.npeers = n;
+		if (n == 0)
+		{
+			RemoveSwarm(i);
+			i--; // an entry may have moved in
+		}
+	}
+	last_expire_ = NOW;
+	dprintf("%s tracker: expired %u members, %u in %u swarms\n",tintstr(),before-nmembers_,nmembers_,nswarms_);
+}
+
+
+int Tracker::Announce(const Address &peer, const Sha1Hash &root, Address *out, int max)
+{
+	if (NOW > last_expire_+SWIFT_TRACKER_PEER_TTL/2*TINT_SEC)
+		Expire(SWIFT_TRACKER_PEER_TTL);
+
+	uint16_t now = Now();
+	uint32_t ipv4 = peer.ipv4();
+	uint16_t port = peer.port();
+	trackswarm_t *s = Lookup(root,false);
+	int n = 0, self = -1, oldest = -1;
+	if (s != NULL)
+	{
+		// Random start, such that answers differ
+		uint32_t start = rand() % s->npeers;
+		for (uint32_t k=0; k<s->npeers; k++)
+		{
+			uint32_t p = (start+k) % s->npeers;
+			trackpeer_t &tp = s->peers[p];
+			if (oldest < 0 || (uint16_t)(now-tp.seen) > (uint16_t)(now-s->peers[oldest].seen))
+				oldest = p;
+			if (tp.ipv4 == ipv4 && tp.port == port)
+			{
+				self = p;
+				continue;
+			}
+			if (n == max || (uint16_t)(now-tp.seen) > SWIFT_TRACKER_PEER_TTL)
+				continue;
+			Address a(tp.ipv4,tp.port);
+			// As Channel::AddPex(): no private addresses to public peers
+			if (a.is_private() && !peer.is_private())
+				continue;
+			out[n++] = a;
+		}
+	}
+
+	if (self >= 0)
+	{
+		s->peers[self].seen = now;
+		return n;
+	}
+	if (s == NULL || s->npeers < SWIFT_TRACKER_SWARM_PEERS)
+	{
+		if (nmembers_ >= max_members_)
+		{
+			if (s == NULL || s->npeers == 0)
+				return n; // full, not remembered
+			s->peers[oldest].ipv4 = ipv4;
+			s->peers[oldest].port = port;
+			s->peers[oldest].seen = now;
+			return n;
+		}
+		if (s == NULL)
+			s = Lookup(root,true);
+		// Capacity is npeers rounded up to a power of 2
+		if (s->npeers > 0 && !(s->npeers & (s->npeers-1)))
+			s->peers = (trackpeer_t *)realloc(s->peers,2*s->npeers*sizeof(trackpeer_t));
+		trackpeer_t &tp = s->peers[s->npeers++];
+		tp.ipv4 = ipv4;
+		tp.port = port;
+		tp.seen = now;
+		nmembers_++;
+	}
+	else
+	{
+		s->peers[oldest].ipv4 = ipv4;
+		s->peers[oldest].port = port;
+		s->peers[oldest].seen = now;
+	}
+	return n;
+}
+
+
+void Tracker::OnHandshake(const Address &peer, const Sha1Hash &root, struct evbuffer *evb)
+{
+	if (evbuffer_get_length(evb) < 1+4 || evbuffer_remove_8(evb) != SWIFT_HANDSHAKE)
+	{
+		dprintf("%s tracker: no handshake from %s\n",tintstr(),peer.str());
+		return;
+	}
+	uint32_t pcid = evbuffer_remove_32be(evb);
+	if (pcid == 0)
+		return;
+	handshakes_++;
+
+	Address pex[SWIFT_TRACKER_PEX];
+	int n = Announce(peer,root,pex,SWIFT_TRACKER_PEX);
+	dprintf("%s tracker: %s in %s, %d peers\n",tintstr(),peer.str(),root.hex().c_str(),n);
+
+	struct evbuffer *out = evbuffer_new();
+	evbuffer_add_32be(out,pcid);
+	evbuffer_add_8(out,SWIFT_HANDSHAKE);
+	evbuffer_add_32be(out,Channel::EncodeID(SWIFT_TRACKER_CHANNEL_NO));
+	for (int i=0; i<n; i++)
+	{
+		evbuffer_add_8(out,SWIFT_PEX_ADD);
+		evbuffer_add_32be(out,pex[i].ipv4());
+		evbuffer_add_16be(out,pex[i].port());
+	}
+	// Explicit close, the peer drops its channel to us
+	evbuffer_add_8(out,SWIFT_HANDSHAKE);
+	evbuffer_add_32be(out,0);
+	Channel::messageQueue.AddBuffer(sock_,out,peer,NULL);
+}
+
+
+size_t Tracker::mem_size()
+{
+	size_t size = sizeof(*this)+table_.capacity()*sizeof(trackswarm_t);
+	for (size_t i=0; i<table_.size(); i++)
+	{
+		if (table_[i].peers == NULL)
+			continue;
+		uint32_t cap = 1;
+		while (cap < table_[i].npeers)
+			cap <<= 1;
+		size += cap*sizeof(trackpeer_t);
+	}
+	return size;
+}
@@ -0,0 +1,195 @@
+/*
+ *  trackerbench.cpp
+ *  benchmark of the tracker-only mode (--tracker-only, class Tracker):
+ *  handshakes answered per second and memory per swarm member, for
+ *  announces of new members and for the re-announces of known ones.
+ *  Reports one JSON line per phase.
+ *
+ *  Crafted initial handshakes go through Channel::RecvDatagram as if they
+ *  came from the network, the answers go to a transport that only counts
+ *  them.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include "bin_utils.h"
+
+using namespace swift;
+
+
+// Fake socket of the tracker, never used for I/O
+#define TRACKERBENCH_SOCKET	200000
+
+
+static void usage()
+{
+    fprintf(stderr,"Usage: trackerbench [options]\n");
+    fprintf(stderr,"  -s\tswarms (default 100000)\n");
+    fprintf(stderr,"  -p\tpeers per swarm (default 10)\n");
+    fprintf(stderr,"  -n\tre-announces of known members (default 1000000)\n");
+    fprintf(stderr,"  -m\tmembers remembered at most (default swarms*peers)\n");
+}
+
+
+static tint WallTime()
+{
+#ifdef _WIN32
+    return (tint)GetTickCount()*TINT_MSEC;
+#else
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (tint)tv.tv_sec*TINT_SEC + tv.tv_usec;
+#endif
+}
+
+
+/** Resident size of the process in KiB, -1 if unknown. */
+static long ResidentKB()
+{
+    long rss = -1;
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/statm","r");
+    if (fp == NULL)
+        return -1;
+    long size, resident;
+    if (fscanf(fp,"%ld %ld",&size,&resident) == 2)
+        rss = resident*(sysconf(_SC_PAGESIZE)/1024);
+    fclose(fp);
+#endif
+    return rss;
+}
+
+
+/** Counts the answers instead of sending them. */
+class CountingTransport : public Transport {
+  public:
+    uint64_t dgrams, bytes;
+    CountingTransport() : dgrams(0), bytes(0) {}
+    int SendMsg(evutil_socket_t sock, struct msghdr *msg) {
+        struct sockaddr_mptp *sa = (struct sockaddr_mptp *)msg->msg_name;
+        int total = 0;
+        for (int i=0; i<msg->msg_iovlen; i++) {
+            sa->dests[i].bytes = msg->msg_iov[i].iov_len;
+            total += msg->msg_iov[i].iov_len;
+            dgrams++;
+        }
+        bytes += total;
+        return total;
+    }
+    int RecvMsg(evutil_socket_t sock, struct msghdr *msg) { return 0; }
+};
+
+
+static Sha1Hash SwarmRoot(uint32_t s)
+{
+    char name[32];
+    sprintf(name,"swarm%u",s);
+    return Sha1Hash(name,strlen(name));
+}
+
+
+/** Member p of swarm s, public addresses from 11.0.0.0 up. */
+static Address MemberAddress(uint32_t s, uint32_t p, uint32_t npeers)
+{
+    uint64_t m = (uint64_t)s*npeers+p;
+    return Address((uint32_t)(0x0B000000+(m>>4)),(uint16_t)(7000+(m&15)));
+}
+
+
+/** Feed the initial handshake of peer for root to the tracker. */
+static void Handshake(const Address &peer, const Sha1Hash &root, uint32_t chid)
+{
+    struct evbuffer *evb = evbuffer_new();
+    evbuffer_add_32be(evb,0);
+    evbuffer_add_8(evb,SWIFT_HASH);
+    evbuffer_add_32be(evb,bin_toUInt32(bin_t::ALL));
+    evbuffer_add_hash(evb,root);
+    evbuffer_add_8(evb,SWIFT_HANDSHAKE);
+    evbuffer_add_32be(evb,chid);
+    Channel::RecvDatagram(TRACKERBENCH_SOCKET,peer,evb);
+}
+
+
+static void Report(const char *phase, Tracker *tracker, CountingTransport *transport,
+    uint64_t handshakes, tint took, long rss0)
+{
+    long rss = ResidentKB();
+    uint32_t members = tracker->members();
+    printf("{\"phase\": \"%s\", \"handshakes\": %llu, \"took_us\": %lld, \"handshakes_per_s\": %.0f, "
+        "\"swarms\": %u, \"members\": %u, \"answers\": %llu, \"answer_bytes_avg\": %.1f, "
+        "\"table_bytes_per_member\": %.1f, \"rss_kb\": %ld, \"rss_bytes_per_member\": %.1f}\n",
+        phase,(unsigned long long)handshakes,(long long)took,
+        took > 0 ? (double)handshakes*TINT_SEC/took : 0.0,
+        tracker->swarms(),members,(unsigned long long)transport->dgrams,
+        transport->dgrams ? (double)transport->bytes/transport->dgrams : 0.0,
+        members ? (double)tracker->mem_size()/members : 0.0,
+        rss >= 0 ? rss-rss0 : -1L,
+        members && rss >= 0 ? (rss-rss0)*1024.0/members : -1.0);
+    fflush(stdout);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint32_t nswarms = 100000, npeers = 10, max_members = 0;
+    uint64_t nreannounce = 1000000;
+    int c;
+
+    LibraryInit();
+    while (-1 != (c = getopt(argc, argv, "s:p:n:m:"))) {
+        switch (c) {
+            case 's': nswarms = atoi(optarg); break;
+            case 'p': npeers = atoi(optarg); break;
+            case 'n': nreannounce = strtoull(optarg,NULL,10); break;
+            case 'm': max_members = atoi(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (nswarms == 0 || npeers == 0) {
+        usage();
+        return 1;
+    }
+    if (max_members == 0)
+        max_members = nswarms*npeers;
+
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    CountingTransport transport;
+    Channel::transport = &transport;
+    Channel::Time();
+
+    // Roots are hashed up front, a real tracker gets them off the wire
+    std::vector<Sha1Hash> roots(nswarms);
+    for (uint32_t s=0; s<nswarms; s++)
+        roots[s] = SwarmRoot(s);
+
+    long rss0 = ResidentKB();
+    Tracker *tracker = new Tracker(TRACKERBENCH_SOCKET,max_members);
+
+    // Every member announces once, round robin over the swarms such that
+    // the tables grow as they would
+    tint start = WallTime();
+    for (uint32_t p=0; p<npeers; p++)
+        for (uint32_t s=0; s<nswarms; s++)
+            Handshake(MemberAddress(s,p,npeers),roots[s],p+1);
+    Report("join",tracker,&transport,tracker->handshakes(),WallTime()-start,rss0);
+
+    // Known members announce again, in random order
+    uint64_t before = tracker->handshakes();
+    transport.dgrams = transport.bytes = 0;
+    start = WallTime();
+    uint64_t x = 1;
+    for (uint64_t i=0; i<nreannounce; i++) {
+        x = x*6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t s = (uint32_t)((x>>33) % nswarms), p = (uint32_t)((x>>13) % npeers);
+        Handshake(MemberAddress(s,p,npeers),roots[s],p+1);
+    }
+    Report("reannounce",tracker,&transport,tracker->handshakes()-before,WallTime()-start,rss0);
+
+    delete tracker;
+    Channel::transport = NULL;
+    return 0;
+}
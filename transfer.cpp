@@ -18,6 +18,8 @@
 using namespace swift;
 
 std::vector<FileTransfer*> FileTransfer::files(20);
+std::vector<int> FileTransfer::progress_pending_fds_;
+struct event *FileTransfer::evprogress_ = NULL;
 
 #define BINHASHSIZE (sizeof(bin64_t)+sizeof(Sha1Hash))
 
@@ -29,9 +31,9 @@ std::vector<FileTransfer*> FileTransfer::files(20);
 // FIXME: separate Bootstrap() and Download(), then Size(), Progress(), SeqProgress()
 
 FileTransfer::FileTransfer(std::string filename, const Sha1Hash& root_hash, bool force_check_diskvshash, bool check_netwvshash, uint32_t chunk_size, bool zerostate) :
-	Operational(), fd_(files.size()+1), cb_installed(0), mychannels_(),
-    speedzerocount_(0), tracker_(), tracker_retry_interval_(TRACKER_RETRY_INTERVAL_START),
-    tracker_retry_time_(NOW), zerostate_(zerostate)
+	Operational(), picker_(NULL), availability_(NULL), progress_pending_(false), mychannels_(), nseeders_(0), nseeders_peaks_(0),
+    peers_version_(0), last_data_time_(NOW), have_log_(), have_log_base_(0), tracker_(), tracker_retry_interval_(TRACKER_RETRY_INTERVAL_START),
+    tracker_retry_time_(NOW), tracker_announce_time_(NOW+SWIFT_TRACKER_REANNOUNCE), fd_(files.size()+1), sock_(INVALID_SOCKET), zerostate_(zerostate)
 {
     if (files.size()<fd()+1)
         files.resize(fd()+1);
@@ -157,6 +159,16 @@ void FileTransfer::ReConnectToTrackerIfAllowed(bool hasestablishedpeers)
 	{
 		tracker_retry_interval_ = TRACKER_RETRY_INTERVAL_START;
 		tracker_retry_time_ = NOW + tracker_retry_interval_;
+
+		// TRACKER: announce again now and then, or a tracker that closes
+		// after answering forgets us
+		if (NOW > tracker_announce_time_)
+		{
+			Address addr = tracker_ != Address() ? tracker_ : Channel::tracker;
+			if (addr != Address() && FindChannel(addr,NULL) == NULL)
+				ConnectToTracker();
+			tracker_announce_time_ = NOW + SWIFT_TRACKER_REANNOUNCE;
+		}
 	}
 }
 
@@ -167,6 +179,7 @@ void FileTransfer::ConnectToTracker()
 		return;
 
 	Channel *c = NULL;
+    Channel::MakeRoom();
     if (tracker_ != Address())
     	c = new Channel(this,INVALID_SOCKET,tracker_);
     else if (Channel::tracker!=Address())
@@ -174,19 +187,121 @@ void FileTransfer::ConnectToTracker()
 }
 
 
+static uint64_t AddressKey(const Address &addr)
+{
+	return ((uint64_t)addr.ipv4()<<16) | addr.port();
+}
+
+
 Channel * FileTransfer::FindChannel(const Address &addr, Channel *notc)
+{
+	std::pair<std::multimap<uint64_t,Channel *>::iterator,std::multimap<uint64_t,Channel *>::iterator> range;
+	range = chanbyaddr_.equal_range(AddressKey(addr));
+	std::multimap<uint64_t,Channel *>::iterator iter;
+	for (iter=range.first; iter!=range.second; iter++)
+	{
+		Channel *c = iter->second;
+		if (c != notc && (c->peer() == addr || c->recv_peer() == addr))
+			return c;
+	}
+	return NULL;
+}
+
+
+void FileTransfer::AddChannel(Channel *c)
+{
+	mychannels_.push_back(c);
+	chanbyaddr_.insert(std::make_pair(AddressKey(c->peer()),c));
+	UpdateChannel(c);
+	OnPeersChanged();
+}
+
+
+void FileTransfer::IndexRecvPeer(Channel *c, const Address &addr)
+{
+	// Every handshake retransmit comes here
+	if (c->recv_peer_ == addr)
+		return;
+	if (c->recv_peer_ != c->peer())
+		UnindexChannel(c,c->recv_peer_);
+	c->recv_peer_ = addr;
+	if (addr != c->peer())
+		chanbyaddr_.insert(std::make_pair(AddressKey(addr),c));
+}
+
+
+void FileTransfer::UnindexChannel(Channel *c, const Address &addr)
+{
+	std::pair<std::multimap<uint64_t,Channel *>::iterator,std::multimap<uint64_t,Channel *>::iterator> range;
+	range = chanbyaddr_.equal_range(AddressKey(addr));
+	std::multimap<uint64_t,Channel *>::iterator aiter = range.first;
+	while (aiter != range.second)
+	{
+		if (aiter->second == c)
+			chanbyaddr_.erase(aiter++);
+		else
+			aiter++;
+	}
+}
+
+
+void FileTransfer::RemoveChannel(Channel *c)
 {
 	channels_t::iterator iter;
 	for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
 	{
-		Channel *c = *iter;
-		if (c != NULL) {
-			if (c != notc && (c->peer() == addr || c->recv_peer() == addr)) {
-				return c;
-			}
-		}
+		if (*iter == c)
+			break;
+	}
+	if (iter != mychannels_.end())
+		mychannels_.erase(iter);
+
+	// Both of its address keys
+	UnindexChannel(c,c->peer());
+	UnindexChannel(c,c->recv_peer());
+
+	if (c->established_pos_ >= 0)
+	{
+		// Fill the hole with the last one
+		Channel *last = established_.back();
+		established_[c->established_pos_] = last;
+		last->established_pos_ = c->established_pos_;
+		established_.pop_back();
+		c->established_pos_ = -1;
+	}
+	if (c->peer_complete_)
+	{
+		nseeders_--;
+		c->peer_complete_ = false;
+	}
+	OnPeersChanged();
+}
+
+
+void FileTransfer::UpdateChannel(Channel *c)
+{
+	bool established = c->is_established();
+	if (established && c->established_pos_ < 0)
+	{
+		c->established_pos_ = established_.size();
+		established_.push_back(c);
+	}
+	else if (!established && c->established_pos_ >= 0)
+	{
+		Channel *last = established_.back();
+		established_[c->established_pos_] = last;
+		last->established_pos_ = c->established_pos_;
+		established_.pop_back();
+		c->established_pos_ = -1;
+	}
+
+	// ack_in_ only grows, so a complete peer stays so
+	if (!c->peer_complete_ && nseeders_peaks_ == hashtree()->peak_count() && c->IsComplete())
+	{
+		c->peer_complete_ = true;
+		nseeders_++;
+		OnPeersChanged();
 	}
-	return NULL;
 }
 
 
@@ -208,7 +323,7 @@ void    Channel::CloseTransfer (FileTransfer* trans) {
 }
 
 
-void swift::AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg) {
+void swift::AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg,uint64_t startoff,uint64_t endoff) {
 
 	//fprintf(stderr,"swift::AddProgressCallback: transfer %i\n", transfer );
 
@@ -218,9 +333,13 @@ void swift::AddProgressCallback (int transfer,ProgressCallback cb,uint8_t agg) {
 
     //fprintf(stderr,"swift::AddProgressCallback: ft obj %p %p\n", trans, cb );
 
-    trans->cb_agg[trans->cb_installed] = agg;
-    trans->callbacks[trans->cb_installed] = cb;
-    trans->cb_installed++;
+    FileTransfer::progress_sub_t sub;
+    sub.cb = cb;
+    sub.agg = agg;
+    sub.startoff = startoff;
+    sub.endoff = endoff;
+    sub.pending = bin_t::NONE;
+    trans->progress_subs_.push_back(sub);
 }
 
 
@@ -242,14 +361,238 @@ void swift::RemoveProgressCallback (int transfer, ProgressCallback cb) {
 
     //fprintf(stderr,"swift::RemoveProgressCallback: transfer %i ft obj %p %p\n", transfer, trans, cb );
 
-    for(int i=0; i<trans->cb_installed; i++)
-        if (trans->callbacks[i]==cb)
-            trans->callbacks[i]=trans->callbacks[--trans->cb_installed];
+    for(int i=0; i<trans->progress_subs_.size(); i++)
+        if (trans->progress_subs_[i].cb==cb) {
+            trans->progress_subs_.erase(trans->progress_subs_.begin()+i);
+            i--;
+        }
+
+    for(int i=0; i<trans->progress_subs_.size(); i++)
+    	dprintf("%s F%i progress callback remains %p\n", tintstr(), transfer, trans->progress_subs_[i].cb );
+}
+
+
+/** Aligned bins covering exactly the chunks with bytes offset..offset+length-1 */
+static void RangeBins(uint64_t offset, uint64_t length, uint32_t chunk_size, std::vector<bin_t> &bins)
+{
+	uint64_t c = offset/chunk_size, end = (offset+length-1)/chunk_size+1;
+	while (c < end)
+	{
+		int layer = 0;
+		while (layer < 63 && !(c & ((1ULL<<(layer+1))-1)) && c+(1ULL<<(layer+1)) <= end)
+			layer++;
+		bins.push_back(bin_t(layer,c>>layer));
+		c += 1ULL<<layer;
+	}
+}
+
 
-    for(int i=0; i<trans->cb_installed; i++)
+int swift::AwaitRange (int transfer,uint64_t offset,uint64_t length,RangeCallback cb,void *arg)
+{
+    FileTransfer* trans = FileTransfer::file(transfer);
+    if (!trans || !cb || length == 0 || offset+length < offset)
+        return -1;
+    HashTree *ht = trans->hashtree();
+    if (ht->size())
     {
-    	fprintf(stderr,"swift::RemoveProgressCallback: transfer %i remain %p\n", transfer, trans->callbacks[i] );
+        if (offset+length > ht->size())
+            return -1;
+        if (ht->seq_complete(offset) >= length)
+        {
+            cb(transfer,offset,length,arg);
+            return 1;
+        }
     }
+    // Size not known yet for a fresh download, checked on completion only
+
+    FileTransfer::range_wait_t w;
+    w.offset = offset;
+    w.length = length;
+    w.cb = cb;
+    w.arg = arg;
+    w.touched = false;
+    w.prioritized = false;
+    if (ht->size())
+        trans->PrioritizeRange(w,true);
+    trans->range_waits_.push_back(w);
+    dprintf("%s F%i await range %llu+%llu\n",tintstr(),transfer,(unsigned long long)offset,(unsigned long long)length);
+    return 0;
+}
+
+
+void swift::CancelRange (int transfer,RangeCallback cb,void *arg)
+{
+    FileTransfer* trans = FileTransfer::file(transfer);
+    if (!trans)
+        return;
+    for(int i=0; i<trans->range_waits_.size(); i++)
+    {
+        FileTransfer::range_wait_t &w = trans->range_waits_[i];
+        if (w.cb != cb || w.arg != arg)
+            continue;
+        trans->PrioritizeRange(w,false);
+        trans->range_waits_.erase(trans->range_waits_.begin()+i);
+        i--;
+    }
+}
+
+
+void PiecePicker::Unprioritize(bin_t range)
+{
+	for (int i=0; i<priority_.size(); i++)
+		if (priority_[i] == range) {
+			priority_.erase(priority_.begin()+i);
+			break;
+		}
+}
+
+
+bin_t PiecePicker::PickPriority(binmap_t& offer, binmap_t& hinted, binmap_t* complete, uint64_t twist)
+{
+	for (int i=0; i<priority_.size(); i++) {
+		if (complete->is_filled(priority_[i])) {
+			priority_.erase(priority_.begin()+i);
+			i--;
+			continue;
+		}
+		bin_t hint = binmap_t::find_complement(hinted, offer, priority_[i], twist);
+		if (!hint.is_none())
+			return hint;
+	}
+	return bin_t::NONE;
+}
+
+
+void FileTransfer::PrioritizeRange(range_wait_t &w, bool on)
+{
+	if (picker_ == NULL || w.prioritized == on)
+		return;
+	std::vector<bin_t> bins;
+	RangeBins(w.offset,w.length,hashtree()->chunk_size(),bins);
+	for (int i=0; i<bins.size(); i++)
+		if (on)
+			picker_->Prioritize(bins[i]);
+		else
+			picker_->Unprioritize(bins[i]);
+	w.prioritized = on;
+}
+
+
+void FileTransfer::NotifyProgress(bin_t cover)
+{
+	uint64_t cs = hashtree()->chunk_size();
+	uint64_t first = cover.base_offset()*cs, last = (cover.base_offset()+cover.base_length())*cs-1;
+	bool any = false;
+	for (int i=0; i<progress_subs_.size(); i++)
+	{
+		progress_sub_t &sub = progress_subs_[i];
+		if (cover.layer() < sub.agg || last < sub.startoff || first > sub.endoff)
+			continue;
+		if (sub.pending.is_none() || cover.layer() >= sub.pending.layer())
+			sub.pending = cover;
+		any = true;
+	}
+	for (int i=0; i<range_waits_.size(); i++)
+	{
+		range_wait_t &w = range_waits_[i];
+		// Pickers need the size, which the first data brings
+		if (!w.prioritized && hashtree()->size())
+		{
+			if (w.offset+w.length > hashtree()->size())
+			{
+				// Waited for before the size was known, past the end
+				w.touched = true;
+				any = true;
+				continue;
+			}
+			PrioritizeRange(w,true);
+		}
+		if (last < w.offset || first >= w.offset+w.length)
+			continue;
+		w.touched = true;
+		any = true;
+	}
+	if (!any || progress_pending_)
+		return;
+
+	progress_pending_ = true;
+	progress_pending_fds_.push_back(fd());
+	if (Channel::evbase == NULL)
+		return;
+	if (evprogress_ == NULL)
+		evprogress_ = evtimer_new(Channel::evbase, LibeventProgressCallback, NULL);
+	if (!evtimer_pending(evprogress_, NULL))
+		evtimer_add(evprogress_, tint2tv(0));
+}
+
+
+void FileTransfer::DeliverProgress()
+{
+	std::vector<int> fds;
+	fds.swap(progress_pending_fds_);
+	for (int f=0; f<fds.size(); f++)
+	{
+		FileTransfer *ft = file(fds[f]);
+		if (ft == NULL)
+			continue; // closed meanwhile
+		ft->progress_pending_ = false;
+
+		// Callbacks may (un)subscribe or close the transfer
+		std::vector<std::pair<ProgressCallback,bin_t> > due;
+		for (int i=0; i<ft->progress_subs_.size(); i++)
+		{
+			if (ft->progress_subs_[i].pending.is_none())
+				continue;
+			due.push_back(std::make_pair(ft->progress_subs_[i].cb,ft->progress_subs_[i].pending));
+			ft->progress_subs_[i].pending = bin_t::NONE;
+		}
+		for (int d=0; d<due.size(); d++)
+		{
+			if (file(fds[f]) != ft)
+				break;
+			bool subscribed = false;
+			for (int i=0; i<ft->progress_subs_.size() && !subscribed; i++)
+				subscribed = ft->progress_subs_[i].cb == due[d].first;
+			if (subscribed)
+				due[d].first(fds[f],due[d].second);
+		}
+
+		// Ranges that got data may be complete now
+		if (file(fds[f]) != ft)
+			continue;
+		std::vector<range_wait_t> done;
+		for (int i=0; i<ft->range_waits_.size(); i++)
+		{
+			range_wait_t &w = ft->range_waits_[i];
+			if (!w.touched)
+				continue;
+			w.touched = false;
+			bool beyond = w.offset+w.length > ft->hashtree()->size();
+			if (!beyond && ft->hashtree()->seq_complete(w.offset) < w.length)
+				continue;
+			ft->PrioritizeRange(w,false);
+			if (beyond)
+				w.length = 0;
+			done.push_back(w);
+			ft->range_waits_.erase(ft->range_waits_.begin()+i);
+			i--;
+		}
+		for (int d=0; d<done.size(); d++)
+		{
+			if (file(fds[f]) != ft)
+				break;
+			dprintf("%s F%i range %llu+%llu complete\n",tintstr(),fds[f],
+				(unsigned long long)done[d].offset,(unsigned long long)done[d].length);
+			done[d].cb(fds[f],done[d].offset,done[d].length,done[d].arg);
+		}
+	}
+}
+
+
+void FileTransfer::LibeventProgressCallback(int fd, short event, void *arg)
+{
+	Channel::Time();
+	DeliverProgress();
 }
 
 
@@ -264,6 +607,8 @@ FileTransfer::~FileTransfer ()
 		delete picker_;
 		delete availability_;
 	}
+	else
+		ZeroState::GetInstance()->ForgetCookiePeers(fd());
   
     // Arno, 2012-02-06: Cancel cleanup timer, otherwise chaos!
     evtimer_del(&evclean_);
@@ -278,6 +623,27 @@ FileTransfer* FileTransfer::Find (const Sha1Hash& root_hash) {
 }
 
 
+FileTransfer* FileTransfer::Find (const Sha1Hash& root_hash, evutil_socket_t sock) {
+    // SIMULATOR: several peers of the same swarm may live in one process,
+    // prefer the one bound to the socket the handshake came in on.
+    FileTransfer *any = NULL;
+    for(int i=0; i<files.size(); i++)
+        if (files[i] && files[i]->root_hash()==root_hash) {
+            if (files[i]->sock_ == sock)
+                return files[i];
+            if (files[i]->sock_ == INVALID_SOCKET && any == NULL)
+                any = files[i];
+        }
+    return any;
+}
+
+
+evutil_socket_t FileTransfer::GetSocket()
+{
+	return sock_ != INVALID_SOCKET ? sock_ : Channel::default_socket();
+}
+
+
 int swift:: Find (Sha1Hash hash) {
     FileTransfer* t = FileTransfer::Find(hash);
     if (t)
@@ -295,12 +661,14 @@ bool FileTransfer::OnPexAddIn (const Address& addr) {
 	//if (addr.is_private())
 	//	return false;
     // Gertjan fix: PEX redo
-    if (hs_in_.size()<SWIFT_MAX_CONNECTIONS)
+    // Not worth evicting another channel for, see Channel::MakeRoom()
+    if (mychannels_.size()<SWIFT_MAX_CONNECTIONS &&
+        (Channel::MAX_CHANNELS <= 0 || Channel::open_channels() < Channel::MAX_CHANNELS))
     {
     	// Arno, 2012-02-27: Check if already connected to this peer.
 		Channel *c = FindChannel(addr,NULL);
 		if (c == NULL)
-			new Channel(this,Channel::default_socket(),addr);
+			new Channel(this,INVALID_SOCKET,addr);
 		else
 			return false;
     }
@@ -309,53 +677,37 @@ bool FileTransfer::OnPexAddIn (const Address& addr) {
 
 //Gertjan
 int FileTransfer::RandomChannel (int own_id) {
-    binqueue choose_from;
-    int i;
-
-    for (i = 0; i < (int) hs_in_.size(); i++) {
-        if (hs_in_[i].toUInt() == own_id)
-            continue;
-        Channel *c = Channel::channel(hs_in_[i].toUInt());
-        if (c == NULL || c->transfer().fd() != this->fd()) {
-            /* Channel was closed or is not associated with this FileTransfer (anymore). */
-            hs_in_[i] = hs_in_[0];
-            hs_in_.pop_front();
-            i--;
-            continue;
-        }
-        if (!c->is_established())
-            continue;
-        choose_from.push_back(hs_in_[i]);
-    }
-    if (choose_from.size() == 0)
+    // Sample established_ leaving out own_id's slot, if it is in there
+    Channel *own = Channel::channel(own_id);
+    int skip = -1;
+    if (own != NULL && own->transfer_ == this)
+        skip = own->established_pos_;
+    int n = established_.size() - (skip >= 0 ? 1 : 0);
+    if (n <= 0)
         return -1;
 
-    return choose_from[rand() % choose_from.size()].toUInt();
+    int i = rand() % n;
+    if (skip >= 0 && i >= skip)
+        i++;
+    return established_[i]->id();
 }
 
 void		FileTransfer::OnRecvData(int n)
 {
 	// Got n ~ 32K
 	cur_speed_[DDIR_DOWNLOAD].AddPoint((uint64_t)n);
+	Channel::global_speed[DDIR_DOWNLOAD].AddPoint((uint64_t)n);
+	if (n > 0)
+		last_data_time_ = NOW;
 }
 
 void		FileTransfer::OnSendData(int n)
 {
 	// Sent n ~ 1K
 	cur_speed_[DDIR_UPLOAD].AddPoint((uint64_t)n);
-}
-
-
-void		FileTransfer::OnSendNoData()
-{
-	// AddPoint(0) everytime we don't AddData gives bad speed measurement
-	// batch 32 such events into 1.
-	speedzerocount_++;
-	if (speedzerocount_ >= 32)
-	{
-		cur_speed_[DDIR_UPLOAD].AddPoint((uint64_t)0);
-		speedzerocount_ = 0;
-	}
+	Channel::global_speed[DDIR_UPLOAD].AddPoint((uint64_t)n);
+	if (n > 0)
+		last_data_time_ = NOW;
 }
 
 
@@ -381,35 +733,92 @@ double		FileTransfer::GetMaxSpeed(data_direction_t ddir)
 
 uint32_t	FileTransfer::GetNumLeechers()
 {
-	uint32_t count = 0;
-	channels_t::iterator iter;
-    for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
-    {
-	    Channel *c = *iter;
-	    if (c != NULL)
-		    if (!c->IsComplete()) // incomplete?
-			    count++;
-    }
-    return count;
+	return mychannels_.size() - GetNumSeeders();
 }
 
 
 uint32_t	FileTransfer::GetNumSeeders()
 {
-	uint32_t count = 0;
+	// Completeness is relative to the peaks, recount once they are known
+	if (nseeders_peaks_ != hashtree()->peak_count())
+	{
+		nseeders_peaks_ = hashtree()->peak_count();
+		uint32_t old = nseeders_;
+		nseeders_ = 0;
+		channels_t::iterator iter;
+		for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
+		{
+			Channel *c = *iter;
+			c->peer_complete_ = c->IsComplete();
+			if (c->peer_complete_)
+				nseeders_++;
+		}
+		if (nseeders_ != old)
+			OnPeersChanged();
+	}
+	return nseeders_;
+}
+
+
+uint32_t	FileTransfer::GetPeersVersion()
+{
+	// Brings the seeder count up to date with the peaks first
+	GetNumSeeders();
+	return peers_version_;
+}
+
+
+void FileTransfer::GetMemoryUsage(memusage_t &mu)
+{
+	mu.hashtree += hashtree_->mem_size() + have_log_.size()*sizeof(havelog_t);
+	mu.mhash += hashtree_->mmap_size();
+	if (picker_ != NULL)
+		mu.picker += picker_->mem_size();
+	if (availability_ != NULL)
+		mu.avail += availability_->mem_size();
+
 	channels_t::iterator iter;
-    for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
-    {
-	    Channel *c = *iter;
-	    if (c != NULL)
-		    if (c->IsComplete()) // complete?
-			    count++;
-    }
-    return count;
+	for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
+	{
+		Channel *c = *iter;
+		if (c != NULL)
+			c->GetMemoryUsage(mu);
+	}
+}
+
+
+void FileTransfer::AddHaveLog(bin_t pos, uint32_t channel)
+{
+	havelog_t entry;
+	entry.bin = pos;
+	entry.channel = channel;
+	have_log_.push_back(entry);
+	if (have_log_.size() < SWIFT_HAVE_LOG_TRIM || have_log_end() % SWIFT_HAVE_LOG_TRIM)
+		return;
+
+	// Drop what all channels have announced. Channels that fall behind
+	// more than SWIFT_HAVE_LOG_MAX redo their scan of ack_out instead.
+	uint64_t trimpos = have_log_end();
+	channels_t::iterator iter;
+	for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
+	{
+		Channel *c = *iter;
+		if (c != NULL && c->have_log_pos() < trimpos)
+			trimpos = c->have_log_pos();
+	}
+	if (have_log_end()-trimpos > SWIFT_HAVE_LOG_MAX)
+		trimpos = have_log_end()-SWIFT_HAVE_LOG_MAX/2;
+	while (have_log_base_ < trimpos)
+	{
+		have_log_.pop_front();
+		have_log_base_++;
+	}
 }
 
 
 void FileTransfer::AddPeer(Address &peer)
 {
+	// Explicitly asked for, so over budget anyway if nothing can go
+	Channel::MakeRoom();
 	Channel *c = new Channel(this,INVALID_SOCKET,peer);
 }
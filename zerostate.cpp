@@ -11,6 +11,7 @@
  */
 #include "swift.h"
 #include "compat.h"
+#include "bin_utils.h"
 
 using namespace swift;
 
@@ -19,13 +20,17 @@ ZeroState * ZeroState::__singleton = NULL;
 
 #define CLEANUP_INTERVAL			30	// seconds
 
-ZeroState::ZeroState() : contentdir_("."), connect_timeout_(TINT_NEVER)
+ZeroState::ZeroState() : contentdir_("."), stateless_(false), connect_timeout_(TINT_NEVER)
 {
 	if (__singleton == NULL)
 	{
 		__singleton = this;
 	}
 
+	// COOKIE: key of the MAC, good for the lifetime of the process
+	tint seed[6] = { usec_time(), rand(), rand(), rand(), rand(), (tint)getpid() };
+	cookie_secret_ = Sha1Hash((const char *)seed,sizeof(seed));
+
 	//fprintf(stderr,"ZeroState: registering clean up\n");
 	evtimer_assign(&evclean_,Channel::evbase,&ZeroState::LibeventCleanCallback,this);
 	evtimer_add(&evclean_,tint2tv(CLEANUP_INTERVAL*TINT_SEC));
@@ -52,6 +57,20 @@ void ZeroState::LibeventCleanCallback(int fd, short event, void *arg)
 	if (zs == NULL)
 		return;
 
+	// COOKIE: forget silent peers, keep the transfers of the others
+	std::set<int> cookiefds;
+	std::map<uint64_t,cookiepeer_t>::iterator citer = zs->cookiepeers_.begin();
+	while (citer != zs->cookiepeers_.end())
+	{
+		if (citer->second.last_recv_time+SWIFT_COOKIE_IDLE < NOW)
+			zs->cookiepeers_.erase(citer++);
+		else
+		{
+			cookiefds.insert(citer->first & ((1<<SWIFT_COOKIE_FD_BITS)-1));
+			citer++;
+		}
+	}
+
 	// See which zero state FileTransfers have no clients
 	std::set<FileTransfer *>	delset;
     for(int i=0; i<FileTransfer::files.size(); i++)
@@ -60,7 +79,7 @@ void ZeroState::LibeventCleanCallback(int fd, short event, void *arg)
     	if (ft == NULL)
     		continue;
 
-    	if (!ft->IsZeroState())
+    	if (!ft->IsZeroState() || cookiefds.count(ft->fd()))
     		continue;
 
     	// Arno, 2012-07-20: Some weirdness on Win7 when we use GetChannels()
@@ -179,7 +198,7 @@ void Channel::OnDataZeroState(struct evbuffer *evb)
 
 void Channel::OnHaveZeroState(struct evbuffer *evb)
 {
-	uint32_t binint = evbuffer_remove_32be(evb);
+	bin_t pos = RemoveBin(evb);
 	// Forget about it, i.e.. don't build peer binmap.
 }
 
@@ -200,3 +219,300 @@ void Channel::OnPexReqZeroState(struct evbuffer *evb)
     // Ignore it
 }
 
+
+
+/*
+ * COOKIE: stateless serving
+ */
+
+/** Key of a cookie peer: address and fd of the transfer */
+static uint64_t CookieKey(const Address &peer, int fd)
+{
+	uint64_t addr = ((uint64_t)peer.ipv4()<<16) | peer.port();
+	return (addr<<SWIFT_COOKIE_FD_BITS) | fd;
+}
+
+
+/** Take the next message off a datagram from a cookie peer, as
+ *  Channel::Recv() would. bin is set for the messages carrying one, value
+ *  for HANDSHAKE and VERSION. Returns false at the end or at a message it
+ *  does not know. */
+static bool RemoveCookieMessage(struct evbuffer *evb, uint32_t *wire_bin, uint8_t *type, bin_t *bin, uint32_t *value)
+{
+	size_t len = evbuffer_get_length(evb);
+	if (len == 0)
+		return false;
+	bool compact;
+	*type = Channel::MessageType(evbuffer_remove_8(evb), &compact);
+	len--;
+	switch (*type) {
+		case SWIFT_HANDSHAKE:
+			if (len < 4)
+				return false;
+			*value = evbuffer_remove_32be(evb);
+			return true;
+		case SWIFT_VERSION:
+			if (len < 1)
+				return false;
+			*value = evbuffer_remove_8(evb);
+			return true;
+		case SWIFT_PEX_REQ:
+			return true;
+		case SWIFT_PEX_ADD:
+		case SWIFT_RANDOMIZE:
+			if (len < (*type == SWIFT_PEX_ADD ? 6 : 4))
+				return false;
+			evbuffer_drain(evb, *type == SWIFT_PEX_ADD ? 6 : 4);
+			return true;
+		case SWIFT_DATA:
+		case SWIFT_ACK:
+		case SWIFT_HAVE:
+		case SWIFT_HASH:
+		case SWIFT_HINT:
+		case SWIFT_COMPACT_UNCLES:
+			break;
+		default:
+			return false;
+	}
+
+	if (!compact && len < 4)
+		return false;
+	*bin = Channel::RemoveBin(evb, compact, wire_bin);
+	// Not needed by a seeder, skip what follows the bin
+	size_t skip = 0;
+	switch (*type) {
+		case SWIFT_DATA: skip = evbuffer_get_length(evb); break;
+		case SWIFT_ACK: skip = compact ? 4 : 8; break;
+		case SWIFT_HASH: skip = Sha1Hash::SIZE; break;
+		case SWIFT_COMPACT_UNCLES:
+			if (evbuffer_get_length(evb) < 1)
+				return false;
+			skip = evbuffer_remove_8(evb)*Sha1Hash::SIZE;
+			break;
+	}
+	if (evbuffer_get_length(evb) < skip)
+		return false;
+	evbuffer_drain(evb, skip);
+	return true;
+}
+
+
+void ZeroState::ForgetCookiePeers(int fd)
+{
+	std::map<uint64_t,cookiepeer_t>::iterator citer = cookiepeers_.begin();
+	while (citer != cookiepeers_.end())
+	{
+		if ((citer->first & ((1<<SWIFT_COOKIE_FD_BITS)-1)) == fd)
+			cookiepeers_.erase(citer++);
+		else
+			citer++;
+	}
+}
+
+
+uint32_t ZeroState::MakeCookie(const Address &peer, uint32_t peer_channel_id, FileTransfer *ft)
+{
+	char buf[Sha1Hash::SIZE*2+16];
+	memcpy(buf, cookie_secret_.bits, Sha1Hash::SIZE);
+	memcpy(buf+Sha1Hash::SIZE, ft->root_hash().bits, Sha1Hash::SIZE);
+	uint32_t fields[4] = { peer.ipv4(), peer.port(), peer_channel_id, (uint32_t)ft->fd() };
+	memcpy(buf+2*Sha1Hash::SIZE, fields, sizeof(fields));
+	Sha1Hash mac(buf, sizeof(buf));
+	uint32_t bits;
+	memcpy(&bits, mac.bits, sizeof(bits));
+	return SWIFT_COOKIE_FLAG | (ft->fd()<<SWIFT_COOKIE_MAC_BITS) | (bits & ((1<<SWIFT_COOKIE_MAC_BITS)-1));
+}
+
+
+bool ZeroState::Answer(evutil_socket_t sock, const Address &peer, FileTransfer *ft, struct evbuffer *evb)
+{
+	if (ft->fd() >= (1<<SWIFT_COOKIE_FD_BITS))
+		return false;
+
+	uint32_t wire_bin = 0, pcid = 0;
+	uint8_t type;
+	bin_t bin;
+	// Its HAVEs are of no interest
+	if (!RemoveCookieMessage(evb,&wire_bin,&type,&bin,&pcid) || type != SWIFT_HANDSHAKE || pcid == 0) {
+		dprintf("%s #0 cookie: no handshake from %s\n",tintstr(),peer.str());
+		return true;
+	}
+
+	uint32_t cookie = MakeCookie(peer,pcid,ft);
+	uint32_t encoded = Channel::EncodeID(cookie);
+	if (encoded == 0 || encoded >= SWIFT_MUX_CHANNEL_ID) {
+		dprintf("%s #0 cookie: %x for %s taken, not answering\n",tintstr(),encoded,peer.str());
+		return true;
+	}
+
+	cookiepeer_t &cp = cookiepeers_[CookieKey(peer,ft->fd())];
+	cp.peer_channel_id = pcid;
+	cp.nhints = 0;
+	cp.cwnd = 1;
+	cp.inflight = 0;
+	cp.last_recv_time = NOW;
+	cp.last_ack_time = NOW;
+	cp.last_data = bin_t::NONE;
+	cp.version = SWIFT_WIRE_LEGACY;
+
+	struct evbuffer *out = evbuffer_new();
+	evbuffer_add_32be(out, pcid);
+	evbuffer_add_8(out, SWIFT_HANDSHAKE);
+	evbuffer_add_32be(out, encoded);
+	wire_bin = 0;
+	// As Channel::AddHave(), the peer has not announced HAVE ALL yet
+	for (int i=0; i<ft->hashtree()->peak_count(); i++)
+		Channel::AddBinMessage(out, cp.version, &wire_bin, SWIFT_HAVE, ft->hashtree()->peak(i));
+	dprintf("%s #0 cookie: %s F%d +hs %x\n",tintstr(),peer.str(),ft->fd(),encoded);
+	Channel::messageQueue.AddBuffer(sock, out, peer, NULL);
+
+	// As Channel::SendVersion(), in a datagram of its own
+	if (Channel::WIRE_VERSION > SWIFT_WIRE_LEGACY) {
+		out = evbuffer_new();
+		evbuffer_add_32be(out, pcid);
+		evbuffer_add_8(out, SWIFT_VERSION);
+		evbuffer_add_8(out, Channel::WIRE_VERSION);
+		Channel::messageQueue.AddBuffer(sock, out, peer, NULL);
+	}
+	return true;
+}
+
+
+void ZeroState::OnCookieDatagram(evutil_socket_t sock, const Address &peer, uint32_t cookie, struct evbuffer *evb)
+{
+	int fd = (cookie>>SWIFT_COOKIE_MAC_BITS) & ((1<<SWIFT_COOKIE_FD_BITS)-1);
+	FileTransfer *ft = FileTransfer::file(fd);
+	std::map<uint64_t,cookiepeer_t>::iterator iter = cookiepeers_.find(CookieKey(peer,fd));
+	if (!stateless_ || ft == NULL || !ft->IsZeroState() || iter == cookiepeers_.end()) {
+		dprintf("%s cookie: %x from %s unknown\n",tintstr(),cookie,peer.str());
+		return;
+	}
+	cookiepeer_t &cp = iter->second;
+	if (MakeCookie(peer,cp.peer_channel_id,ft) != cookie) {
+		dprintf("%s cookie: %x from %s does not check out\n",tintstr(),cookie,peer.str());
+		return;
+	}
+
+	uint32_t wire_bin = 0, value;
+	uint8_t type;
+	bin_t bin;
+	uint64_t size = ft->hashtree()->size_in_chunks();
+	while (RemoveCookieMessage(evb,&wire_bin,&type,&bin,&value)) {
+		if (type == SWIFT_HANDSHAKE && value == 0) {
+			// Explicit close
+			dprintf("%s cookie: %s F%d closed\n",tintstr(),peer.str(),fd);
+			cookiepeers_.erase(iter);
+			return;
+		}
+		if (type == SWIFT_VERSION) {
+			cp.version = value < Channel::WIRE_VERSION ? value : Channel::WIRE_VERSION;
+			dprintf("%s cookie: %s F%d -version %d\n",tintstr(),peer.str(),fd,(int)value);
+		}
+		if (type == SWIFT_ACK && !bin.is_none()) {
+			uint64_t acked = bin.base_length();
+			cp.inflight -= acked < cp.inflight ? acked : cp.inflight;
+			// Slow start only, loss halves
+			if (cp.cwnd < SWIFT_COOKIE_CWND_MAX)
+				cp.cwnd++;
+			cp.last_ack_time = NOW;
+		}
+		else if (type == SWIFT_HINT && !bin.is_none() && !bin.is_all() && bin.base_offset() < size) {
+			if (cp.nhints == SWIFT_COOKIE_HINTS) {
+				dprintf("%s cookie: %s F%d hints full\n",tintstr(),peer.str(),fd);
+				continue;
+			}
+			uint64_t end = bin.base_offset()+bin.base_length();
+			cp.hint_next[cp.nhints] = bin.base_offset();
+			cp.hint_end[cp.nhints] = end < size ? end : size;
+			cp.nhints++;
+		}
+	}
+	cp.last_recv_time = NOW;
+
+	// No timers: losses are noticed when the peer comes back, e.g. with
+	// the HINT it sends again
+	if (cp.inflight > 0 && cp.last_ack_time+SWIFT_COOKIE_RTO < NOW) {
+		dprintf("%s cookie: %s F%d %d chunks lost\n",tintstr(),peer.str(),fd,(int)cp.inflight);
+		cp.inflight = 0;
+		cp.cwnd = cp.cwnd > 1 ? cp.cwnd/2 : 1;
+		cp.last_ack_time = NOW;
+		cp.last_data = bin_t::NONE;
+	}
+	Pump(sock,peer,ft,cp.version,cp);
+}
+
+
+void ZeroState::Pump(evutil_socket_t sock, const Address &peer, FileTransfer *ft, int version, cookiepeer_t &cp)
+{
+	while (cp.inflight < cp.cwnd && cp.nhints > 0) {
+		// RATELIMIT
+		if (ft->GetCurrentSpeed(DDIR_UPLOAD) > ft->GetMaxSpeed(DDIR_UPLOAD))
+			return;
+		bin_t pos(0,cp.hint_next[0]++);
+		if (cp.hint_next[0] >= cp.hint_end[0]) {
+			cp.nhints--;
+			for (int i=0; i<cp.nhints; i++) {
+				cp.hint_next[i] = cp.hint_next[i+1];
+				cp.hint_end[i] = cp.hint_end[i+1];
+			}
+		}
+		SendData(sock,peer,ft,version,cp,pos);
+	}
+}
+
+
+void ZeroState::SendData(evutil_socket_t sock, const Address &peer, FileTransfer *ft, int version, cookiepeer_t &cp, bin_t pos)
+{
+	HashTree *ht = ft->hashtree();
+	struct evbuffer *evb = evbuffer_new();
+	evbuffer_add_32be(evb, cp.peer_channel_id);
+	uint32_t wire_bin = 0;
+
+	// As Channel::AddData(), without knowing what the peer has but what
+	// was sent before
+	if (cp.last_data.is_none())
+		for (int i=0; i<ht->peak_count(); i++) {
+			Channel::AddBinMessage(evb, version, &wire_bin, SWIFT_HASH, ht->peak(i));
+			evbuffer_add_hash(evb, ht->peak_hash(i));
+		}
+	if (ht->get_check_netwvshash()) {
+		bin_t peak = ht->peak_for(pos), start = pos, uncle = pos;
+		std::vector<bin_t> uncles;
+		while (uncle != peak && ((NOW&3)==3 || cp.last_data.is_none() || !uncle.parent().contains(cp.last_data))) {
+			uncles.push_back(uncle.sibling());
+			uncle = uncle.parent();
+		}
+		if (version >= SWIFT_WIRE_COMPACT && !uncles.empty()) {
+			Channel::AddBinMessage(evb, version, &wire_bin, SWIFT_COMPACT_UNCLES, start);
+			evbuffer_add_8(evb, uncles.size());
+			for (int i=0; i<uncles.size(); i++)
+				evbuffer_add_hash(evb, ht->hash(uncles[i]));
+		}
+		else
+			for (int i=0; i<uncles.size(); i++) {
+				Channel::AddBinMessage(evb, version, &wire_bin, SWIFT_HASH, uncles[i]);
+				evbuffer_add_hash(evb, ht->hash(uncles[i]));
+			}
+	}
+	if (ht->chunk_size() == SWIFT_DEFAULT_CHUNK_SIZE && evbuffer_get_length(evb) > SWIFT_MAX_NONDATA_DGRAM_SIZE) {
+		// Hashes in a datagram of their own, as AddData() does
+		Channel::messageQueue.AddBuffer(sock, evb, peer, NULL);
+		evb = evbuffer_new();
+		evbuffer_add_32be(evb, cp.peer_channel_id);
+		wire_bin = 0;
+	}
+
+	Channel::AddBinMessage(evb, version, &wire_bin, SWIFT_DATA, pos);
+	// Flash crowds ask for the same chunks, read each once
+	ssize_t r = Channel::messageQueue.AddPayload(evb, ft->root_hash(), ft->GetStorage(), pos.base_offset()*ht->chunk_size(), ht->chunk_size());
+	if (r < 0) {
+		evbuffer_free(evb);
+		return;
+	}
+
+	cp.last_data = pos;
+	cp.inflight++;
+	Channel::global_bytes_up += r;
+	ft->OnSendData(ht->chunk_size());
+	Channel::messageQueue.AddBuffer(sock, evb, peer, NULL, true, true);
+}